@@ -14,8 +14,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 /* /open */
+#include <sys/mman.h>
+#include <sys/uio.h> /* writev */
+#include <stdint.h> /* SIZE_MAX */
 #include <errno.h>
 #include <assert.h>
+#include <string.h> /* memmove */
 
 #include "io.h"
 #include "shorttypenames.h"
@@ -23,6 +27,10 @@
 #include "Result.h"
 #include "Buffer.h"
 #include "util.h"
+#include "mmapguard.h"
+#include "uringreader.h"
+#include "readahead.h"
+#include "monotime.h"
 
 #include "monkey.h"
 
@@ -42,12 +50,43 @@ typedef struct {
 
 #define FD_NONE -1
 
+typedef ssize_t (*BufferedStream_read_fn)(void *ctx, int fd, u8 *buf,
+                                          size_t len);
+
+// Statistics about the reads of an input file stream, collected if
+// requested via `BufferedStream_set_read_stats`.
+typedef struct {
+    u64 refills; // reads that returned data
+    u64 bytes; // bytes read
+    u64 read_ns; // time spent in (blocked in) the reads
+} ReadStats;
+
 typedef struct {
     int optional_fd; // FD_NONE == closed
     bool is_exhausted; // saw EOF
-    String optional_failure; // error we saw
+    Error optional_failure; // error we saw
+    off_t start_offset; // file position of the start of the stream,
+                        // -1 if the file is not seekable
+    // reading ahead instead of calling `read` directly (at most one
+    // of these is set):
+    UringReader *optional_uring;
+    ReadAhead *optional_readahead;
+    // or a replacement for `read` (e.g. to pass the data on, see
+    // passthrough.h), with the same semantics; see
+    // `BufferedStream_set_read_fn`:
+    BufferedStream_read_fn optional_read_fn;
+    void *read_fn_ctx;
+    ReadStats *optional_read_stats; // borrowed
 } _FileStream;
 
+// A file that is mapped into memory as a whole; the mapping is the
+// stream's buffer.
+typedef struct {
+    int optional_fd; // FD_NONE == closed
+    int guard; // slot number in mmapguard
+    Error optional_failure; // error we saw (on close)
+} _MmapStream;
+
 
 #define STREAM_DIRECTION_IN 1
 #define STREAM_DIRECTION_OUT 2
@@ -61,6 +100,7 @@ void assert_direction(uint8_t direction) {
 
 #define STREAM_TYPE_BUFFERSTREAM 1
 #define STREAM_TYPE_FILESTREAM 2
+#define STREAM_TYPE_MMAPSTREAM 3
 
 typedef struct {
     Buffer buffer;
@@ -72,6 +112,7 @@ typedef struct {
     union {
         _BufferStream bufferstream;
         _FileStream filestream;
+        _MmapStream mmapstream;
     };
 } BufferedStream;
 
@@ -133,11 +174,42 @@ BufferedStream fd_BufferedStream(int fd,
         .filestream = (_FileStream) {
             .optional_fd = fd,
             .is_exhausted = false,
-            .optional_failure = noString
+            .optional_failure = noError,
+            .start_offset = lseek(fd, 0, SEEK_CUR),
+            .optional_uring = NULL,
+            .optional_readahead = NULL,
+            .optional_read_fn = NULL,
+            .read_fn_ctx = NULL,
+            .optional_read_stats = NULL
         }
     };
 }
 
+// Make an input file stream (that doesn't read ahead) get its data
+// via read_fn(ctx, fd, ...) instead of `read(fd, ...)`. ctx is
+// borrowed.
+UNUSED static
+void BufferedStream_set_read_fn(BufferedStream *s,
+                                BufferedStream_read_fn read_fn,
+                                void *ctx) {
+    assert(s->stream_type == STREAM_TYPE_FILESTREAM);
+    assert(! (s->filestream.optional_uring
+              || s->filestream.optional_readahead));
+    s->filestream.optional_read_fn = read_fn;
+    s->filestream.read_fn_ctx = ctx;
+}
+
+// Collect statistics about the reads of s into *stats from now on
+// (stats is borrowed, and must outlive the reading). Does nothing for
+// streams that aren't read from a file descriptor (buffers, mapped
+// files).
+UNUSED static
+void BufferedStream_set_read_stats(BufferedStream *s, ReadStats *stats) {
+    if (s->stream_type == STREAM_TYPE_FILESTREAM) {
+        s->filestream.optional_read_stats = stats;
+    }
+}
+
 DEFTYPE_Result(BufferedStream);
 
 UNUSED static
@@ -163,7 +235,7 @@ Result(BufferedStream) open_BufferedStream(String path /* owned */,
         int err = errno;
         String_release(path);
         free(buf);
-        return Err(BufferedStream, strerror_String(err));
+        return Err_from(BufferedStream, Error_errno(err));
     }
     return Ok(BufferedStream,
               ((BufferedStream) {
@@ -178,14 +250,137 @@ Result(BufferedStream) open_BufferedStream(String path /* owned */,
                   .filestream = (_FileStream) {
                       .optional_fd = fd,
                       .is_exhausted = false,
-                      .optional_failure = noString
+                      .optional_failure = noError,
+                      .optional_uring = NULL,
+                      .optional_readahead = NULL,
+                      .optional_read_fn = NULL,
+                      .read_fn_ctx = NULL,
+                      .optional_read_stats = NULL
                   }
               }));
 }
 
+// Returns a stream on the whole of fd mapped into memory, if fd is a
+// (non-empty) regular file and mapping works; None otherwise.
+DEFTYPE_Option(BufferedStream);
+static
+Option(BufferedStream) _fd_mmap_BufferedStream(int fd,
+                                                String *optional_path_or_name,
+                                                bool is_path) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return None(BufferedStream);
+    }
+    if (! S_ISREG(st.st_mode)
+        || (st.st_size <= 0)
+        || ((uint64_t)st.st_size > SIZE_MAX)) {
+        return None(BufferedStream);
+    }
+    size_t len = st.st_size;
+    void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        return None(BufferedStream);
+    }
+    int guard = mmapguard_register(addr, len);
+    if (guard < 0) {
+        munmap(addr, len);
+        return None(BufferedStream);
+    }
+    // Only a hint, failure doesn't matter
+    posix_madvise(addr, len, POSIX_MADV_SEQUENTIAL);
+    return Some(BufferedStream,
+                ((BufferedStream) {
+                    .buffer = Buffer_from_array(false, (unsigned char *)addr,
+                                                len),
+                    .is_closed = false,
+                    .has_path = is_path,
+                    .optional_path_or_name = *optional_path_or_name,
+                    .direction = STREAM_DIRECTION_IN,
+                    .stream_type = STREAM_TYPE_MMAPSTREAM,
+                    .mmapstream = (_MmapStream) {
+                        .optional_fd = fd,
+                        .guard = guard,
+                        .optional_failure = noError
+                    }
+                }));
+}
+
+// How input files are read (by `fd_r_BufferedStream`)
+typedef enum {
+    READ_METHOD_MMAP, // map regular files into memory
+    READ_METHOD_READ, // always via `read`
+    READ_METHOD_URING // regular files via io_uring, reading ahead
+} ReadMethod;
+
+typedef struct {
+    ReadMethod method;
+    unsigned uring_depth; // number of buffers being read ahead
+    unsigned readahead_buffers; // 0, or the number of buffers for
+                                // reading on a background thread
+                                // what is read via `read`
+} ReadOptions;
+
+#define default_ReadOptions (ReadOptions) {             \
+        .method = READ_METHOD_MMAP,                     \
+        .uring_depth = URINGREADER_DEFAULT_DEPTH,       \
+        .readahead_buffers = 0                          \
+    }
+
+// Returns true if fd is a regular file.
+static
+bool _fd_is_regular(int fd) {
+    struct stat st;
+    return (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+}
+
+/*
+  An input stream for fd. Depending on opts->method, a regular file
+  is mapped into memory (without copying it through a buffer), or
+  read ahead via io_uring; anything else (pipes, terminals, special
+  files, or if mapping or io_uring are not available or fail, or an
+  empty file for mapping) is read via `read`, like
+  `fd_BufferedStream` does, on a background thread if
+  opts->readahead_buffers is not 0 (and the thread can be started).
+*/
+UNUSED static
+BufferedStream fd_r_BufferedStream(int fd,
+                                   String optional_path_or_name /* owned */,
+                                   bool is_path,
+                                   const ReadOptions *opts) {
+    assert(fd >= 0);
+    if (opts->method == READ_METHOD_MMAP) {
+        Option(BufferedStream) m =
+            _fd_mmap_BufferedStream(fd, &optional_path_or_name, is_path);
+        if (Option_is_some(m)) {
+            return m.value;
+        }
+    }
+    BufferedStream s = fd_BufferedStream(fd, STREAM_DIRECTION_IN,
+                                         optional_path_or_name, is_path);
+    if ((opts->method == READ_METHOD_URING)
+        && (s.filestream.start_offset >= 0)
+        && _fd_is_regular(fd)) {
+        s.filestream.optional_uring =
+            UringReader_new(fd, s.filestream.start_offset,
+                            opts->uring_depth);
+    }
+    if ((! s.filestream.optional_uring) && opts->readahead_buffers) {
+        s.filestream.optional_readahead =
+            ReadAhead_new(fd, opts->readahead_buffers);
+    }
+    return s;
+}
+
 UNUSED static
-Result(BufferedStream) open_r_BufferedStream(String path /* owned */) {
-    return open_BufferedStream(path, O_RDONLY, 0);
+Result(BufferedStream) open_r_BufferedStream(String path /* owned */,
+                                             const ReadOptions *opts) {
+    int fd = open(path.str, O_RDONLY);
+    if (fd < 0) {
+        int err = errno;
+        String_release(path);
+        return Err_from(BufferedStream, Error_errno(err));
+    }
+    return Ok(BufferedStream, fd_r_BufferedStream(fd, path, true, opts));
 }
 
 
@@ -200,7 +395,12 @@ void BufferedStream_release(BufferedStream *s) {
         // nothing
     }
     else if (s->stream_type == STREAM_TYPE_FILESTREAM) {
-        String_release(s->filestream.optional_failure);
+        Error_release(s->filestream.optional_failure);
+    }
+    else if (s->stream_type == STREAM_TYPE_MMAPSTREAM) {
+        mmapguard_unregister(s->mmapstream.guard);
+        munmap(s->buffer.lslice.data, s->buffer.size);
+        Error_release(s->mmapstream.optional_failure);
     }
     else {
         DIE("invalid stream_type");
@@ -226,8 +426,9 @@ retry: {
             if (err == EINTR) {
                 goto retry;
             }
-            s->filestream.optional_failure = strerror_String(err);
-            return Err(Unit, {});
+            Error_release(s->filestream.optional_failure);
+            s->filestream.optional_failure = Error_errno(err);
+            return Err_from(Unit, Error_clone(&s->filestream.optional_failure));
         } else if ((size_t)n == LSlice_length(s->buffer.lslice)) {
             // done
             s->buffer.lslice.startpos = 0;
@@ -248,7 +449,8 @@ Result(Unit) BufferedStream_flush(BufferedStream *s) {
     if (s->is_closed) {
         return Err(Unit, literal_String("flush: stream is closed"));
     }
-    if (s->stream_type == STREAM_TYPE_BUFFERSTREAM) {
+    if ((s->stream_type == STREAM_TYPE_BUFFERSTREAM)
+        || (s->stream_type == STREAM_TYPE_MMAPSTREAM)) {
         return Ok(Unit, {});
     }
     else if (s->stream_type == STREAM_TYPE_FILESTREAM) {
@@ -279,12 +481,23 @@ Result(Unit) BufferedStream_close(BufferedStream *s) {
         // really call close when desired. (But we have to check
         // whether we already closed the fd, as the same fd could have
         // been re-used in the mean time, but that has been done above
-        // via `is_closed` already.)
+        // via `is_closed` already.) If flushing fails, the fd is
+        // still closed, and that failure is the one returned.
+        Result(Unit) rf = Ok(Unit, {});
         if (s->direction & STREAM_DIRECTION_OUT) {
-            Result(Unit) r = BufferedStream_flush(s);
-            PROPAGATE_return(Unit, r);
+            rf = BufferedStream_flush(s);
         }
         assert(s->filestream.optional_fd != FD_NONE);
+        if (s->filestream.optional_uring) {
+            // The kernel may still be reading into its buffers
+            UringReader_free(s->filestream.optional_uring);
+            s->filestream.optional_uring = NULL;
+        }
+        if (s->filestream.optional_readahead) {
+            // Stop the thread before its fd goes away
+            ReadAhead_free(s->filestream.optional_readahead);
+            s->filestream.optional_readahead = NULL;
+        }
         int fd = s->filestream.optional_fd;
     retry: 
         if (close(fd) < 0) {
@@ -295,10 +508,32 @@ Result(Unit) BufferedStream_close(BufferedStream *s) {
             // Clear `optional_fd`? Store the failure? XX This is a bit
             // unclear!
             s->filestream.optional_fd = FD_NONE;
-            s->filestream.optional_failure = strerror_String(err);
-            RETURN(Err(Unit, String_clone(&s->filestream.optional_failure)));
+            if (Result_is_Err(rf)) {
+                RETURN(rf);
+            }
+            Error_release(s->filestream.optional_failure);
+            s->filestream.optional_failure = Error_errno(err);
+            RETURN(Err_from(Unit, Error_clone(&s->filestream.optional_failure)));
         } else {
             s->filestream.optional_fd = FD_NONE;
+            RETURN(rf);
+        }
+    }
+    else if (s->stream_type == STREAM_TYPE_MMAPSTREAM) {
+        // The mapping stays valid until BufferedStream_release
+        assert(s->mmapstream.optional_fd != FD_NONE);
+        int fd = s->mmapstream.optional_fd;
+    retry_mmap:
+        if (close(fd) < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                goto retry_mmap;
+            }
+            s->mmapstream.optional_fd = FD_NONE;
+            s->mmapstream.optional_failure = Error_errno(err);
+            RETURN(Err_from(Unit, Error_clone(&s->mmapstream.optional_failure)));
+        } else {
+            s->mmapstream.optional_fd = FD_NONE;
             RETURN(Ok(Unit, {}));
         }
     }
@@ -312,59 +547,231 @@ Result(Unit) BufferedStream_close(BufferedStream *s) {
     END_PROPAGATE;
 }
 
+// Read more data into the buffer of an input file stream, after
+// moving the unread data to the start of the buffer. Returns Ok
+// without reading anything if EOF was already seen or the buffer is
+// full; on a read failure, that failure is stored and returned.
 static
-Result(Option(u8)) BufferedStream_getc(BufferedStream *s) {
-    if (s->is_closed) {
-        return Err(Option(u8), literal_String("getc: stream is closed"));
+Result(Unit) _BufferedStream_filestream_read_unsafe(BufferedStream *s) {
+    assert(s->filestream.optional_fd != FD_NONE);
+    LSlice_u8 *l = &s->buffer.lslice;
+    if (l->startpos > 0) {
+        size_t len = LSlice_length(*l);
+        memmove(l->data, LSlice_start(*l), len);
+        l->startpos = 0;
+        l->endpos = len;
     }
-    if (! (s->direction & STREAM_DIRECTION_IN)) {
-        return Err(Option(u8), literal_String(
-                         "getc: stream was not opened for input"));
+    if (s->filestream.is_exhausted || (l->endpos == s->buffer.size)) {
+        return Ok(Unit, {});
     }
-    
-    Option(u8) c = Buffer_getc(&s->buffer);
-    if (Option_is_some(c)) {
-        return Ok(Option(u8), c);
-    } else {
+    int fd = s->filestream.optional_fd;
+    UringReader *uring = s->filestream.optional_uring;
+    ReadAhead *readahead = s->filestream.optional_readahead;
+    BufferedStream_read_fn read_fn = s->filestream.optional_read_fn;
+    ReadStats *stats = s->filestream.optional_read_stats;
+retry: {
+        u64 t0 = stats ? monotime_ns() : 0;
+        ssize_t n = uring
+            ? UringReader_read(uring, LSlice_end(*l),
+                               s->buffer.size - l->endpos)
+            : readahead
+            ? ReadAhead_read(readahead, LSlice_end(*l),
+                             s->buffer.size - l->endpos)
+            : read_fn
+            ? read_fn(s->filestream.read_fn_ctx, fd, LSlice_end(*l),
+                      s->buffer.size - l->endpos)
+            : read(fd, LSlice_end(*l), s->buffer.size - l->endpos);
+        if (stats) {
+            int err = errno;
+            stats->read_ns += monotime_ns() - t0;
+            if (n > 0) {
+                stats->refills++;
+                stats->bytes += n;
+            }
+            errno = err;
+        }
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                goto retry;
+            }
+            s->filestream.optional_failure = Error_errno(err);
+            return Err_from(Unit, Error_clone(&s->filestream.optional_failure));
+        } else if (n == 0) {
+            // EOF
+            s->filestream.is_exhausted = true;
+        } else {
+            l->endpos += n;
+        }
+        return Ok(Unit, {});
+    }
+}
+
+// Make sure that at least k bytes are in the buffer unless the end
+// of the stream is reached first. Returns a read failure even if it
+// was seen in an earlier call.
+static
+Result(Unit) _BufferedStream_fill_atleast(BufferedStream *s, size_t k) {
+    while (LSlice_length(s->buffer.lslice) < k) {
         if (s->stream_type == STREAM_TYPE_BUFFERSTREAM) {
-            // there's nothing to do with s->bufferstream, simply:
-            return Ok(Option(u8), None(u8));
+            // there's nothing to do with s->bufferstream
+            break;
+        }
+        else if (s->stream_type == STREAM_TYPE_MMAPSTREAM) {
+            // All of the file is in the buffer already, but its end
+            // may not actually have been readable
+            if (mmapguard_is_truncated(s->mmapstream.guard)) {
+                return Err(Unit, literal_String(
+                               "file was truncated while reading it"));
+            }
+            break;
         }
         else if (s->stream_type == STREAM_TYPE_FILESTREAM) {
+            assert(k <= s->buffer.size);
             if (s->filestream.is_exhausted) {
-                return Ok(Option(u8), None(u8));
+                break;
             } else if (s->filestream.optional_failure.str) {
                 // return previously seen failure (OK?)
-                return Err(Option(u8),
-                           String_clone(&s->filestream.optional_failure));
+                return Err_from(Unit,
+                           Error_clone(&s->filestream.optional_failure));
             } else {
-                // replenish the buffer
-                assert(s->filestream.optional_fd != FD_NONE);
-                int fd = s->filestream.optional_fd;
-            retry: {
-                    int n = read(fd, s->buffer.lslice.data, s->buffer.size);
-                    if (n < 0) {
-                        int err = errno;
-                        if (err == EINTR) {
-                            goto retry;
-                        }
-                        s->filestream.optional_failure = strerror_String(err);
-                    } else if (n == 0) {
-                        // EOF
-                        s->filestream.is_exhausted = true;
-                        //return Ok(Option(u8), None(u8));
-                    } else {
-                        s->buffer.lslice.startpos = 0;
-                        s->buffer.lslice.endpos = n;
-                    }
-                    return BufferedStream_getc(s);
-                }
+                Result(Unit) r = _BufferedStream_filestream_read_unsafe(s);
+                PROPAGATE_return(Unit, r);
             }
         }
         else {
             DIE("invalid stream_type");
         }
     }
+    return Ok(Unit, {});
+}
+
+UNUSED static
+Result(Option(u8)) BufferedStream_getc(BufferedStream *s) {
+    if (s->is_closed) {
+        return Err(Option(u8), literal_String("getc: stream is closed"));
+    }
+    if (! (s->direction & STREAM_DIRECTION_IN)) {
+        return Err(Option(u8), literal_String(
+                         "getc: stream was not opened for input"));
+    }
+    if (LSlice_is_empty(s->buffer.lslice)) {
+        Result(Unit) r = _BufferedStream_fill_atleast(s, 1);
+        PROPAGATE_return(Option(u8), r);
+    }
+    return Ok(Option(u8), Buffer_getc(&s->buffer));
+}
+
+
+/*
+  Block-oriented reading: `BufferedStream_peek` gives access to the
+  currently buffered data (refilling the buffer first if it is
+  empty), `BufferedStream_consume` then marks (part of) it as
+  read. An empty slice means the end of the stream has been
+  reached.
+
+  The returned slice borrows the stream's buffer, it is only valid
+  until the next call to a reading function on the stream.
+*/
+
+DEFTYPE_Result(LSlice_u8);
+
+static
+Result(LSlice_u8) BufferedStream_peek(BufferedStream *s) {
+    if (s->is_closed) {
+        return Err(LSlice_u8, literal_String("peek: stream is closed"));
+    }
+    if (! (s->direction & STREAM_DIRECTION_IN)) {
+        return Err(LSlice_u8, literal_String(
+                         "peek: stream was not opened for input"));
+    }
+    if (LSlice_is_empty(s->buffer.lslice)) {
+        Result(Unit) r = _BufferedStream_fill_atleast(s, 1);
+        PROPAGATE_return(LSlice_u8, r);
+    }
+    return Ok(LSlice_u8, s->buffer.lslice);
+}
+
+// Like `BufferedStream_peek` but for when at least k bytes are
+// needed (e.g. to decode a character that crosses the end of the
+// buffer): reads until at least k bytes are buffered. The slice is
+// only shorter if the stream ends earlier. k must not be larger than
+// the buffer size of a file stream.
+static
+Result(LSlice_u8) BufferedStream_peek_atleast(BufferedStream *s, size_t k) {
+    if (s->is_closed) {
+        return Err(LSlice_u8, literal_String("peek: stream is closed"));
+    }
+    if (! (s->direction & STREAM_DIRECTION_IN)) {
+        return Err(LSlice_u8, literal_String(
+                         "peek: stream was not opened for input"));
+    }
+    Result(Unit) r = _BufferedStream_fill_atleast(s, k);
+    PROPAGATE_return(LSlice_u8, r);
+    return Ok(LSlice_u8, s->buffer.lslice);
+}
+
+// Mark the first n bytes of the slice returned by the last peek as
+// read.
+static
+void BufferedStream_consume(BufferedStream *s, size_t n) {
+    assert(n <= LSlice_length(s->buffer.lslice));
+    s->buffer.lslice.startpos += n;
+}
+
+// Whether the data that has been read can be read again via
+// `BufferedStream_reread`: true for streams backed by memory, and for
+// seekable files.
+static
+bool BufferedStream_can_reread(const BufferedStream *s) {
+    if (! (s->direction & STREAM_DIRECTION_IN)) {
+        return false;
+    }
+    switch (s->stream_type) {
+    case STREAM_TYPE_BUFFERSTREAM:
+    case STREAM_TYPE_MMAPSTREAM:
+        return true;
+    case STREAM_TYPE_FILESTREAM:
+        return s->filestream.start_offset >= 0;
+    }
+    return false;
+}
+
+// Copy the len bytes at offset (counted from the start of the
+// stream), which must have been consumed already, into buf. The
+// stream position is not changed.
+static
+Result(Unit) BufferedStream_reread(BufferedStream *s, u64 offset,
+                                   u8 *buf, size_t len) {
+    assert(BufferedStream_can_reread(s));
+    if (s->is_closed) {
+        return Err(Unit, literal_String("reread: stream is closed"));
+    }
+    if (s->stream_type == STREAM_TYPE_FILESTREAM) {
+        int fd = s->filestream.optional_fd;
+        off_t pos = s->filestream.start_offset + offset;
+        while (len) {
+            ssize_t n = pread(fd, buf, len, pos);
+            if (n < 0) {
+                int err = errno;
+                if (err == EINTR) {
+                    continue;
+                }
+                return Err_from(Unit, Error_errno(err));
+            } else if (n == 0) {
+                return Err(Unit, literal_String(
+                               "file was truncated while reading it"));
+            }
+            buf += n;
+            len -= n;
+            pos += n;
+        }
+    } else {
+        // The data before startpos is still in the buffer
+        assert(offset + len <= s->buffer.lslice.startpos);
+        memcpy(buf, s->buffer.lslice.data + offset, len);
+    }
+    return Ok(Unit, {});
 }
 
 static
@@ -395,4 +802,117 @@ Result(Unit) BufferedStream_putc(BufferedStream *s, unsigned char c) {
     }
 }
 
+/*
+  Write the buffered data followed by the len bytes at p, with a
+  single `writev` unless the writes are partial. EINTR and partial
+  writes are handled like in `_BufferedStream_filestream_flush_unsafe`.
+  On failure, the buffer keeps just the part of its data that wasn't
+  written yet, so that flushing later doesn't write anything twice.
+*/
+static
+Result(Unit) _BufferedStream_filestream_writev_unsafe(BufferedStream *s,
+                                                      const u8 *p,
+                                                      size_t len) {
+    int fd = s->filestream.optional_fd;
+    LSlice_u8 *l = &s->buffer.lslice;
+    // As in BufferedStream_flush: the buffered data starts at 0
+    l->startpos = 0;
+    struct iovec iov[2] = {
+        { LSlice_start(*l), LSlice_length(*l) },
+        { (void *)p, len }
+    };
+    int i = 0;
+    while (1) {
+        while ((i < 2) && (iov[i].iov_len == 0)) {
+            i++;
+        }
+        if (i == 2) {
+            break;
+        }
+        ssize_t n = writev(fd, iov + i, 2 - i);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            if (iov[0].iov_len) {
+                // Keep only the buffered data that wasn't written,
+                // for the next flush
+                memmove(l->data, iov[0].iov_base, iov[0].iov_len);
+                l->startpos = iov[0].iov_len;
+                l->endpos = iov[0].iov_len;
+            }
+            Error_release(s->filestream.optional_failure);
+            s->filestream.optional_failure = Error_errno(err);
+            return Err_from(Unit, Error_clone(&s->filestream.optional_failure));
+        }
+        // partial or complete write
+        size_t k = n;
+        for (; (i < 2) && (k >= iov[i].iov_len); i++) {
+            k -= iov[i].iov_len;
+            iov[i].iov_len = 0;
+        }
+        if (i < 2) {
+            iov[i].iov_base = (u8 *)iov[i].iov_base + k;
+            iov[i].iov_len -= k;
+        }
+        if (iov[0].iov_len == 0) {
+            // The buffered data is out
+            l->startpos = 0;
+            l->endpos = 0;
+        }
+    }
+    return Ok(Unit, {});
+}
+
+/*
+  Write the len bytes at p. Short runs are copied into the buffer
+  (which is flushed whenever it is full); runs at least as large as
+  the buffer of a file stream bypass it: they are written together
+  with the buffered data via a single `writev`.
+*/
+UNUSED static
+Result(Unit) BufferedStream_write(BufferedStream *s, const u8 *p, size_t len) {
+    if (s->is_closed) {
+        return Err(Unit, literal_String("write: stream is closed"));
+    }
+    if (! (s->direction & STREAM_DIRECTION_OUT)) {
+        return Err(Unit, literal_String(
+                         "write: stream was not opened for output"));
+    }
+    Buffer *b = &s->buffer;
+    if ((s->stream_type == STREAM_TYPE_FILESTREAM) && (len >= b->size)) {
+        assert(s->filestream.optional_fd != FD_NONE);
+        return _BufferedStream_filestream_writev_unsafe(s, p, len);
+    }
+    while (len) {
+        size_t room = b->size - b->lslice.startpos;
+        if (room == 0) {
+            if (s->stream_type == STREAM_TYPE_FILESTREAM) {
+                Result(Unit) r = BufferedStream_flush(s);
+                PROPAGATE_return(Unit, r);
+                continue;
+            } else {
+                return Err(Unit, literal_String(
+                               "write to buffer: out of space"));
+            }
+        }
+        size_t n = (len < room) ? len : room;
+        memcpy(b->lslice.data + b->lslice.startpos, p, n);
+        b->lslice.startpos += n;
+        if (b->lslice.endpos < b->lslice.startpos) {
+            b->lslice.endpos = b->lslice.startpos;
+        }
+        p += n;
+        len -= n;
+    }
+    return Ok(Unit, {});
+}
+
+UNUSED static
+Result(Unit) BufferedStream_write_String(BufferedStream *s,
+                                         String str /* borrowed */) {
+    return BufferedStream_write(s, (const u8 *)str.str, strlen(str.str));
+}
+
 #endif /* BUFFEREDSTREAM_H_ */
@@ -0,0 +1,218 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef ERROR_H_
+#define ERROR_H_
+
+/*
+
+  The error values carried by `Result` (see Result.h): a kind (which
+  also identifies the subsystem), numeric context, and a message.
+
+  Errors other than of kind ERROR_MESSAGE are made without
+  allocating: their message is a constant string, the context (a byte
+  number, codepoint, or errno value) is only formatted into it when
+  printing, via `Error_format`, `Error_message` or `Error_to_String`.
+  An ERROR_MESSAGE carries just a (possibly allocated) message string.
+
+  `.str` is always the message or, for kinds with context, its
+  constant part, so that code that only needs a description of the
+  error (or checks whether there is one, `noError` has `.str` NULL)
+  can use it directly. Handling particular errors should match on
+  `.kind` instead of comparing messages.
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "String.h"
+
+
+typedef enum {
+    ERROR_NONE, // noError
+    // general:
+    ERROR_MESSAGE, // the message is all there is
+    // io:
+    ERROR_ERRNO, // a system call failed; context is errno
+    // utf8:
+    ERROR_UTF8_INVALID_START_BYTE,
+    ERROR_UTF8_PREMATURE_EOF, // context is the byte number, from 1
+    ERROR_UTF8_INVALID_CONTINUATION, // context is the byte number, from 1
+    ERROR_UTF8_INVALID_CODEPOINT, // context is the codepoint
+    // utf16:
+    ERROR_UTF16_PREMATURE_EOF, // context is the byte number, from 1
+    ERROR_UTF16_UNPAIRED_SURROGATE, // context is the code unit
+    // csv:
+    ERROR_CSV_UNBALANCED_QUOTE,
+} ErrorKind;
+
+typedef enum {
+    ERROR_SUBSYSTEM_GENERAL,
+    ERROR_SUBSYSTEM_IO,
+    ERROR_SUBSYSTEM_UTF8,
+    ERROR_SUBSYSTEM_UTF16,
+    ERROR_SUBSYSTEM_CSV,
+} ErrorSubsystem;
+
+typedef struct {
+    bool needs_freeing; // str
+    u8 kind; // ErrorKind
+    u32 context; // see ErrorKind
+    const char *str;
+} Error;
+
+#define noError (Error) { false, ERROR_NONE, 0, NULL }
+
+static UNUSED
+ErrorSubsystem ErrorKind_subsystem(ErrorKind kind) {
+    switch (kind) {
+    case ERROR_NONE:
+    case ERROR_MESSAGE:
+        return ERROR_SUBSYSTEM_GENERAL;
+    case ERROR_ERRNO:
+        return ERROR_SUBSYSTEM_IO;
+    case ERROR_UTF8_INVALID_START_BYTE:
+    case ERROR_UTF8_PREMATURE_EOF:
+    case ERROR_UTF8_INVALID_CONTINUATION:
+    case ERROR_UTF8_INVALID_CODEPOINT:
+        return ERROR_SUBSYSTEM_UTF8;
+    case ERROR_UTF16_PREMATURE_EOF:
+    case ERROR_UTF16_UNPAIRED_SURROGATE:
+        return ERROR_SUBSYSTEM_UTF16;
+    case ERROR_CSV_UNBALANCED_QUOTE:
+        return ERROR_SUBSYSTEM_CSV;
+    }
+    return ERROR_SUBSYSTEM_GENERAL;
+}
+
+// An error with just the message str.
+static UNUSED
+Error Error_from_String(String str /* owned */) {
+    return (Error) {
+        .needs_freeing = str.needs_freeing,
+        .kind = ERROR_MESSAGE,
+        .context = 0,
+        .str = str.str
+    };
+}
+
+// A failed system call. (Its message is only looked up when
+// formatting: strerror is not thread-safe, this is also used on
+// worker threads.)
+static UNUSED
+Error Error_errno(int err) {
+    return (Error) {
+        .needs_freeing = false,
+        .kind = ERROR_ERRNO,
+        .context = (u32)err,
+        .str = "system call failed"
+    };
+}
+
+// An error of a kind with a constant message and context (see
+// ErrorKind).
+static UNUSED
+Error Error_of_kind(ErrorKind kind, u32 context) {
+    const char *str;
+    switch (kind) {
+    case ERROR_UTF8_INVALID_START_BYTE:
+        str = "invalid start byte decoding UTF-8";
+        break;
+    case ERROR_UTF8_PREMATURE_EOF:
+        str = "premature EOF decoding UTF-8";
+        break;
+    case ERROR_UTF8_INVALID_CONTINUATION:
+        str = "invalid continuation byte decoding UTF-8";
+        break;
+    case ERROR_UTF8_INVALID_CODEPOINT:
+        str = "invalid unicode codepoint";
+        break;
+    case ERROR_UTF16_PREMATURE_EOF:
+        str = "premature EOF decoding UTF-16";
+        break;
+    case ERROR_UTF16_UNPAIRED_SURROGATE:
+        str = "unpaired surrogate decoding UTF-16";
+        break;
+    case ERROR_CSV_UNBALANCED_QUOTE:
+        str = "quoted field not closed in CSV";
+        break;
+    default:
+        DIE_("Error_of_kind: kind %i needs a message", kind);
+    }
+    return (Error) {
+        .needs_freeing = false,
+        .kind = kind,
+        .context = context,
+        .str = str
+    };
+}
+
+static UNUSED
+void Error_release(Error e) {
+    if (e.needs_freeing) {
+        free((void*)e.str);
+    }
+}
+
+// Only allocates for an ERROR_MESSAGE with an allocated message.
+static UNUSED
+Error Error_clone(const Error *e) {
+    Error e2 = *e;
+    if (e->needs_freeing) {
+        e2.str = xstrdup(e->str);
+    }
+    return e2;
+}
+
+#define ERROR_MSGSIZ 256
+
+/*
+  The complete message for e: either e->str, or the message
+  formatted into buf (of size bufsiz, e.g. ERROR_MSGSIZ), which is
+  returned then.
+*/
+static UNUSED
+const char *Error_format(const Error *e, char *buf, size_t bufsiz) {
+    switch ((ErrorKind)e->kind) {
+    case ERROR_ERRNO:
+        if (strerror_r((int)e->context, buf, bufsiz)) {
+            snprintf(buf, bufsiz, "%s (errno %u)", e->str, e->context);
+        }
+        return buf;
+    case ERROR_UTF8_PREMATURE_EOF:
+    case ERROR_UTF8_INVALID_CONTINUATION:
+    case ERROR_UTF16_PREMATURE_EOF:
+        snprintf(buf, bufsiz, "%s (byte #%u)", e->str, e->context);
+        return buf;
+    case ERROR_UTF8_INVALID_CODEPOINT:
+        snprintf(buf, bufsiz, "%s (%u, 0x%x)", e->str, e->context,
+                 e->context);
+        return buf;
+    case ERROR_UTF16_UNPAIRED_SURROGATE:
+        snprintf(buf, bufsiz, "%s (0x%04X)", e->str, e->context);
+        return buf;
+    default:
+        return e->str ? e->str : "(no error)";
+    }
+}
+
+// The complete message for the Error e (an lvalue), valid until the
+// end of the enclosing block.
+#define Error_message(e)                                        \
+    Error_format(&(e), (char[ERROR_MSGSIZ]) { 0 }, ERROR_MSGSIZ)
+
+// The complete message for e, as an (allocated) String.
+static UNUSED
+String Error_to_String(const Error *e) {
+    char buf[ERROR_MSGSIZ];
+    return copy_String(Error_format(e, buf, ERROR_MSGSIZ));
+}
+
+
+#endif /* ERROR_H_ */
@@ -7,6 +7,7 @@
 #define RESULT_H_
 
 #include "String.h"
+#include "Error.h"
 #include "macro-util.h"
 
 
@@ -16,13 +17,18 @@
     typedef struct {                            \
         bool is_err;                            \
         union {                                 \
-            String err;                         \
+            Error err;                          \
             T ok;                               \
         };                                      \
     } Result(T)
 
+// An error with the message string
 #define Err(T, string)                          \
-    (Result(T)) { .is_err = true, .err = string }
+    (Result(T)) { .is_err = true, .err = Error_from_String(string) }
+// An error with an `Error` value (see Error.h), e.g. one to be
+// propagated
+#define Err_from(T, error)                      \
+    (Result(T)) { .is_err = true, .err = error }
 #define Ok(T, val)                              \
     (Result(T)) { .is_err = false, .ok = val }
 
@@ -32,13 +38,13 @@
 // We don't release the .ok part here as that one may have changed
 // ownership in the mean time!
 #define Result_release(v)                       \
-    if (Result_is_Err(v)) String_release((v).err)
+    if (Result_is_Err(v)) Error_release((v).err)
 
 #define PROPAGATE_return(T, r)                                          \
     if (Result_is_Err(r)) {                                             \
         /* (r).err.needs_freeing = false;                               \
            after the next line, but usually deallocated anyway */       \
-        return Err(T, (r).err);                                         \
+        return Err_from(T, (r).err);                                    \
     }
 
 
@@ -77,7 +83,7 @@
 
 #define PROPAGATE_goto(label, T, r)                                     \
     if (Result_is_Err(r)) {                                             \
-        __return = Err(T, (r).err);                                     \
+        __return = Err_from(T, (r).err);                                \
         (r).err.needs_freeing = false;                                  \
         goto label;                                                     \
     }
@@ -115,7 +121,7 @@
 #define if_Ok(T, expr)                                  \
     __typeof__(expr) __if_Ok_result = expr;             \
     if (Result_is_Err(__if_Ok_result)) {                \
-        RETURN(Err(T, __if_Ok_result.err));             \
+        RETURN(Err_from(T, __if_Ok_result.err));        \
         Result_release(__if_Ok_result);                 \
     } else 
 
@@ -126,7 +132,7 @@
 #define if_let_Ok(T, var, expr)                         \
     __typeof__(expr) __if_Ok_result = expr;             \
     if (Result_is_Err(__if_Ok_result)) {                \
-        RETURN(Err(T, __if_Ok_result.err));             \
+        RETURN(Err_from(T, __if_Ok_result.err));        \
         Result_release(__if_Ok_result);                 \
     } else {                                            \
     __typeof__(__if_Ok_result.ok) var =                 \
@@ -143,7 +149,7 @@ So...:
     __typeof__(__if_Ok_result.ok) var =                 \
         __if_Ok_result.ok;                              \
     if (Result_is_Err(__if_Ok_result)) {                \
-        RETURN(Err(T, __if_Ok_result.err));             \
+        RETURN(Err_from(T, __if_Ok_result.err));        \
         Result_release(__if_Ok_result);                 \
     } else
 
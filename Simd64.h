@@ -0,0 +1,353 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef SIMD64_H_
+#define SIMD64_H_
+
+/*
+
+  A block of 64 bytes held in vector registers, and the few
+  operations the byte scanning kernels need on it. Every comparison
+  yields a `u64` bit mask with bit i representing byte i of the
+  block, so that the kernels themselves can be written as plain
+  integer code, independent of the vector width.
+
+  There is one implementation per instruction set level (see
+  cpudispatch.h), all with the same interface, e.g. for AVX2:
+
+    Simd64_avx2               the type
+    Simd64_avx2_load(p)       load the 64 bytes at p
+    Simd64_avx2_high_mask(v)  bytes >= 0x80
+    Simd64_avx2_eq_mask(v, c) bytes == c
+    Simd64_avx2_sgt_mask(v, c)  bytes > c when both are seen as
+                              signed (i8) values; i.e. for c >= 0x80,
+                              all ASCII bytes plus the high bytes > c
+
+  and one operation on 8 bytes in memory, for transcoding (see
+  `Simd64_latin1_shuffles` for the argument `shuffles`):
+
+    Simd64_avx2_latin1_expand8(p, high, out, shuffles)
+                              store the UTF-8 encoding of the 8
+                              Latin-1 bytes at p, of which those >= 0x80
+                              are given by the bit mask high, at out;
+                              always stores 16 bytes, returns the
+                              length of the encoding (8 + the number
+                              of high bytes)
+
+  On x86, all of them are compiled regardless of the compiler flags,
+  each function carrying the target attribute for its level
+  (`SIMD64_TARGET_*`); code using them has to carry the same
+  attribute, and must only be run after checking that the CPU
+  supports it. Elsewhere, only the scalar implementation exists.
+
+ */
+
+#include <string.h> /* memcpy */
+#include <pthread.h>
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define SIMD64_X86 1
+#  include <immintrin.h>
+#else
+#  define SIMD64_X86 0
+#endif
+
+
+/*
+  The shuffle patterns for `Simd64_*_latin1_expand8`: the 8 bytes are
+  widened to 16-bit lanes holding their UTF-8 encoding (first byte in
+  the low half), row `high` of the table then picks the low half of
+  every lane, and the high half of the lanes with their bit set in
+  `high` (0x80, i.e. zero, for the unused rest).
+*/
+
+// Should be in a Simd64.c but we're currently using a single binary
+// object for everything.
+u8 simd64_latin1_shuffles[256][16];
+pthread_once_t simd64_latin1_shuffles_once = PTHREAD_ONCE_INIT;
+
+static
+void _Simd64_latin1_shuffles_init(void) {
+    for (int m = 0; m < 256; m++) {
+        int j = 0;
+        for (int i = 0; i < 8; i++) {
+            simd64_latin1_shuffles[m][j++] = 2 * i;
+            if (m & (1 << i)) {
+                simd64_latin1_shuffles[m][j++] = 2 * i + 1;
+            }
+        }
+        for (; j < 16; j++) {
+            simd64_latin1_shuffles[m][j] = 0x80;
+        }
+    }
+}
+
+// The table, initialized on the first call.
+static UNUSED
+const u8 (*Simd64_latin1_shuffles(void))[16] {
+    pthread_once(&simd64_latin1_shuffles_once, _Simd64_latin1_shuffles_init);
+    return (const u8 (*)[16])simd64_latin1_shuffles;
+}
+
+
+/* Scalar */
+
+#define SIMD64_TARGET_scalar
+
+typedef struct {
+    u8 b[64];
+} Simd64_scalar;
+
+static inline UNUSED
+Simd64_scalar Simd64_scalar_load(const u8 *p) {
+    Simd64_scalar v;
+    memcpy(v.b, p, 64);
+    return v;
+}
+
+static inline UNUSED
+u64 Simd64_scalar_high_mask(Simd64_scalar v) {
+    u64 m = 0;
+    for (int i = 0; i < 64; i++) {
+        m |= (u64)(v.b[i] >> 7) << i;
+    }
+    return m;
+}
+
+static inline UNUSED
+u64 Simd64_scalar_eq_mask(Simd64_scalar v, u8 c) {
+    u64 m = 0;
+    for (int i = 0; i < 64; i++) {
+        m |= (u64)(v.b[i] == c) << i;
+    }
+    return m;
+}
+
+static inline UNUSED
+u64 Simd64_scalar_sgt_mask(Simd64_scalar v, u8 c) {
+    u64 m = 0;
+    for (int i = 0; i < 64; i++) {
+        m |= (u64)((i8)v.b[i] > (i8)c) << i;
+    }
+    return m;
+}
+
+static inline UNUSED
+size_t Simd64_scalar_latin1_expand8(const u8 *p, u8 high, u8 *out,
+                                    const u8 (*shuffles)[16]) {
+    (void)high;
+    (void)shuffles;
+    size_t o = 0;
+    for (int i = 0; i < 8; i++) {
+        u8 b = p[i];
+        if (b < 0x80) {
+            out[o++] = b;
+        } else {
+            out[o++] = 0xC0 | (b >> 6);
+            out[o++] = 0x80 | (b & 0x3F);
+        }
+    }
+    return o;
+}
+
+
+#if SIMD64_X86
+
+/* SSE4.2: only SSE2 instructions are needed for the vectors, but the
+   level also guarantees the popcnt instruction. */
+
+#define SIMD64_TARGET_sse42 __attribute__((target("sse4.2,popcnt")))
+
+typedef struct {
+    __m128i v0, v1, v2, v3;
+} Simd64_sse42;
+
+static inline UNUSED SIMD64_TARGET_sse42
+Simd64_sse42 Simd64_sse42_load(const u8 *p) {
+    return (Simd64_sse42) {
+        _mm_loadu_si128((const __m128i *)p),
+        _mm_loadu_si128((const __m128i *)(p + 16)),
+        _mm_loadu_si128((const __m128i *)(p + 32)),
+        _mm_loadu_si128((const __m128i *)(p + 48))
+    };
+}
+
+static inline UNUSED SIMD64_TARGET_sse42
+u64 _Simd64_sse42_combine(__m128i m0, __m128i m1, __m128i m2, __m128i m3) {
+    return (u64)(u32)_mm_movemask_epi8(m0)
+        | ((u64)(u32)_mm_movemask_epi8(m1) << 16)
+        | ((u64)(u32)_mm_movemask_epi8(m2) << 32)
+        | ((u64)(u32)_mm_movemask_epi8(m3) << 48);
+}
+
+static inline UNUSED SIMD64_TARGET_sse42
+u64 Simd64_sse42_high_mask(Simd64_sse42 v) {
+    return _Simd64_sse42_combine(v.v0, v.v1, v.v2, v.v3);
+}
+
+static inline UNUSED SIMD64_TARGET_sse42
+u64 Simd64_sse42_eq_mask(Simd64_sse42 v, u8 c) {
+    __m128i cv = _mm_set1_epi8((char)c);
+    return _Simd64_sse42_combine(_mm_cmpeq_epi8(v.v0, cv),
+                                 _mm_cmpeq_epi8(v.v1, cv),
+                                 _mm_cmpeq_epi8(v.v2, cv),
+                                 _mm_cmpeq_epi8(v.v3, cv));
+}
+
+static inline UNUSED SIMD64_TARGET_sse42
+u64 Simd64_sse42_sgt_mask(Simd64_sse42 v, u8 c) {
+    __m128i cv = _mm_set1_epi8((char)c);
+    return _Simd64_sse42_combine(_mm_cmpgt_epi8(v.v0, cv),
+                                 _mm_cmpgt_epi8(v.v1, cv),
+                                 _mm_cmpgt_epi8(v.v2, cv),
+                                 _mm_cmpgt_epi8(v.v3, cv));
+}
+
+// (SSSE3, for pshufb, is part of this level)
+static inline UNUSED SIMD64_TARGET_sse42
+size_t Simd64_sse42_latin1_expand8(const u8 *p, u8 high, u8 *out,
+                                   const u8 (*shuffles)[16]) {
+    __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),
+                                  _mm_setzero_si128());
+    // For a high byte b: 0xC2 or 0xC3 (b >= 0xC0), then 0x80 | (b & 0x3F)
+    __m128i lead = _mm_or_si128(_mm_set1_epi16(0xC2),
+                                _mm_and_si128(_mm_srli_epi16(w, 6),
+                                              _mm_set1_epi16(1)));
+    __m128i cont = _mm_slli_epi16(_mm_and_si128(w, _mm_set1_epi16(0xBF)), 8);
+    __m128i is_high = _mm_cmpgt_epi16(w, _mm_set1_epi16(0x7F));
+    __m128i lanes = _mm_or_si128(
+        _mm_and_si128(is_high, _mm_or_si128(lead, cont)),
+        _mm_andnot_si128(is_high, w));
+    __m128i shuffle = _mm_loadu_si128((const __m128i *)shuffles[high]);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(lanes, shuffle));
+    return 8 + __builtin_popcount(high);
+}
+
+
+/* AVX2 */
+
+#define SIMD64_TARGET_avx2                                      \
+    __attribute__((target("avx2,popcnt,lzcnt,bmi")))
+
+typedef struct {
+    __m256i v0, v1;
+} Simd64_avx2;
+
+static inline UNUSED SIMD64_TARGET_avx2
+Simd64_avx2 Simd64_avx2_load(const u8 *p) {
+    return (Simd64_avx2) {
+        _mm256_loadu_si256((const __m256i *)p),
+        _mm256_loadu_si256((const __m256i *)(p + 32))
+    };
+}
+
+static inline UNUSED SIMD64_TARGET_avx2
+u64 _Simd64_avx2_combine(__m256i m0, __m256i m1) {
+    return (u64)(u32)_mm256_movemask_epi8(m0)
+        | ((u64)(u32)_mm256_movemask_epi8(m1) << 32);
+}
+
+static inline UNUSED SIMD64_TARGET_avx2
+u64 Simd64_avx2_high_mask(Simd64_avx2 v) {
+    return _Simd64_avx2_combine(v.v0, v.v1);
+}
+
+static inline UNUSED SIMD64_TARGET_avx2
+u64 Simd64_avx2_eq_mask(Simd64_avx2 v, u8 c) {
+    __m256i cv = _mm256_set1_epi8((char)c);
+    return _Simd64_avx2_combine(_mm256_cmpeq_epi8(v.v0, cv),
+                                _mm256_cmpeq_epi8(v.v1, cv));
+}
+
+static inline UNUSED SIMD64_TARGET_avx2
+u64 Simd64_avx2_sgt_mask(Simd64_avx2 v, u8 c) {
+    __m256i cv = _mm256_set1_epi8((char)c);
+    return _Simd64_avx2_combine(_mm256_cmpgt_epi8(v.v0, cv),
+                                _mm256_cmpgt_epi8(v.v1, cv));
+}
+
+static inline UNUSED SIMD64_TARGET_avx2
+size_t Simd64_avx2_latin1_expand8(const u8 *p, u8 high, u8 *out,
+                                  const u8 (*shuffles)[16]) {
+    return Simd64_sse42_latin1_expand8(p, high, out, shuffles);
+}
+
+
+/* AVX-512 (BW): the comparisons yield the 64-bit masks directly */
+
+#define SIMD64_TARGET_avx512                                            \
+    __attribute__((target("avx512f,avx512bw,avx2,popcnt,lzcnt,bmi")))
+
+typedef struct {
+    __m512i v;
+} Simd64_avx512;
+
+static inline UNUSED SIMD64_TARGET_avx512
+Simd64_avx512 Simd64_avx512_load(const u8 *p) {
+    return (Simd64_avx512) { _mm512_loadu_si512((const void *)p) };
+}
+
+static inline UNUSED SIMD64_TARGET_avx512
+u64 Simd64_avx512_high_mask(Simd64_avx512 v) {
+    return _mm512_movepi8_mask(v.v);
+}
+
+static inline UNUSED SIMD64_TARGET_avx512
+u64 Simd64_avx512_eq_mask(Simd64_avx512 v, u8 c) {
+    return _mm512_cmpeq_epi8_mask(v.v, _mm512_set1_epi8((char)c));
+}
+
+static inline UNUSED SIMD64_TARGET_avx512
+u64 Simd64_avx512_sgt_mask(Simd64_avx512 v, u8 c) {
+    return _mm512_cmpgt_epi8_mask(v.v, _mm512_set1_epi8((char)c));
+}
+
+static inline UNUSED SIMD64_TARGET_avx512
+size_t Simd64_avx512_latin1_expand8(const u8 *p, u8 high, u8 *out,
+                                    const u8 (*shuffles)[16]) {
+    return Simd64_sse42_latin1_expand8(p, high, out, shuffles);
+}
+
+#endif /* SIMD64_X86 */
+
+
+/* Bit mask helpers (these compile to the popcnt/lzcnt/tzcnt
+   instructions when inlined into code for a level that has them) */
+
+static inline UNUSED
+int u64_popcount(u64 m) {
+    return __builtin_popcountll(m);
+}
+
+// Index of the lowest set bit; m must not be 0.
+static inline UNUSED
+int u64_lowest_bit(u64 m) {
+    return __builtin_ctzll(m);
+}
+
+// Index of the highest set bit; m must not be 0.
+static inline UNUSED
+int u64_highest_bit(u64 m) {
+    return 63 - __builtin_clzll(m);
+}
+
+// Bit i of the result is the XOR of the bits 0..i of m (i.e. whether
+// an odd number of them is set). (A carry-less multiplication by ~0
+// would do the same, but PCLMULQDQ isn't part of the levels.)
+static inline UNUSED
+u64 u64_prefix_xor(u64 m) {
+    m ^= m << 1;
+    m ^= m << 2;
+    m ^= m << 4;
+    m ^= m << 8;
+    m ^= m << 16;
+    m ^= m << 32;
+    return m;
+}
+
+
+#endif /* SIMD64_H_ */
@@ -15,7 +15,9 @@
 #define STRING_H_
 
 #include <stdbool.h>
+#include <assert.h>
 #include "mem.h"
+#include "util.h" /* UNUSED */
 
 
 typedef struct {
@@ -50,7 +52,7 @@ void String_release(String s) {
   library. Note that so far nothing in this library is designed for
   mutation.
 */
-static
+UNUSED static
 String String_clone(const String *s) {
     if (s->needs_freeing) {
         return copy_String(s->str);
@@ -97,5 +99,61 @@ finish:
 #undef QBUFSIZ
 }
 
+/*
+  Quote str as a JSON (JavaScript) string literal, including the
+  surrounding double quotes. Bytes >= 0x80 are passed through
+  unchanged, thus the result is only valid JSON if str is valid
+  UTF-8. Unlike String_quote_sh, this never truncates (paths can be
+  long).
+*/
+static
+String String_quote_js(const char *str) {
+    size_t len = 2; // the quotes
+    for (const char *s = str; *s; s++) {
+        unsigned char c = *s;
+        if ((c == '"') || (c == '\\')
+            || (c == '\n') || (c == '\r') || (c == '\t')) {
+            len += 2;
+        } else if (c < 0x20) {
+            len += 6;
+        } else {
+            len++;
+        }
+    }
+    char *out = (char *)xmalloc(len + 1);
+    size_t out_i = 0;
+    out[out_i++] = '"';
+    for (const char *s = str; *s; s++) {
+        unsigned char c = *s;
+        if ((c == '"') || (c == '\\')) {
+            out[out_i++] = '\\';
+            out[out_i++] = c;
+        } else if (c == '\n') {
+            out[out_i++] = '\\';
+            out[out_i++] = 'n';
+        } else if (c == '\r') {
+            out[out_i++] = '\\';
+            out[out_i++] = 'r';
+        } else if (c == '\t') {
+            out[out_i++] = '\\';
+            out[out_i++] = 't';
+        } else if (c < 0x20) {
+            const char *hex = "0123456789abcdef";
+            out[out_i++] = '\\';
+            out[out_i++] = 'u';
+            out[out_i++] = '0';
+            out[out_i++] = '0';
+            out[out_i++] = hex[c >> 4];
+            out[out_i++] = hex[c & 15];
+        } else {
+            out[out_i++] = c;
+        }
+    }
+    out[out_i++] = '"';
+    out[out_i] = '\0';
+    assert(out_i == len);
+    return allocated_String(out);
+}
+
 
 #endif /* STRING_H_ */
@@ -0,0 +1,281 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef ALLERRORS_H_
+#define ALLERRORS_H_
+
+/*
+
+  Checking an input stream for all of its encoding errors instead of
+  stopping at the first one (`Report_scan_all`), streaming a JSON
+  record per error to an `ErrorLog`, and closing it with a summary
+  record (`ErrorLog_summary`).
+
+  After an invalid sequence, decoding resumes after its maximal
+  subpart (see `get_unicodechar_resync`), which counts as one
+  character, as if it had been replaced by U+FFFD; the positions of
+  the following errors and the counts in the summary are those of
+  the input with these replacements. UTF-16 input (from a BOM)
+  resumes after the invalid code unit.
+
+  The valid parts are scanned by the same kernels as with
+  `Report_scan`, without tracking the column; it is only determined
+  at the end of each of them (scanning back to the last line
+  separator, see `LineCount_tail_column`). The records are formatted
+  into the log's output stream, a `BufferedStream`; after
+  `max_records` of them, the errors are only counted.
+
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "shorttypenames.h"
+#include "String.h"
+#include "Error.h"
+#include "BufferedStream.h"
+#include "unicode.h"
+#include "encoding.h"
+#include "scankernels.h"
+#include "utf8dfa.h"
+#include "report.h"
+
+
+// The number of error records written unless chosen otherwise
+#define ERRORLOG_DEFAULT_MAX_RECORDS 1000
+
+// Room for one record
+#define ERRORLOG_RECORDSIZ (ERROR_MSGSIZ + 512)
+
+typedef struct {
+    BufferedStream *out;
+    u64 max_records;
+    u64 errorcount; // all errors seen, written or not
+    Error failure; // from writing to out; nothing more is written then
+} ErrorLog;
+
+static
+ErrorLog ErrorLog_new(BufferedStream *out /* borrowed */, u64 max_records) {
+    return (ErrorLog) {
+        .out = out,
+        .max_records = max_records,
+        .errorcount = 0,
+        .failure = noError
+    };
+}
+
+static
+void ErrorLog_release(ErrorLog *log) {
+    Error_release(log->failure);
+}
+
+static inline
+bool ErrorLog_is_failure(const ErrorLog *log) {
+    return log->failure.str != NULL;
+}
+
+// Record a failure writing to log->out, dropping what couldn't be
+// written (so that closing it doesn't try again).
+static
+void _ErrorLog_fail(ErrorLog *log, Error e /* owned */) {
+    log->failure = e;
+    log->out->buffer.lslice.startpos = 0;
+    log->out->buffer.lslice.endpos = 0;
+}
+
+// Format a record into log->out, unless writing failed before.
+static __attribute__ ((format (printf, 2, 3)))
+void _ErrorLog_printf(ErrorLog *log, const char *fmt, ...) {
+    if (ErrorLog_is_failure(log)) {
+        return;
+    }
+    char buf[ERRORLOG_RECORDSIZ];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, ERRORLOG_RECORDSIZ, fmt, ap);
+    va_end(ap);
+    if (n >= ERRORLOG_RECORDSIZ) {
+        n = ERRORLOG_RECORDSIZ - 1;
+    }
+    Result(Unit) rw = BufferedStream_write(log->out, (const u8 *)buf, n);
+    if (Result_is_Err(rw)) {
+        _ErrorLog_fail(log, rw.err); // moved
+    }
+}
+
+/*
+  Record the error e for the invalid sequence of len bytes at offset,
+  lc being the count before it (with the column tracked). The line
+  of a sequence directly following a CR is the next one, unlike in
+  the record of `Report_print`.
+*/
+static
+void ErrorLog_add(ErrorLog *log, const Error *e, u64 offset, size_t len,
+                  const LineCount *lc) {
+    log->errorcount++;
+    if (log->errorcount > log->max_records) {
+        return;
+    }
+    char buf[ERROR_MSGSIZ];
+    String msg = String_quote_js(Error_format(e, buf, ERROR_MSGSIZ));
+    bool is_utf16 = (ErrorKind_subsystem(e->kind) == ERROR_SUBSYSTEM_UTF16);
+    _ErrorLog_printf(log, "{ \"type\": \"%s\", \"failure\": %s, \"byte_offset\": %" PRIu64 ", \"byte_length\": %zu, \"character_position\": %li, \"line\": %li, \"column\": %li }\n",
+                     is_utf16 ? "utf-16-error" : "utf-8-error",
+                     msg.str, offset, len,
+                     lc->charcount + 1,
+                     LineCount_lines(lc) + lc->last_was_CR + 1,
+                     lc->column + 1);
+    String_release(msg);
+}
+
+/*
+  Write the summary record for r, the result of `Report_scan_all`
+  with log, and flush log->out. Returns false if writing failed (the
+  error is in log->failure then).
+*/
+static
+bool ErrorLog_summary(ErrorLog *log, const Report *r) {
+    const LineCount *lc = &r->lc;
+    u64 omitted = (log->errorcount > log->max_records)
+        ? log->errorcount - log->max_records : 0;
+    const char *encodingsep = r->has_bom ? ", \"encoding\": \"" : "";
+    const char *encoding = r->has_bom ? Encoding_name(r->encoding) : "";
+    const char *encodingend = r->has_bom ? "\"" : "";
+    _ErrorLog_printf(log, "{ \"type\": \"summary\"%s%s%s, \"errorcount\": %" PRIu64 ", \"omitted_errorcount\": %" PRIu64 ", \"bytecount\": %" PRIu64 ", \"charcount\": %li, \"LFcount\": %li, \"CRcount\": %li, \"CRLFcount\": %li",
+                     encodingsep, encoding, encodingend,
+                     log->errorcount, omitted, r->bytecount,
+                     lc->charcount, lc->LFcount, lc->CRcount,
+                     lc->CRLFcount);
+    if (Report_is_failure(r)) {
+        // Reading failed, the counts are up to there
+        char buf[ERROR_MSGSIZ];
+        String msg = String_quote_js(
+            Error_format(&r->failure, buf, ERROR_MSGSIZ));
+        _ErrorLog_printf(log, ", \"failure\": %s", msg.str);
+        String_release(msg);
+    }
+    _ErrorLog_printf(log, " }\n");
+    if (! ErrorLog_is_failure(log)) {
+        Result(Unit) rf = BufferedStream_flush(log->out);
+        if (Result_is_Err(rf)) {
+            _ErrorLog_fail(log, rf.err); // moved
+        }
+    }
+    return ! ErrorLog_is_failure(log);
+}
+
+// The number of bytes consumed by `get_utf16char` for the error e.
+static
+size_t _utf16_error_length(const Error *e) {
+    return (e->kind == ERROR_UTF16_PREMATURE_EOF) ? e->context - 1 : 2;
+}
+
+/*
+  Read all of `in`, recording each invalid sequence in log. The
+  failure in the report is only set if reading failed; scanning also
+  stops when writing to log fails. Only `opts->decoder` is used from
+  opts, the scan always happens on the calling thread.
+*/
+static
+Report Report_scan_all(BufferedStream *in /* borrowed */,
+                       const ScanOptions *opts,
+                       ErrorLog *log) {
+    Report r = { .lc = default_LineCount, .failure = noError,
+                 .bytecount = 0, .encoding = ENCODING_UTF8,
+                 .has_bom = false, .is_csv = false,
+                 .csv = default_CsvCount };
+    LineCount *lc = &r.lc;
+    u64 offset = 0; // of the next character
+    {
+        Result(LSlice_u8) rs = BufferedStream_peek_atleast(in, BOM_MAXLEN);
+        if (Result_is_Err(rs)) {
+            r.failure = rs.err; // moved
+            return r;
+        }
+        size_t bomlen = Encoding_from_bom(LSlice_start(rs.ok),
+                                          LSlice_length(rs.ok),
+                                          &r.encoding);
+        BufferedStream_consume(in, bomlen);
+        offset = bomlen;
+        r.has_bom = (bomlen > 0);
+    }
+    bool is_utf16 = (r.encoding == ENCODING_UTF16LE)
+        || (r.encoding == ENCODING_UTF16BE);
+    bool is_be = (r.encoding == ENCODING_UTF16BE);
+    utf8_valid_prefix_fn valid_prefix =
+        is_utf16 ? (is_be ? utf16be_valid_prefix : utf16le_valid_prefix)
+        : (opts->decoder == UTF8_DECODER_DFA) ? utf8dfa_valid_prefix
+        : utf8_valid_prefix;
+    // (the UTF-16 kernels always track the column)
+    LineCount_valid_bytes_fn valid_bytes =
+        is_utf16 ? (is_be ? LineCount_utf16be_valid_bytes
+                    : LineCount_utf16le_valid_bytes)
+        : LineCount_valid_bytes_nocolumn;
+    while (1) {
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Err(rs)) {
+            r.failure = rs.err; // moved
+            break;
+        }
+        size_t len = LSlice_length(rs.ok);
+        if (len == 0) {
+            LineCount_finish(lc);
+            break;
+        }
+        const u8 *p = LSlice_start(rs.ok);
+        size_t n = valid_prefix(p, len);
+        int64_t column = lc->column;
+        valid_bytes(lc, p, n);
+        if (! is_utf16) {
+            int64_t tail;
+            lc->column = LineCount_tail_column(p, n, &tail) ? tail
+                : column + tail;
+        }
+        BufferedStream_consume(in, n);
+        offset += n;
+        if (n < len) {
+            // A character crossing the end of the buffer, or an
+            // invalid sequence
+            u8 b1 = p[n];
+            size_t charlen = is_utf16 ? 0 : utf8_sequence_length(b1);
+            size_t errlen = 0;
+            Result(Option(u32)) c = is_utf16 ? get_utf16char(in, is_be)
+                : get_unicodechar_resync(in, &errlen);
+            if (Result_is_Err(c)) {
+                ErrorSubsystem sub = ErrorKind_subsystem(c.err.kind);
+                if ((sub != ERROR_SUBSYSTEM_UTF8)
+                    && (sub != ERROR_SUBSYSTEM_UTF16)) {
+                    r.failure = c.err; // moved
+                    break;
+                }
+                if (is_utf16) {
+                    errlen = _utf16_error_length(&c.err);
+                }
+                ErrorLog_add(log, &c.err, offset, errlen, lc);
+                Error_release(c.err);
+                if (ErrorLog_is_failure(log)) {
+                    break;
+                }
+                LineCount_char(lc, 0xFFFD);
+                offset += errlen;
+                continue;
+            }
+            if (c.ok.is_none) {
+                LineCount_finish(lc);
+                break;
+            }
+            LineCount_char(lc, is_utf16 ? c.ok.value
+                           : utf8_counted_char(b1, c.ok.value));
+            offset += is_utf16 ? ((c.ok.value > 0xFFFF) ? 4 : 2) : charlen;
+        }
+    }
+    r.bytecount = offset;
+    return r;
+}
+
+
+#endif /* ALLERRORS_H_ */
@@ -0,0 +1,336 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+/*
+
+  Checking many files in one process, on a fixed pool of worker
+  threads.
+
+  Files are submitted by path (`Batch_submit`, or
+  `Batch_submit_nul_separated` for a list as produced by `find
+  -print0`); each is opened, scanned and closed by one of the workers,
+  and one JSON record per file, including its path, is printed to the
+  output. Errors opening or closing a file are printed as records of
+  type "error" instead of aborting the batch. With a result cache
+  (see resultcache.h), files that are unchanged since they were last
+  checked are answered from it without reading them.
+
+  The files in flight (waiting for a worker, being scanned, or
+  waiting to be printed) are kept in a ring of `window` slots, which
+  also serves as the reorder buffer: in ordered mode the records are
+  printed in submission order, a slot being freed only once all
+  earlier records have been printed; in unordered mode a record is
+  printed as soon as its file is done. Submission blocks while the
+  ring is full.
+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* DIE */
+#include "mem.h"
+#include "String.h"
+#include "BufferedStream.h"
+#include "report.h"
+#include "resultcache.h"
+
+
+#define BATCH_MAX_JOBS 256
+
+// Number of slots in the ring per worker thread
+#define BATCH_WINDOW_PER_JOB 16
+
+typedef enum {
+    BATCHSLOT_FREE,
+    BATCHSLOT_QUEUED, // waiting for or being processed by a worker
+    BATCHSLOT_DONE, // waiting to be printed
+    BATCHSLOT_PRINTED // (unordered mode) waiting to be freed
+} BatchSlotState;
+
+typedef struct {
+    BatchSlotState state;
+    String path;
+    // results:
+    bool has_report; // false if the file could not be opened
+    Report report;
+    const char *optional_error_operation; // "open" or "close"
+    Error error;
+} BatchSlot;
+
+typedef struct {
+    ReadOptions readopts; // per file
+    ScanOptions scanopts;
+    const ResultCache *optional_cache;
+    bool is_unordered;
+    FILE *out;
+
+    pthread_mutex_t mutex; // protects everything below
+    pthread_cond_t cond; // broadcast on every change of state
+    BatchSlot *slots; // file number i is in slot i % window
+    size_t window;
+    size_t nsubmitted;
+    size_t ntaken; // by workers
+    size_t nfreed;
+    bool is_complete; // no more files will be submitted
+    size_t nerrors;
+
+    int njobs;
+    pthread_t *workers;
+} Batch;
+
+
+// Open, scan and close the file (or take the result from
+// optional_cache); runs without holding the lock
+static
+void BatchSlot_run(BatchSlot *slot, const ReadOptions *readopts,
+                   const ScanOptions *scanopts,
+                   const ResultCache *optional_cache) {
+    const char *path = slot->path.str;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (optional_cache && (fstat(fd, &st) < 0))) {
+        slot->optional_error_operation = "open";
+        slot->error = Error_errno(errno);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (optional_cache && (! optional_cache->verify)
+        && ResultCache_lookup(optional_cache, fd, &st, scanopts->csv,
+                              &slot->report)) {
+        slot->has_report = true;
+        close(fd);
+        return;
+    }
+    BufferedStream in = fd_r_BufferedStream(fd, borrowing_String(path),
+                                            true, readopts);
+    slot->report = Report_scan(&in, scanopts);
+    slot->has_report = true;
+    if (optional_cache) {
+        ResultCache_update(optional_cache, fd, &st, &slot->report, path);
+    }
+    Result(Unit) r = BufferedStream_close(&in);
+    if (Result_is_Err(r)) {
+        slot->optional_error_operation = "close";
+        slot->error = r.err; // moved
+    }
+    BufferedStream_release(&in);
+}
+
+static
+void BatchSlot_print(BatchSlot *slot, FILE *out) {
+    String path = String_quote_js(slot->path.str);
+    if (slot->has_report) {
+        Report_print(&slot->report, path.str, out);
+    }
+    if (slot->optional_error_operation) {
+        char buf[ERROR_MSGSIZ];
+        String msg = String_quote_js(
+            Error_format(&slot->error, buf, ERROR_MSGSIZ));
+        fprintf(out, "{ \"type\": \"error\", \"path\": %s, \"operation\": \"%s\", \"failure\": %s }\n",
+                path.str, slot->optional_error_operation, msg.str);
+        String_release(msg);
+    }
+    String_release(path);
+}
+
+static
+void BatchSlot_release(BatchSlot *slot) {
+    String_release(slot->path);
+    if (slot->has_report) {
+        Report_release(&slot->report);
+    }
+    if (slot->optional_error_operation) {
+        Error_release(slot->error);
+    }
+    slot->state = BATCHSLOT_FREE;
+}
+
+// Print what can be printed now and free the slots at the start of
+// the ring that are finished. Must hold the lock.
+static
+void _Batch_advance(Batch *b) {
+    while (b->nfreed < b->nsubmitted) {
+        BatchSlot *slot = &b->slots[b->nfreed % b->window];
+        if (slot->state == BATCHSLOT_DONE) {
+            assert(! b->is_unordered);
+            BatchSlot_print(slot, b->out);
+        } else if (slot->state != BATCHSLOT_PRINTED) {
+            break;
+        }
+        BatchSlot_release(slot);
+        b->nfreed++;
+    }
+}
+
+static
+void *Batch_worker(void *arg) {
+    Batch *b = (Batch *)arg;
+    pthread_mutex_lock(&b->mutex);
+    while (1) {
+        while ((b->ntaken == b->nsubmitted) && (! b->is_complete)) {
+            pthread_cond_wait(&b->cond, &b->mutex);
+        }
+        if (b->ntaken == b->nsubmitted) {
+            break;
+        }
+        BatchSlot *slot = &b->slots[b->ntaken % b->window];
+        b->ntaken++;
+        pthread_mutex_unlock(&b->mutex);
+
+        BatchSlot_run(slot, &b->readopts, &b->scanopts, b->optional_cache);
+
+        pthread_mutex_lock(&b->mutex);
+        if (slot->optional_error_operation) {
+            b->nerrors++;
+        }
+        if (b->is_unordered) {
+            BatchSlot_print(slot, b->out);
+            slot->state = BATCHSLOT_PRINTED;
+        } else {
+            slot->state = BATCHSLOT_DONE;
+        }
+        _Batch_advance(b);
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->mutex);
+    return NULL;
+}
+
+// Start njobs worker threads (at least one is started, or the
+// process dies). optional_cache is borrowed until `Batch_finish`.
+static
+void Batch_init(Batch *b, int njobs, const ReadOptions *readopts,
+                const ScanOptions *scanopts,
+                const ResultCache *optional_cache, bool is_unordered,
+                FILE *out) {
+    if (njobs < 1) {
+        njobs = 1;
+    }
+    if (njobs > BATCH_MAX_JOBS) {
+        njobs = BATCH_MAX_JOBS;
+    }
+    *b = (Batch) {
+        .readopts = *readopts,
+        .scanopts = *scanopts,
+        .optional_cache = optional_cache,
+        .is_unordered = is_unordered,
+        .out = out,
+        .window = njobs * BATCH_WINDOW_PER_JOB,
+        .workers = (pthread_t *)xmalloc(njobs * sizeof(pthread_t))
+    };
+    b->slots = (BatchSlot *)xmalloc(b->window * sizeof(BatchSlot));
+    for (size_t i = 0; i < b->window; i++) {
+        b->slots[i].state = BATCHSLOT_FREE;
+    }
+    pthread_mutex_init(&b->mutex, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    for (int i = 0; i < njobs; i++) {
+        if (pthread_create(&b->workers[b->njobs], NULL,
+                           Batch_worker, b) == 0) {
+            b->njobs++;
+        }
+    }
+    if (b->njobs == 0) {
+        DIE("Batch_init: could not start any worker thread");
+    }
+}
+
+static
+void Batch_submit(Batch *b, String path /* owned */) {
+    pthread_mutex_lock(&b->mutex);
+    assert(! b->is_complete);
+    while (b->nsubmitted - b->nfreed >= b->window) {
+        pthread_cond_wait(&b->cond, &b->mutex);
+    }
+    BatchSlot *slot = &b->slots[b->nsubmitted % b->window];
+    assert(slot->state == BATCHSLOT_FREE);
+    *slot = (BatchSlot) {
+        .state = BATCHSLOT_QUEUED,
+        .path = path,
+        .has_report = false,
+        .optional_error_operation = NULL,
+        .error = noError
+    };
+    b->nsubmitted++;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+}
+
+// Submit the paths in `in`, which are separated by (or terminated
+// with) NUL bytes.
+static
+Result(Unit) Batch_submit_nul_separated(Batch *b,
+                                        BufferedStream *in /* borrowed */) {
+    size_t size = 256;
+    size_t len = 0;
+    char *path = (char *)xmalloc(size);
+    while (1) {
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Err(rs)) {
+            free(path);
+            return Err_from(Unit, rs.err);
+        }
+        size_t n = LSlice_length(rs.ok);
+        if (n == 0) {
+            break;
+        }
+        const u8 *p = LSlice_start(rs.ok);
+        const u8 *nul = (const u8 *)memchr(p, 0, n);
+        size_t k = nul ? (size_t)(nul - p) : n;
+        if (len + k + 1 > size) {
+            while (len + k + 1 > size) {
+                size *= 2;
+            }
+            char *newpath = (char *)xmalloc(size);
+            memcpy(newpath, path, len);
+            free(path);
+            path = newpath;
+        }
+        memcpy(path + len, p, k);
+        len += k;
+        BufferedStream_consume(in, nul ? k + 1 : k);
+        if (nul) {
+            path[len] = '\0';
+            Batch_submit(b, copy_String(path));
+            len = 0;
+        }
+    }
+    if (len) {
+        // the last path was not terminated
+        path[len] = '\0';
+        Batch_submit(b, copy_String(path));
+    }
+    free(path);
+    return Ok(Unit, {});
+}
+
+// Wait for all submitted files to be processed and printed, and
+// release b. Returns the number of files that had open or close
+// errors.
+static
+size_t Batch_finish(Batch *b) {
+    pthread_mutex_lock(&b->mutex);
+    b->is_complete = true;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->mutex);
+    for (int i = 0; i < b->njobs; i++) {
+        pthread_join(b->workers[i], NULL);
+    }
+    assert(b->nfreed == b->nsubmitted);
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->mutex);
+    free(b->slots);
+    free(b->workers);
+    return b->nerrors;
+}
+
+
+#endif /* BATCH_H_ */
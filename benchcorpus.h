@@ -0,0 +1,301 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef BENCHCORPUS_H_
+#define BENCHCORPUS_H_
+
+/*
+
+  Synthetic inputs for benchmarking (see benchmark.c): text of a given
+  size with the character and line separator mix of a particular kind
+  of file. The generation is deterministic (a fixed pseudo random
+  sequence), so that the same sizes give the same inputs on every
+  run and machine.
+
+ */
+
+#include <stdlib.h>
+#include <stdio.h> /* snprintf */
+#include <stdbool.h>
+#include <string.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+
+
+typedef enum {
+    BENCH_CORPUS_ASCII_CSV, // numbers and words, comma separated, LF
+    BENCH_CORPUS_LATIN1, // European text, many 2-byte characters
+    BENCH_CORPUS_CJK, // mostly 3-byte characters
+    BENCH_CORPUS_EMOJI, // mostly 4-byte characters
+    BENCH_CORPUS_MIXED_EOL, // ASCII lines ending in CR, LF or CRLF
+    BENCH_CORPUS_LONG_LINES, // ASCII, one LF per MiB
+    BENCH_CORPUS_ERROR_AT_END, // valid text followed by an invalid byte
+} BenchCorpus;
+
+#define BENCH_CORPUS_COUNT 7
+
+static UNUSED
+const char *BenchCorpus_name(BenchCorpus c) {
+    switch (c) {
+    case BENCH_CORPUS_ASCII_CSV: return "ascii-csv";
+    case BENCH_CORPUS_LATIN1: return "latin1";
+    case BENCH_CORPUS_CJK: return "cjk";
+    case BENCH_CORPUS_EMOJI: return "emoji";
+    case BENCH_CORPUS_MIXED_EOL: return "mixed-eol";
+    case BENCH_CORPUS_LONG_LINES: return "long-lines";
+    case BENCH_CORPUS_ERROR_AT_END: return "error-at-end";
+    }
+    return "?";
+}
+
+// xorshift64
+static inline
+u64 _BenchCorpus_random(u64 *state) {
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+typedef struct {
+    u8 *buf;
+    size_t len;
+    size_t pos;
+    u64 random_state;
+} _BenchCorpusWriter;
+
+static inline
+size_t _BenchCorpusWriter_room(const _BenchCorpusWriter *w) {
+    return w->len - w->pos;
+}
+
+static inline
+void _BenchCorpusWriter_byte(_BenchCorpusWriter *w, u8 b) {
+    if (w->pos < w->len) {
+        w->buf[w->pos++] = b;
+    }
+}
+
+static
+void _BenchCorpusWriter_string(_BenchCorpusWriter *w, const char *str) {
+    size_t n = strlen(str);
+    if (n > _BenchCorpusWriter_room(w)) {
+        // don't cut a character into pieces
+        n = 0;
+    }
+    memcpy(w->buf + w->pos, str, n);
+    w->pos += n;
+}
+
+// Append the UTF-8 encoding of c, or an 'x' if there's no room for it
+// (so that the output only ends with a complete character).
+static
+void _BenchCorpusWriter_char(_BenchCorpusWriter *w, u32 c) {
+    if (c < 0x80) {
+        _BenchCorpusWriter_byte(w, c);
+    } else if (c < 0x800) {
+        if (_BenchCorpusWriter_room(w) < 2) {
+            _BenchCorpusWriter_byte(w, 'x');
+            return;
+        }
+        w->buf[w->pos++] = 0xC0 | (c >> 6);
+        w->buf[w->pos++] = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+        if (_BenchCorpusWriter_room(w) < 3) {
+            _BenchCorpusWriter_byte(w, 'x');
+            return;
+        }
+        w->buf[w->pos++] = 0xE0 | (c >> 12);
+        w->buf[w->pos++] = 0x80 | ((c >> 6) & 0x3F);
+        w->buf[w->pos++] = 0x80 | (c & 0x3F);
+    } else {
+        if (_BenchCorpusWriter_room(w) < 4) {
+            _BenchCorpusWriter_byte(w, 'x');
+            return;
+        }
+        w->buf[w->pos++] = 0xF0 | (c >> 18);
+        w->buf[w->pos++] = 0x80 | ((c >> 12) & 0x3F);
+        w->buf[w->pos++] = 0x80 | ((c >> 6) & 0x3F);
+        w->buf[w->pos++] = 0x80 | (c & 0x3F);
+    }
+}
+
+static
+u64 _BenchCorpusWriter_random(_BenchCorpusWriter *w, u64 n) {
+    return _BenchCorpus_random(&w->random_state) % n;
+}
+
+static
+void _BenchCorpusWriter_ascii_word(_BenchCorpusWriter *w) {
+    size_t n = 2 + _BenchCorpusWriter_random(w, 8);
+    for (size_t i = 0; i < n; i++) {
+        _BenchCorpusWriter_byte(w, 'a' + _BenchCorpusWriter_random(w, 26));
+    }
+}
+
+static const char *const _BenchCorpus_latin1_words[] = {
+    "und", "der", "Straße", "über", "Müller", "Größe", "schön", "für",
+    "le", "café", "été", "déjà", "français", "garçon", "où", "très",
+    "el", "año", "niño", "señor", "corazón", "qué", "está",
+    "og", "på", "Ærø", "blåbær", "smørrebrød", "naïve", "façade",
+};
+
+static
+void _BenchCorpus_generate_line(_BenchCorpusWriter *w, BenchCorpus c) {
+    switch (c) {
+    case BENCH_CORPUS_ASCII_CSV: {
+        int nfields = 8;
+        for (int i = 0; i < nfields; i++) {
+            if (i) {
+                _BenchCorpusWriter_byte(w, ',');
+            }
+            if (i % 2) {
+                _BenchCorpusWriter_ascii_word(w);
+            } else {
+                char num[24];
+                snprintf(num, sizeof(num), "%lu",
+                         (unsigned long)_BenchCorpusWriter_random(
+                             w, 1000000));
+                _BenchCorpusWriter_string(w, num);
+            }
+        }
+        _BenchCorpusWriter_byte(w, '\n');
+        break;
+    }
+    case BENCH_CORPUS_LATIN1:
+    case BENCH_CORPUS_ERROR_AT_END: {
+        size_t nwords = sizeof(_BenchCorpus_latin1_words)
+            / sizeof(_BenchCorpus_latin1_words[0]);
+        for (int i = 0; i < 12; i++) {
+            if (i) {
+                _BenchCorpusWriter_byte(w, ' ');
+            }
+            if (_BenchCorpusWriter_random(w, 3)) {
+                _BenchCorpusWriter_string(
+                    w, _BenchCorpus_latin1_words[
+                        _BenchCorpusWriter_random(w, nwords)]);
+            } else {
+                _BenchCorpusWriter_ascii_word(w);
+            }
+        }
+        _BenchCorpusWriter_byte(w, '\n');
+        break;
+    }
+    case BENCH_CORPUS_CJK:
+        for (int i = 0; i < 40; i++) {
+            if (_BenchCorpusWriter_random(w, 16) == 0) {
+                _BenchCorpusWriter_char(w, 0x3002); // ideographic full stop
+            } else {
+                _BenchCorpusWriter_char(
+                    w, 0x4E00 + _BenchCorpusWriter_random(w, 0x5200));
+            }
+        }
+        _BenchCorpusWriter_byte(w, '\n');
+        break;
+    case BENCH_CORPUS_EMOJI:
+        for (int i = 0; i < 30; i++) {
+            u64 r = _BenchCorpusWriter_random(w, 8);
+            if (r == 0) {
+                _BenchCorpusWriter_byte(w, ' ');
+            } else if (r == 1) {
+                _BenchCorpusWriter_ascii_word(w);
+            } else {
+                _BenchCorpusWriter_char(
+                    w, 0x1F300 + _BenchCorpusWriter_random(w, 0x350));
+            }
+        }
+        _BenchCorpusWriter_byte(w, '\n');
+        break;
+    case BENCH_CORPUS_MIXED_EOL: {
+        size_t n = _BenchCorpusWriter_random(w, 80);
+        for (size_t i = 0; i < n; i++) {
+            _BenchCorpusWriter_byte(w, ' ' + _BenchCorpusWriter_random(w, 95));
+        }
+        switch (_BenchCorpusWriter_random(w, 3)) {
+        case 0: _BenchCorpusWriter_byte(w, '\r'); break;
+        case 1: _BenchCorpusWriter_byte(w, '\n'); break;
+        default: _BenchCorpusWriter_string(w, "\r\n");
+        }
+        break;
+    }
+    case BENCH_CORPUS_LONG_LINES: {
+        size_t n = 1024 * 1024;
+        for (size_t i = 0; (i < n) && _BenchCorpusWriter_room(w); i++) {
+            _BenchCorpusWriter_byte(w, ' ' + _BenchCorpusWriter_random(w, 95));
+        }
+        _BenchCorpusWriter_byte(w, '\n');
+        break;
+    }
+    }
+}
+
+// Fill buf with len bytes of input of kind c.
+static UNUSED
+void BenchCorpus_generate(BenchCorpus c, u8 *buf, size_t len) {
+    bool is_error_at_end = (c == BENCH_CORPUS_ERROR_AT_END) && len;
+    _BenchCorpusWriter w = {
+        .buf = buf,
+        .len = is_error_at_end ? len - 1 : len,
+        .pos = 0,
+        .random_state = 0x9E3779B97F4A7C15ULL + c
+    };
+    while (_BenchCorpusWriter_room(&w)) {
+        _BenchCorpus_generate_line(&w, c);
+    }
+    if (is_error_at_end) {
+        buf[len - 1] = 0xFF;
+    }
+}
+
+
+/*
+  Convert the valid UTF-8 [p, p+len) to UTF-16LE with a BOM, into
+  out, which must have room for 2 * len + 2 bytes. Returns the number
+  of bytes written.
+*/
+static UNUSED
+size_t BenchCorpus_to_utf16le(const u8 *p, size_t len, u8 *out) {
+    size_t o = 0;
+    out[o++] = 0xFF;
+    out[o++] = 0xFE;
+    size_t i = 0;
+    while (i < len) {
+        u8 b = p[i];
+        u32 c;
+        if (b < 0x80) {
+            c = b;
+            i += 1;
+        } else if (b < 0xE0) {
+            c = ((b & 0x1F) << 6) | (p[i + 1] & 0x3F);
+            i += 2;
+        } else if (b < 0xF0) {
+            c = ((b & 0x0F) << 12) | ((p[i + 1] & 0x3F) << 6)
+                | (p[i + 2] & 0x3F);
+            i += 3;
+        } else {
+            c = ((b & 0x07) << 18) | ((p[i + 1] & 0x3F) << 12)
+                | ((p[i + 2] & 0x3F) << 6) | (p[i + 3] & 0x3F);
+            i += 4;
+        }
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            u32 hi = 0xD800 | (c >> 10);
+            u32 lo = 0xDC00 | (c & 0x3FF);
+            out[o++] = hi & 0xFF;
+            out[o++] = hi >> 8;
+            out[o++] = lo & 0xFF;
+            out[o++] = lo >> 8;
+        } else {
+            out[o++] = c & 0xFF;
+            out[o++] = c >> 8;
+        }
+    }
+    return o;
+}
+
+#endif /* BENCHCORPUS_H_ */
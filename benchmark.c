@@ -0,0 +1,476 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+/*
+
+  Throughput benchmarks (`make bench`): runs `Report_scan` and the
+  byte scanning kernels over synthetic inputs (see benchcorpus.h) of
+  several sizes, in memory and from a file, the UTF-16 scanning on
+  the same texts converted to UTF-16LE, the transcoding kernels
+  (taking the bytes as Latin-1 resp. Windows-1252), and rewriting the
+  line separators to CRLF, and prints one JSON record per
+  measurement, so that results can be compared between versions and
+  machines.
+
+  Usage: benchmark [size...]
+
+  Sizes are in bytes, optionally followed by k, M or G (binary
+  units); the default is 64k 1M 16M.
+
+ */
+
+#undef _GNU_SOURCE
+#define _POSIX_C_SOURCE 202112L
+#define _DEFAULT_SOURCE /* syscall, MAP_POPULATE */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "leakcheck.h"
+
+#include "String.h"
+#include "util.h"
+#include "BufferedStream.h"
+#include "report.h"
+#include "scankernels.h"
+#include "utf8dfa.h"
+#include "benchcorpus.h"
+
+
+// Each measurement is repeated for at least this long and at least
+// BENCH_MIN_ITERATIONS times; the fastest run is reported.
+#define BENCH_MIN_SECONDS 0.1
+#define BENCH_MIN_ITERATIONS 3
+#define BENCH_MAX_ITERATIONS 10000
+
+#define BENCH_MAX_SIZES 32
+
+typedef struct {
+    BenchCorpus corpus;
+    const u8 *data;
+    size_t len;
+    const char *path; // a file with the same contents
+    size_t valid_len; // the length of the valid prefix of data
+    const char *source; // "memory", "file" or "kernel"
+    const char *name; // what is being run
+    CpuLevel level;
+    ReadOptions read;
+    ScanOptions scan;
+} BenchCase;
+
+// The results of the runs end up here so that they can't be
+// optimized away.
+volatile u64 bench_sink = 0;
+
+// The output of the transcoding kernels
+u8 *bench_transcode_out = NULL;
+
+static
+double now_seconds() {
+    struct timespec t;
+    if (clock_gettime(CLOCK_MONOTONIC, &t) < 0) {
+        DIE_("clock_gettime: %s", strerror(errno));
+    }
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static
+void bench_sink_Report(Report *r) {
+    bench_sink += r->lc.charcount + r->lc.LFcount + (r->failure.str != NULL);
+    Report_release(r);
+}
+
+static
+void bench_report_memory(const BenchCase *bc) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (u8 *)bc->data, bc->len),
+        STREAM_DIRECTION_IN,
+        literal_String("benchmark"));
+    Report r = Report_scan(&in, &bc->scan);
+    bench_sink_Report(&r);
+    Result(Unit) rc = BufferedStream_close(&in);
+    Result_release(rc);
+    BufferedStream_release(&in);
+}
+
+static
+void bench_report_file(const BenchCase *bc) {
+    Result(BufferedStream) rs =
+        open_r_BufferedStream(borrowing_String(bc->path), &bc->read);
+    if (Result_is_Err(rs)) {
+        DIE_("%s: %s", bc->path, Error_message(rs.err));
+    }
+    Report r = Report_scan(&rs.ok, &bc->scan);
+    bench_sink_Report(&r);
+    Result(Unit) rc = BufferedStream_close(&rs.ok);
+    Result_release(rc);
+    BufferedStream_release(&rs.ok);
+    Result_release(rs);
+}
+
+static
+void bench_valid_prefix(const BenchCase *bc) {
+    bench_sink += scankernels_by_level[bc->level].utf8_valid_prefix(
+        bc->data, bc->len);
+}
+
+static
+void bench_valid_prefix_dfa(const BenchCase *bc) {
+    bench_sink += utf8dfa_valid_prefix(bc->data, bc->len);
+}
+
+static
+void bench_valid_prefix_bytewise(const BenchCase *bc) {
+    bench_sink += utf8_valid_prefix_bytewise(bc->data, bc->len);
+}
+
+static
+void bench_LineCount_valid_bytes(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    scankernels_by_level[bc->level].LineCount_valid_bytes(
+        &lc, bc->data, bc->valid_len);
+    bench_sink += lc.charcount + lc.LFcount;
+}
+
+static
+void bench_LineCount_valid_bytes_nocolumn(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    scankernels_by_level[bc->level].LineCount_valid_bytes_nocolumn(
+        &lc, bc->data, bc->valid_len);
+    bench_sink += lc.charcount + lc.LFcount;
+}
+
+static
+void bench_LineCount_csv_valid_bytes(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    CsvCount csv = default_CsvCount;
+    scankernels_by_level[bc->level].LineCount_csv_valid_bytes(
+        &lc, &csv, bc->data, bc->valid_len);
+    bench_sink += lc.charcount + csv.cells.LFcount;
+}
+
+static
+void bench_LineCount_index_valid_bytes(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    LineIndexing ix;
+    LineIndexing_init(&ix);
+    LineIndexing_begin(&ix, 0);
+    scankernels_by_level[bc->level].LineCount_index_valid_bytes(
+        &lc, &ix, bc->data, bc->valid_len, 0);
+    bench_sink += lc.charcount + ix.kinds[LINESEPARATOR_LF].deltas_len;
+    LineIndexing_release(&ix);
+}
+
+static
+void bench_utf16le_valid_prefix(const BenchCase *bc) {
+    bench_sink += scankernels_by_level[bc->level].utf16le_valid_prefix(
+        bc->data, bc->len);
+}
+
+static
+void bench_LineCount_utf16le_valid_bytes(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    scankernels_by_level[bc->level].LineCount_utf16le_valid_bytes(
+        &lc, bc->data, bc->valid_len);
+    bench_sink += lc.charcount + lc.LFcount;
+}
+
+static
+void bench_latin1_to_utf8(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    bench_sink += scankernels_by_level[bc->level].latin1_to_utf8(
+        &lc, bc->data, bc->len, bench_transcode_out);
+    bench_sink += lc.LFcount;
+}
+
+static
+void bench_windows1252_to_utf8(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    bench_sink += scankernels_by_level[bc->level].windows1252_to_utf8(
+        &lc, bc->data, bc->len, bench_transcode_out);
+    bench_sink += lc.LFcount;
+}
+
+static
+void bench_normalize_separators(const BenchCase *bc) {
+    LineCount lc = default_LineCount;
+    bench_sink += scankernels_by_level[bc->level].normalize_separators(
+        &lc, bc->data, bc->valid_len, bench_transcode_out,
+        LINESEPARATOR_CRLF);
+    bench_sink += lc.LFcount;
+}
+
+static
+const char *ReadMethod_name(ReadMethod m) {
+    switch (m) {
+    case READ_METHOD_MMAP: return "mmap";
+    case READ_METHOD_READ: return "read";
+    case READ_METHOD_URING: return "uring";
+    }
+    return "?";
+}
+
+// Time run(bc) and print the record; nbytes is the amount of data
+// the speed is given for.
+static
+void bench_run(void (*run)(const BenchCase *bc), const BenchCase *bc,
+               size_t nbytes) {
+    // The kernels used by `Report_scan`
+    __atomic_store_n(&scankernels_selected, &scankernels_by_level[bc->level],
+                     __ATOMIC_RELEASE);
+    double best = 0;
+    double total = 0;
+    int iterations = 0;
+    while ((iterations < BENCH_MIN_ITERATIONS)
+           || ((total < BENCH_MIN_SECONDS)
+               && (iterations < BENCH_MAX_ITERATIONS))) {
+        double t0 = now_seconds();
+        run(bc);
+        double t = now_seconds() - t0;
+        if ((iterations == 0) || (t < best)) {
+            best = t;
+        }
+        total += t;
+        iterations++;
+    }
+    printf("{ \"type\": \"bench\", \"corpus\": \"%s\", \"size\": %zu, "
+           "\"source\": \"%s\", \"name\": \"%s\", \"kernel\": \"%s\", "
+           "\"decoder\": \"%s\", ",
+           BenchCorpus_name(bc->corpus), bc->len, bc->source, bc->name,
+           CpuLevel_name(bc->level),
+           (bc->scan.decoder == UTF8_DECODER_DFA) ? "dfa" : "simd");
+    if (bc->path) {
+        printf("\"io\": \"%s\", ", ReadMethod_name(bc->read.method));
+    } else {
+        printf("\"io\": null, ");
+    }
+    printf("\"bytes\": %zu, \"iterations\": %d, \"seconds\": %.9f, "
+           "\"GBps\": %.3f, \"ns_per_byte\": %.4f }\n",
+           nbytes, iterations, best,
+           (best > 0) ? nbytes / best * 1e-9 : 0.,
+           nbytes ? best * 1e9 / nbytes : 0.);
+    fflush(stdout);
+}
+
+// Write data to a new temporary file; returns its path, to be freed
+// (and the file unlinked) by the caller.
+static
+char *bench_tempfile(const u8 *data, size_t len) {
+    const char *dir = env_string("TMPDIR");
+    if (! dir) {
+        dir = "/tmp";
+    }
+    const char *name = "/utf-8-lineseparator-bench-XXXXXX";
+    char *path = (char *)xmalloc(strlen(dir) + strlen(name) + 1);
+    strcpy(path, dir);
+    strcat(path, name);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        DIE_("mkstemp %s: %s", path, strerror(errno));
+    }
+    size_t pos = 0;
+    while (pos < len) {
+        ssize_t n = write(fd, data + pos, len - pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DIE_("write %s: %s", path, strerror(errno));
+        }
+        pos += n;
+    }
+    if (close(fd) < 0) {
+        DIE_("close %s: %s", path, strerror(errno));
+    }
+    return path;
+}
+
+static
+void bench_corpus(BenchCorpus corpus, size_t len) {
+    u8 *data = (u8 *)xmalloc(len ? len : 1);
+    BenchCorpus_generate(corpus, data, len);
+    char *path = bench_tempfile(data, len);
+    CpuLevel best_level = CpuLevel_detect();
+    size_t valid_len = utf8_valid_prefix_bytewise(data, len);
+    if (valid_len != ((corpus == BENCH_CORPUS_ERROR_AT_END) && len
+                      ? len - 1 : len)) {
+        DIE_("bug: corpus %s is not valid up to the expected position",
+             BenchCorpus_name(corpus));
+    }
+
+    BenchCase bc = {
+        .corpus = corpus,
+        .data = data,
+        .len = len,
+        .path = NULL,
+        .valid_len = valid_len,
+        .source = "memory",
+        .name = "report",
+        .level = best_level,
+        .read = default_ReadOptions,
+        .scan = default_ScanOptions
+    };
+
+    // `Report_scan` in memory, with every kernel level and both
+    // decoders
+    for (int l = 0; l < CPU_LEVEL_COUNT; l++) {
+        if (CpuLevel_is_supported((CpuLevel)l)) {
+            bc.level = (CpuLevel)l;
+            bench_run(bench_report_memory, &bc, len);
+        }
+    }
+    bc.level = best_level;
+    bc.scan.decoder = UTF8_DECODER_DFA;
+    bench_run(bench_report_memory, &bc, len);
+    bc.scan.decoder = default_ScanOptions.decoder;
+
+    // `Report_scan` from the file (it is in the page cache after the
+    // first run), via each read method
+    bc.source = "file";
+    bc.path = path;
+    const ReadMethod methods[] = {
+        READ_METHOD_MMAP, READ_METHOD_READ, READ_METHOD_URING
+    };
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        bc.read.method = methods[i];
+        bench_run(bench_report_file, &bc, len);
+    }
+    bc.path = NULL;
+    bc.read = default_ReadOptions;
+
+    // The kernels on their own
+    bc.source = "kernel";
+    for (int l = 0; l < CPU_LEVEL_COUNT; l++) {
+        if (CpuLevel_is_supported((CpuLevel)l)) {
+            bc.level = (CpuLevel)l;
+            bc.name = "utf8_valid_prefix";
+            bench_run(bench_valid_prefix, &bc, len);
+            bc.name = "LineCount_valid_bytes";
+            bench_run(bench_LineCount_valid_bytes, &bc, bc.valid_len);
+            bc.name = "LineCount_valid_bytes_nocolumn";
+            bench_run(bench_LineCount_valid_bytes_nocolumn, &bc,
+                      bc.valid_len);
+            bc.name = "LineCount_csv_valid_bytes";
+            bench_run(bench_LineCount_csv_valid_bytes, &bc, bc.valid_len);
+            bc.name = "LineCount_index_valid_bytes";
+            bench_run(bench_LineCount_index_valid_bytes, &bc, bc.valid_len);
+        }
+    }
+    bc.level = best_level;
+    bc.name = "utf8dfa_valid_prefix";
+    bc.scan.decoder = UTF8_DECODER_DFA;
+    bench_run(bench_valid_prefix_dfa, &bc, len);
+    bc.scan.decoder = default_ScanOptions.decoder;
+    bc.name = "utf8_valid_prefix_bytewise";
+    bench_run(bench_valid_prefix_bytewise, &bc, len);
+
+    // Transcoding (any bytes are valid Latin-1 and Windows-1252), and
+    // rewriting the separators of the valid part (into the same
+    // buffer, which is large enough for both)
+    bench_transcode_out = (u8 *)xmalloc(TRANSCODE_UTF8_MAXLEN(len) + 2);
+    for (int l = 0; l < CPU_LEVEL_COUNT; l++) {
+        if (CpuLevel_is_supported((CpuLevel)l)) {
+            bc.level = (CpuLevel)l;
+            bc.name = "latin1_to_utf8";
+            bench_run(bench_latin1_to_utf8, &bc, len);
+            bc.name = "windows1252_to_utf8";
+            bench_run(bench_windows1252_to_utf8, &bc, len);
+            bc.name = "normalize_separators";
+            bench_run(bench_normalize_separators, &bc, bc.valid_len);
+        }
+    }
+    free(bench_transcode_out);
+    bench_transcode_out = NULL;
+    bc.level = best_level;
+
+    // The valid part as UTF-16LE: `Report_scan` (detecting the BOM)
+    // and the UTF-16 kernels
+    u8 *data16 = (u8 *)xmalloc(2 * valid_len + 2);
+    size_t len16 = BenchCorpus_to_utf16le(data, valid_len, data16);
+    bc.data = data16;
+    bc.len = len16;
+    bc.valid_len = len16 - 2; // without the BOM
+    bc.source = "memory";
+    bc.name = "report_utf16le";
+    bench_run(bench_report_memory, &bc, len16);
+    bc.source = "kernel";
+    bc.data = data16 + 2;
+    bc.len = bc.valid_len;
+    for (int l = 0; l < CPU_LEVEL_COUNT; l++) {
+        if (CpuLevel_is_supported((CpuLevel)l)) {
+            bc.level = (CpuLevel)l;
+            bc.name = "utf16le_valid_prefix";
+            bench_run(bench_utf16le_valid_prefix, &bc, bc.len);
+            bc.name = "LineCount_utf16le_valid_bytes";
+            bench_run(bench_LineCount_utf16le_valid_bytes, &bc,
+                      bc.valid_len);
+        }
+    }
+    free(data16);
+
+    unlink(path);
+    free(path);
+    free(data);
+}
+
+// Parse a size like "64k"; returns false if it isn't one.
+static
+bool parse_size(const char *str, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    if ((*str == 0) || (*str == '-') || errno) {
+        return false;
+    }
+    switch (*end) {
+    case 0: break;
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'M': n <<= 20; end++; break;
+    case 'G': n <<= 30; end++; break;
+    default: return false;
+    }
+    if (*end != 0) {
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+int main(int argc, const char **argv) {
+    size_t sizes[BENCH_MAX_SIZES] = { 64 << 10, 1 << 20, 16 << 20 };
+    int nsizes = 3;
+    if (argc > 1) {
+        nsizes = argc - 1;
+        if (nsizes > BENCH_MAX_SIZES) {
+            DIE_("too many sizes (max %i)", BENCH_MAX_SIZES);
+        }
+        for (int i = 0; i < nsizes; i++) {
+            if (! parse_size(argv[i + 1], &sizes[i])) {
+                fprintf(stderr, "usage: %s [size...]\n"
+                        "  invalid size '%s' (bytes, optionally "
+                        "followed by k, M or G)\n",
+                        argv[0], argv[i + 1]);
+                return 1;
+            }
+        }
+    }
+
+    printf("{ \"type\": \"bench-config\", \"program\": "
+           "\"utf-8-lineseparator\", \"cpu\": \"%s\", "
+           "\"min_seconds\": %g, \"min_iterations\": %i }\n",
+           CpuLevel_name(CpuLevel_detect()),
+           BENCH_MIN_SECONDS, BENCH_MIN_ITERATIONS);
+    for (int i = 0; i < nsizes; i++) {
+        for (int c = 0; c < BENCH_CORPUS_COUNT; c++) {
+            bench_corpus((BenchCorpus)c, sizes[i]);
+        }
+    }
+    leakcheck_verify(false);
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+/*
+
+  Checkpoints for checking files that only grow (logs, exports)
+  again without rescanning what was already checked.
+
+  After scanning a regular file, its scanner state (the `LineCount`
+  up to the end of its last complete character, not finished, so
+  that a CR at the end can still become part of a CRLF) is saved
+  together with the file's identity (device and inode), a
+  fingerprint of its contents (see fingerprint.h), and the bytes of
+  a character that is not complete yet at the end (written only
+  partially so far). The checkpoint file is named after the
+  identity, in a directory given by the user (`Checkpoint_path`).
+
+  A later scan of the same file can continue from the checkpoint if
+  the file is at least as large and the fingerprint still matches
+  (`Checkpoint_matches`), reading only the new bytes (plus the
+  incomplete character); otherwise (the file was truncated or
+  rewritten, or the checkpoint is missing or unreadable), it is
+  scanned in full.
+
+  Only valid UTF-8 input (with or without BOM) gets a checkpoint, or
+  input whose only problem is an incomplete character at the end.
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "mem.h"
+#include "io.h" /* put_u64_le, get_u64_le, pread_full,
+                   write_file_atomically */
+#include "fingerprint.h"
+#include "Result.h"
+#include "BufferedStream.h" /* Result(Unit) */
+#include "linecount.h"
+#include "report.h"
+
+
+#define CHECKPOINT_MAGIC "ULSCKP\0\1"
+#define CHECKPOINT_MAGICLEN 8
+#define CHECKPOINT_NFIELDS 15
+#define CHECKPOINT_SIZ (CHECKPOINT_MAGICLEN + 8 * CHECKPOINT_NFIELDS)
+
+typedef struct {
+    u64 dev;
+    u64 ino;
+    u64 size; // of the file that was checked
+    ScanResume state; // at the end of its last complete character
+    u8 pendinglen; // the bytes from offset to size (0..3)
+    u8 pending[4];
+    u64 head_hash; // of the first block
+    u64 tail_hash; // of the last block (ending at size)
+} Checkpoint;
+
+DEFTYPE_Result(Checkpoint);
+
+/*
+  Write the path of the checkpoint file for the file with the status
+  st, in the directory dir, to buf (of size bufsiz). Returns false if
+  it doesn't fit.
+*/
+static UNUSED
+bool Checkpoint_path(char *buf, size_t bufsiz, const char *dir,
+                     const struct stat *st) {
+    int n = snprintf(buf, bufsiz, "%s/%" PRIx64 "-%" PRIx64 ".checkpoint",
+                     dir, (u64)st->st_dev, (u64)st->st_ino);
+    return (n >= 0) && ((size_t)n < bufsiz);
+}
+
+/*
+  The checkpoint for the scan of fd (with the status st taken before
+  it) that led to r. Returns false if there is none: the input is not
+  valid UTF-8 (other than ending in an incomplete character), or fd
+  can't be read for the fingerprint.
+*/
+static UNUSED
+bool Checkpoint_of_report(Checkpoint *ck, const Report *r, int fd,
+                          const struct stat *st) {
+    bool is_pending = Report_is_failure(r)
+        && (r->failure.kind == ERROR_UTF8_PREMATURE_EOF);
+    if ((r->encoding != ENCODING_UTF8)
+        || (Report_is_failure(r) && ! is_pending)) {
+        return false;
+    }
+    *ck = (Checkpoint) {
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .state = {
+            .lc = r->lc,
+            .offset = r->bytecount,
+            .has_bom = r->has_bom
+        }
+    };
+    if (is_pending) {
+        // The count is up to the incomplete character, unfinished
+        ssize_t n = pread_full(fd, ck->pending, 3, ck->state.offset);
+        if (n < 0) {
+            return false;
+        }
+        ck->pendinglen = n;
+    } else if (ck->state.offset > 0) {
+        // Undo the `LineCount_finish`: a CR as the last character
+        // is not counted yet
+        u8 last;
+        if (pread_full(fd, &last, 1, ck->state.offset - 1) != 1) {
+            return false;
+        }
+        if (last == '\r') {
+            ck->state.lc.CRcount--;
+            ck->state.lc.last_was_CR = true;
+        }
+    }
+    ck->size = ck->state.offset + ck->pendinglen;
+    return fingerprint_file(fd, ck->size, &ck->head_hash, &ck->tail_hash);
+}
+
+/*
+  Whether the scan of fd (with the status st) can continue from ck:
+  it is the same file, not smaller, and the fingerprint matches.
+*/
+static UNUSED
+bool Checkpoint_matches(const Checkpoint *ck, int fd,
+                        const struct stat *st) {
+    if ((ck->dev != (u64)st->st_dev) || (ck->ino != (u64)st->st_ino)
+        || ((u64)st->st_size < ck->size)) {
+        return false;
+    }
+    u8 pending[4];
+    u64 head_hash, tail_hash;
+    return (pread_full(fd, pending, ck->pendinglen, ck->state.offset)
+            == ck->pendinglen)
+        && (memcmp(pending, ck->pending, ck->pendinglen) == 0)
+        && fingerprint_file(fd, ck->size, &head_hash, &tail_hash)
+        && (head_hash == ck->head_hash) && (tail_hash == ck->tail_hash);
+}
+
+/*
+  Read the checkpoint file at path. Fails with an errno error (ENOENT
+  if there is none), or if it is not a checkpoint file.
+*/
+static UNUSED
+Result(Checkpoint) Checkpoint_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return Err_from(Checkpoint, Error_errno(errno));
+    }
+    u8 buf[CHECKPOINT_SIZ + 1];
+    ssize_t n = pread_full(fd, buf, sizeof(buf), 0);
+    int err = errno;
+    close(fd);
+    if (n < 0) {
+        return Err_from(Checkpoint, Error_errno(err));
+    }
+    u64 f[CHECKPOINT_NFIELDS];
+    for (int i = 0; (n == CHECKPOINT_SIZ) && (i < CHECKPOINT_NFIELDS); i++) {
+        f[i] = get_u64_le(buf + CHECKPOINT_MAGICLEN + 8 * i);
+    }
+    if ((n != CHECKPOINT_SIZ)
+        || memcmp(buf, CHECKPOINT_MAGIC, CHECKPOINT_MAGICLEN)
+        || (f[3] > f[2]) || (f[2] - f[3] != f[11]) || (f[11] > 3)
+        || (f[9] > 1) || (f[10] > 1)) {
+        return Err(Checkpoint, literal_String("not a checkpoint file"));
+    }
+    Checkpoint ck = {
+        .dev = f[0],
+        .ino = f[1],
+        .size = f[2],
+        .state = {
+            .lc = {
+                .charcount = f[4],
+                .LFcount = f[5],
+                .CRcount = f[6],
+                .CRLFcount = f[7],
+                .column = f[8],
+                .last_was_CR = f[9]
+            },
+            .offset = f[3],
+            .has_bom = f[10]
+        },
+        .pendinglen = f[11],
+        .head_hash = f[13],
+        .tail_hash = f[14]
+    };
+    u8 pending[8];
+    put_u64_le(pending, f[12]);
+    memcpy(ck.pending, pending, 4);
+    return Ok(Checkpoint, ck);
+}
+
+// Write ck to the file at path (atomically).
+static UNUSED
+Result(Unit) Checkpoint_save(const Checkpoint *ck, const char *path) {
+    u8 buf[CHECKPOINT_SIZ];
+    u8 pending[8] = {};
+    memcpy(pending, ck->pending, 4);
+    const LineCount *lc = &ck->state.lc;
+    u64 f[CHECKPOINT_NFIELDS] = {
+        ck->dev, ck->ino, ck->size, ck->state.offset,
+        lc->charcount, lc->LFcount, lc->CRcount, lc->CRLFcount,
+        lc->column, lc->last_was_CR,
+        ck->state.has_bom, ck->pendinglen, get_u64_le(pending),
+        ck->head_hash, ck->tail_hash
+    };
+    memcpy(buf, CHECKPOINT_MAGIC, CHECKPOINT_MAGICLEN);
+    for (int i = 0; i < CHECKPOINT_NFIELDS; i++) {
+        put_u64_le(buf + CHECKPOINT_MAGICLEN + 8 * i, f[i]);
+    }
+    int err = write_file_atomically(path, buf, CHECKPOINT_SIZ);
+    if (err) {
+        return Err_from(Unit, Error_errno(err));
+    }
+    return Ok(Unit, {});
+}
+
+
+#endif /* CHECKPOINT_H_ */
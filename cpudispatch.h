@@ -0,0 +1,122 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef CPUDISPATCH_H_
+#define CPUDISPATCH_H_
+
+/*
+
+  Instruction set levels for code that is compiled in several
+  variants (see Simd64.h), and choosing among them at runtime: the
+  highest level the CPU supports, unless overridden via an
+  environment variable (for benchmarking, or to reproduce a bug seen
+  with a particular level).
+
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "util.h" /* UNUSED WARN_ */
+#include "env.h"
+#include "Simd64.h" /* SIMD64_X86 */
+
+
+typedef enum {
+    CPU_LEVEL_SCALAR,
+    CPU_LEVEL_SSE42,
+    CPU_LEVEL_AVX2,
+    CPU_LEVEL_AVX512,
+} CpuLevel;
+
+#define CPU_LEVEL_COUNT 4
+
+static UNUSED
+const char *CpuLevel_name(CpuLevel level) {
+    switch (level) {
+    case CPU_LEVEL_SCALAR: return "scalar";
+    case CPU_LEVEL_SSE42: return "sse4.2";
+    case CPU_LEVEL_AVX2: return "avx2";
+    case CPU_LEVEL_AVX512: return "avx512";
+    }
+    return "?";
+}
+
+// Parse a name as returned by CpuLevel_name; returns false if it is
+// not one.
+static UNUSED
+bool CpuLevel_from_name(const char *name, CpuLevel *out) {
+    for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+        if (0 == strcmp(name, CpuLevel_name((CpuLevel)i))) {
+            *out = (CpuLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether code for the level can be run on this CPU (and was compiled
+// into this binary).
+static UNUSED
+bool CpuLevel_is_supported(CpuLevel level) {
+#if SIMD64_X86
+    switch (level) {
+    case CPU_LEVEL_SCALAR:
+        return true;
+    case CPU_LEVEL_SSE42:
+        return __builtin_cpu_supports("sse4.2")
+            && __builtin_cpu_supports("popcnt");
+    case CPU_LEVEL_AVX2:
+        return __builtin_cpu_supports("avx2")
+            && __builtin_cpu_supports("popcnt")
+            && __builtin_cpu_supports("bmi");
+    case CPU_LEVEL_AVX512:
+        return __builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("avx512bw")
+            && CpuLevel_is_supported(CPU_LEVEL_AVX2);
+    }
+    return false;
+#else
+    return level == CPU_LEVEL_SCALAR;
+#endif
+}
+
+// The highest level this CPU supports.
+static UNUSED
+CpuLevel CpuLevel_detect() {
+    for (int i = CPU_LEVEL_COUNT - 1; i > 0; i--) {
+        if (CpuLevel_is_supported((CpuLevel)i)) {
+            return (CpuLevel)i;
+        }
+    }
+    return CPU_LEVEL_SCALAR;
+}
+
+/*
+  The level to use: the one named in the environment variable
+  envvar_name if it is set (and supported), otherwise the highest one
+  the CPU supports. Invalid or unsupported settings are reported on
+  stderr and ignored.
+*/
+static UNUSED
+CpuLevel CpuLevel_select(const char *envvar_name) {
+    CpuLevel detected = CpuLevel_detect();
+    const char *name = env_string(envvar_name);
+    if (name) {
+        CpuLevel level;
+        if (! CpuLevel_from_name(name, &level)) {
+            WARN_("%s: unknown level '%s', using '%s'",
+                  envvar_name, name, CpuLevel_name(detected));
+        } else if (! CpuLevel_is_supported(level)) {
+            WARN_("%s: level '%s' is not supported by this CPU, using '%s'",
+                  envvar_name, name, CpuLevel_name(detected));
+        } else {
+            return level;
+        }
+    }
+    return detected;
+}
+
+
+#endif /* CPUDISPATCH_H_ */
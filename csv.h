@@ -0,0 +1,113 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef CSV_H_
+#define CSV_H_
+
+/*
+
+  Telling the line separators that end CSV rows apart from the line
+  breaks inside quoted fields, while counting (`CsvCount`).
+
+  Only the quote character matters: a field starting with `"` goes
+  on up to the next `"` that is not doubled (RFC 4180), and a doubled
+  one toggles the state twice; thus whether a position is inside a
+  quoted field is the parity of the number of quotes before it, which
+  the vectorized variant computes for 64 bytes at once as the prefix
+  XOR of the quote positions (see `LineCount_csv_valid_bytes` in
+  scankernels.h). Quotes in the middle of unquoted fields are not
+  treated specially.
+
+  Like `LineCount`, a `CsvCount` carries all the state needed to
+  continue with the next piece of input. The row separators are the
+  ones in the `LineCount` for the same input minus the `cells` ones.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "linecount.h"
+
+
+typedef struct {
+    LineCount cells; // the line breaks inside quoted fields (only the
+                     // separator counts are used)
+    bool in_quote; // inside a quoted field
+    bool after_close; // the last character was a closing quote (a
+                      // quote following it is a doubled one)
+    bool row_pending; // there are characters after the last row
+                      // separator
+    LineCount quote_lc; // the count before the quote that opened the
+                        // field if in_quote (not counting doubled
+                        // quotes)
+} CsvCount;
+
+#define default_CsvCount (CsvCount){}
+
+// Count c, a separator or other character inside a quoted field, into
+// the cells.
+static inline
+void _CsvCount_cell_char(CsvCount *csv, u32 c) {
+    LineCount *cells = &csv->cells;
+    if (c == '\n') {
+        if (cells->last_was_CR) {
+            cells->CRLFcount++;
+        } else {
+            cells->LFcount++;
+        }
+        cells->last_was_CR = false;
+    } else {
+        if (cells->last_was_CR) {
+            cells->CRcount++;
+        }
+        cells->last_was_CR = (c == '\r');
+    }
+}
+
+// Count the character c, with lc being the count before it (c is
+// counted into lc separately, after this).
+static inline
+void CsvCount_char(CsvCount *csv, const LineCount *lc, u32 c) {
+    if (csv->in_quote) {
+        _CsvCount_cell_char(csv, c);
+    }
+    bool after_close = csv->after_close;
+    csv->after_close = false;
+    if (c == '"') {
+        csv->in_quote = ! csv->in_quote;
+        if (! csv->in_quote) {
+            csv->after_close = true;
+        } else if (! after_close) {
+            csv->quote_lc = *lc;
+        }
+        csv->row_pending = true;
+    } else if ((c == '\r') || (c == '\n')) {
+        if (! csv->in_quote) {
+            csv->row_pending = false;
+        }
+    } else {
+        csv->row_pending = true;
+    }
+}
+
+// Count the CR that may still be pending in the cells at the end of
+// the input.
+static inline
+void CsvCount_finish(CsvCount *csv) {
+    LineCount_finish(&csv->cells);
+}
+
+// The number of rows, given the (finished) count lc for the same
+// input: a last row without a separator is counted, too.
+static inline UNUSED
+int64_t CsvCount_rows(const CsvCount *csv, const LineCount *lc) {
+    return LineCount_lines(lc) - LineCount_lines(&csv->cells)
+        + (csv->row_pending ? 1 : 0);
+}
+
+
+#endif /* CSV_H_ */
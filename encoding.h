@@ -0,0 +1,106 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef ENCODING_H_
+#define ENCODING_H_
+
+/*
+
+  The input encodings that can be checked (UTF-8, UTF-16) or
+  converted to UTF-8 (Latin-1, Windows-1252, see transcode.h), and
+  detecting the former from the byte order mark (BOM) at the start of
+  the input.
+
+  Input without a BOM is taken to be UTF-8. (A UTF-16LE BOM followed
+  by a NUL character would also be the UTF-32LE BOM; UTF-32 is not
+  supported, thus it's taken to be UTF-16LE.)
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp */
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+
+
+typedef enum {
+    ENCODING_UTF8,
+    ENCODING_UTF16LE,
+    ENCODING_UTF16BE,
+    ENCODING_LATIN1,
+    ENCODING_WINDOWS1252,
+} Encoding;
+
+// The name used in JSON output
+static UNUSED
+const char *Encoding_name(Encoding e) {
+    switch (e) {
+    case ENCODING_UTF8: return "UTF-8";
+    case ENCODING_UTF16LE: return "UTF-16LE";
+    case ENCODING_UTF16BE: return "UTF-16BE";
+    case ENCODING_LATIN1: return "ISO-8859-1";
+    case ENCODING_WINDOWS1252: return "windows-1252";
+    }
+    return "?";
+}
+
+// The encoding named str (as given on the command line), if known.
+static UNUSED
+bool Encoding_parse(const char *str, Encoding *encoding) {
+    const struct {
+        const char *name;
+        Encoding encoding;
+    } names[] = {
+        { "utf-8", ENCODING_UTF8 },
+        { "utf-16le", ENCODING_UTF16LE },
+        { "utf-16be", ENCODING_UTF16BE },
+        { "latin1", ENCODING_LATIN1 },
+        { "iso-8859-1", ENCODING_LATIN1 },
+        { "windows-1252", ENCODING_WINDOWS1252 },
+        { "cp1252", ENCODING_WINDOWS1252 },
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcasecmp(str, names[i].name) == 0) {
+            *encoding = names[i].encoding;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The longest BOM
+#define BOM_MAXLEN 3
+
+/*
+  Detect the encoding from the BOM at the start of [p, p+len), which
+  should hold BOM_MAXLEN bytes unless the input is shorter. Returns
+  the length of the BOM (0 if there is none, then *encoding is set to
+  ENCODING_UTF8).
+*/
+static UNUSED
+size_t Encoding_from_bom(const u8 *p, size_t len, Encoding *encoding) {
+    if ((len >= 3) && (memcmp(p, "\xEF\xBB\xBF", 3) == 0)) {
+        *encoding = ENCODING_UTF8;
+        return 3;
+    }
+    if (len >= 2) {
+        if ((p[0] == 0xFF) && (p[1] == 0xFE)) {
+            *encoding = ENCODING_UTF16LE;
+            return 2;
+        }
+        if ((p[0] == 0xFE) && (p[1] == 0xFF)) {
+            *encoding = ENCODING_UTF16BE;
+            return 2;
+        }
+    }
+    *encoding = ENCODING_UTF8;
+    return 0;
+}
+
+
+#endif /* ENCODING_H_ */
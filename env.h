@@ -25,4 +25,16 @@ bool env(const char* name) {
     }
 }
 
+// The value of the environment variable, or NULL if it is not set or
+// empty.
+UNUSED static
+const char *env_string(const char* name) {
+    const char *val = getenv(name);
+    if (val && *val) {
+        return val;
+    } else {
+        return NULL;
+    }
+}
+
 #endif /* ENV_H_ */
@@ -0,0 +1,64 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef FINGERPRINT_H_
+#define FINGERPRINT_H_
+
+/*
+
+  A cheap fingerprint of a file's contents: hashes of its first and
+  of its last block (see checkpoint.h and resultcache.h). It detects
+  a file being rewritten or truncated and written anew, not changes
+  in its middle.
+
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "shorttypenames.h"
+#include "mem.h"
+#include "io.h" /* pread_full */
+
+
+// The size of the blocks at the start and end that are hashed
+#define FINGERPRINT_BLOCKSIZ (64 * 1024)
+
+// FNV-1a
+static
+u64 fingerprint_hash(const u8 *p, size_t len) {
+    u64 h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+// Hash the len bytes of fd at offset into *hash; false if they can't
+// all be read.
+static
+bool _fingerprint_range(int fd, u64 offset, size_t len, u8 *buf,
+                        u64 *hash) {
+    if (pread_full(fd, buf, len, offset) != (ssize_t)len) {
+        return false;
+    }
+    *hash = fingerprint_hash(buf, len);
+    return true;
+}
+
+// Hash the first and the last block of the first size bytes of fd;
+// false if they can't be read.
+static UNUSED
+bool fingerprint_file(int fd, u64 size, u64 *head_hash, u64 *tail_hash) {
+    size_t n = (size < FINGERPRINT_BLOCKSIZ) ? size : FINGERPRINT_BLOCKSIZ;
+    u8 *buf = (u8 *)xmalloc(n ? n : 1);
+    bool ok = _fingerprint_range(fd, 0, n, buf, head_hash)
+        && _fingerprint_range(fd, size - n, n, buf, tail_hash);
+    free(buf);
+    return ok;
+}
+
+
+#endif /* FINGERPRINT_H_ */
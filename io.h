@@ -6,10 +6,16 @@
 #ifndef IO_H_
 #define IO_H_
 
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> /* PATH_MAX */
+#include "shorttypenames.h"
 #include "String.h"
 
 
-static
+UNUSED static
 String strerror_String(int err) {
 #define EBUFSIZ 256
     char msg[EBUFSIZ];
@@ -18,4 +24,84 @@ String strerror_String(int err) {
 #undef EBUFSIZ
 }
 
+// Little endian encoding of numbers in files
+static inline UNUSED
+void put_u64_le(u8 *p, u64 v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = v >> (8 * i);
+    }
+}
+
+static inline UNUSED
+u64 get_u64_le(const u8 *p) {
+    u64 v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= (u64)p[i] << (8 * i);
+    }
+    return v;
+}
+
+// pread until len bytes are read or the end of the file is reached.
+// Returns the number of bytes read, or -1 with errno set.
+UNUSED static
+ssize_t pread_full(int fd, u8 *buf, size_t len, off_t offset) {
+    size_t n = 0;
+    while (n < len) {
+        ssize_t r = pread(fd, buf + n, len - n, offset + n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        n += r;
+    }
+    return n;
+}
+
+// Should be in a io.c but we're currently using a single binary
+// object for everything.
+u32 io_tmpfile_counter = 0;
+
+/*
+  Replace the file at path with one containing the len bytes at buf,
+  atomically (readers see either the old or the new file): by writing
+  a temporary file in the same directory, unique to this process and
+  call, and renaming it. Returns 0, or the errno value on failure.
+*/
+UNUSED static
+int write_file_atomically(const char *path, const u8 *buf, size_t len) {
+    char tmppath[PATH_MAX];
+    u32 k = __atomic_add_fetch(&io_tmpfile_counter, 1, __ATOMIC_RELAXED);
+    int n = snprintf(tmppath, PATH_MAX, "%s.%i-%u.tmp", path,
+                     (int)getpid(), k);
+    if ((n < 0) || (n >= PATH_MAX)) {
+        return ENAMETOOLONG;
+    }
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        return errno;
+    }
+    int err = 0;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = write(fd, buf + done, len - done);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            err = errno;
+            break;
+        }
+        done += w;
+    }
+    if ((close(fd) < 0) && ! err) {
+        err = errno;
+    }
+    if ((! err) && (rename(tmppath, path) < 0)) {
+        err = errno;
+    }
+    if (err) {
+        unlink(tmppath);
+    }
+    return err;
+}
+
 #endif /* IO_H_ */
@@ -0,0 +1,83 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef LATIN1_H_
+#define LATIN1_H_
+
+/*
+
+  Encoding Latin-1 (ISO-8859-1) and Windows-1252 text as UTF-8.
+
+  Every byte is a character: in Latin-1, byte b is the codepoint b;
+  Windows-1252 differs only in 0x80-0x9F, which mostly hold
+  typographic characters (`windows1252_c1`). The five bytes that
+  Windows-1252 leaves undefined are mapped to the C1 control
+  codepoints of the same value, as web browsers do, so that any input
+  can be converted.
+
+  This file has the byte-wise variant; the vectorized ones,
+  `latin1_to_utf8` and `windows1252_to_utf8`, are in scankernels.h.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "shorttypenames.h"
+#include "linecount.h"
+
+
+// The UTF-8 output for len bytes of input is at most this long (for
+// Latin-1 it is at most 2 * len)
+#define TRANSCODE_UTF8_MAXLEN(len) (3 * (len))
+
+// Should be in a latin1.c but we're currently using a single binary
+// object for everything.
+
+// The codepoints for the Windows-1252 bytes 0x80-0x9F
+const u16 windows1252_c1[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+
+// Write the UTF-8 encoding of the byte b to out, returns the number
+// of bytes written (1 to 3).
+static inline
+size_t latin1_encode_byte(u8 b, u8 *out, bool is_windows1252) {
+    if (b < 0x80) {
+        out[0] = b;
+        return 1;
+    }
+    u32 c = (is_windows1252 && (b < 0xA0)) ? windows1252_c1[b - 0x80] : b;
+    if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    }
+    out[0] = 0xE0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3F);
+    out[2] = 0x80 | (c & 0x3F);
+    return 3;
+}
+
+/*
+  Write the UTF-8 encoding of [p, p+len) to out (which must have room
+  for TRANSCODE_UTF8_MAXLEN(len) bytes) and count its characters into
+  lc. Returns the number of bytes written.
+*/
+static inline
+size_t latin1_to_utf8_bytewise(LineCount *lc, const u8 *p, size_t len,
+                               u8 *out, bool is_windows1252) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        LineCount_char(lc, p[i]);
+        o += latin1_encode_byte(p[i], out + o, is_windows1252);
+    }
+    return o;
+}
+
+
+#endif /* LATIN1_H_ */
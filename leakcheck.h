@@ -13,6 +13,9 @@
   Because the leak sanitizer is somehow disabled or ignored when
   running in AFL's persistent mode (the failures that should be
   reported after leaving the main loop, are not detected).
+
+  The counter is updated atomically, as allocations happen on worker
+  threads, too (see batch.h).
 */
 
 #include <stdio.h>
@@ -28,10 +31,12 @@ int32_t leakcheck_active_allocs = 0;
 
 static
 void leakcheck_verify(bool abort_on_failure) {
-    if (leakcheck_active_allocs != 0) {
+    int32_t active = __atomic_load_n(&leakcheck_active_allocs,
+                                     __ATOMIC_SEQ_CST);
+    if (active != 0) {
         fprintf(stderr,
                 "*** leakcheck failure: leakcheck_active_allocs = %i\n",
-                leakcheck_active_allocs);
+                active);
         if (abort_on_failure) abort();
     }
 }
@@ -39,26 +44,36 @@ void leakcheck_verify(bool abort_on_failure) {
 static
 void *leakcheck_malloc(size_t x) {
     void *p = malloc(x);
-    if (p) leakcheck_active_allocs++;
+    if (p) __atomic_add_fetch(&leakcheck_active_allocs, 1, __ATOMIC_RELAXED);
     return p;
 }
 
 static
 void leakcheck_free(void *p) {
     free(p);
-    /* if (p) */ leakcheck_active_allocs--;
+    /* if (p) */ __atomic_sub_fetch(&leakcheck_active_allocs, 1,
+                                    __ATOMIC_RELAXED);
+}
+
+static
+void *leakcheck_realloc(void *p, size_t x) {
+    void *p2 = realloc(p, x);
+    if (p2 && !p) __atomic_add_fetch(&leakcheck_active_allocs, 1,
+                                     __ATOMIC_RELAXED);
+    return p2;
 }
 
 static
 char *leakcheck_strdup(const char *s) {
     char *t = strdup(s);
-    if (t) leakcheck_active_allocs++;
+    if (t) __atomic_add_fetch(&leakcheck_active_allocs, 1, __ATOMIC_RELAXED);
     return t;
 }
 
 
 #define malloc(x) leakcheck_malloc(x)
 #define free(x) leakcheck_free(x)
+#define realloc(p, x) leakcheck_realloc(p, x)
 #define strdup(x) leakcheck_strdup(x)
 
 
@@ -0,0 +1,102 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+// The library around `PushScan`, see libutf8lineseparator.h
+
+#undef _GNU_SOURCE
+#define _POSIX_C_SOURCE 202112L
+#define _DEFAULT_SOURCE /* syscall, MAP_POPULATE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libutf8lineseparator.h"
+#include "shorttypenames.h"
+#include "Error.h"
+#include "encoding.h"
+#include "linecount.h"
+#include "csv.h"
+#include "report.h"
+#include "pushscan.h"
+
+// Only the functions declared in libutf8lineseparator.h are exported
+// from the shared library (it is compiled with -fvisibility=hidden).
+#define EXPORT __attribute__((visibility("default")))
+
+
+struct Utf8LineSeparator {
+    ScanOptions opts;
+    PushScan scan;
+};
+
+EXPORT
+Utf8LineSeparator *Utf8LineSeparator_new(unsigned flags) {
+    Utf8LineSeparator *s = (Utf8LineSeparator *)malloc(sizeof(*s));
+    if (! s) {
+        return NULL;
+    }
+    s->opts = default_ScanOptions;
+    s->opts.lazy_column = false;
+    s->opts.csv = (flags & UTF8LINESEPARATOR_CSV);
+    if (flags & UTF8LINESEPARATOR_DFA) {
+        s->opts.decoder = UTF8_DECODER_DFA;
+    }
+    PushScan_init(&s->scan, &s->opts);
+    return s;
+}
+
+EXPORT
+void Utf8LineSeparator_reset(Utf8LineSeparator *s) {
+    PushScan_init(&s->scan, &s->opts);
+}
+
+EXPORT
+int Utf8LineSeparator_feed(Utf8LineSeparator *s, const void *p, size_t len) {
+    return PushScan_feed(&s->scan, (const u8 *)p, len);
+}
+
+// The same fields as in `Report_print`
+EXPORT
+void Utf8LineSeparator_finish(Utf8LineSeparator *s,
+                              Utf8LineSeparatorResult *result) {
+    Report r = PushScan_finish(&s->scan);
+    const LineCount *lc = &r.lc;
+    bool is_failure = Report_is_failure(&r);
+    *result = (Utf8LineSeparatorResult) {
+        .is_valid = ! is_failure,
+        .failure = "",
+        .is_csv_failure = is_failure
+            && (ErrorKind_subsystem((ErrorKind)r.failure.kind)
+                == ERROR_SUBSYSTEM_CSV),
+        .encoding = Encoding_name(r.encoding),
+        .has_bom = r.has_bom,
+        .bytecount = r.bytecount,
+        .charcount = lc->charcount,
+        .LFcount = lc->LFcount,
+        .CRcount = lc->CRcount,
+        .CRLFcount = lc->CRLFcount,
+        .is_csv = r.is_csv
+    };
+    if (is_failure) {
+        char buf[ERROR_MSGSIZ];
+        snprintf(result->failure, UTF8LINESEPARATOR_MSGSIZ, "%s",
+                 Error_format(&r.failure, buf, ERROR_MSGSIZ));
+        result->character_position = lc->charcount + 1;
+        result->line = LineCount_lines(lc) + 1;
+        result->column = lc->column + 1;
+        result->line_questionable = LineCount_is_questionable(lc);
+    } else if (r.is_csv) {
+        result->rowcount = CsvCount_rows(&r.csv, lc);
+        result->cell_LFcount = r.csv.cells.LFcount;
+        result->cell_CRcount = r.csv.cells.CRcount;
+        result->cell_CRLFcount = r.csv.cells.CRLFcount;
+    }
+    Report_release(&r);
+}
+
+EXPORT
+void Utf8LineSeparator_free(Utf8LineSeparator *s) {
+    free(s);
+}
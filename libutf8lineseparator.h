@@ -0,0 +1,87 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef LIBUTF8LINESEPARATOR_H_
+#define LIBUTF8LINESEPARATOR_H_
+
+/*
+
+  The interface of libutf8lineseparator.a / libutf8lineseparator.so:
+  checking input for valid UTF-8 (or UTF-16 if it starts with a BOM
+  for it) and counting its line separators in-process, with the
+  input pushed in fragments as it arrives, split anywhere (see
+  pushscan.h). The result holds what `utf-8-lineseparator` prints
+  for the same input.
+
+  A scanner is allocated once (`Utf8LineSeparator_new`) and can be
+  reused for any number of inputs (`Utf8LineSeparator_reset`); feeding
+  and finishing don't allocate. A scanner must not be used from
+  several threads at the same time, separate scanners can.
+
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Utf8LineSeparator Utf8LineSeparator;
+
+// Flags for `Utf8LineSeparator_new`
+#define UTF8LINESEPARATOR_CSV 1 // also count UTF-8 input as CSV
+#define UTF8LINESEPARATOR_DFA 2 // use the table-driven UTF-8 decoder
+
+#define UTF8LINESEPARATOR_MSGSIZ 256
+
+typedef struct {
+    int is_valid;
+    char failure[UTF8LINESEPARATOR_MSGSIZ]; // the message, "" if valid
+    int is_csv_failure; // a quoted field is not closed at the end
+    const char *encoding; // "UTF-8", "UTF-16LE" or "UTF-16BE"
+    int has_bom; // the encoding was detected from a BOM
+    uint64_t bytecount; // the number of bytes scanned (up to the failure)
+    int64_t charcount; // up to the failure
+    int64_t LFcount;
+    int64_t CRcount;
+    int64_t CRLFcount;
+    // If not is_valid, where the failure is (counting from 1):
+    int64_t character_position;
+    int64_t line;
+    int64_t column;
+    int line_questionable; // the line number depends on which line
+                           // separator counts
+    // If counted as CSV: the rows, and the line separators (of the
+    // counts above) that are in quoted cells instead of ending rows
+    int is_csv;
+    int64_t rowcount;
+    int64_t cell_LFcount;
+    int64_t cell_CRcount;
+    int64_t cell_CRLFcount;
+} Utf8LineSeparatorResult;
+
+// A scanner with the given flags, ready for an input; NULL if out of
+// memory.
+Utf8LineSeparator *Utf8LineSeparator_new(unsigned flags);
+
+// Start over with a new input.
+void Utf8LineSeparator_reset(Utf8LineSeparator *s);
+
+// Scan the next len bytes of the input at p. Returns 0 once the input
+// is known to be invalid (the rest can be skipped), 1 otherwise.
+int Utf8LineSeparator_feed(Utf8LineSeparator *s, const void *p, size_t len);
+
+// The end of the input: store the result in *result.
+void Utf8LineSeparator_finish(Utf8LineSeparator *s,
+                              Utf8LineSeparatorResult *result);
+
+void Utf8LineSeparator_free(Utf8LineSeparator *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBUTF8LINESEPARATOR_H_ */
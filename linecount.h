@@ -0,0 +1,158 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef LINECOUNT_H_
+#define LINECOUNT_H_
+
+/*
+
+  Counting of characters and CR, LF and CRLF line separators.
+
+  A `LineCount` carries all the state needed to continue counting
+  with the next piece of input, including a CR at the end of one
+  piece that is followed by an LF at the start of the next one
+  (`last_was_CR`); thus input can be fed in arbitrary pieces
+  (e.g. one `BufferedStream` buffer at a time), and either character
+  by character (`LineCount_char`), or as validated UTF-8 bytes
+  (`LineCount_valid_bytes`, in scankernels.h).
+
+  Only the actual CR and LF bytes are line separators in UTF-8 input:
+  an overlong encoding of them (which is let through as valid, see
+  utf8validate.h) is some other character, also when it is decoded
+  and counted via `LineCount_char` (see `utf8_counted_char`), so that
+  the counts don't depend on where the pieces end.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "shorttypenames.h"
+#include "util.h" /* MAX3 */
+
+
+typedef struct {
+    int64_t charcount;
+    int64_t LFcount;
+    int64_t CRcount;
+    int64_t CRLFcount;
+    int64_t column; // number of characters since the last separator
+    bool last_was_CR; // a CR that is not counted yet
+} LineCount;
+
+#define default_LineCount (LineCount){}
+
+static inline
+void LineCount_char(LineCount *lc, u32 c) {
+    lc->charcount++;
+    if (c == '\r') {
+        if (lc->last_was_CR) {
+            lc->CRcount++;
+        }
+        // the new one will be counted with the next character
+        lc->last_was_CR = true;
+        lc->column = 0;
+    } else if (c == '\n') {
+        if (lc->last_was_CR) {
+            lc->CRLFcount++;
+        } else {
+            lc->LFcount++;
+        }
+        lc->last_was_CR = false;
+        lc->column = 0;
+    } else {
+        if (lc->last_was_CR) {
+            lc->CRcount++;
+        }
+        lc->last_was_CR = false;
+        lc->column++;
+    }
+}
+
+/*
+  Set *column to the number of characters in the valid bytes [p,
+  p+len) that follow the last line separator in it, or to the number
+  of all characters if there is none. Returns whether there is a
+  separator. (This is the column that `LineCount_valid_bytes` would
+  arrive at, for reconstructing it after `*_nocolumn` was used:
+  scanning backwards from the position in question.)
+*/
+static UNUSED
+bool LineCount_tail_column(const u8 *p, size_t len, int64_t *column) {
+    size_t i = len;
+    bool found = false;
+    while (i > 0) {
+        u8 b = p[i - 1];
+        if ((b == '\r') || (b == '\n')) {
+            found = true;
+            break;
+        }
+        i--;
+    }
+    int64_t n = 0;
+    for (; i < len; i++) {
+        if ((p[i] & 0b11000000) != 0b10000000) {
+            n++;
+        }
+    }
+    *column = n;
+    return found;
+}
+
+// Count the CR that may still be pending at the end of the input.
+static inline
+void LineCount_finish(LineCount *lc) {
+    if (lc->last_was_CR) {
+        lc->CRcount++;
+        lc->last_was_CR = false;
+    }
+}
+
+/*
+  Add the counts of a following piece of input, b, that was counted
+  separately starting from `default_LineCount`, to a. b_first_byte
+  is the first byte of that piece (which is needed to resolve a CR
+  that a might end with).
+*/
+static UNUSED
+void LineCount_append(LineCount *a, const LineCount *b, u8 b_first_byte) {
+    if (b->charcount == 0) {
+        return;
+    }
+    int64_t LFcount = b->LFcount;
+    int64_t CRcount = b->CRcount;
+    int64_t CRLFcount = b->CRLFcount;
+    if (a->last_was_CR) {
+        if (b_first_byte == '\n') {
+            // b counted it as LF
+            LFcount--;
+            CRLFcount++;
+        } else {
+            CRcount++;
+        }
+    }
+    bool b_has_separator = (b->LFcount + b->CRcount + b->CRLFcount > 0)
+        || b->last_was_CR;
+    a->charcount += b->charcount;
+    a->LFcount += LFcount;
+    a->CRcount += CRcount;
+    a->CRLFcount += CRLFcount;
+    a->column = b_has_separator ? b->column : a->column + b->column;
+    a->last_was_CR = b->last_was_CR;
+}
+
+static inline UNUSED
+int64_t LineCount_lines(const LineCount *lc) {
+    return lc->LFcount + lc->CRcount + lc->CRLFcount;
+}
+
+// Whether the line count is questionable because more than one kind
+// of separator was seen.
+static inline UNUSED
+bool LineCount_is_questionable(const LineCount *lc) {
+    return LineCount_lines(lc) != MAX3(lc->LFcount, lc->CRcount, lc->CRLFcount);
+}
+
+
+#endif /* LINECOUNT_H_ */
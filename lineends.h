@@ -0,0 +1,125 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef LINEENDS_H_
+#define LINEENDS_H_
+
+/*
+
+  Rewriting the line separators of UTF-8 text: every CRLF, lone CR
+  and lone LF becomes the chosen target separator.
+
+  A CR at the end of a piece of input can only be resolved with the
+  next piece (it may be the first half of a CRLF): its output is
+  deferred, which is exactly the state that `LineCount` already
+  carries (`last_was_CR`); thus the text can be rewritten in
+  arbitrary pieces while counting it, and `normalize_separators_finish`
+  writes the deferred CR at the end.
+
+  This file has the byte-wise variant; the vectorized one,
+  `normalize_separators`, is in scankernels.h.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp */
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "linecount.h"
+
+
+typedef enum {
+    LINESEPARATOR_LF,
+    LINESEPARATOR_CRLF,
+    LINESEPARATOR_CR,
+} LineSeparator;
+
+// The name used on the command line and in JSON output
+static UNUSED
+const char *LineSeparator_name(LineSeparator s) {
+    switch (s) {
+    case LINESEPARATOR_LF: return "LF";
+    case LINESEPARATOR_CRLF: return "CRLF";
+    case LINESEPARATOR_CR: return "CR";
+    }
+    return "?";
+}
+
+// The separator named str (case insensitively), if known.
+static UNUSED
+bool LineSeparator_parse(const char *str, LineSeparator *s) {
+    for (int i = LINESEPARATOR_LF; i <= LINESEPARATOR_CR; i++) {
+        if (strcasecmp(str, LineSeparator_name((LineSeparator)i)) == 0) {
+            *s = (LineSeparator)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The output for len bytes of input is at most this long (every LF
+// becoming a CRLF, plus a deferred CR from the previous piece)
+#define NORMALIZE_MAXLEN(len) (2 * (len) + 2)
+
+// Write the separator s to out, returns its length.
+static inline
+size_t LineSeparator_put(LineSeparator s, u8 *out) {
+    switch (s) {
+    case LINESEPARATOR_LF: out[0] = '\n'; return 1;
+    case LINESEPARATOR_CRLF: out[0] = '\r'; out[1] = '\n'; return 2;
+    case LINESEPARATOR_CR: out[0] = '\r'; return 1;
+    }
+    return 0;
+}
+
+/*
+  Write the valid UTF-8 [p, p+len), which must consist of complete
+  characters, with its separators rewritten to target, to out (which
+  must have room for NORMALIZE_MAXLEN(len) bytes), and count its
+  characters into lc. Returns the number of bytes written.
+*/
+static UNUSED
+size_t normalize_separators_bytewise(LineCount *lc, const u8 *p, size_t len,
+                                     u8 *out, LineSeparator target) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        u8 b = p[i];
+        if ((b & 0b11000000) == 0b10000000) {
+            out[o++] = b;
+            continue;
+        }
+        if (lc->last_was_CR) {
+            // the deferred CR, or the CRLF if b is its LF
+            o += LineSeparator_put(target, out + o);
+            if (b == '\n') {
+                LineCount_char(lc, b);
+                continue;
+            }
+        }
+        LineCount_char(lc, b);
+        if (b == '\n') {
+            o += LineSeparator_put(target, out + o);
+        } else if (b != '\r') {
+            out[o++] = b;
+        }
+    }
+    return o;
+}
+
+// Write a CR still deferred at the end of the input to out (which
+// needs room for 2 bytes), and finish the counting. Returns the
+// number of bytes written.
+static inline
+size_t normalize_separators_finish(LineCount *lc, u8 *out,
+                                   LineSeparator target) {
+    size_t o = lc->last_was_CR ? LineSeparator_put(target, out) : 0;
+    LineCount_finish(lc);
+    return o;
+}
+
+
+#endif /* LINEENDS_H_ */
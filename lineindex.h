@@ -0,0 +1,427 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef LINEINDEX_H_
+#define LINEINDEX_H_
+
+/*
+
+  An index of the byte offsets where the lines of a file start, for
+  going to a line (or finding the line of a byte) without reading the
+  file up to there.
+
+  It is collected while scanning (`LineIndexing`, see
+  `LineCount_index_valid_bytes` in scankernels.h) for all three kinds
+  of separators at once, since which of them the file uses is only
+  known at the end; the index file is written for the kind that
+  occurs most often (`LineIndexing_write`), separators of the other
+  kinds are then part of the lines. Line 0 starts at the start of
+  the data (after a BOM), line n after the n-th separator; a
+  separator at the end of the file is followed by an empty last line.
+
+  The index file (all numbers little endian) consists of
+
+    a header: the magic LINEINDEX_MAGIC (8 bytes), then as u64: the
+      separator kind (`LineSeparator`), the number of lines, the size
+      of the data file, the number of lines per block, the number of
+      blocks, and the length of the delta section;
+
+    a table with an entry per block: the offset of the block's first
+      line, and the position of the rest of the block in the delta
+      section, as u64;
+
+    the delta section: for each block, the distances from each line
+      start to the next one, as LEB128 varints (usually 1 byte).
+
+  Reading it (`LineIndex_read`) loads the file into memory; the byte
+  range of a line is found via the table and decoding at most a
+  block of deltas (`LineIndex_line_range`), the line containing a
+  byte via binary search in the table (`LineIndex_line_at`).
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "mem.h"
+#include "Simd64.h" /* u64_lowest_bit */
+#include "Result.h"
+#include "io.h" /* put_u64_le, get_u64_le */
+#include "BufferedStream.h"
+#include "linecount.h"
+#include "lineends.h"
+
+
+#define LINEINDEX_MAGIC "ULSIDX\0\1"
+#define LINEINDEX_MAGICLEN 8
+#define LINEINDEX_HEADERSIZ (LINEINDEX_MAGICLEN + 6 * 8)
+#define LINEINDEX_BLOCK_LINES 128
+
+// The line starts for one kind of separator
+typedef struct {
+    u64 count;
+    u64 last; // the last one added
+    u8 *deltas;
+    size_t deltas_len;
+    size_t deltas_cap;
+    u64 *table; // 2 entries per block
+    size_t table_len;
+    size_t table_cap;
+} LineStarts;
+
+typedef struct {
+    LineStarts kinds[3]; // indexed by LineSeparator
+} LineIndexing;
+
+static UNUSED
+void LineIndexing_init(LineIndexing *ix) {
+    memset(ix, 0, sizeof(*ix));
+}
+
+static UNUSED
+void LineIndexing_release(LineIndexing *ix) {
+    for (int k = 0; k < 3; k++) {
+        if (ix->kinds[k].deltas) free(ix->kinds[k].deltas);
+        if (ix->kinds[k].table) free(ix->kinds[k].table);
+    }
+}
+
+static
+void _LineStarts_new_block(LineStarts *ls, u64 offset) {
+    if (ls->table_len + 2 > ls->table_cap) {
+        ls->table_cap = ls->table_cap ? 2 * ls->table_cap : 64;
+        ls->table = (u64 *)xrealloc(ls->table, ls->table_cap * sizeof(u64));
+    }
+    ls->table[ls->table_len++] = offset;
+    ls->table[ls->table_len++] = ls->deltas_len;
+}
+
+static inline
+void LineStarts_add(LineStarts *ls, u64 offset) {
+    if (ls->count % LINEINDEX_BLOCK_LINES == 0) {
+        _LineStarts_new_block(ls, offset);
+    } else {
+        if (ls->deltas_len + 10 > ls->deltas_cap) {
+            ls->deltas_cap = ls->deltas_cap ? 2 * ls->deltas_cap : 4096;
+            ls->deltas = (u8 *)xrealloc(ls->deltas, ls->deltas_cap);
+        }
+        u64 d = offset - ls->last;
+        while (d >= 0x80) {
+            ls->deltas[ls->deltas_len++] = 0x80 | (d & 0x7F);
+            d >>= 7;
+        }
+        ls->deltas[ls->deltas_len++] = d;
+    }
+    ls->last = offset;
+    ls->count++;
+}
+
+// Add base + the position of each bit in mask, for the kind k.
+static inline
+void LineIndexing_add_mask(LineIndexing *ix, LineSeparator k, u64 mask,
+                           u64 base) {
+    while (mask) {
+        LineStarts_add(&ix->kinds[k], base + u64_lowest_bit(mask));
+        mask &= mask - 1;
+    }
+}
+
+// The start of the data, line 0 for all kinds.
+static UNUSED
+void LineIndexing_begin(LineIndexing *ix, u64 offset) {
+    for (int k = 0; k < 3; k++) {
+        LineStarts_add(&ix->kinds[k], offset);
+    }
+}
+
+// Add the line start that the character c at offset makes, if any,
+// with lc being the count before it (c is counted into lc
+// separately, after this).
+static inline
+void LineIndexing_char(LineIndexing *ix, const LineCount *lc, u32 c,
+                       u64 offset) {
+    if (c == '\n') {
+        LineStarts_add(&ix->kinds[lc->last_was_CR ? LINESEPARATOR_CRLF
+                                  : LINESEPARATOR_LF], offset + 1);
+    } else if (lc->last_was_CR) {
+        LineStarts_add(&ix->kinds[LINESEPARATOR_CR], offset);
+    }
+}
+
+// Add the line start after a CR still pending at the end of the
+// input, at offset (before `LineCount_finish`).
+static UNUSED
+void LineIndexing_finish(LineIndexing *ix, const LineCount *lc, u64 offset) {
+    if (lc->last_was_CR) {
+        LineStarts_add(&ix->kinds[LINESEPARATOR_CR], offset);
+    }
+}
+
+// The kind of separator the (finished) count lc has most of; LF if
+// there are none.
+static UNUSED
+LineSeparator LineIndexing_kind(const LineCount *lc) {
+    if ((lc->LFcount >= lc->CRLFcount) && (lc->LFcount >= lc->CRcount)) {
+        return LINESEPARATOR_LF;
+    }
+    return (lc->CRLFcount >= lc->CRcount) ? LINESEPARATOR_CRLF
+        : LINESEPARATOR_CR;
+}
+
+/*
+  Write the index for the separator kind k to out (which is
+  flushed), datasize being the size of the scanned file.
+*/
+static UNUSED
+Result(Unit) LineIndexing_write(const LineIndexing *ix, LineSeparator k,
+                                u64 datasize, BufferedStream *out) {
+    const LineStarts *ls = &ix->kinds[k];
+    u64 nblocks = ls->table_len / 2;
+    u8 header[LINEINDEX_HEADERSIZ];
+    memcpy(header, LINEINDEX_MAGIC, LINEINDEX_MAGICLEN);
+    u64 fields[6] = { k, ls->count, datasize, LINEINDEX_BLOCK_LINES,
+                      nblocks, ls->deltas_len };
+    for (int i = 0; i < 6; i++) {
+        put_u64_le(header + LINEINDEX_MAGICLEN + 8 * i, fields[i]);
+    }
+    Result(Unit) r = BufferedStream_write(out, header, LINEINDEX_HEADERSIZ);
+    PROPAGATE_return(Unit, r);
+    for (size_t i = 0; i < ls->table_len; i++) {
+        u8 buf[8];
+        put_u64_le(buf, ls->table[i]);
+        r = BufferedStream_write(out, buf, 8);
+        PROPAGATE_return(Unit, r);
+    }
+    r = BufferedStream_write(out, ls->deltas, ls->deltas_len);
+    PROPAGATE_return(Unit, r);
+    return BufferedStream_flush(out);
+}
+
+
+typedef struct {
+    u8 *buf; // the whole index file
+    LineSeparator kind;
+    u64 linecount;
+    u64 datasize;
+    u64 block_lines;
+    u64 nblocks;
+    u64 deltas_len;
+    const u8 *table;
+    const u8 *deltas;
+} LineIndex;
+
+DEFTYPE_Result(LineIndex);
+
+static UNUSED
+void LineIndex_release(LineIndex *ix) {
+    free(ix->buf);
+}
+
+static inline
+u64 _LineIndex_block_start(const LineIndex *ix, u64 b) {
+    return get_u64_le(ix->table + 16 * b);
+}
+
+static inline
+u64 _LineIndex_block_pos(const LineIndex *ix, u64 b) {
+    return get_u64_le(ix->table + 16 * b + 8);
+}
+
+/*
+  Read the index file at path. Fails if it can't be read or is not a
+  well-formed index file; the deltas are only checked when they are
+  decoded.
+*/
+static UNUSED
+Result(LineIndex) LineIndex_read(const char *path) {
+#define LINEINDEX_ERR(msg) do {                                 \
+        free(buf);                                              \
+        return Err(LineIndex, literal_String(msg));             \
+    } while (0)
+    u8 *buf = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return Err_from(LineIndex, Error_errno(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        return Err_from(LineIndex, Error_errno(err));
+    }
+    size_t len = st.st_size;
+    buf = (u8 *)xmalloc(len ? len : 1);
+    size_t n = 0;
+    while (n < len) {
+        ssize_t r = read(fd, buf + n, len - n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            int err = errno;
+            close(fd);
+            free(buf);
+            return Err_from(LineIndex, Error_errno(err));
+        }
+        if (r == 0) break;
+        n += r;
+    }
+    close(fd);
+    if ((n != len) || (len < LINEINDEX_HEADERSIZ)
+        || memcmp(buf, LINEINDEX_MAGIC, LINEINDEX_MAGICLEN)) {
+        LINEINDEX_ERR("not a line index file");
+    }
+    LineIndex ix;
+    ix.buf = buf;
+    const u8 *h = buf + LINEINDEX_MAGICLEN;
+    u64 kind = get_u64_le(h);
+    ix.linecount = get_u64_le(h + 8);
+    ix.datasize = get_u64_le(h + 16);
+    ix.block_lines = get_u64_le(h + 24);
+    ix.nblocks = get_u64_le(h + 32);
+    ix.deltas_len = get_u64_le(h + 40);
+    if ((kind > LINESEPARATOR_CR) || (ix.block_lines == 0)
+        || (ix.linecount == 0)
+        || (ix.nblocks != (ix.linecount - 1) / ix.block_lines + 1)
+        || (ix.nblocks > (len - LINEINDEX_HEADERSIZ) / 16)
+        || (ix.deltas_len != len - LINEINDEX_HEADERSIZ - 16 * ix.nblocks)) {
+        LINEINDEX_ERR("invalid line index header");
+    }
+    ix.kind = (LineSeparator)kind;
+    ix.table = buf + LINEINDEX_HEADERSIZ;
+    ix.deltas = ix.table + 16 * ix.nblocks;
+    u64 start = 0, pos = 0;
+    for (u64 b = 0; b < ix.nblocks; b++) {
+        u64 start2 = _LineIndex_block_start(&ix, b);
+        u64 pos2 = _LineIndex_block_pos(&ix, b);
+        if ((start2 < start) || (start2 > ix.datasize)
+            || (pos2 < pos) || (pos2 > ix.deltas_len)) {
+            LINEINDEX_ERR("invalid line index table");
+        }
+        start = start2;
+        pos = pos2;
+    }
+    return Ok(LineIndex, ix);
+#undef LINEINDEX_ERR
+}
+
+// Decode the varint at *pos (before end) into *v; returns false if
+// it is not complete.
+static inline
+bool _LineIndex_varint(const LineIndex *ix, u64 *pos, u64 end, u64 *v) {
+    u64 d = 0;
+    int shift = 0;
+    while ((*pos < end) && (shift < 64)) {
+        u8 b = ix->deltas[(*pos)++];
+        d |= (u64)(b & 0x7F) << shift;
+        if (! (b & 0x80)) {
+            *v = d;
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+// The end of the deltas of block b.
+static inline
+u64 _LineIndex_block_end(const LineIndex *ix, u64 b) {
+    return (b + 1 < ix->nblocks) ? _LineIndex_block_pos(ix, b + 1)
+        : ix->deltas_len;
+}
+
+/*
+  Set [*start, *end) to the byte range of line `line` (counting from
+  0), including its separator. Returns false if there is no such
+  line or the index is broken.
+*/
+static UNUSED
+bool LineIndex_line_range(const LineIndex *ix, u64 line, u64 *start,
+                          u64 *end) {
+    if (line >= ix->linecount) {
+        return false;
+    }
+    u64 b = line / ix->block_lines;
+    u64 k = line % ix->block_lines;
+    u64 pos = _LineIndex_block_pos(ix, b);
+    u64 blockend = _LineIndex_block_end(ix, b);
+    u64 s = _LineIndex_block_start(ix, b);
+    for (u64 j = 0; j < k; j++) {
+        u64 d;
+        if (! _LineIndex_varint(ix, &pos, blockend, &d)) {
+            return false;
+        }
+        s += d;
+    }
+    u64 e;
+    if (line + 1 == ix->linecount) {
+        e = ix->datasize;
+    } else if (k + 1 == ix->block_lines) {
+        e = _LineIndex_block_start(ix, b + 1);
+    } else {
+        u64 d;
+        if (! _LineIndex_varint(ix, &pos, blockend, &d)) {
+            return false;
+        }
+        e = s + d;
+    }
+    if ((s > e) || (e > ix->datasize)) {
+        return false;
+    }
+    *start = s;
+    *end = e;
+    return true;
+}
+
+/*
+  Set *line to the line (counting from 0) that the byte at offset
+  belongs to. Returns false if offset is not before the end of the
+  data, or the index is broken. (Bytes of a BOM belong to line 0.)
+*/
+static UNUSED
+bool LineIndex_line_at(const LineIndex *ix, u64 offset, u64 *line) {
+    if (offset >= ix->datasize) {
+        return false;
+    }
+    // The last block starting at or before offset
+    u64 lo = 0, hi = ix->nblocks;
+    while (hi - lo > 1) {
+        u64 mid = lo + (hi - lo) / 2;
+        if (_LineIndex_block_start(ix, mid) <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    u64 n = lo * ix->block_lines;
+    u64 s = _LineIndex_block_start(ix, lo);
+    u64 pos = _LineIndex_block_pos(ix, lo);
+    u64 blockend = _LineIndex_block_end(ix, lo);
+    u64 lines_in_block = ix->linecount - n;
+    if (lines_in_block > ix->block_lines) {
+        lines_in_block = ix->block_lines;
+    }
+    for (u64 j = 1; j < lines_in_block; j++) {
+        u64 d;
+        if (! _LineIndex_varint(ix, &pos, blockend, &d)) {
+            return false;
+        }
+        if (s + d > offset) {
+            break;
+        }
+        s += d;
+        n++;
+    }
+    *line = n;
+    return true;
+}
+
+
+#endif /* LINEINDEX_H_ */
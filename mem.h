@@ -23,6 +23,13 @@ void *xmalloc(size_t size) {
     return p;
 }
 
+static inline
+void *xrealloc(void *p, size_t size) {
+    void *p2 = realloc(p, size);
+    if (!p2) die_outofmemory();
+    return p2;
+}
+
 
 static
 char *xstrdup(const char *str) {
@@ -0,0 +1,135 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef MMAPGUARD_H_
+#define MMAPGUARD_H_
+
+/*
+
+  Protection against files being truncated while they are mapped into
+  memory and being read: accessing a page beyond the new end of the
+  file raises SIGBUS, which would kill the process.
+
+  Mappings are registered here; the SIGBUS handler replaces the
+  faulting page of a registered mapping with a page of zeroes (so
+  that the access can complete) and marks the mapping as truncated;
+  the code owning the mapping then checks `mmapguard_is_truncated` to
+  turn that into an error. Faults outside registered mappings are
+  handled the default way (i.e. the process is killed).
+
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "util.h" /* DIE */
+
+
+#define MMAPGUARD_MAX_MAPPINGS 64
+
+typedef struct {
+    uintptr_t start; // 0 == unused slot; accessed atomically
+    uintptr_t end;
+    volatile sig_atomic_t is_truncated;
+} MmapGuardSlot;
+
+// Should be in a mmapguard.c but we're currently using a single
+// binary object for everything.
+MmapGuardSlot mmapguard_slots[MMAPGUARD_MAX_MAPPINGS];
+int mmapguard_state = 0; // 0: not installed, 1: installing, 2: installed
+uintptr_t mmapguard_pagesize;
+
+static
+void mmapguard_handler(int signo, siginfo_t *info, void *context) {
+    (void)context;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    for (int i = 0; i < MMAPGUARD_MAX_MAPPINGS; i++) {
+        MmapGuardSlot *slot = &mmapguard_slots[i];
+        uintptr_t start = __atomic_load_n(&slot->start, __ATOMIC_ACQUIRE);
+        if (start && (addr >= start) && (addr < slot->end)) {
+            uintptr_t page = addr & ~(mmapguard_pagesize - 1);
+            // open, mmap and close are fine to use in signal handlers
+            // on Linux
+            int fd = open("/dev/zero", O_RDONLY);
+            if (fd >= 0) {
+                void *p = mmap((void*)page, mmapguard_pagesize, PROT_READ,
+                               MAP_PRIVATE | MAP_FIXED, fd, 0);
+                close(fd);
+                if (p != MAP_FAILED) {
+                    slot->is_truncated = 1;
+                    return;
+                }
+            }
+            break;
+        }
+    }
+    // Not ours (or we can't help): let the access fault again with
+    // the default action.
+    signal(signo, SIG_DFL);
+}
+
+static
+void mmapguard_install() {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&mmapguard_state, &expected, 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        mmapguard_pagesize = sysconf(_SC_PAGESIZE);
+        struct sigaction sa = {};
+        sa.sa_sigaction = mmapguard_handler;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGBUS, &sa, NULL) < 0) {
+            DIE("mmapguard_install: sigaction failed");
+        }
+        __atomic_store_n(&mmapguard_state, 2, __ATOMIC_RELEASE);
+    } else {
+        while (__atomic_load_n(&mmapguard_state, __ATOMIC_ACQUIRE) != 2) {
+            // another thread is installing the handler
+        }
+    }
+}
+
+// Register the mapping at [addr, addr+len). Returns the slot number
+// to pass to the other functions, or -1 if there are too many
+// mappings registered already (in which case the caller should not
+// use the mapping).
+static
+int mmapguard_register(const void *addr, size_t len) {
+    mmapguard_install();
+    for (int i = 0; i < MMAPGUARD_MAX_MAPPINGS; i++) {
+        MmapGuardSlot *slot = &mmapguard_slots[i];
+        uintptr_t expected = 0;
+        // Reserve the slot with a value that can't match any address
+        if (__atomic_compare_exchange_n(&slot->start, &expected,
+                                        UINTPTR_MAX, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            slot->end = (uintptr_t)addr + len;
+            slot->is_truncated = 0;
+            __atomic_store_n(&slot->start, (uintptr_t)addr, __ATOMIC_RELEASE);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static
+void mmapguard_unregister(int slotnum) {
+    assert(slotnum >= 0 && slotnum < MMAPGUARD_MAX_MAPPINGS);
+    __atomic_store_n(&mmapguard_slots[slotnum].start, 0, __ATOMIC_RELEASE);
+}
+
+static
+bool mmapguard_is_truncated(int slotnum) {
+    assert(slotnum >= 0 && slotnum < MMAPGUARD_MAX_MAPPINGS);
+    return mmapguard_slots[slotnum].is_truncated;
+}
+
+
+#endif /* MMAPGUARD_H_ */
@@ -0,0 +1,24 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef MONOTIME_H_
+#define MONOTIME_H_
+
+#include <time.h>
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+
+
+// Nanoseconds on the monotonic clock (from an unspecified starting
+// point), for measuring durations.
+static UNUSED
+u64 monotime_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u64)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+#endif /* MONOTIME_H_ */
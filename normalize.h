@@ -0,0 +1,190 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef NORMALIZE_H_
+#define NORMALIZE_H_
+
+/*
+
+  Copying UTF-8 input to an output stream with its line separators
+  rewritten to one kind (`Report_normalize`, see lineends.h), while
+  checking and counting it as `Report_scan` does, in the same pass.
+
+  Like in transcode.h, the input is processed a piece of at most
+  NORMALIZE_CHUNKSIZE bytes at a time: validated, then rewritten and
+  counted into a scratch buffer by one kernel, which goes to the
+  output stream via `BufferedStream_write`.
+
+  The output ends where the input stops being valid UTF-8. A UTF-8
+  BOM is copied but not counted; other input is always taken to be
+  UTF-8 (a UTF-16 BOM is reported as invalid UTF-8).
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "shorttypenames.h"
+#include "Error.h"
+#include "BufferedStream.h"
+#include "unicode.h"
+#include "utf8dfa.h"
+#include "lineends.h"
+#include "scankernels.h"
+#include "report.h"
+
+
+#define NORMALIZE_CHUNKSIZE (64 * 1024)
+// The scratch buffer: a piece, then a character crossing its end
+// (after a CR left pending by the piece)
+#define NORMALIZE_SCRATCHSIZE \
+    (NORMALIZE_MAXLEN(NORMALIZE_CHUNKSIZE) + NORMALIZE_MAXLEN(4))
+
+// Drop what couldn't be written, so that closing out doesn't try
+// again
+static
+void _Report_normalize_drop_output(BufferedStream *out) {
+    out->buffer.lslice.startpos = 0;
+    out->buffer.lslice.endpos = 0;
+}
+
+// Write [p, p+len) to out, recording a failure in r; returns whether
+// it succeeded.
+static
+bool _Report_normalize_write(Report *r, BufferedStream *out,
+                             const u8 *p, size_t len) {
+    Result(Unit) rw = BufferedStream_write(out, p, len);
+    if (Result_is_Err(rw)) {
+        if (Report_is_failure(r)) {
+            // keep the first failure
+            Error_release(rw.err);
+        } else {
+            r->failure = rw.err; // moved
+        }
+        _Report_normalize_drop_output(out);
+        return false;
+    }
+    return true;
+}
+
+/*
+  Copy `in` to `out` (which is flushed at the end) with all line
+  separators rewritten to `to`, up to the end or the first invalid
+  character (the output is flushed in either case, unless writing
+  failed). Only `opts->decoder` is used from opts. The column is
+  always tracked. The report is about the input, but its failure may
+  also be from writing the output.
+*/
+static
+Report Report_normalize(BufferedStream *in /* borrowed */,
+                        BufferedStream *out /* borrowed */,
+                        LineSeparator to,
+                        const ScanOptions *opts) {
+    Report report = { .lc = default_LineCount, .failure = noError,
+                      .bytecount = 0, .encoding = ENCODING_UTF8,
+                      .has_bom = false };
+    Report *r = &report;
+    LineCount *lc = &r->lc;
+    {
+        Result(LSlice_u8) rs = BufferedStream_peek_atleast(in, BOM_MAXLEN);
+        if (Result_is_Err(rs)) {
+            r->failure = rs.err; // moved
+            return report;
+        }
+        Encoding enc;
+        size_t bomlen = Encoding_from_bom(LSlice_start(rs.ok),
+                                          LSlice_length(rs.ok), &enc);
+        if (enc == ENCODING_UTF8) {
+            if (bomlen
+                && ! _Report_normalize_write(r, out, LSlice_start(rs.ok),
+                                             bomlen)) {
+                return report;
+            }
+            BufferedStream_consume(in, bomlen);
+            r->bytecount = bomlen;
+            r->has_bom = (bomlen > 0);
+        }
+    }
+    bool is_dfa = (opts->decoder == UTF8_DECODER_DFA);
+    utf8_valid_prefix_fn valid_prefix =
+        is_dfa ? utf8dfa_valid_prefix : utf8_valid_prefix;
+    u8 *scratch = (u8 *)xmalloc(NORMALIZE_SCRATCHSIZE);
+    bool is_written = true; // no failure writing
+    while (1) {
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Err(rs)) {
+            r->failure = rs.err; // moved
+            break;
+        }
+        size_t len = LSlice_length(rs.ok);
+        if (len == 0) {
+            size_t o = normalize_separators_finish(lc, scratch, to);
+            is_written = _Report_normalize_write(r, out, scratch, o);
+            break;
+        }
+        if (len > NORMALIZE_CHUNKSIZE) {
+            len = NORMALIZE_CHUNKSIZE;
+        }
+        const u8 *p = LSlice_start(rs.ok);
+        size_t valid = valid_prefix(p, len);
+        size_t o = normalize_separators(lc, p, valid, scratch, to);
+        BufferedStream_consume(in, valid);
+        r->bytecount += valid;
+        Result(Option(u32)) c = Ok(Option(u32), None(u32));
+        if (valid < len) {
+            // A character crossing the end of the piece, or an error;
+            // its original bytes go out (re-encoding it would change
+            // an overlong sequence, which the decoders let through)
+            u8 buf[4];
+            Result(LSlice_u8) rb = BufferedStream_peek_atleast(in,
+                                                               sizeof(buf));
+            if (Result_is_Err(rb)) {
+                c = Err_from(Option(u32), rb.err); // moved
+            } else {
+                size_t buflen = LSlice_length(rb.ok);
+                memcpy(buf, LSlice_start(rb.ok),
+                       (buflen < sizeof(buf)) ? buflen : sizeof(buf));
+                c = is_dfa ? get_unicodechar_dfa(in) : get_unicodechar(in);
+            }
+            if (Result_is_Ok(c) && ! c.ok.is_none) {
+                size_t charlen = utf8_sequence_length(buf[0]);
+                o += normalize_separators_bytewise(lc, buf, charlen,
+                                                   scratch + o, to);
+                r->bytecount += charlen;
+            }
+        }
+        if (! _Report_normalize_write(r, out, scratch, o)) {
+            is_written = false;
+            Result_release(c);
+            break;
+        }
+        if (Result_is_Err(c)) {
+            r->failure = c.err; // moved
+            break;
+        }
+    }
+    if (is_written && lc->last_was_CR) {
+        // Stopped by a failure after a CR: it still goes out, but
+        // stays uncounted as with `Report_scan`
+        size_t o = LineSeparator_put(to, scratch);
+        is_written = _Report_normalize_write(r, out, scratch, o);
+    }
+    free(scratch);
+    if (is_written) {
+        Result(Unit) rf = BufferedStream_flush(out);
+        if (Result_is_Err(rf)) {
+            if (! Report_is_failure(r)) {
+                r->failure = rf.err; // moved
+            } else {
+                Error_release(rf.err);
+            }
+            _Report_normalize_drop_output(out);
+        }
+    }
+    return report;
+}
+
+
+#endif /* NORMALIZE_H_ */
@@ -0,0 +1,139 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef PARALLELSCAN_H_
+#define PARALLELSCAN_H_
+
+/*
+
+  Validating and counting a large in-memory input (e.g. a file mapped
+  via `fd_r_BufferedStream`) on multiple threads.
+
+  The input is split into chunks, each chunk boundary moved forward
+  to the next character start. Each thread validates and counts its
+  chunk from a fresh `LineCount`; the results are then merged in
+  order via `LineCount_append`, which resolves a CR at the end of one
+  chunk that is followed by an LF at the start of the next one.
+
+  Merging stops at the first chunk that isn't fully valid, after its
+  valid part; the caller then continues sequentially from there
+  (which pinpoints the error exactly as a single-threaded run
+  would). Thus the results are identical to a sequential scan.
+
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "shorttypenames.h"
+#include "mem.h"
+#include "scankernels.h"
+
+
+typedef struct {
+    utf8_valid_prefix_fn valid_prefix;
+    const u8 *start;
+    size_t len;
+    // results:
+    LineCount lc; // for the valid part
+    size_t valid_len;
+} ScanChunk;
+
+static
+void *ScanChunk_run(void *arg) {
+    ScanChunk *c = (ScanChunk *)arg;
+    c->lc = default_LineCount;
+    c->valid_len = c->valid_prefix(c->start, c->len);
+    LineCount_valid_bytes(&c->lc, c->start, c->valid_len);
+    return NULL;
+}
+
+#define PARALLELSCAN_MAX_THREADS 256
+
+/*
+  Validate and count [p, p+len) using up to nthreads threads (the
+  calling thread being one of them), adding the counts to *lc.
+  valid_prefix is the validator to use (`utf8_valid_prefix` or
+  `utf8dfa_valid_prefix`).
+
+  Returns the number of bytes from p on that have been counted: this
+  is len unless there is an invalid or incomplete character at that
+  position, which the caller has to handle (e.g. via
+  `get_unicodechar`).
+*/
+static UNUSED
+size_t parallel_scan(const u8 *p, size_t len, int nthreads, LineCount *lc,
+                     utf8_valid_prefix_fn valid_prefix) {
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > PARALLELSCAN_MAX_THREADS) {
+        nthreads = PARALLELSCAN_MAX_THREADS;
+    }
+    if ((size_t)nthreads > len) {
+        nthreads = len ? len : 1;
+    }
+
+    ScanChunk *chunks = (ScanChunk *)xmalloc(nthreads * sizeof(ScanChunk));
+    pthread_t *threads = (pthread_t *)xmalloc(nthreads * sizeof(pthread_t));
+    bool *is_started = (bool *)xmalloc(nthreads * sizeof(bool));
+
+    size_t start = 0;
+    for (int i = 0; i < nthreads; i++) {
+        size_t end = (i == nthreads - 1) ? len : (len / nthreads) * (i + 1);
+        // Move the boundary to the next character start; an invalid
+        // run of more than 3 continuation bytes is left alone (the
+        // chunks around it will then not be valid).
+        for (int k = 0;
+             (k < 3) && (end < len) && ((p[end] & 0b11000000) == 0b10000000);
+             k++) {
+            end++;
+        }
+        if (end < start) {
+            end = start;
+        }
+        chunks[i] = (ScanChunk) {
+            .valid_prefix = valid_prefix,
+            .start = p + start,
+            .len = end - start
+        };
+        start = end;
+    }
+
+    // chunks[0] is run by the calling thread
+    for (int i = 1; i < nthreads; i++) {
+        is_started[i] = (pthread_create(&threads[i], NULL,
+                                        ScanChunk_run, &chunks[i]) == 0);
+    }
+    ScanChunk_run(&chunks[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (is_started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            // Couldn't start a thread, do it here
+            ScanChunk_run(&chunks[i]);
+        }
+    }
+
+    size_t scanned = 0;
+    for (int i = 0; i < nthreads; i++) {
+        ScanChunk *c = &chunks[i];
+        if (c->valid_len) {
+            LineCount_append(lc, &c->lc, c->start[0]);
+        }
+        scanned += c->valid_len;
+        if (c->valid_len < c->len) {
+            break;
+        }
+    }
+
+    free(is_started);
+    free(threads);
+    free(chunks);
+    return scanned;
+}
+
+
+#endif /* PARALLELSCAN_H_ */
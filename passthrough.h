@@ -0,0 +1,248 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef PASSTHROUGH_H_
+#define PASSTHROUGH_H_
+
+/*
+
+  Passing the input on to an output file descriptor unchanged while
+  it is being checked (filter mode), avoiding to copy the data
+  through user space where the kernel allows:
+
+  - Input read from a pipe is passed on by `Passthrough_read`, which
+    replaces `read` for the input stream (see
+    `BufferedStream_set_read_fn`): if the output is a pipe too, the
+    data is duplicated into it via `tee` before being read, otherwise
+    it is written after being read.
+
+  - A regular input file (which is mapped into memory for checking)
+    is copied afterwards via `Passthrough_copy_rest`, using
+    `copy_file_range` if the output is a regular file, `splice` if it
+    is a pipe, and `read`/`write` otherwise.
+
+  Copying through user space goes through a write-direction
+  BufferedStream. A failure writing the output stops the passing on;
+  it is reported by `Passthrough_finish`.
+
+  The system calls are used directly as glibc only declares them with
+  _GNU_SOURCE.
+
+ */
+
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "shorttypenames.h"
+#include "String.h"
+#include "io.h"
+#include "BufferedStream.h"
+
+
+// Size of the pieces that `Passthrough_copy_rest` asks the kernel to
+// copy at once
+#define PASSTHROUGH_CHUNKSIZE (1 << 30)
+
+typedef struct {
+    int out_fd; // borrowed
+    bool is_pipe_to_pipe; // use `tee`
+    BufferedStream out; // on a dup of out_fd
+    Error optional_failure; // writing to the output
+    bool is_stopped; // pass nothing on anymore
+} Passthrough;
+
+static
+bool _fd_is_fifo(int fd) {
+    struct stat st;
+    return (fstat(fd, &st) == 0) && S_ISFIFO(st.st_mode);
+}
+
+static
+bool _fd_is_regular_file(int fd) {
+    struct stat st;
+    return (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+}
+
+DEFTYPE_Result(Passthrough);
+
+// Prepare to pass the data read from in_fd on to out_fd. Fails if
+// out_fd can't be duplicated.
+static
+Result(Passthrough) Passthrough_new(int in_fd, int out_fd) {
+    int fd = dup(out_fd);
+    if (fd < 0) {
+        return Err_from(Passthrough, Error_errno(errno));
+    }
+    return Ok(Passthrough,
+              ((Passthrough) {
+                  .out_fd = out_fd,
+                  .is_pipe_to_pipe = _fd_is_fifo(in_fd)
+                                     && _fd_is_fifo(out_fd),
+                  .out = fd_BufferedStream(fd, STREAM_DIRECTION_OUT,
+                                           literal_String("output"),
+                                           false),
+                  .optional_failure = noError,
+                  .is_stopped = false
+              }));
+}
+
+static
+void _Passthrough_fail(Passthrough *pt, Error e /* owned */) {
+    if (! pt->optional_failure.str) {
+        pt->optional_failure = e;
+    } else {
+        Error_release(e);
+    }
+    pt->is_stopped = true;
+}
+
+// Stop passing data on (e.g. after finding an error in it)
+static UNUSED
+void Passthrough_stop(Passthrough *pt) {
+    pt->is_stopped = true;
+}
+
+// A `BufferedStream_read_fn`: read from fd like `read`, passing
+// what is read on to the output (ctx is the Passthrough).
+static
+ssize_t Passthrough_read(void *ctx, int fd, u8 *buf, size_t len) {
+    Passthrough *pt = (Passthrough *)ctx;
+    if (pt->is_pipe_to_pipe && ! pt->is_stopped) {
+        long k = syscall(__NR_tee, fd, pt->out_fd, len, 0);
+        if (k < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                return -1;
+            }
+            _Passthrough_fail(pt, Error_errno(err));
+            // go on reading without passing on
+        } else if (k > 0) {
+            // Now read what was duplicated, all of it, as a second
+            // `tee` would duplicate the rest again
+            size_t got = 0;
+            while (got < (size_t)k) {
+                ssize_t n = read(fd, buf + got, k - got);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return -1;
+                }
+                if (n == 0) {
+                    break; // can't happen
+                }
+                got += n;
+            }
+            return got;
+        }
+        // k == 0: EOF, or the output failed; fall through to `read`
+    }
+    ssize_t n = read(fd, buf, len);
+    if ((n > 0) && ! pt->is_stopped) {
+        Result(Unit) r = BufferedStream_write(&pt->out, buf, n);
+        if (Result_is_Err(r)) {
+            _Passthrough_fail(pt, r.err);
+        }
+    }
+    return n;
+}
+
+// Copy the rest of the regular file in_fd, from its current position
+// on, to the output.
+static
+void Passthrough_copy_rest(Passthrough *pt, int in_fd) {
+    if (pt->is_stopped) {
+        return;
+    }
+    bool out_is_regular = _fd_is_regular_file(pt->out_fd);
+    bool out_is_fifo = _fd_is_fifo(pt->out_fd);
+    // Anything that went through the buffer must come first
+    Result(Unit) rf = BufferedStream_flush(&pt->out);
+    if (Result_is_Err(rf)) {
+        _Passthrough_fail(pt, rf.err);
+        return;
+    }
+    while (out_is_regular || out_is_fifo) {
+        long n = out_is_regular
+            ? syscall(__NR_copy_file_range, in_fd, NULL, pt->out_fd, NULL,
+                      PASSTHROUGH_CHUNKSIZE, 0)
+            : syscall(__NR_splice, in_fd, NULL, pt->out_fd, NULL,
+                      PASSTHROUGH_CHUNKSIZE, 0);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            if ((err == EINVAL) || (err == EXDEV) || (err == ENOSYS)
+                || (err == EOPNOTSUPP)) {
+                // Not supported for this pair of files; nothing has
+                // been copied by this call, copy the rest by hand
+                break;
+            }
+            _Passthrough_fail(pt, Error_errno(err));
+            return;
+        }
+        if (n == 0) {
+            return;
+        }
+    }
+    u8 *buf = (u8 *)xmalloc(BufferedStream_buffersize);
+    while (1) {
+        ssize_t n = read(in_fd, buf, BufferedStream_buffersize);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            _Passthrough_fail(pt, Error_errno(err));
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        Result(Unit) r = BufferedStream_write(&pt->out, buf, n);
+        if (Result_is_Err(r)) {
+            _Passthrough_fail(pt, r.err);
+            break;
+        }
+    }
+    free(buf);
+}
+
+// Flush and close the output (the dup of it), and release pt.
+// Returns the first failure writing the output, if any.
+static
+Result(Unit) Passthrough_finish(Passthrough *pt) {
+    if (! pt->optional_failure.str) {
+        Result(Unit) r = BufferedStream_flush(&pt->out);
+        if (Result_is_Err(r)) {
+            pt->optional_failure = r.err;
+        }
+    }
+    if (pt->optional_failure.str) {
+        // Drop what couldn't be written, so that closing doesn't try
+        // again
+        pt->out.buffer.lslice.startpos = 0;
+        pt->out.buffer.lslice.endpos = 0;
+    }
+    Result(Unit) rc = BufferedStream_close(&pt->out);
+    if (Result_is_Err(rc) && ! pt->optional_failure.str) {
+        pt->optional_failure = rc.err;
+    } else {
+        Result_release(rc);
+    }
+    BufferedStream_release(&pt->out);
+    if (pt->optional_failure.str) {
+        return Err_from(Unit, pt->optional_failure); // moved
+    }
+    return Ok(Unit, {});
+}
+
+
+#endif /* PASSTHROUGH_H_ */
@@ -0,0 +1,273 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef PERFCOUNTERS_H_
+#define PERFCOUNTERS_H_
+
+/*
+
+  Hardware performance counters (via `perf_event_open`) for the
+  calling thread and the threads it starts while they are running:
+  cycles, instructions, branch misses, L1 data cache and last level
+  cache read misses. Only user space is counted, which the default
+  `perf_event_paranoid` setting allows.
+
+  Counters that can't be opened (no PMU in a VM or container,
+  forbidden by `perf_event_paranoid` or seccomp, not Linux) are just
+  missing; `PerfCounters_open` never fails. If the kernel has to
+  multiplex the counters, the values are scaled up to the full time.
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "String.h"
+
+#ifdef __linux__
+#  define PERFCOUNTERS_AVAILABLE 1
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <linux/perf_event.h>
+#else
+#  define PERFCOUNTERS_AVAILABLE 0
+#endif
+
+
+typedef enum {
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_BRANCH_MISSES,
+    PERF_COUNTER_L1D_MISSES,
+    PERF_COUNTER_LLC_MISSES,
+} PerfCounterId;
+
+#define PERF_COUNTER_COUNT 5
+
+// The name used in JSON output
+static UNUSED
+const char *PerfCounterId_name(PerfCounterId id) {
+    switch (id) {
+    case PERF_COUNTER_CYCLES: return "cycles";
+    case PERF_COUNTER_INSTRUCTIONS: return "instructions";
+    case PERF_COUNTER_BRANCH_MISSES: return "branch_misses";
+    case PERF_COUNTER_L1D_MISSES: return "L1d_misses";
+    case PERF_COUNTER_LLC_MISSES: return "LLC_misses";
+    }
+    return "?";
+}
+
+typedef struct {
+    int fds[PERF_COUNTER_COUNT]; // -1 if not available
+    u64 values[PERF_COUNTER_COUNT]; // set by `PerfCounters_stop`
+    int error; // errno of the first counter that couldn't be opened
+} PerfCounters;
+
+#if PERFCOUNTERS_AVAILABLE
+
+static
+int _PerfCounters_open_one(PerfCounterId id) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.inherit = 1; // include threads started while counting
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (id) {
+    case PERF_COUNTER_CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_COUNTER_INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_COUNTER_BRANCH_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    case PERF_COUNTER_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERF_COUNTER_LLC_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    }
+    // this process, any CPU, no group
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Open all counters that are available.
+static UNUSED
+void PerfCounters_open(PerfCounters *pc) {
+    pc->error = 0;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        pc->values[i] = 0;
+        pc->fds[i] = _PerfCounters_open_one((PerfCounterId)i);
+        if ((pc->fds[i] < 0) && ! pc->error) {
+            pc->error = errno;
+        }
+    }
+}
+
+// Start counting from 0.
+static UNUSED
+void PerfCounters_start(PerfCounters *pc) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+// Stop counting and store the counts in pc->values. A counter that
+// can't be read becomes unavailable.
+static UNUSED
+void PerfCounters_stop(PerfCounters *pc) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (pc->fds[i] < 0) {
+            continue;
+        }
+        u64 v[3]; // value, time enabled, time running
+        if (read(pc->fds[i], v, sizeof(v)) != sizeof(v)) {
+            if (! pc->error) {
+                pc->error = errno;
+            }
+            close(pc->fds[i]);
+            pc->fds[i] = -1;
+            continue;
+        }
+        if ((v[2] > 0) && (v[2] < v[1])) {
+            // multiplexed
+            pc->values[i] = (u64)((double)v[0] * v[1] / v[2]);
+        } else {
+            pc->values[i] = v[0];
+        }
+    }
+}
+
+static UNUSED
+void PerfCounters_close(PerfCounters *pc) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (pc->fds[i] >= 0) {
+            close(pc->fds[i]);
+            pc->fds[i] = -1;
+        }
+    }
+}
+
+#else /* ! PERFCOUNTERS_AVAILABLE */
+
+static UNUSED
+void PerfCounters_open(PerfCounters *pc) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        pc->fds[i] = -1;
+        pc->values[i] = 0;
+    }
+    pc->error = ENOSYS;
+}
+
+static UNUSED
+void PerfCounters_start(PerfCounters *pc) {
+    (void)pc;
+}
+
+static UNUSED
+void PerfCounters_stop(PerfCounters *pc) {
+    (void)pc;
+}
+
+static UNUSED
+void PerfCounters_close(PerfCounters *pc) {
+    (void)pc;
+}
+
+#endif /* PERFCOUNTERS_AVAILABLE */
+
+static UNUSED
+bool PerfCounters_is_available(const PerfCounters *pc, PerfCounterId id) {
+    return pc->fds[id] >= 0;
+}
+
+// Why counters are missing, for the error pc->error
+static UNUSED
+const char *PerfCounters_error_message(const PerfCounters *pc) {
+    switch (pc->error) {
+    case ENOENT:
+    case ENODEV:
+    case EOPNOTSUPP:
+        return "hardware performance counters are not supported here";
+    case EACCES:
+    case EPERM:
+        return "perf events are not permitted (see "
+            "/proc/sys/kernel/perf_event_paranoid)";
+    case ENOSYS:
+        return "perf events are not available on this system";
+    }
+    return strerror(pc->error);
+}
+
+/*
+  Print the counts as JSON fields (`"name": count, ` for each
+  counter, followed by the count per byte and per codepoint), null
+  for counters that are not available, and the reason for the first
+  missing one as "perf_error" (null if there is none).
+*/
+static UNUSED
+void PerfCounters_print_fields(const PerfCounters *pc, u64 bytes,
+                               u64 codepoints, FILE *out) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        const char *name = PerfCounterId_name((PerfCounterId)i);
+        if (PerfCounters_is_available(pc, (PerfCounterId)i)) {
+            u64 v = pc->values[i];
+            fprintf(out, "\"%s\": %" PRIu64 ", ", name, v);
+            if (bytes) {
+                fprintf(out, "\"%s_per_byte\": %.4f, ", name,
+                        (double)v / bytes);
+            } else {
+                fprintf(out, "\"%s_per_byte\": null, ", name);
+            }
+            if (codepoints) {
+                fprintf(out, "\"%s_per_codepoint\": %.4f, ", name,
+                        (double)v / codepoints);
+            } else {
+                fprintf(out, "\"%s_per_codepoint\": null, ", name);
+            }
+        } else {
+            fprintf(out, "\"%s\": null, \"%s_per_byte\": null, "
+                    "\"%s_per_codepoint\": null, ", name, name, name);
+        }
+    }
+    if (pc->error) {
+        String msg = String_quote_js(PerfCounters_error_message(pc));
+        fprintf(out, "\"perf_error\": %s", msg.str);
+        String_release(msg);
+    } else {
+        fprintf(out, "\"perf_error\": null");
+    }
+}
+
+
+#endif /* PERFCOUNTERS_H_ */
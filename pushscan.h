@@ -0,0 +1,263 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef PUSHSCAN_H_
+#define PUSHSCAN_H_
+
+/*
+
+  The push counterpart of `Report_scan`, for embedding: instead of
+  pulling from a `BufferedStream`, the input is handed over in
+  fragments as it arrives (`PushScan_feed`), split anywhere (also
+  inside a BOM or a character), and the `Report` is taken at the end
+  (`PushScan_finish`); it is the same as `Report_scan` gives for the
+  whole input (with `lazy_column` false: the column is always
+  tracked, the fragments can't be reread).
+
+  All state is in the `PushScan` object, including the up to 3 bytes
+  of a BOM or character that continues in the next fragment; nothing
+  is allocated, thus it can live anywhere and be reused via
+  `PushScan_init`. Fragments are only read during the call.
+
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED */
+#include "Buffer.h"
+#include "BufferedStream.h"
+#include "unicode.h"
+#include "encoding.h"
+#include "csv.h"
+#include "scankernels.h"
+#include "utf8dfa.h"
+#include "report.h"
+
+
+typedef struct {
+    Report r; // so far; bytecount is the offset of the next character
+    bool is_dfa; // opts->decoder
+    bool want_csv; // opts->csv, is_csv once the input is known to be
+                   // UTF-8
+    bool is_started; // the BOM has been looked for
+    bool is_done; // a failure was found, or finished
+    u8 pendinglen;
+    u8 pending[4]; // the start of the BOM or character that continues
+                   // in the next fragment
+} PushScan;
+
+// Only `opts->decoder` and `opts->csv` apply (see `Report_scan`).
+static UNUSED
+void PushScan_init(PushScan *s, const ScanOptions *opts) {
+    *s = (PushScan) {
+        .r = { .lc = default_LineCount, .failure = noError,
+               .bytecount = 0, .encoding = ENCODING_UTF8,
+               .has_bom = false, .is_csv = false,
+               .csv = default_CsvCount },
+        .is_dfa = (opts->decoder == UTF8_DECODER_DFA),
+        .want_csv = opts->csv,
+        .is_started = false,
+        .is_done = false,
+        .pendinglen = 0
+    };
+    // Select the kernels now, not while feeding
+    scankernels();
+}
+
+typedef enum {
+    PUSHSCAN_CHAR, // a character was counted
+    PUSHSCAN_NEED_MORE, // it continues in the next fragment
+    PUSHSCAN_FAILURE // s->r.failure is set
+} PushScanStep;
+
+// Decode and count the character at the start of [p, p+len) with the
+// decoder `Report_scan` uses, so that failures are the same; *charlen
+// is set to its length. If is_eof is false, running out of bytes is
+// not a failure.
+static
+PushScanStep _PushScan_char(PushScan *s, const u8 *p, size_t len,
+                            bool is_eof, size_t *charlen) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (u8 *)p, len), STREAM_DIRECTION_IN,
+        literal_String("fragment"));
+    bool is_utf16 = (s->r.encoding != ENCODING_UTF8);
+    Result(Option(u32)) c =
+        is_utf16 ? get_utf16char(&in, (s->r.encoding == ENCODING_UTF16BE))
+        : s->is_dfa ? get_unicodechar_dfa(&in)
+        : get_unicodechar(&in);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    if (Result_is_Err(c)) {
+        if ((! is_eof) && ((c.err.kind == ERROR_UTF8_PREMATURE_EOF)
+                           || (c.err.kind == ERROR_UTF16_PREMATURE_EOF))) {
+            Error_release(c.err);
+            return PUSHSCAN_NEED_MORE;
+        }
+        s->r.failure = c.err; // moved
+        s->is_done = true;
+        return PUSHSCAN_FAILURE;
+    }
+    if (c.ok.is_none) {
+        // (not called without bytes)
+        *charlen = 0;
+        return PUSHSCAN_CHAR;
+    }
+    u32 cp = is_utf16 ? c.ok.value : utf8_counted_char(p[0], c.ok.value);
+    *charlen = is_utf16 ? ((c.ok.value > 0xFFFF) ? 4 : 2)
+        : utf8_sequence_length(p[0]);
+    if (s->r.is_csv) {
+        CsvCount_char(&s->r.csv, &s->r.lc, cp);
+    }
+    LineCount_char(&s->r.lc, cp);
+    s->r.bytecount += *charlen;
+    return PUSHSCAN_CHAR;
+}
+
+// Scan the fragment [p, p+len) after the BOM.
+static
+void _PushScan_data(PushScan *s, const u8 *p, size_t len) {
+    size_t charlen;
+    if (s->pendinglen && len) {
+        // Complete the character from the last fragment
+        u8 buf[8];
+        size_t n = (len < 4) ? len : 4;
+        memcpy(buf, s->pending, s->pendinglen);
+        memcpy(buf + s->pendinglen, p, n);
+        PushScanStep step = _PushScan_char(s, buf, s->pendinglen + n, false,
+                                           &charlen);
+        if (step == PUSHSCAN_NEED_MORE) {
+            // (n < len is not possible: 4 bytes are always enough)
+            memcpy(s->pending, buf, s->pendinglen + n);
+            s->pendinglen += n;
+            return;
+        }
+        if (step == PUSHSCAN_FAILURE) {
+            return;
+        }
+        p += charlen - s->pendinglen;
+        len -= charlen - s->pendinglen;
+        s->pendinglen = 0;
+    }
+    bool is_utf16 = (s->r.encoding != ENCODING_UTF8);
+    bool is_be = (s->r.encoding == ENCODING_UTF16BE);
+    utf8_valid_prefix_fn valid_prefix =
+        is_utf16 ? (is_be ? utf16be_valid_prefix : utf16le_valid_prefix)
+        : s->is_dfa ? utf8dfa_valid_prefix : utf8_valid_prefix;
+    while (len) {
+        // Bulk-validate and count as much as possible
+        size_t n = valid_prefix(p, len);
+        if (is_utf16) {
+            (is_be ? LineCount_utf16be_valid_bytes
+             : LineCount_utf16le_valid_bytes)(&s->r.lc, p, n);
+        } else if (s->r.is_csv) {
+            LineCount_csv_valid_bytes(&s->r.lc, &s->r.csv, p, n);
+        } else {
+            LineCount_valid_bytes(&s->r.lc, p, n);
+        }
+        s->r.bytecount += n;
+        p += n;
+        len -= n;
+        if (len == 0) {
+            break;
+        }
+        // A character crossing the end of the fragment, or an error
+        PushScanStep step = _PushScan_char(s, p, len, false, &charlen);
+        if (step == PUSHSCAN_NEED_MORE) {
+            memcpy(s->pending, p, len);
+            s->pendinglen = len;
+            break;
+        }
+        if (step == PUSHSCAN_FAILURE) {
+            break;
+        }
+        p += charlen;
+        len -= charlen;
+    }
+}
+
+// Detect the encoding from the BOM among the pending bytes, then
+// scan the rest of them.
+static
+void _PushScan_start(PushScan *s) {
+    size_t bomlen = Encoding_from_bom(s->pending, s->pendinglen,
+                                      &s->r.encoding);
+    s->r.has_bom = (bomlen > 0);
+    s->r.bytecount = bomlen;
+    s->r.is_csv = s->want_csv && (s->r.encoding == ENCODING_UTF8);
+    s->is_started = true;
+    u8 rest[4];
+    size_t n = s->pendinglen - bomlen;
+    memcpy(rest, s->pending + bomlen, n);
+    s->pendinglen = 0;
+    _PushScan_data(s, rest, n);
+}
+
+/*
+  Scan the next len bytes of the input, at p. Returns false once the
+  input is known to be invalid (further fragments are ignored, the
+  caller may just as well stop feeding and finish).
+*/
+static UNUSED
+bool PushScan_feed(PushScan *s, const u8 *p, size_t len) {
+    if (s->is_done) {
+        return ! Report_is_failure(&s->r);
+    }
+    if (! s->is_started) {
+        while (len && (s->pendinglen < BOM_MAXLEN)) {
+            s->pending[s->pendinglen++] = *p++;
+            len--;
+        }
+        if (s->pendinglen < BOM_MAXLEN) {
+            return true;
+        }
+        _PushScan_start(s);
+    }
+    if (! s->is_done) {
+        _PushScan_data(s, p, len);
+    }
+    return ! s->is_done;
+}
+
+/*
+  The end of the input: returns the report (which is to be released
+  as usual, although it owns no memory). Feeding more is ignored
+  afterwards, until `PushScan_init` is called again.
+*/
+static UNUSED
+Report PushScan_finish(PushScan *s) {
+    if (s->is_done) {
+        return s->r;
+    }
+    if (! s->is_started) {
+        _PushScan_start(s);
+    }
+    if ((! s->is_done) && s->pendinglen) {
+        // Incomplete at the end: fails now
+        u8 buf[4];
+        size_t n = s->pendinglen;
+        size_t charlen;
+        memcpy(buf, s->pending, n);
+        s->pendinglen = 0;
+        _PushScan_char(s, buf, n, true, &charlen);
+    }
+    Report *r = &s->r;
+    if (! Report_is_failure(r)) {
+        LineCount_finish(&r->lc);
+        if (r->is_csv) {
+            CsvCount_finish(&r->csv);
+            if (r->csv.in_quote) {
+                r->failure = Error_of_kind(ERROR_CSV_UNBALANCED_QUOTE, 0);
+                r->lc = r->csv.quote_lc;
+            }
+        }
+    }
+    s->is_done = true;
+    return *r;
+}
+
+
+#endif /* PUSHSCAN_H_ */
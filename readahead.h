@@ -0,0 +1,243 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef READAHEAD_H_
+#define READAHEAD_H_
+
+/*
+
+  Reading a file descriptor (a pipe or socket, typically) on a
+  background thread, so that reading and decoding overlap: the reader
+  thread fills a ring of `nbuffers` buffers of READAHEAD_BUFSIZE bytes
+  each, the decoding thread takes the data out of them via
+  `ReadAhead_read`, which behaves like `read` (so that the callers'
+  EINTR/EOF/error handling stays the same). Memory use is fixed by
+  the number of buffers.
+
+  The buffers are handed over between the two threads through the
+  `head` and `tail` indices alone (single producer, single
+  consumer). The mutex and condition variable are only used by a
+  thread that has to wait because the ring is full or empty, and by
+  the other one to wake it up.
+
+  A read error or the end of the file ends the ring; the error is
+  returned once the data before it has been consumed.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "shorttypenames.h"
+#include "mem.h"
+
+
+#define READAHEAD_BUFSIZE (64 * 1024)
+#define READAHEAD_MAX_BUFFERS 64
+
+typedef struct {
+    u8 *buf;
+    size_t len;
+    bool is_final; // EOF or error instead of data
+    int error; // errno of a failure, 0 if none (EOF)
+} ReadAheadBuffer;
+
+typedef struct {
+    int fd; // borrowed
+    ReadAheadBuffer *buffers;
+    unsigned nbuffers;
+    // Buffers [head, tail) (modulo nbuffers) are filled, the others
+    // are free. Both are counters that only increase, written by one
+    // thread each, accessed atomically.
+    unsigned head; // written by the consumer
+    unsigned tail; // written by the reader thread
+    size_t pos; // consumer: bytes taken from buffers[head]
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool is_consumer_waiting; // accessed atomically
+    bool is_reader_waiting; // accessed atomically
+    bool is_stopping; // accessed atomically
+    pthread_t thread;
+} ReadAhead;
+
+
+// Wait to be woken up via `_ReadAhead_wake`, unless test(ra) shows
+// that there's no need (anymore); flag is the waiting thread's
+// `is_*_waiting`. The caller has to re-check its condition.
+static
+void _ReadAhead_wait(ReadAhead *ra, bool *flag,
+                     bool (*test)(ReadAhead *ra)) {
+    pthread_mutex_lock(&ra->mutex);
+    __atomic_store_n(flag, true, __ATOMIC_SEQ_CST);
+    if (! test(ra)) {
+        pthread_cond_wait(&ra->cond, &ra->mutex);
+    }
+    __atomic_store_n(flag, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ra->mutex);
+}
+
+// Wake up the other thread if it is waiting (or about to).
+static
+void _ReadAhead_wake(ReadAhead *ra, bool *flag) {
+    if (__atomic_load_n(flag, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ra->mutex);
+        pthread_cond_signal(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+    }
+}
+
+static
+bool _ReadAhead_reader_can_go_on(ReadAhead *ra) {
+    return (ra->tail - __atomic_load_n(&ra->head, __ATOMIC_SEQ_CST)
+            < ra->nbuffers)
+        || __atomic_load_n(&ra->is_stopping, __ATOMIC_SEQ_CST);
+}
+
+static
+bool _ReadAhead_consumer_can_go_on(ReadAhead *ra) {
+    return __atomic_load_n(&ra->tail, __ATOMIC_SEQ_CST) != ra->head;
+}
+
+static
+void *_ReadAhead_thread(void *arg) {
+    ReadAhead *ra = (ReadAhead *)arg;
+    // Only cancelled (by `ReadAhead_free`) while blocked in `read`
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (1) {
+        while (! _ReadAhead_reader_can_go_on(ra)) {
+            _ReadAhead_wait(ra, &ra->is_reader_waiting,
+                            _ReadAhead_reader_can_go_on);
+        }
+        if (__atomic_load_n(&ra->is_stopping, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        ReadAheadBuffer *b = &ra->buffers[ra->tail % ra->nbuffers];
+        ssize_t n;
+        do {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            n = read(ra->fd, b->buf, READAHEAD_BUFSIZE);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        } while ((n < 0) && (errno == EINTR));
+        if (n > 0) {
+            b->len = n;
+            b->is_final = false;
+        } else {
+            b->len = 0;
+            b->is_final = true;
+            b->error = (n < 0) ? errno : 0;
+        }
+        __atomic_store_n(&ra->tail, ra->tail + 1, __ATOMIC_SEQ_CST);
+        _ReadAhead_wake(ra, &ra->is_consumer_waiting);
+        if (n <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+  Start reading fd on a background thread with nbuffers buffers.
+  Returns NULL if the thread can't be started. fd is not owned, but
+  must stay open until `ReadAhead_free`.
+*/
+static
+ReadAhead *ReadAhead_new(int fd, unsigned nbuffers) {
+    if (nbuffers < 1) {
+        nbuffers = 1;
+    }
+    if (nbuffers > READAHEAD_MAX_BUFFERS) {
+        nbuffers = READAHEAD_MAX_BUFFERS;
+    }
+    ReadAhead *ra = (ReadAhead *)xmalloc(sizeof(ReadAhead));
+    *ra = (ReadAhead) {
+        .fd = fd,
+        .buffers = (ReadAheadBuffer *)xmalloc(
+            nbuffers * sizeof(ReadAheadBuffer)),
+        .nbuffers = nbuffers,
+        .head = 0,
+        .tail = 0,
+        .pos = 0,
+        .is_consumer_waiting = false,
+        .is_reader_waiting = false,
+        .is_stopping = false
+    };
+    for (unsigned i = 0; i < nbuffers; i++) {
+        ra->buffers[i] = (ReadAheadBuffer) {
+            .buf = (u8 *)xmalloc(READAHEAD_BUFSIZE)
+        };
+    }
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if (pthread_create(&ra->thread, NULL, _ReadAhead_thread, ra) != 0) {
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->mutex);
+        for (unsigned i = 0; i < nbuffers; i++) {
+            free(ra->buffers[i].buf);
+        }
+        free(ra->buffers);
+        free(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+/*
+  Copy up to len bytes into buf. Returns the number of bytes copied,
+  0 at the end of the file, or -1 with errno set on failure, like
+  `read`.
+*/
+static
+ssize_t ReadAhead_read(ReadAhead *ra, u8 *buf, size_t len) {
+    while (! _ReadAhead_consumer_can_go_on(ra)) {
+        _ReadAhead_wait(ra, &ra->is_consumer_waiting,
+                        _ReadAhead_consumer_can_go_on);
+    }
+    ReadAheadBuffer *b = &ra->buffers[ra->head % ra->nbuffers];
+    if (b->is_final) {
+        // stays there
+        if (b->error) {
+            errno = b->error;
+            return -1;
+        }
+        return 0;
+    }
+    size_t n = b->len - ra->pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, b->buf + ra->pos, n);
+    ra->pos += n;
+    if (ra->pos == b->len) {
+        ra->pos = 0;
+        __atomic_store_n(&ra->head, ra->head + 1, __ATOMIC_SEQ_CST);
+        _ReadAhead_wake(ra, &ra->is_reader_waiting);
+    }
+    return n;
+}
+
+// Stop the reader thread (even if it is blocked in `read`) and free
+// everything.
+static
+void ReadAhead_free(ReadAhead *ra) {
+    __atomic_store_n(&ra->is_stopping, true, __ATOMIC_SEQ_CST);
+    _ReadAhead_wake(ra, &ra->is_reader_waiting);
+    pthread_cancel(ra->thread);
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    for (unsigned i = 0; i < ra->nbuffers; i++) {
+        free(ra->buffers[i].buf);
+    }
+    free(ra->buffers);
+    free(ra);
+}
+
+
+#endif /* READAHEAD_H_ */
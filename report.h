@@ -0,0 +1,386 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef REPORT_H_
+#define REPORT_H_
+
+/*
+
+  Checking an input stream for valid UTF-8 and counting its line
+  separators (`Report_scan`), and printing the result as a JSON
+  record (`Report_print`). Input starting with a byte order mark is
+  checked in the encoding that the BOM indicates instead (see
+  encoding.h), the BOM itself is not counted as a character.
+  Optionally, UTF-8 input is also counted as CSV (see csv.h).
+
+  These are kept separate so that the scanning can happen on a worker
+  thread while the printing happens in the order of the inputs (see
+  batch.h).
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "shorttypenames.h"
+#include "String.h"
+#include "BufferedStream.h"
+#include "unicode.h"
+#include "encoding.h"
+#include "csv.h"
+#include "lineindex.h"
+#include "scankernels.h"
+#include "utf8dfa.h"
+#include "parallelscan.h"
+
+
+// Only use threads for at least this many bytes per thread
+#define THREADS_MIN_CHUNKSIZE (1024 * 1024)
+
+typedef enum {
+    UTF8_DECODER_SIMD, // utf8validate.h and get_unicodechar
+    UTF8_DECODER_DFA // utf8dfa.h
+} Utf8Decoder;
+
+// The decoder used unless chosen at runtime; can be set at compile
+// time, e.g. via `make CFLAGS=-DUTF8_DECODER_DEFAULT=UTF8_DECODER_DFA`.
+#ifndef UTF8_DECODER_DEFAULT
+#  define UTF8_DECODER_DEFAULT UTF8_DECODER_SIMD
+#endif
+
+// Where a scan of UTF-8 input continues (see checkpoint.h)
+typedef struct {
+    LineCount lc; // up to offset, not finished
+    u64 offset;
+    bool has_bom; // the input starts with a (UTF-8) BOM
+} ScanResume;
+
+typedef struct {
+    int threads; // for a file that is mapped into memory
+    Utf8Decoder decoder;
+    bool lazy_column; // only track the column for a failure report,
+                      // if the input can be reread
+    bool csv; // count UTF-8 input as CSV, too
+    LineIndexing *index; // if not NULL, collect the line starts of
+                         // UTF-8 input into it
+    const ScanResume *resume; // if not NULL, `in` continues the
+                              // input at resume->offset
+} ScanOptions;
+
+#define default_ScanOptions (ScanOptions) {     \
+        .threads = 1,                           \
+        .decoder = UTF8_DECODER_DEFAULT,        \
+        .lazy_column = true,                    \
+        .csv = false,                           \
+        .index = NULL,                          \
+        .resume = NULL                          \
+    }
+
+typedef struct {
+    LineCount lc; // up to the failure, if any; the column is only
+                  // meaningful in case of a failure
+    Error failure; // noError if the whole input was valid
+    u64 bytecount; // the number of bytes scanned (up to the failure)
+    Encoding encoding;
+    bool has_bom; // the encoding was detected from a BOM
+    bool is_csv; // csv was counted
+    CsvCount csv;
+} Report;
+
+static
+void Report_release(Report *r) {
+    Error_release(r->failure);
+}
+
+static inline
+bool Report_is_failure(const Report *r) {
+    return r->failure.str != NULL;
+}
+
+// Reconstruct r->lc.column for a failure at offset, by rereading the
+// (UTF-8) input backwards from there up to the last line separator,
+// or up to the start of the data at offset start (after the BOM).
+static
+void _Report_locate_column(Report *r, BufferedStream *in, u64 start,
+                           u64 offset) {
+#define RBUFSIZ (64 * 1024)
+    u8 *buf = (u8 *)xmalloc(RBUFSIZ);
+    int64_t column = 0;
+    u64 end = offset;
+    while (end > start) {
+        size_t n = (end - start < RBUFSIZ) ? end - start : RBUFSIZ;
+        u64 chunk_start = end - n;
+        Result(Unit) rr = BufferedStream_reread(in, chunk_start, buf, n);
+        if (Result_is_Err(rr)) {
+            // The position can't be determined; report that instead
+            Error_release(r->failure);
+            r->failure = rr.err; // moved
+            break;
+        }
+        int64_t c;
+        bool found = LineCount_tail_column(buf, n, &c);
+        column += c;
+        if (found) {
+            break;
+        }
+        end = chunk_start;
+    }
+    r->lc.column = column;
+    free(buf);
+#undef RBUFSIZ
+}
+
+// The rest of `Report_scan` for UTF-16 input; *offset is advanced
+// over the bytes scanned.
+static
+void _Report_scan_utf16(Report *r, BufferedStream *in, u64 *offset) {
+    LineCount *lc = &r->lc;
+    bool is_be = (r->encoding == ENCODING_UTF16BE);
+    utf8_valid_prefix_fn valid_prefix =
+        is_be ? utf16be_valid_prefix : utf16le_valid_prefix;
+    LineCount_valid_bytes_fn valid_bytes =
+        is_be ? LineCount_utf16be_valid_bytes : LineCount_utf16le_valid_bytes;
+    while (1) {
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Err(rs)) {
+            r->failure = rs.err; // moved
+            break;
+        }
+        size_t len = LSlice_length(rs.ok);
+        if (len == 0) {
+            LineCount_finish(lc);
+            break;
+        }
+        const u8 *p = LSlice_start(rs.ok);
+        size_t n = valid_prefix(p, len);
+        valid_bytes(lc, p, n);
+        BufferedStream_consume(in, n);
+        *offset += n;
+        if (n < len) {
+            // A character crossing the end of the buffer, or an error
+            Result(Option(u32)) c = get_utf16char(in, is_be);
+            if (Result_is_Err(c)) {
+                r->failure = c.err; // moved
+                break;
+            }
+            if (c.ok.is_none) {
+                LineCount_finish(lc);
+                break;
+            }
+            LineCount_char(lc, c.ok.value);
+            *offset += (c.ok.value > 0xFFFF) ? 4 : 2;
+        }
+    }
+}
+
+/*
+  Read `in` to the end or up to the first invalid character.
+
+  Unless opts->lazy_column is false or `in` can't be reread (a pipe),
+  the column isn't tracked while scanning, but reconstructed in case
+  of a failure (it is not part of the record otherwise).
+
+  UTF-16 input (detected from its BOM) is always scanned on the
+  calling thread, with the column tracked; `opts->decoder` and
+  `opts->csv` only apply to UTF-8. Counting as CSV, too, also happens
+  on the calling thread with the column tracked (the quoting state
+  at a position depends on all of the input before it); a quoted
+  field that is not closed at the end is a failure, reported at the
+  position of its opening quote. The same goes for collecting the
+  line starts into `opts->index` (which can't be combined with
+  `opts->csv`).
+
+  With `opts->resume` (see checkpoint.h), no BOM is looked for, and
+  the offsets (`bytecount`) include the part of the input before
+  `in`; the column is always tracked then.
+*/
+static UNUSED
+Report Report_scan(BufferedStream* in /* borrowed */,
+                   const ScanOptions *opts) {
+    Report r = { .lc = default_LineCount, .failure = noError,
+                 .bytecount = 0, .encoding = ENCODING_UTF8,
+                 .has_bom = false, .is_csv = false,
+                 .csv = default_CsvCount };
+    LineCount *lc = &r.lc;
+    u64 offset = 0; // of the next character
+    if (opts->resume) {
+        r.lc = opts->resume->lc;
+        offset = opts->resume->offset;
+        r.has_bom = opts->resume->has_bom;
+    } else {
+        Result(LSlice_u8) rs = BufferedStream_peek_atleast(in, BOM_MAXLEN);
+        if (Result_is_Err(rs)) {
+            r.failure = rs.err; // moved
+            return r;
+        }
+        size_t bomlen = Encoding_from_bom(LSlice_start(rs.ok),
+                                          LSlice_length(rs.ok),
+                                          &r.encoding);
+        BufferedStream_consume(in, bomlen);
+        offset = bomlen;
+        r.has_bom = (bomlen > 0);
+    }
+    if ((r.encoding == ENCODING_UTF16LE)
+        || (r.encoding == ENCODING_UTF16BE)) {
+        _Report_scan_utf16(&r, in, &offset);
+        r.bytecount = offset;
+        return r;
+    }
+    u64 data_start = offset;
+    bool is_dfa = (opts->decoder == UTF8_DECODER_DFA);
+    utf8_valid_prefix_fn valid_prefix =
+        is_dfa ? utf8dfa_valid_prefix : utf8_valid_prefix;
+    r.is_csv = opts->csv;
+    LineIndexing *ix = opts->index;
+    if (ix) {
+        LineIndexing_begin(ix, offset);
+    }
+    bool is_lazy = opts->lazy_column && BufferedStream_can_reread(in)
+        && ! (r.is_csv || ix || opts->resume);
+    int threads = (r.is_csv || ix) ? 1 : opts->threads;
+    if ((threads > 1)
+        && (in->stream_type == STREAM_TYPE_MMAPSTREAM)) {
+        // The whole file is in the buffer; scan as much of it as
+        // possible in parallel, the loop below does the rest.
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Ok(rs)) {
+            size_t len = LSlice_length(rs.ok);
+            size_t maxthreads = len / THREADS_MIN_CHUNKSIZE;
+            if ((size_t)threads > maxthreads) {
+                threads = (int)maxthreads;
+            }
+            if (threads > 1) {
+                size_t n = parallel_scan(LSlice_start(rs.ok), len,
+                                         threads, lc, valid_prefix);
+                BufferedStream_consume(in, n);
+                offset += n;
+            }
+        }
+        Result_release(rs);
+    }
+    while (1) {
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Err(rs)) {
+            r.failure = rs.err; // moved
+            break;
+        }
+        size_t len = LSlice_length(rs.ok);
+        if (len == 0) {
+            if (ix) {
+                LineIndexing_finish(ix, lc, offset);
+            }
+            LineCount_finish(lc);
+            break;
+        }
+        // Bulk-validate and count what is currently in the buffer
+        const u8 *p = LSlice_start(rs.ok);
+        size_t n = valid_prefix(p, len);
+        if (ix) {
+            LineCount_index_valid_bytes(lc, ix, p, n, offset);
+        } else if (r.is_csv) {
+            LineCount_csv_valid_bytes(lc, &r.csv, p, n);
+        } else if (is_lazy) {
+            LineCount_valid_bytes_nocolumn(lc, p, n);
+        } else {
+            LineCount_valid_bytes(lc, p, n);
+        }
+        BufferedStream_consume(in, n);
+        offset += n;
+        if (n < len) {
+            // A character crossing the end of the buffer, or an
+            // error; get_unicodechar reads on as needed and
+            // pinpoints errors.
+            u8 b1 = p[n];
+            size_t charlen = utf8_sequence_length(b1);
+            Result(Option(u32)) c =
+                is_dfa ? get_unicodechar_dfa(in) : get_unicodechar(in);
+            if (Result_is_Err(c)) {
+                r.failure = c.err; // moved
+                break;
+            }
+            if (c.ok.is_none) {
+                if (ix) {
+                    LineIndexing_finish(ix, lc, offset);
+                }
+                LineCount_finish(lc);
+                break;
+            }
+            u32 cp = utf8_counted_char(b1, c.ok.value);
+            if (r.is_csv) {
+                CsvCount_char(&r.csv, lc, cp);
+            }
+            if (ix) {
+                LineIndexing_char(ix, lc, cp, offset);
+            }
+            LineCount_char(lc, cp);
+            offset += charlen;
+        }
+    }
+    if (r.is_csv && ! Report_is_failure(&r)) {
+        CsvCount_finish(&r.csv);
+        if (r.csv.in_quote) {
+            r.failure = Error_of_kind(ERROR_CSV_UNBALANCED_QUOTE, 0);
+            r.lc = r.csv.quote_lc;
+        }
+    }
+    if (Report_is_failure(&r) && is_lazy) {
+        _Report_locate_column(&r, in, data_start, offset);
+    }
+    r.bytecount = offset;
+    return r;
+}
+
+/*
+  Print the record for r as one line to out. If
+  optional_quoted_path is not NULL, it is included as the "path"
+  field (it must already be quoted via `String_quote_js`).
+*/
+static UNUSED
+void Report_print(const Report *r, const char *optional_quoted_path,
+                  FILE *out) {
+    const LineCount *lc = &r->lc;
+    const char *pathsep = optional_quoted_path ? ", \"path\": " : "";
+    const char *path = optional_quoted_path ? optional_quoted_path : "";
+    // Only shown when detected from a BOM, so that the records for
+    // input without one stay the same
+    const char *encodingsep = r->has_bom ? ", \"encoding\": \"" : "";
+    const char *encoding = r->has_bom ? Encoding_name(r->encoding) : "";
+    const char *encodingend = r->has_bom ? "\"" : "";
+    if (Report_is_failure(r)) {
+        char buf[ERROR_MSGSIZ];
+        String msg = String_quote_js(
+            Error_format(&r->failure, buf, ERROR_MSGSIZ));
+        bool is_csv_failure = (ErrorKind_subsystem(r->failure.kind)
+                               == ERROR_SUBSYSTEM_CSV);
+        fprintf(out, "{ \"type\": \"%s\"%s%s%s%s%s, \"failure\": %s, \"character_position\": %li, \"line\": %li, \"column\": %li, \"line_questionable\": %s }\n",
+                is_csv_failure ? "csv-failure" : "utf-8-failure",
+                pathsep, path, encodingsep, encoding, encodingend,
+                msg.str,
+                lc->charcount + 1,
+                LineCount_lines(lc) + 1,
+                lc->column + 1,
+                LineCount_is_questionable(lc) ? "true" : "false");
+        String_release(msg);
+    } else {
+        fprintf(out, "{ \"type\": \"linecount\"%s%s%s%s%s, \"charcount\": %li, \"LFcount\": %li, \"CRcount\": %li, \"CRLFcount\": %li",
+                pathsep, path, encodingsep, encoding, encodingend,
+                lc->charcount, lc->LFcount, lc->CRcount, lc->CRLFcount);
+        if (r->is_csv) {
+            // The counts above split into row separators and line
+            // breaks in cells
+            const LineCount *cells = &r->csv.cells;
+            fprintf(out, ", \"rowcount\": %li, \"row_LFcount\": %li, \"row_CRcount\": %li, \"row_CRLFcount\": %li, \"cell_LFcount\": %li, \"cell_CRcount\": %li, \"cell_CRLFcount\": %li",
+                    CsvCount_rows(&r->csv, lc),
+                    lc->LFcount - cells->LFcount,
+                    lc->CRcount - cells->CRcount,
+                    lc->CRLFcount - cells->CRLFcount,
+                    cells->LFcount, cells->CRcount, cells->CRLFcount);
+        }
+        fprintf(out, " }\n");
+    }
+}
+
+
+#endif /* REPORT_H_ */
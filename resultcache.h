@@ -0,0 +1,358 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef RESULTCACHE_H_
+#define RESULTCACHE_H_
+
+/*
+
+  A persistent cache of the scan results of regular files, so that
+  files that haven't changed since they were checked last are
+  answered without reading them.
+
+  An entry is keyed by the file's identity and modification state
+  (device, inode, size and modification time in nanoseconds) and,
+  optionally, the fingerprint of its contents (see fingerprint.h),
+  which costs reading the first and last block; it holds what is
+  needed to print the `Report` again. Only results that don't depend
+  on the circumstances are stored: I/O failures are not.
+
+  The entries are files in a directory, spread over 256
+  subdirectories ("shards", to keep directories small), named after
+  the identity. They are replaced atomically (see
+  `write_file_atomically`), thus concurrent processes (and threads,
+  see batch.h) can use the same cache: an entry being read is either
+  the old or the new one, and the last writer wins. Entries that are
+  not used are evicted when a shard gets more than its part of
+  `max_entries`, the least recently used first (using an entry
+  updates its modification time).
+
+  A result is not stored if the file changed while it was scanned,
+  or if it was modified less than `RESULTCACHE_RACY_SECONDS` ago: a
+  change right after the scan might not change the modification time
+  (its resolution is coarser than nanoseconds on most file systems),
+  and the entry would then be taken for the new contents.
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h> /* PATH_MAX */
+#include <time.h> /* clock_gettime */
+#include <sys/stat.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* UNUSED, WARN_ */
+#include "mem.h"
+#include "io.h" /* put_u64_le, get_u64_le, pread_full,
+                   write_file_atomically */
+#include "fingerprint.h"
+#include "Error.h"
+#include "linecount.h"
+#include "csv.h"
+#include "report.h"
+
+
+#define RESULTCACHE_MAGIC "ULSRES\0\1"
+#define RESULTCACHE_MAGICLEN 8
+#define RESULTCACHE_NFIELDS 21
+#define RESULTCACHE_ENTRYSIZ (RESULTCACHE_MAGICLEN + 8 * RESULTCACHE_NFIELDS)
+#define RESULTCACHE_NSHARDS 256
+#define RESULTCACHE_DEFAULT_MAX_ENTRIES 100000
+#define RESULTCACHE_RACY_SECONDS 2
+
+// The environment variable to set the cache directory from
+#define RESULTCACHE_ENVVAR "UTF8_LINESEPARATOR_CACHE"
+
+typedef struct {
+    const char *dir;
+    bool use_fingerprint; // also key on the fingerprint
+    bool verify; // scan anyway, warn if the entry differs
+    u64 max_entries; // about (evicting per shard)
+} ResultCache;
+
+// The flags field of an entry
+#define RESULTCACHE_HAS_FINGERPRINT 1
+#define RESULTCACHE_IS_CSV 2
+#define RESULTCACHE_HAS_BOM 4
+#define RESULTCACHE_ROW_PENDING 8
+
+// Whether r can be stored: the result of the contents alone.
+static
+bool _ResultCache_is_cacheable(const Report *r) {
+    if (! Report_is_failure(r)) {
+        return true;
+    }
+    ErrorSubsystem sub = ErrorKind_subsystem(r->failure.kind);
+    return (sub == ERROR_SUBSYSTEM_UTF8) || (sub == ERROR_SUBSYSTEM_UTF16)
+        || (sub == ERROR_SUBSYSTEM_CSV);
+}
+
+// The path of the entry for the file with the status st, in buf (of
+// size PATH_MAX); with is_shard, only the shard's directory. Returns
+// false if it doesn't fit.
+static
+bool _ResultCache_path(const ResultCache *c, const struct stat *st,
+                       bool is_shard, char *buf) {
+    u64 dev = st->st_dev, ino = st->st_ino;
+    unsigned shard = (unsigned)((ino ^ (ino >> 8) ^ dev)
+                                % RESULTCACHE_NSHARDS);
+    int n = is_shard
+        ? snprintf(buf, PATH_MAX, "%s/%02x", c->dir, shard)
+        : snprintf(buf, PATH_MAX, "%s/%02x/%" PRIx64 "-%" PRIx64, c->dir,
+                   shard, dev, ino);
+    return (n >= 0) && (n < PATH_MAX);
+}
+
+/*
+  Look up the result for the file fd, with the status st (taken
+  before any reading), when scanned as CSV or not (is_csv). Returns
+  true and sets *r if there is a matching entry (r is then to be
+  released as usual).
+*/
+static UNUSED
+bool ResultCache_lookup(const ResultCache *c, int fd, const struct stat *st,
+                        bool is_csv, Report *r) {
+    char path[PATH_MAX];
+    if (! (S_ISREG(st->st_mode) && _ResultCache_path(c, st, false, path))) {
+        return false;
+    }
+    int efd = open(path, O_RDONLY);
+    if (efd < 0) {
+        return false;
+    }
+    u8 buf[RESULTCACHE_ENTRYSIZ + 1];
+    ssize_t n = pread_full(efd, buf, sizeof(buf), 0);
+    close(efd);
+    if ((n != RESULTCACHE_ENTRYSIZ)
+        || memcmp(buf, RESULTCACHE_MAGIC, RESULTCACHE_MAGICLEN)) {
+        return false;
+    }
+    u64 f[RESULTCACHE_NFIELDS];
+    for (int i = 0; i < RESULTCACHE_NFIELDS; i++) {
+        f[i] = get_u64_le(buf + RESULTCACHE_MAGICLEN + 8 * i);
+    }
+    u64 flags = f[5];
+    if ((f[0] != (u64)st->st_dev) || (f[1] != (u64)st->st_ino)
+        || (f[2] != (u64)st->st_size)
+        || (f[3] != (u64)st->st_mtim.tv_sec)
+        || (f[4] != (u64)st->st_mtim.tv_nsec)
+        || (!! (flags & RESULTCACHE_IS_CSV) != is_csv)
+        || (c->use_fingerprint && ! (flags & RESULTCACHE_HAS_FINGERPRINT))
+        || (f[9] > ENCODING_UTF16BE)) {
+        return false;
+    }
+    if (c->use_fingerprint) {
+        u64 head_hash, tail_hash;
+        if (! (fingerprint_file(fd, st->st_size, &head_hash, &tail_hash)
+               && (head_hash == f[6]) && (tail_hash == f[7]))) {
+            return false;
+        }
+    }
+    Error failure = noError;
+    if (f[10] != ERROR_NONE) {
+        ErrorSubsystem sub = ErrorKind_subsystem((ErrorKind)f[10]);
+        if (! ((sub == ERROR_SUBSYSTEM_UTF8) || (sub == ERROR_SUBSYSTEM_UTF16)
+               || (sub == ERROR_SUBSYSTEM_CSV))) {
+            // not written by us
+            return false;
+        }
+        failure = Error_of_kind((ErrorKind)f[10], f[11]);
+    }
+    *r = (Report) {
+        .lc = {
+            .charcount = f[12],
+            .LFcount = f[13],
+            .CRcount = f[14],
+            .CRLFcount = f[15],
+            .column = f[16],
+            .last_was_CR = f[17]
+        },
+        .failure = failure,
+        .bytecount = f[8],
+        .encoding = (Encoding)f[9],
+        .has_bom = flags & RESULTCACHE_HAS_BOM,
+        .is_csv = is_csv,
+        .csv = default_CsvCount
+    };
+    r->csv.cells.LFcount = f[18];
+    r->csv.cells.CRcount = f[19];
+    r->csv.cells.CRLFcount = f[20];
+    r->csv.row_pending = flags & RESULTCACHE_ROW_PENDING;
+    // Used now; failure doesn't matter
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return true;
+}
+
+// Remove the least recently used entries of the shard at shardpath
+// while there are more than max.
+static
+void _ResultCache_evict(const char *shardpath, u64 max) {
+    DIR *d = opendir(shardpath);
+    if (! d) {
+        return;
+    }
+    char path[PATH_MAX];
+    while (1) {
+        u64 count = 0;
+        struct timespec oldest_time = { 0, 0 };
+        char oldest[NAME_MAX + 1] = "";
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            // (temporary files are not counted)
+            if ((e->d_name[0] == '.') || strchr(e->d_name, '.')) {
+                continue;
+            }
+            count++;
+            struct stat st;
+            if (fstatat(dirfd(d), e->d_name, &st, 0) < 0) {
+                continue;
+            }
+            if ((! oldest[0])
+                || (st.st_mtim.tv_sec < oldest_time.tv_sec)
+                || ((st.st_mtim.tv_sec == oldest_time.tv_sec)
+                    && (st.st_mtim.tv_nsec < oldest_time.tv_nsec))) {
+                oldest_time = st.st_mtim;
+                strcpy(oldest, e->d_name);
+            }
+        }
+        if ((count <= max) || ! oldest[0]) {
+            break;
+        }
+        int n = snprintf(path, PATH_MAX, "%s/%s", shardpath, oldest);
+        if ((n < 0) || (n >= PATH_MAX) || (unlink(path) < 0)) {
+            // (another process may have removed it already)
+            if (errno != ENOENT) {
+                break;
+            }
+        }
+        rewinddir(d);
+    }
+    closedir(d);
+}
+
+/*
+  Store r, the result of scanning the file fd with the status st
+  (taken before scanning it), unless it is not cacheable or the file
+  is too new or has changed (see above). Returns 0, or the errno value
+  of the failure to store it.
+*/
+static UNUSED
+int ResultCache_store(const ResultCache *c, int fd, const struct stat *st,
+                      const Report *r) {
+    if (! (S_ISREG(st->st_mode) && _ResultCache_is_cacheable(r))) {
+        return 0;
+    }
+    struct timespec now;
+    struct stat st2;
+    if ((clock_gettime(CLOCK_REALTIME, &now) < 0)
+        || (now.tv_sec - st->st_mtim.tv_sec < RESULTCACHE_RACY_SECONDS)
+        || (fstat(fd, &st2) < 0) || (st2.st_size != st->st_size)
+        || (st2.st_mtim.tv_sec != st->st_mtim.tv_sec)
+        || (st2.st_mtim.tv_nsec != st->st_mtim.tv_nsec)) {
+        return 0;
+    }
+    char path[PATH_MAX];
+    char shardpath[PATH_MAX];
+    if (! (_ResultCache_path(c, st, false, path)
+           && _ResultCache_path(c, st, true, shardpath))) {
+        return ENAMETOOLONG;
+    }
+    u64 head_hash = 0, tail_hash = 0;
+    if (c->use_fingerprint
+        && ! fingerprint_file(fd, st->st_size, &head_hash, &tail_hash)) {
+        return errno ? errno : EIO;
+    }
+    const LineCount *lc = &r->lc;
+    const LineCount *cells = &r->csv.cells;
+    u64 flags = (c->use_fingerprint ? RESULTCACHE_HAS_FINGERPRINT : 0)
+        | (r->is_csv ? RESULTCACHE_IS_CSV : 0)
+        | (r->has_bom ? RESULTCACHE_HAS_BOM : 0)
+        | (r->csv.row_pending ? RESULTCACHE_ROW_PENDING : 0);
+    u64 f[RESULTCACHE_NFIELDS] = {
+        st->st_dev, st->st_ino, st->st_size,
+        st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+        flags, head_hash, tail_hash,
+        r->bytecount, r->encoding, r->failure.kind, r->failure.context,
+        lc->charcount, lc->LFcount, lc->CRcount, lc->CRLFcount,
+        lc->column, lc->last_was_CR,
+        cells->LFcount, cells->CRcount, cells->CRLFcount
+    };
+    u8 buf[RESULTCACHE_ENTRYSIZ];
+    memcpy(buf, RESULTCACHE_MAGIC, RESULTCACHE_MAGICLEN);
+    for (int i = 0; i < RESULTCACHE_NFIELDS; i++) {
+        put_u64_le(buf + RESULTCACHE_MAGICLEN + 8 * i, f[i]);
+    }
+    int err = write_file_atomically(path, buf, RESULTCACHE_ENTRYSIZ);
+    if (err == ENOENT) {
+        // Create the directories on first use
+        if (((mkdir(c->dir, 0777) < 0) && (errno != EEXIST))
+            || ((mkdir(shardpath, 0777) < 0) && (errno != EEXIST))) {
+            return errno;
+        }
+        err = write_file_atomically(path, buf, RESULTCACHE_ENTRYSIZ);
+    }
+    if (err) {
+        return err;
+    }
+    u64 max = c->max_entries / RESULTCACHE_NSHARDS;
+    _ResultCache_evict(shardpath, max ? max : 1);
+    return 0;
+}
+
+// Whether a and b would print the same.
+static UNUSED
+bool ResultCache_reports_equal(const Report *a, const Report *b) {
+    const LineCount *la = &a->lc, *lb = &b->lc;
+    bool is_failure = Report_is_failure(a);
+    return (is_failure == Report_is_failure(b))
+        && ((! is_failure) || ((a->failure.kind == b->failure.kind)
+                               && (a->failure.context == b->failure.context)
+                               && (la->column == lb->column)))
+        && (a->encoding == b->encoding) && (a->has_bom == b->has_bom)
+        && (la->charcount == lb->charcount)
+        && (la->LFcount == lb->LFcount) && (la->CRcount == lb->CRcount)
+        && (la->CRLFcount == lb->CRLFcount)
+        && (a->is_csv == b->is_csv)
+        && ((! a->is_csv)
+            || ((CsvCount_rows(&a->csv, la) == CsvCount_rows(&b->csv, lb))
+                && (a->csv.cells.LFcount == b->csv.cells.LFcount)
+                && (a->csv.cells.CRcount == b->csv.cells.CRcount)
+                && (a->csv.cells.CRLFcount == b->csv.cells.CRLFcount)));
+}
+
+/*
+  `ResultCache_store` r, the result of scanning the file fd at path
+  (with the status st taken before), warning if that fails; in verify
+  mode, first warn if the entry there (if any) differs from r.
+*/
+static UNUSED
+void ResultCache_update(const ResultCache *c, int fd, const struct stat *st,
+                        const Report *r, const char *path) {
+    if (c->verify) {
+        Report cached;
+        if (ResultCache_lookup(c, fd, st, r->is_csv, &cached)) {
+            if (! ResultCache_reports_equal(&cached, r)) {
+                WARN_("--verify-cache: the cached result for '%s' is wrong",
+                      path);
+            }
+            Report_release(&cached);
+        }
+    }
+    int err = ResultCache_store(c, fd, st, r);
+    if (err) {
+        Error e = Error_errno(err);
+        WARN_("--cache: can't store the result for '%s': %s", path,
+              Error_message(e));
+    }
+}
+
+#endif /* RESULTCACHE_H_ */
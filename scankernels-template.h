@@ -0,0 +1,633 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+/*
+
+  The byte scanning kernels, written against the Simd64 interface.
+
+  This file has no include guard: scankernels.h includes it once per
+  instruction set level, with SCANKERNEL_LEVEL defined to the level's
+  suffix in Simd64.h (e.g. `avx2`); the functions get that suffix
+  appended to their names (e.g. `utf8_valid_prefix_avx2`), and carry
+  the level's target attribute.
+
+ */
+
+#ifndef SCANKERNEL_LEVEL
+#  error "SCANKERNEL_LEVEL must be defined, include scankernels.h instead"
+#endif
+
+#define KERNEL(name) XCAT(name##_, SCANKERNEL_LEVEL)
+#define SIMD64 XCAT(Simd64_, SCANKERNEL_LEVEL)
+#define SIMD(name) XCAT(SIMD64, _##name)
+#define TARGET XCAT(SIMD64_TARGET_, SCANKERNEL_LEVEL)
+
+
+/*
+  The vectorized variant works on blocks of 64 bytes, computing bit
+  masks of the byte classes, and from those the positions where a
+  continuation byte is required:
+
+    need = (leads << 1) | (3-and-4-byte leads << 2) | (4-byte leads << 3)
+
+  The block is valid if `need` matches the positions of the actual
+  continuation bytes exactly, and there are no bytes >= 0xF5 and no
+  0xF4 followed by a byte >= 0x90. Requirements reaching past the end
+  of the block are carried into the next one.
+
+  On a block with an error (or for the last, partial block), we go
+  back to the last known character boundary and let the byte-wise
+  variant find the exact end of the valid data.
+*/
+static TARGET
+size_t KERNEL(utf8_valid_prefix)(const u8 *p, size_t len) {
+    size_t i = 0;
+    // All of [p, p+ok) is known to be valid complete characters
+    size_t ok = 0;
+    u64 carry_need = 0;
+    u64 carry_F4 = 0;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v);
+        if ((high | carry_need) == 0) {
+            // ASCII only
+            i += 64;
+            ok = i;
+            continue;
+        }
+        u64 ge_C0 = SIMD(sgt_mask)(v, 0xBF) & high;
+        u64 ge_E0 = SIMD(sgt_mask)(v, 0xDF) & high;
+        u64 ge_F0 = SIMD(sgt_mask)(v, 0xEF) & high;
+        u64 ge_F4 = SIMD(sgt_mask)(v, 0xF3) & high;
+        u64 ge_F5 = SIMD(sgt_mask)(v, 0xF4) & high;
+        u64 ge_90 = SIMD(sgt_mask)(v, 0x8F) & high;
+        u64 cont = high & ~ge_C0;
+        u64 is_F4 = ge_F4 & ~ge_F5;
+
+        u64 need = (ge_C0 << 1) | (ge_E0 << 2) | (ge_F0 << 3) | carry_need;
+        u64 err = (need ^ cont)
+            | ge_F5
+            | (((is_F4 << 1) | carry_F4) & ge_90);
+        if (err) {
+            break;
+        }
+        carry_need = (ge_C0 >> 63) | (ge_E0 >> 62) | (ge_F0 >> 61);
+        carry_F4 = is_F4 >> 63;
+        if (carry_need) {
+            // The last character is incomplete, it starts at the last
+            // lead byte
+            ok = i + u64_highest_bit(ge_C0);
+        } else {
+            ok = i + 64;
+        }
+        i += 64;
+    }
+    return ok + utf8_valid_prefix_bytewise(p + ok, len - ok);
+}
+
+
+/*
+  Count the characters in [p, p+len), which must consist of complete
+  characters that have been validated (e.g. via `utf8_valid_prefix`).
+
+  Works on blocks of 64 bytes: with `cr` and `lf` being the bit masks
+  of the CR and LF bytes, and `crs` the CR positions moved to the
+  position of the byte that follows them (including a CR carried over
+  from before the block in bit 0),
+
+    CRLF pairs are   crs & lf
+    lone CRs are     crs & ~lf
+
+  and since CR and LF are ASCII, the byte following them always
+  starts the next character.
+
+  With track_column false, `column` is left alone in the block loop
+  (for callers that reconstruct it when needed, see
+  `LineCount_tail_column`).
+*/
+static inline __attribute__((always_inline)) TARGET
+void KERNEL(_LineCount_valid_bytes)(LineCount *lc, const u8 *p, size_t len,
+                                    bool track_column) {
+    size_t i = 0;
+    u64 carry_CR = lc->last_was_CR;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v);
+        // character starts: everything except continuation bytes
+        u64 starts = high ? ~(high & ~SIMD(sgt_mask)(v, 0xBF)) : ~(u64)0;
+        u64 cr = SIMD(eq_mask)(v, '\r');
+        u64 lf = SIMD(eq_mask)(v, '\n');
+
+        lc->charcount += u64_popcount(starts);
+        if (cr | lf | carry_CR) {
+            u64 crs = (cr << 1) | carry_CR;
+            int nCRLF = u64_popcount(crs & lf);
+            lc->CRLFcount += nCRLF;
+            lc->LFcount += u64_popcount(lf) - nCRLF;
+            lc->CRcount += u64_popcount(crs & ~lf);
+            carry_CR = cr >> 63;
+            if (track_column) {
+                u64 seps = cr | lf;
+                if (seps) {
+                    int last = u64_highest_bit(seps);
+                    lc->column = (last == 63)
+                        ? 0 : u64_popcount(starts >> (last + 1));
+                } else {
+                    lc->column += u64_popcount(starts);
+                }
+            }
+        } else if (track_column) {
+            lc->column += u64_popcount(starts);
+        }
+        i += 64;
+    }
+    lc->last_was_CR = carry_CR;
+
+    for (; i < len; i++) {
+        u8 b = p[i];
+        if ((b & 0b11000000) != 0b10000000) {
+            // Only the lead byte matters for the counting
+            LineCount_char(lc, b);
+        }
+    }
+}
+
+static TARGET
+void KERNEL(LineCount_valid_bytes)(LineCount *lc, const u8 *p, size_t len) {
+    KERNEL(_LineCount_valid_bytes)(lc, p, len, true);
+}
+
+static TARGET
+void KERNEL(LineCount_valid_bytes_nocolumn)(LineCount *lc, const u8 *p,
+                                            size_t len) {
+    KERNEL(_LineCount_valid_bytes)(lc, p, len, false);
+}
+
+
+/*
+  `LineCount_valid_bytes`, also adding the line starts to ix, with
+  offset being the position of p in the input. In a block with
+  separators, the line starts are (with `crs` as above)
+
+    after an LF    lf & ~crs, plus 1
+    after a CRLF   lf & crs, plus 1
+    after a CR     crs & ~lf
+
+  (the latter is where the following character starts; for a CR at
+  the end of a block, that is in the next one).
+*/
+static TARGET
+void KERNEL(LineCount_index_valid_bytes)(LineCount *lc, LineIndexing *ix,
+                                         const u8 *p, size_t len,
+                                         u64 offset) {
+    size_t i = 0;
+    u64 carry_CR = lc->last_was_CR;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v);
+        u64 starts = high ? ~(high & ~SIMD(sgt_mask)(v, 0xBF)) : ~(u64)0;
+        u64 cr = SIMD(eq_mask)(v, '\r');
+        u64 lf = SIMD(eq_mask)(v, '\n');
+
+        lc->charcount += u64_popcount(starts);
+        if (cr | lf | carry_CR) {
+            u64 crs = (cr << 1) | carry_CR;
+            u64 crlf = crs & lf;
+            int nCRLF = u64_popcount(crlf);
+            lc->CRLFcount += nCRLF;
+            lc->LFcount += u64_popcount(lf) - nCRLF;
+            lc->CRcount += u64_popcount(crs & ~lf);
+            carry_CR = cr >> 63;
+            LineIndexing_add_mask(ix, LINESEPARATOR_LF, lf & ~crlf,
+                                  offset + i + 1);
+            LineIndexing_add_mask(ix, LINESEPARATOR_CRLF, crlf,
+                                  offset + i + 1);
+            LineIndexing_add_mask(ix, LINESEPARATOR_CR, crs & ~lf,
+                                  offset + i);
+            u64 seps = cr | lf;
+            if (seps) {
+                int last = u64_highest_bit(seps);
+                lc->column = (last == 63)
+                    ? 0 : u64_popcount(starts >> (last + 1));
+            } else {
+                lc->column += u64_popcount(starts);
+            }
+        } else {
+            lc->column += u64_popcount(starts);
+        }
+        i += 64;
+    }
+    lc->last_was_CR = carry_CR;
+
+    for (; i < len; i++) {
+        u8 b = p[i];
+        if ((b & 0b11000000) != 0b10000000) {
+            LineIndexing_char(ix, lc, b, offset + i);
+            LineCount_char(lc, b);
+        }
+    }
+}
+
+
+// Count the first n (0..64) positions of a block, given its masks,
+// into lc, as `_LineCount_valid_bytes` does for a whole block. A CR
+// in the last of the n positions stays pending.
+static inline __attribute__((always_inline)) TARGET
+void KERNEL(_LineCount_block)(LineCount *lc, u64 starts, u64 cr, u64 lf,
+                              int n, bool track_column) {
+    if (n == 0) {
+        return;
+    }
+    u64 mask = (n == 64) ? ~(u64)0 : ((u64)1 << n) - 1;
+    starts &= mask;
+    cr &= mask;
+    lf &= mask;
+    lc->charcount += u64_popcount(starts);
+    u64 crs = ((cr << 1) | lc->last_was_CR) & mask;
+    int nCRLF = u64_popcount(crs & lf);
+    lc->CRLFcount += nCRLF;
+    lc->LFcount += u64_popcount(lf) - nCRLF;
+    lc->CRcount += u64_popcount(crs & ~lf);
+    lc->last_was_CR = (cr >> (n - 1)) & 1;
+    if (track_column) {
+        u64 seps = cr | lf;
+        if (seps) {
+            int last = u64_highest_bit(seps);
+            lc->column = (last == 63) ? 0 : u64_popcount(starts >> (last + 1));
+        } else {
+            lc->column += u64_popcount(starts);
+        }
+    }
+}
+
+/*
+  Counting as `LineCount_valid_bytes` does, plus the CSV structure
+  (see csv.h): the positions inside quoted fields are the prefix XOR
+  of the quote positions, inverted if the block starts inside one.
+  The separators there are counted into csv->cells. If a field is
+  still open at the end of a block (or may be), the count before its
+  opening quote (the last quote in the block that opens, and doesn't
+  directly follow a closing one) is kept for a failure report.
+*/
+static TARGET
+void KERNEL(LineCount_csv_valid_bytes)(LineCount *lc, CsvCount *csv,
+                                       const u8 *p, size_t len) {
+    size_t i = 0;
+    u64 in_quote = csv->in_quote ? ~(u64)0 : 0;
+    u64 after_close = csv->after_close;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v);
+        u64 starts = high ? ~(high & ~SIMD(sgt_mask)(v, 0xBF)) : ~(u64)0;
+        u64 cr = SIMD(eq_mask)(v, '\r');
+        u64 lf = SIMD(eq_mask)(v, '\n');
+        u64 q = SIMD(eq_mask)(v, '"');
+
+        if ((cr | lf | q | in_quote | lc->last_was_CR) == 0) {
+            int n = u64_popcount(starts);
+            lc->charcount += n;
+            lc->column += n;
+            csv->row_pending = true;
+            after_close = 0;
+            i += 64;
+            continue;
+        }
+        u64 inside = 0;
+        if (q | in_quote) {
+            inside = u64_prefix_xor(q) ^ in_quote;
+            if (((cr | lf) & inside) | csv->cells.last_was_CR) {
+                KERNEL(_LineCount_block)(&csv->cells, 0, cr & inside,
+                                         lf & inside, 64, false);
+            }
+            in_quote = (inside >> 63) ? ~(u64)0 : 0;
+            u64 closing = q & ~inside;
+            u64 opening = q & inside & ~((closing << 1) | after_close);
+            after_close = closing >> 63;
+            // (a field closed at the end of the block may go on with
+            // a doubled quote at the start of the next one)
+            if ((in_quote | after_close) && opening) {
+                csv->quote_lc = *lc;
+                KERNEL(_LineCount_block)(&csv->quote_lc, starts, cr, lf,
+                                         u64_highest_bit(opening), true);
+            }
+        } else {
+            after_close = 0;
+        }
+        KERNEL(_LineCount_block)(lc, starts, cr, lf, 64, true);
+        u64 rowseps = (cr | lf) & ~inside;
+        if (rowseps) {
+            int last = u64_highest_bit(rowseps);
+            csv->row_pending = (last < 63) && (starts >> (last + 1));
+        } else {
+            csv->row_pending = true;
+        }
+        i += 64;
+    }
+    csv->in_quote = (in_quote != 0);
+    csv->after_close = after_close;
+
+    for (; i < len; i++) {
+        u8 b = p[i];
+        if ((b & 0b11000000) != 0b10000000) {
+            CsvCount_char(csv, lc, b);
+            LineCount_char(lc, b);
+        }
+    }
+}
+
+
+
+/*
+  UTF-16 in either byte order: of the 32 code units in a block of 64
+  bytes, the bytes holding their high halves are at the odd positions
+  (little endian) or the even ones (big endian), `hi_pos`. Only those
+  bytes are needed to find the surrogates (0xD8-0xDB leading,
+  0xDC-0xDF trailing):
+
+    valid if   (leads << 2) | carried lead == trails
+
+  A lead in the last code unit of the block is carried into the next
+  one. As with UTF-8, on a block with an error (or for the last,
+  partial block), the unit-wise variant finds the exact end of the
+  valid data, from the last known character boundary.
+*/
+static inline __attribute__((always_inline)) TARGET
+size_t KERNEL(_utf16_valid_prefix)(const u8 *p, size_t len, bool is_be) {
+    const u64 hi_pos = is_be ? 0x5555555555555555 : 0xAAAAAAAAAAAAAAAA;
+    size_t i = 0;
+    // All of [p, p+ok) is known to be valid complete characters
+    size_t ok = 0;
+    u64 carry_lead = 0;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 ge_D8 = SIMD(sgt_mask)(v, 0xD7) & SIMD(high_mask)(v) & hi_pos;
+        if ((ge_D8 | carry_lead) == 0) {
+            // no surrogates
+            i += 64;
+            ok = i;
+            continue;
+        }
+        u64 ge_DC = SIMD(sgt_mask)(v, 0xDB) & ge_D8;
+        u64 ge_E0 = SIMD(sgt_mask)(v, 0xDF) & ge_D8;
+        u64 lead = ge_D8 & ~ge_DC;
+        u64 trail = ge_DC & ~ge_E0;
+        if (((lead << 2) | carry_lead) != trail) {
+            break;
+        }
+        // lands on the high half of the first unit of the next block
+        carry_lead = lead >> 62;
+        ok = carry_lead ? i + 62 : i + 64;
+        i += 64;
+    }
+    return ok + utf16_valid_prefix_unitwise(p + ok, len - ok, is_be);
+}
+
+static TARGET
+size_t KERNEL(utf16le_valid_prefix)(const u8 *p, size_t len) {
+    return KERNEL(_utf16_valid_prefix)(p, len, false);
+}
+
+static TARGET
+size_t KERNEL(utf16be_valid_prefix)(const u8 *p, size_t len) {
+    return KERNEL(_utf16_valid_prefix)(p, len, true);
+}
+
+/*
+  Count the characters in the validated UTF-16 data [p, p+len). Same
+  approach as `_LineCount_valid_bytes`, with the masks for the code
+  units at the positions of their low bytes (`lo_pos`): a CR or LF
+  is the low byte with a zero high byte, and every unit except a
+  trailing surrogate starts a character. The column is always
+  tracked (`LineCount_tail_column` only knows UTF-8).
+*/
+static inline __attribute__((always_inline)) TARGET
+void KERNEL(_LineCount_utf16_valid_bytes)(LineCount *lc, const u8 *p,
+                                          size_t len, bool is_be) {
+    const u64 hi_pos = is_be ? 0x5555555555555555 : 0xAAAAAAAAAAAAAAAA;
+    const u64 lo_pos = ~hi_pos;
+    // bit of the first unit's low byte
+    const u64 first_lo = is_be ? 2 : 1;
+    size_t i = 0;
+    u64 carry_CR = lc->last_was_CR ? first_lo : 0;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v) & hi_pos;
+        u64 trail = 0;
+        if (high) {
+            trail = SIMD(sgt_mask)(v, 0xDB) & ~SIMD(sgt_mask)(v, 0xDF)
+                & high;
+        }
+        u64 zero = SIMD(eq_mask)(v, 0) & hi_pos;
+        // moved from the high to the low byte positions
+        u64 trail_lo = is_be ? trail << 1 : trail >> 1;
+        u64 zero_lo = is_be ? zero << 1 : zero >> 1;
+        u64 starts = lo_pos & ~trail_lo;
+        u64 cr = SIMD(eq_mask)(v, '\r') & lo_pos & zero_lo;
+        u64 lf = SIMD(eq_mask)(v, '\n') & lo_pos & zero_lo;
+
+        lc->charcount += u64_popcount(starts);
+        if (cr | lf | carry_CR) {
+            u64 crs = (cr << 2) | carry_CR;
+            int nCRLF = u64_popcount(crs & lf);
+            lc->CRLFcount += nCRLF;
+            lc->LFcount += u64_popcount(lf) - nCRLF;
+            lc->CRcount += u64_popcount(crs & ~lf);
+            carry_CR = cr >> 62;
+            u64 seps = cr | lf;
+            if (seps) {
+                int last = u64_highest_bit(seps);
+                lc->column = (last >= 62)
+                    ? 0 : u64_popcount(starts >> (last + 1));
+            } else {
+                lc->column += u64_popcount(starts);
+            }
+        } else {
+            lc->column += u64_popcount(starts);
+        }
+        i += 64;
+    }
+    lc->last_was_CR = (carry_CR != 0);
+    LineCount_utf16_valid_unitwise(lc, p + i, len - i, is_be);
+}
+
+static TARGET
+void KERNEL(LineCount_utf16le_valid_bytes)(LineCount *lc, const u8 *p,
+                                           size_t len) {
+    KERNEL(_LineCount_utf16_valid_bytes)(lc, p, len, false);
+}
+
+static TARGET
+void KERNEL(LineCount_utf16be_valid_bytes)(LineCount *lc, const u8 *p,
+                                           size_t len) {
+    KERNEL(_LineCount_utf16_valid_bytes)(lc, p, len, true);
+}
+
+
+
+/*
+  Latin-1 or Windows-1252 to UTF-8, counting the characters (every
+  byte is one) in the same pass. Blocks without high bytes are copied
+  as they are; otherwise every 8 bytes with high bytes are expanded
+  via `latin1_expand8`, except those with Windows-1252 bytes in
+  0x80-0x9F, which are encoded byte-wise. out must have room for
+  TRANSCODE_UTF8_MAXLEN(len) bytes; returns the number of bytes
+  written to it.
+*/
+static inline __attribute__((always_inline)) TARGET
+size_t KERNEL(_latin1_to_utf8)(LineCount *lc, const u8 *p, size_t len,
+                               u8 *out, bool is_windows1252) {
+    const u8 (*shuffles)[16] = Simd64_latin1_shuffles();
+    size_t i = 0;
+    size_t o = 0;
+    u64 carry_CR = lc->last_was_CR;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v);
+        u64 cr = SIMD(eq_mask)(v, '\r');
+        u64 lf = SIMD(eq_mask)(v, '\n');
+
+        lc->charcount += 64;
+        if (cr | lf | carry_CR) {
+            u64 crs = (cr << 1) | carry_CR;
+            int nCRLF = u64_popcount(crs & lf);
+            lc->CRLFcount += nCRLF;
+            lc->LFcount += u64_popcount(lf) - nCRLF;
+            lc->CRcount += u64_popcount(crs & ~lf);
+            carry_CR = cr >> 63;
+            u64 seps = cr | lf;
+            if (seps) {
+                lc->column = 63 - u64_highest_bit(seps);
+            } else {
+                lc->column += 64;
+            }
+        } else {
+            lc->column += 64;
+        }
+
+        if (high == 0) {
+            memcpy(out + o, p + i, 64);
+            o += 64;
+        } else {
+            u64 c1 = is_windows1252
+                ? high & ~SIMD(sgt_mask)(v, 0x9F) : 0;
+            for (int g = 0; g < 64; g += 8) {
+                u8 h = (u8)(high >> g);
+                if ((u8)(c1 >> g)) {
+                    for (int k = 0; k < 8; k++) {
+                        o += latin1_encode_byte(p[i + g + k], out + o, true);
+                    }
+                } else if (h == 0) {
+                    memcpy(out + o, p + i + g, 8);
+                    o += 8;
+                } else {
+                    o += SIMD(latin1_expand8)(p + i + g, h, out + o,
+                                              shuffles);
+                }
+            }
+        }
+        i += 64;
+    }
+    lc->last_was_CR = carry_CR;
+    return o + latin1_to_utf8_bytewise(lc, p + i, len - i, out + o,
+                                       is_windows1252);
+}
+
+static TARGET
+size_t KERNEL(latin1_to_utf8)(LineCount *lc, const u8 *p, size_t len,
+                              u8 *out) {
+    return KERNEL(_latin1_to_utf8)(lc, p, len, out, false);
+}
+
+static TARGET
+size_t KERNEL(windows1252_to_utf8)(LineCount *lc, const u8 *p, size_t len,
+                                   u8 *out) {
+    return KERNEL(_latin1_to_utf8)(lc, p, len, out, true);
+}
+
+
+/*
+  Rewriting the separators (see lineends.h), counting as in
+  `_LineCount_valid_bytes` (with the column). The bytes between the
+  separators that need rewriting (only CRs if the target is LF) are
+  copied in runs, [run, position of the next separator). A CR in the
+  last position of a block is deferred like one at the end of the
+  input, and resolved at the start of the next block (carry_CR).
+*/
+static TARGET
+size_t KERNEL(normalize_separators)(LineCount *lc, const u8 *p, size_t len,
+                                    u8 *out, LineSeparator target) {
+    size_t i = 0;
+    size_t o = 0;
+    size_t run = 0; // start of the bytes not written yet
+    u64 carry_CR = lc->last_was_CR;
+    while (len - i >= 64) {
+        SIMD64 v = SIMD(load)(p + i);
+        u64 high = SIMD(high_mask)(v);
+        u64 starts = high ? ~(high & ~SIMD(sgt_mask)(v, 0xBF)) : ~(u64)0;
+        u64 cr = SIMD(eq_mask)(v, '\r');
+        u64 lf = SIMD(eq_mask)(v, '\n');
+
+        lc->charcount += u64_popcount(starts);
+        if ((cr | lf | carry_CR) == 0) {
+            lc->column += u64_popcount(starts);
+            i += 64;
+            continue;
+        }
+        if (carry_CR) {
+            // the deferred CR, or the CRLF if the block starts with
+            // its LF
+            memcpy(out + o, p + run, i - run);
+            o += i - run;
+            o += LineSeparator_put(target, out + o);
+            run = i + (lf & 1);
+        }
+        u64 crs = (cr << 1) | carry_CR;
+        int nCRLF = u64_popcount(crs & lf);
+        lc->CRLFcount += nCRLF;
+        lc->LFcount += u64_popcount(lf) - nCRLF;
+        lc->CRcount += u64_popcount(crs & ~lf);
+        carry_CR = cr >> 63;
+        u64 seps = cr | lf;
+        if (seps) {
+            int last = u64_highest_bit(seps);
+            lc->column = (last == 63) ? 0 : u64_popcount(starts >> (last + 1));
+        } else {
+            lc->column += u64_popcount(starts);
+        }
+
+        u64 m = (target == LINESEPARATOR_LF) ? cr : seps;
+        while (m) {
+            size_t pos = i + u64_lowest_bit(m);
+            m &= m - 1;
+            if (pos < run) {
+                // the LF of a CRLF already written
+                continue;
+            }
+            memcpy(out + o, p + run, pos - run);
+            o += pos - run;
+            run = pos + 1;
+            if (p[pos] == '\r') {
+                if (pos == i + 63) {
+                    // deferred
+                    break;
+                }
+                run += (p[pos + 1] == '\n');
+            }
+            o += LineSeparator_put(target, out + o);
+        }
+        i += 64;
+    }
+    memcpy(out + o, p + run, i - run);
+    o += i - run;
+    lc->last_was_CR = carry_CR;
+    return o + normalize_separators_bytewise(lc, p + i, len - i, out + o,
+                                             target);
+}
+
+
+#undef TARGET
+#undef SIMD
+#undef SIMD64
+#undef KERNEL
@@ -0,0 +1,235 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef SCANKERNELS_H_
+#define SCANKERNELS_H_
+
+/*
+
+  The byte scanning kernels (`utf8_valid_prefix`,
+  `LineCount_valid_bytes`, their UTF-16 counterparts,
+  `LineCount_index_valid_bytes`, `LineCount_csv_valid_bytes`, the transcoders from Latin-1 and
+  Windows-1252, and `normalize_separators`), compiled for every
+  instruction set level (from scankernels-template.h), and
+  dispatching to the variant for the level chosen at runtime (see
+  cpudispatch.h): the best one the CPU supports, or the one named in
+  the environment variable UTF8_LINESEPARATOR_KERNEL (scalar, sse4.2,
+  avx2, avx512).
+
+ */
+
+#include <stdlib.h>
+#include "shorttypenames.h"
+#include "macro-util.h" /* XCAT */
+#include "Simd64.h"
+#include "cpudispatch.h"
+#include "utf8validate.h"
+#include "utf16validate.h"
+#include "latin1.h"
+#include "lineends.h"
+#include "csv.h"
+#include "lineindex.h"
+#include "linecount.h"
+
+
+#define SCANKERNEL_LEVEL scalar
+#include "scankernels-template.h"
+#undef SCANKERNEL_LEVEL
+
+#if SIMD64_X86
+#  define SCANKERNEL_LEVEL sse42
+#  include "scankernels-template.h"
+#  undef SCANKERNEL_LEVEL
+
+#  define SCANKERNEL_LEVEL avx2
+#  include "scankernels-template.h"
+#  undef SCANKERNEL_LEVEL
+
+#  define SCANKERNEL_LEVEL avx512
+#  include "scankernels-template.h"
+#  undef SCANKERNEL_LEVEL
+#endif
+
+
+typedef void (*LineCount_valid_bytes_fn)(LineCount *lc, const u8 *p,
+                                         size_t len);
+
+typedef void (*LineCount_index_valid_bytes_fn)(LineCount *lc,
+                                               LineIndexing *ix,
+                                               const u8 *p, size_t len,
+                                               u64 offset);
+
+typedef void (*LineCount_csv_valid_bytes_fn)(LineCount *lc, CsvCount *csv,
+                                             const u8 *p, size_t len);
+
+// Transcoding to UTF-8 while counting, see `latin1_to_utf8`
+typedef size_t (*transcode_to_utf8_fn)(LineCount *lc, const u8 *p,
+                                       size_t len, u8 *out);
+
+typedef size_t (*normalize_separators_fn)(LineCount *lc, const u8 *p,
+                                          size_t len, u8 *out,
+                                          LineSeparator target);
+
+typedef struct {
+    CpuLevel level;
+    utf8_valid_prefix_fn utf8_valid_prefix;
+    LineCount_valid_bytes_fn LineCount_valid_bytes;
+    LineCount_valid_bytes_fn LineCount_valid_bytes_nocolumn;
+    LineCount_index_valid_bytes_fn LineCount_index_valid_bytes;
+    // same signatures for UTF-16
+    utf8_valid_prefix_fn utf16le_valid_prefix;
+    utf8_valid_prefix_fn utf16be_valid_prefix;
+    LineCount_valid_bytes_fn LineCount_utf16le_valid_bytes;
+    LineCount_valid_bytes_fn LineCount_utf16be_valid_bytes;
+    LineCount_csv_valid_bytes_fn LineCount_csv_valid_bytes;
+    transcode_to_utf8_fn latin1_to_utf8;
+    transcode_to_utf8_fn windows1252_to_utf8;
+    normalize_separators_fn normalize_separators;
+} ScanKernels;
+
+#define _SCANKERNELS(level, suffix)                     \
+    {                                                   \
+        level,                                          \
+        utf8_valid_prefix_##suffix,                     \
+        LineCount_valid_bytes_##suffix,                 \
+        LineCount_valid_bytes_nocolumn_##suffix,        \
+        LineCount_index_valid_bytes_##suffix,           \
+        utf16le_valid_prefix_##suffix,                  \
+        utf16be_valid_prefix_##suffix,                  \
+        LineCount_utf16le_valid_bytes_##suffix,         \
+        LineCount_utf16be_valid_bytes_##suffix,         \
+        LineCount_csv_valid_bytes_##suffix,             \
+        latin1_to_utf8_##suffix,                        \
+        windows1252_to_utf8_##suffix,                   \
+        normalize_separators_##suffix                   \
+    }
+
+// Should be in a scankernels.c but we're currently using a single
+// binary object for everything.
+
+// Indexed by CpuLevel; without x86, the other levels are never
+// supported (thus never selected).
+const ScanKernels scankernels_by_level[CPU_LEVEL_COUNT] = {
+    _SCANKERNELS(CPU_LEVEL_SCALAR, scalar),
+#if SIMD64_X86
+    _SCANKERNELS(CPU_LEVEL_SSE42, sse42),
+    _SCANKERNELS(CPU_LEVEL_AVX2, avx2),
+    _SCANKERNELS(CPU_LEVEL_AVX512, avx512),
+#else
+    _SCANKERNELS(CPU_LEVEL_SCALAR, scalar),
+    _SCANKERNELS(CPU_LEVEL_SCALAR, scalar),
+    _SCANKERNELS(CPU_LEVEL_SCALAR, scalar),
+#endif
+};
+
+#undef _SCANKERNELS
+
+#define SCANKERNELS_ENVVAR "UTF8_LINESEPARATOR_KERNEL"
+
+const ScanKernels *scankernels_selected = NULL; // accessed atomically
+
+// The kernels to use; selected on the first call.
+static UNUSED
+const ScanKernels *scankernels() {
+    const ScanKernels *k =
+        __atomic_load_n(&scankernels_selected, __ATOMIC_ACQUIRE);
+    if (! k) {
+        k = &scankernels_by_level[CpuLevel_select(SCANKERNELS_ENVVAR)];
+        __atomic_store_n(&scankernels_selected, k, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+
+// Returns the length of the longest prefix of [p, p+len) that
+// consists only of complete characters that `get_unicodechar` would
+// accept.
+static UNUSED
+size_t utf8_valid_prefix(const u8 *p, size_t len) {
+    return scankernels()->utf8_valid_prefix(p, len);
+}
+
+// Count the characters in [p, p+len), which must consist of complete
+// characters that have been validated (e.g. via `utf8_valid_prefix`).
+static UNUSED
+void LineCount_valid_bytes(LineCount *lc, const u8 *p, size_t len) {
+    scankernels()->LineCount_valid_bytes(lc, p, len);
+}
+
+// Same as `LineCount_valid_bytes` but the resulting `column` is
+// only meaningful if the input ends with a line separator.
+static UNUSED
+void LineCount_valid_bytes_nocolumn(LineCount *lc, const u8 *p, size_t len) {
+    scankernels()->LineCount_valid_bytes_nocolumn(lc, p, len);
+}
+
+// Returns the length of the longest prefix of [p, p+len) that
+// consists only of complete, correctly paired UTF-16 characters
+// (little resp. big endian).
+static UNUSED
+size_t utf16le_valid_prefix(const u8 *p, size_t len) {
+    return scankernels()->utf16le_valid_prefix(p, len);
+}
+
+static UNUSED
+size_t utf16be_valid_prefix(const u8 *p, size_t len) {
+    return scankernels()->utf16be_valid_prefix(p, len);
+}
+
+// Count the characters in [p, p+len), which must have been validated
+// via `utf16le_valid_prefix` resp. `utf16be_valid_prefix`.
+static UNUSED
+void LineCount_utf16le_valid_bytes(LineCount *lc, const u8 *p, size_t len) {
+    scankernels()->LineCount_utf16le_valid_bytes(lc, p, len);
+}
+
+static UNUSED
+void LineCount_utf16be_valid_bytes(LineCount *lc, const u8 *p, size_t len) {
+    scankernels()->LineCount_utf16be_valid_bytes(lc, p, len);
+}
+
+// Count the valid UTF-8 [p, p+len) into lc (with the column) and add
+// its line starts to ix, offset being the position of p in the input.
+static UNUSED
+void LineCount_index_valid_bytes(LineCount *lc, LineIndexing *ix,
+                                 const u8 *p, size_t len, u64 offset) {
+    scankernels()->LineCount_index_valid_bytes(lc, ix, p, len, offset);
+}
+
+// Count the valid UTF-8 [p, p+len) into lc (with the column) and its
+// CSV structure into csv.
+static UNUSED
+void LineCount_csv_valid_bytes(LineCount *lc, CsvCount *csv, const u8 *p,
+                               size_t len) {
+    scankernels()->LineCount_csv_valid_bytes(lc, csv, p, len);
+}
+
+// Write the UTF-8 encoding of the Latin-1 text [p, p+len) to out,
+// which must have room for TRANSCODE_UTF8_MAXLEN(len) bytes, and
+// count its characters. Returns the number of bytes written.
+static UNUSED
+size_t latin1_to_utf8(LineCount *lc, const u8 *p, size_t len, u8 *out) {
+    return scankernels()->latin1_to_utf8(lc, p, len, out);
+}
+
+// Same for Windows-1252 text.
+static UNUSED
+size_t windows1252_to_utf8(LineCount *lc, const u8 *p, size_t len,
+                           u8 *out) {
+    return scankernels()->windows1252_to_utf8(lc, p, len, out);
+}
+
+// Write the valid UTF-8 [p, p+len), consisting of complete
+// characters, with its separators rewritten to target, to out, which
+// must have room for NORMALIZE_MAXLEN(len) bytes, and count its
+// characters. Returns the number of bytes written.
+static UNUSED
+size_t normalize_separators(LineCount *lc, const u8 *p, size_t len, u8 *out,
+                            LineSeparator target) {
+    return scankernels()->normalize_separators(lc, p, len, out, target);
+}
+
+
+#endif /* SCANKERNELS_H_ */
@@ -15,8 +15,14 @@
 
 typedef uint8_t u8;
 #define default_u8 0
+typedef uint16_t u16;
+#define default_u16 0
 typedef uint32_t u32;
 #define default_u32 0
+typedef uint64_t u64;
+#define default_u64 0
+typedef int8_t i8;
+#define default_i8 0
 
 /* And default values for other types */
 #define default_bool false
@@ -0,0 +1,148 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+/*
+
+  Checks libutf8lineseparator.a the way an application uses it,
+  through libutf8lineseparator.h only: scans the given file, fed in
+  fragments of several sizes to the same scanner, and prints the
+  record `utf-8-lineseparator` prints for it (see runtests). Exits
+  with code 1 if the fragment sizes give different results, 2 if the
+  file can't be read.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libutf8lineseparator.h"
+
+
+#define RECORDSIZ 1024
+
+// The record for result, as in `Report_print`.
+static
+void format_record(const Utf8LineSeparatorResult *result,
+                   char *buf, size_t bufsiz) {
+    char encoding[64] = "";
+    if (result->has_bom) {
+        snprintf(encoding, sizeof(encoding), ", \"encoding\": \"%s\"",
+                 result->encoding);
+    }
+    if (! result->is_valid) {
+        snprintf(buf, bufsiz, "{ \"type\": \"%s\"%s, \"failure\": \"%s\", \"character_position\": %" PRId64 ", \"line\": %" PRId64 ", \"column\": %" PRId64 ", \"line_questionable\": %s }",
+                 result->is_csv_failure ? "csv-failure" : "utf-8-failure",
+                 encoding, result->failure, result->character_position,
+                 result->line, result->column,
+                 result->line_questionable ? "true" : "false");
+    } else if (! result->is_csv) {
+        snprintf(buf, bufsiz, "{ \"type\": \"linecount\"%s, \"charcount\": %" PRId64 ", \"LFcount\": %" PRId64 ", \"CRcount\": %" PRId64 ", \"CRLFcount\": %" PRId64 " }",
+                 encoding, result->charcount, result->LFcount,
+                 result->CRcount, result->CRLFcount);
+    } else {
+        snprintf(buf, bufsiz, "{ \"type\": \"linecount\"%s, \"charcount\": %" PRId64 ", \"LFcount\": %" PRId64 ", \"CRcount\": %" PRId64 ", \"CRLFcount\": %" PRId64 ", \"rowcount\": %" PRId64 ", \"row_LFcount\": %" PRId64 ", \"row_CRcount\": %" PRId64 ", \"row_CRLFcount\": %" PRId64 ", \"cell_LFcount\": %" PRId64 ", \"cell_CRcount\": %" PRId64 ", \"cell_CRLFcount\": %" PRId64 " }",
+                 encoding, result->charcount, result->LFcount,
+                 result->CRcount, result->CRLFcount, result->rowcount,
+                 result->LFcount - result->cell_LFcount,
+                 result->CRcount - result->cell_CRcount,
+                 result->CRLFcount - result->cell_CRLFcount,
+                 result->cell_LFcount, result->cell_CRcount,
+                 result->cell_CRLFcount);
+    }
+}
+
+// Scan [p, p+len) with s in fragments of fragmentlen bytes. Returns
+// false if feeding went on reporting valid input after it didn't.
+static
+bool scan(Utf8LineSeparator *s, const unsigned char *p, size_t len,
+          size_t fragmentlen, Utf8LineSeparatorResult *result) {
+    bool ok = true;
+    bool is_valid = true;
+    for (size_t i = 0; i < len; i += fragmentlen) {
+        size_t n = (len - i < fragmentlen) ? len - i : fragmentlen;
+        bool v = Utf8LineSeparator_feed(s, p + i, n);
+        ok = ok && (is_valid || ! v);
+        is_valid = v;
+    }
+    Utf8LineSeparator_finish(s, result);
+    return ok && (is_valid || ! result->is_valid);
+}
+
+int main(int argc, const char **argv) {
+    unsigned flags = 0;
+    int argi = 1;
+    if ((argi < argc) && (0 == strcmp(argv[argi], "--csv"))) {
+        flags |= UTF8LINESEPARATOR_CSV;
+        argi++;
+    }
+    if (argi + 1 != argc) {
+        fprintf(stderr, "usage: %s [--csv] file\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[argi];
+
+    FILE *f = fopen(path, "rb");
+    if (! f) {
+        perror(path);
+        return 2;
+    }
+    size_t len = 0, siz = 4096;
+    unsigned char *p = (unsigned char *)malloc(siz);
+    size_t n;
+    while (p && ((n = fread(p + len, 1, siz - len, f)) > 0)) {
+        len += n;
+        if (len == siz) {
+            siz *= 2;
+            p = (unsigned char *)realloc(p, siz);
+        }
+    }
+    if ((! p) || ferror(f)) {
+        perror(path);
+        return 2;
+    }
+    fclose(f);
+
+    int res = 0;
+    char first[RECORDSIZ];
+    uint64_t first_bytecount = 0;
+    const size_t fragmentlens[] = { len ? len : 1, 1, 2, 3, 5, 64 * 1024 };
+    for (int decoder = 0; decoder < 2; decoder++) {
+        Utf8LineSeparator *s = Utf8LineSeparator_new(
+            flags | (decoder ? UTF8LINESEPARATOR_DFA : 0));
+        if (! s) {
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+            return 2;
+        }
+        for (size_t i = 0;
+             i < sizeof(fragmentlens) / sizeof(fragmentlens[0]); i++) {
+            Utf8LineSeparatorResult result;
+            char record[RECORDSIZ];
+            if (! scan(s, p, len, fragmentlens[i], &result)) {
+                fprintf(stderr, "%s: feeding reported valid input after "
+                        "invalid input\n", path);
+                res = 1;
+            }
+            format_record(&result, record, RECORDSIZ);
+            if ((decoder == 0) && (i == 0)) {
+                strcpy(first, record);
+                first_bytecount = result.bytecount;
+                printf("%s\n", first);
+            } else if (strcmp(record, first)
+                       || (result.bytecount != first_bytecount)) {
+                fprintf(stderr, "%s: scanning in fragments of %zu bytes "
+                        "(decoder %i) gives:\n%s\n", path, fragmentlens[i],
+                        decoder, record);
+                res = 1;
+            }
+            Utf8LineSeparator_reset(s);
+        }
+        Utf8LineSeparator_free(s);
+    }
+    free(p);
+    return res;
+}
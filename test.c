@@ -4,19 +4,50 @@
 */
 
 #define _POSIX_C_SOURCE 202112L
+#define _DEFAULT_SOURCE /* syscall, MAP_POPULATE */
 
 #include "leakcheck.h"
 
 #include "testinfra.h"
+#include "test_String.h"
 #include "test_unicode.h"
 #include "test_BufferedStream.h"
+#include "test_utf8validate.h"
+#include "test_utf8dfa.h"
+#include "test_utf16.h"
+#include "test_transcode.h"
+#include "test_lineends.h"
+#include "test_csv.h"
+#include "test_allerrors.h"
+#include "test_lineindex.h"
+#include "test_checkpoint.h"
+#include "test_resultcache.h"
+#include "test_pushscan.h"
+#include "test_linecount.h"
+#include "test_parallelscan.h"
+#include "test_report.h"
 
 
 int main() {
     TestStatistics stats = {};
 
+    test_String(&stats);
     test_unicode(&stats);
     test_BufferedStream(&stats);
+    test_utf8validate(&stats);
+    test_utf8dfa(&stats);
+    test_utf16(&stats);
+    test_transcode(&stats);
+    test_lineends(&stats);
+    test_csv(&stats);
+    test_allerrors(&stats);
+    test_lineindex(&stats);
+    test_checkpoint(&stats);
+    test_resultcache(&stats);
+    test_pushscan(&stats);
+    test_linecount(&stats);
+    test_parallelscan(&stats);
+    test_report(&stats);
 
     TestStatistics_print(&stats);
     leakcheck_verify(false);
@@ -10,22 +10,26 @@
 #include "BufferedStream.h"
 
 
+#define TBUFSIZ 90000
+
+static
+void t_fill_testdata(unsigned char *buf, size_t len) {
+    uint64_t n0, n1;
+    n0 = 1;
+    n1 = 1;
+    for (uint64_t i = 0; i < len; i++) {
+        uint64_t n = n0 + n1 - (i >> 8);
+        buf[i] = n;
+        n0 = n1;
+        n1 = n;
+    }
+}
+
 static
 Result(Unit) test_BufferedStream_1(TestStatistics *stats) {
     BEGIN_PROPAGATE(Unit);
-#define TBUFSIZ 90000
     unsigned char buf[TBUFSIZ];
-    {
-        uint64_t n0, n1;
-        n0 = 1;
-        n1 = 1;
-        for (uint64_t i = 0; i < TBUFSIZ; i++) {
-            uint64_t n = n0 + n1 - (i >> 8);
-            buf[i] = n;
-            n0 = n1;
-            n1 = n;
-        }
-    }
+    t_fill_testdata(buf, TBUFSIZ);
 
     Result(BufferedStream) rs = open_BufferedStream(
         literal_String(".test.out"), O_WRONLY | O_CREAT | O_TRUNC, 0666);
@@ -54,7 +58,8 @@ Result(Unit) test_BufferedStream_1(TestStatistics *stats) {
 
             if_let_Ok(Unit,
                       s2, open_r_BufferedStream(
-                          literal_String(".test.out"))) {
+                          literal_String(".test.out"),
+                          &default_ReadOptions)) {
 
                 Result(Option(u8)) rmc;
                 for (int i = 0; i < TBUFSIZ; i++) {
@@ -102,21 +107,321 @@ rs:
     END_PROPAGATE;
 }
 
+// Reads back the file written by test_BufferedStream_1 via
+// BufferedStream_peek_atleast and BufferedStream_consume, with
+// varying amounts, so that the requests cross the buffer refills
+// (and, with io_uring, the read-ahead buffers).
+static
+Result(Unit) test_BufferedStream_2(TestStatistics *stats,
+                                   const ReadOptions *opts) {
+    BEGIN_PROPAGATE(Unit);
+    unsigned char buf[TBUFSIZ];
+    t_fill_testdata(buf, TBUFSIZ);
+
+    Result(BufferedStream) rs = open_r_BufferedStream(
+        literal_String(".test.out"), opts);
+    PROPAGATE_goto(rs, Unit, rs);
+    {
+        size_t pos = 0;
+        size_t k = 1;
+        Result(LSlice_u8) rl;
+        while (1) {
+            rl = BufferedStream_peek_atleast(&rs.ok, k);
+            PROPAGATE_goto(rl, Unit, rl);
+            size_t len = LSlice_length(rl.ok);
+            if (len == 0) {
+                break;
+            }
+            if ((len < k) && (pos + len != TBUFSIZ)) {
+                RETURN_goto(rl, Err(Unit, literal_String(
+                                        "peek_atleast returned too little")));
+            }
+            if ((pos + len > TBUFSIZ)
+                || (memcmp(LSlice_start(rl.ok), buf + pos, len) != 0)) {
+                RETURN_goto(rl, Err(Unit, literal_String(
+                                        "peek_atleast returned wrong data")));
+            }
+            size_t n = (len < k) ? len : k;
+            BufferedStream_consume(&rs.ok, n);
+            pos += n;
+            k = (k * 7 + 3) % 5000 + 1;
+        }
+        TEST_ASSERT(pos == TBUFSIZ);
+        RETURN(Ok(Unit, {}));
+    rl:
+        Result_release(rl);
+    }
+rs:
+    BufferedStream_close(&rs.ok);
+    BufferedStream_release(&rs.ok);
+    Result_release(rs);
+    END_PROPAGATE;
+}
+
+// Regular files are mapped into memory; if the file is truncated
+// while we read it, we get an error instead of a crash.
+static
+Result(Unit) test_BufferedStream_3(TestStatistics *stats) {
+    BEGIN_PROPAGATE(Unit);
+    const char *path = ".test-mmap.out";
+    size_t len = 3 * sysconf(_SC_PAGESIZE) + 100;
+    {
+        FILE *out = fopen(path, "w");
+        if (! out) {
+            RETURN_goto(out, Err(Unit, literal_String("can't create file")));
+        }
+        for (size_t i = 0; i < len; i++) {
+            fputc('x', out);
+        }
+        fclose(out);
+    }
+    Result(BufferedStream) rs = open_r_BufferedStream(borrowing_String(path),
+                                                      &default_ReadOptions);
+    PROPAGATE_goto(rs, Unit, rs);
+    TEST_ASSERT(rs.ok.stream_type == STREAM_TYPE_MMAPSTREAM);
+    {
+        Result(LSlice_u8) rl = BufferedStream_peek(&rs.ok);
+        PROPAGATE_goto(rl, Unit, rl);
+        TEST_ASSERT(LSlice_length(rl.ok) == len);
+        TEST_ASSERT(LSlice_start(rl.ok)[0] == 'x');
+
+        if (truncate(path, 10) < 0) {
+            RETURN_goto(rl, Err(Unit, literal_String("truncate failed")));
+        }
+        // Would be SIGBUS:
+        TEST_ASSERT(LSlice_start(rl.ok)[len - 1] == 0);
+        BufferedStream_consume(&rs.ok, len);
+
+        Result(LSlice_u8) rl2 = BufferedStream_peek(&rs.ok);
+        TEST_ASSERT(Result_is_Err(rl2));
+        if (Result_is_Err(rl2)) {
+            TEST_ASSERT(0 == strcmp(rl2.err.str,
+                                    "file was truncated while reading it"));
+        }
+        Result_release(rl2);
+        RETURN(Ok(Unit, {}));
+    rl:
+        Result_release(rl);
+    }
+    BufferedStream_close(&rs.ok);
+    BufferedStream_release(&rs.ok);
+rs:
+    Result_release(rs);
+out:
+    unlink(path);
+    END_PROPAGATE;
+}
+
+// Writes test data via a mix of BufferedStream_putc and
+// BufferedStream_write (with pieces smaller and larger than the
+// buffer), then a string, and reads it back.
+static
+Result(Unit) test_BufferedStream_4(TestStatistics *stats) {
+    BEGIN_PROPAGATE(Unit);
+    const char *path = ".test-write.out";
+    unsigned char buf[TBUFSIZ];
+    t_fill_testdata(buf, TBUFSIZ);
+
+    Result(BufferedStream) rs = open_BufferedStream(
+        literal_String(".test-write.out"), O_WRONLY | O_CREAT | O_TRUNC,
+        0666);
+    PROPAGATE_goto(rs, Unit, rs);
+    {
+        const size_t sizes[] = { 1, 0, 7, 5000, 16384, 100, 40000, 3 };
+        size_t pos = 0;
+        Result(Unit) ru = Ok(Unit, {});
+        for (int i = 0; pos < TBUFSIZ; i++) {
+            size_t n = sizes[i % 8];
+            if (n > TBUFSIZ - pos) {
+                n = TBUFSIZ - pos;
+            }
+            if (n == 1) {
+                ru = BufferedStream_putc(&rs.ok, buf[pos]);
+            } else {
+                ru = BufferedStream_write(&rs.ok, buf + pos, n);
+            }
+            PROPAGATE_goto(ru, Unit, ru);
+            pos += n;
+        }
+        ru = BufferedStream_write_String(&rs.ok, literal_String("end\n"));
+        PROPAGATE_goto(ru, Unit, ru);
+        ru = BufferedStream_close(&rs.ok);
+        PROPAGATE_goto(ru, Unit, ru);
+
+        FILE *in = fopen(path, "r");
+        if (! in) {
+            RETURN_goto(ru, Err(Unit, literal_String("can't open file")));
+        }
+        unsigned char buf2[TBUFSIZ + 5];
+        size_t len = fread(buf2, 1, TBUFSIZ + 5, in);
+        fclose(in);
+        TEST_ASSERT(len == TBUFSIZ + 4);
+        TEST_ASSERT(memcmp(buf, buf2, TBUFSIZ) == 0);
+        TEST_ASSERT(memcmp("end\n", buf2 + TBUFSIZ, 4) == 0);
+        BufferedStream_release(&rs.ok);
+        Result_release(rs);
+        unlink(path);
+        RETURN(Ok(Unit, {}));
+        END_PROPAGATE;
+    ru:
+        Result_release(ru);
+    }
+    BufferedStream_close(&rs.ok); // no need to check the result here
+    BufferedStream_release(&rs.ok);
+rs:
+    Result_release(rs);
+    unlink(path);
+    END_PROPAGATE;
+}
 
 #define CHECK(e)                                        \
     r = e;                                              \
     if (Result_is_Err(r)) {                             \
-        TEST_FAILURE_("%s", r.err.str);                 \
+        TEST_FAILURE_("%s", Error_message(r.err));      \
         Result_release(r);                              \
     }
 
 
+// Read what is available from the non-blocking fd into p, up to
+// siz bytes; returns the number of bytes read.
+static
+size_t t_drain(int fd, u8 *p, size_t siz) {
+    size_t len = 0;
+    while (len < siz) {
+        ssize_t n = read(fd, p + len, siz - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+// Fail a bulk write (after a partial one) into a pipe that only has
+// room for `room` bytes while `buffered` bytes are in the buffer:
+// closing afterwards must pass on the rest of the buffered data, and
+// nothing twice.
+static
+void t_writev_failure(TestStatistics *stats, size_t room, size_t buffered) {
+#define TPIPESIZ (64 * 1024)
+#define TBULKSIZ (4 * TPIPESIZ)
+    int fds[2];
+    if (pipe(fds) < 0) {
+        TEST_ERROR("pipe");
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    u8 *got = (u8 *)xmalloc(2 * TBULKSIZ);
+    u8 *data = (u8 *)xmalloc(TBULKSIZ);
+    memset(data, 'x', TBULKSIZ);
+    size_t filled = 0;
+    if (room < TPIPESIZ) {
+        memset(got, 'f', TPIPESIZ - room);
+        while (filled < TPIPESIZ - room) {
+            ssize_t n = write(fds[1], got, TPIPESIZ - room - filled);
+            if (n <= 0) break;
+            filled += n;
+        }
+    }
+    BufferedStream out = fd_BufferedStream(fds[1], STREAM_DIRECTION_OUT,
+                                           literal_String("pipe"), false);
+    t_fill_testdata(got, buffered);
+    Result(Unit) r = BufferedStream_write(&out, got, buffered);
+    TEST_ASSERT(Result_is_Ok(r));
+    Result_release(r);
+    r = BufferedStream_write(&out, data, TBULKSIZ);
+    TEST_ASSERT(Result_is_Err(r) && (r.err.context == EAGAIN));
+    Result_release(r);
+
+    size_t len = t_drain(fds[0], got, 2 * TBULKSIZ);
+    r = BufferedStream_close(&out);
+    TEST_ASSERT(Result_is_Ok(r));
+    Result_release(r);
+    BufferedStream_release(&out);
+    len += t_drain(fds[0], got + len, 2 * TBULKSIZ - len);
+    close(fds[0]);
+
+    // The filling, then the buffered data in any case (the partial
+    // write and the rest), then the start of the bulk data
+    u8 *expected = (u8 *)xmalloc(buffered);
+    t_fill_testdata(expected, buffered);
+    size_t x = filled + buffered;
+    bool ok = (len >= x) && (len <= x + TBULKSIZ);
+    for (size_t i = 0; ok && (i < filled); i++) {
+        ok = (got[i] == 'f');
+    }
+    ok = ok && (memcmp(got + filled, expected, buffered) == 0);
+    for (size_t i = x; ok && (i < len); i++) {
+        ok = (got[i] == 'x');
+    }
+    if (! ok) {
+        WARN_("writev failing with %zu bytes of room and %zu bytes "
+              "buffered: got %zu bytes, not as written", room, buffered,
+              len);
+    }
+    TEST_ASSERT(ok);
+    free(expected);
+    free(data);
+    free(got);
+#undef TBULKSIZ
+#undef TPIPESIZ
+}
+
 static
 void test_BufferedStream(TestStatistics *stats) {
 
     Result(Unit) r;
 
     CHECK(test_BufferedStream_1(stats));
+    CHECK(test_BufferedStream_2(stats, &default_ReadOptions));
+    CHECK(test_BufferedStream_2(stats, &(ReadOptions) {
+                .method = READ_METHOD_READ }));
+    for (unsigned depth = 1; depth <= 3; depth++) {
+        CHECK(test_BufferedStream_2(stats, &(ReadOptions) {
+                    .method = READ_METHOD_URING, .uring_depth = depth }));
+        CHECK(test_BufferedStream_2(stats, &(ReadOptions) {
+                    .method = READ_METHOD_READ,
+                    .readahead_buffers = depth }));
+    }
+    CHECK(test_BufferedStream_3(stats));
+    CHECK(test_BufferedStream_4(stats));
+
+    // A failing bulk write: after the buffered data was written, and
+    // in the middle of it
+    t_writev_failure(stats, 64 * 1024, 10);
+    t_writev_failure(stats, 2000, 10000);
+
+    // A failure flushing on close: the stream is closed all the same
+    {
+        Result(BufferedStream) rs = open_BufferedStream(
+            literal_String("/dev/full"), O_WRONLY, 0);
+        if (Result_is_Ok(rs)) {
+            Result(Unit) rw = BufferedStream_write(&rs.ok, (u8 *)"x", 1);
+            TEST_ASSERT(Result_is_Ok(rw));
+            Result_release(rw);
+            Result(Unit) rc = BufferedStream_close(&rs.ok);
+            TEST_ASSERT(Result_is_Err(rc) && (rc.err.context == ENOSPC)
+                        && rs.ok.is_closed);
+            Result_release(rc);
+            BufferedStream_release(&rs.ok);
+        }
+        Result_release(rs);
+    }
+
+    // A failed system call: errno is formatted into the message
+    {
+        Result(BufferedStream) rs = open_BufferedStream(
+            literal_String(".test-nonexistent/file"), O_RDONLY, 0);
+        TEST_ASSERT(Result_is_Err(rs));
+        if (Result_is_Err(rs)) {
+            TEST_ASSERT((rs.err.kind == ERROR_ERRNO)
+                        && (rs.err.context == ENOENT)
+                        && (0 == strcmp(Error_message(rs.err),
+                                        "No such file or directory")));
+        }
+        Result_release(rs);
+    }
 }
 
 #endif /* TEST_BUFFEREDSTREAM_H_ */
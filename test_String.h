@@ -0,0 +1,35 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_STRING_H_
+#define TEST_STRING_H_
+
+#include <string.h>
+#include "testinfra.h"
+#include "String.h"
+
+
+static
+bool t_quote_js_is(const char *str, const char *expected) {
+    String s = String_quote_js(str);
+    bool ok = (0 == strcmp(s.str, expected));
+    if (! ok) {
+        WARN_("String_quote_js: expected %s, got %s", expected, s.str);
+    }
+    String_release(s);
+    return ok;
+}
+
+static
+void test_String(TestStatistics *stats) {
+    TEST_ASSERT(t_quote_js_is("", "\"\""));
+    TEST_ASSERT(t_quote_js_is("t/1.in", "\"t/1.in\""));
+    TEST_ASSERT(t_quote_js_is("a \"b\" \\c", "\"a \\\"b\\\" \\\\c\""));
+    TEST_ASSERT(t_quote_js_is("\r\n\t\x01\x1f\x7f",
+                              "\"\\r\\n\\t\\u0001\\u001f\x7f\""));
+    TEST_ASSERT(t_quote_js_is("\xc3\xa4", "\"\xc3\xa4\""));
+}
+
+#endif /* TEST_STRING_H_ */
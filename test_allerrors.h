@@ -0,0 +1,354 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_ALLERRORS_H_
+#define TEST_ALLERRORS_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "utf8validate.h"
+#include "allerrors.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+typedef struct {
+    u64 offset;
+    u64 length;
+    int64_t position;
+    int64_t line;
+    int64_t column;
+} TErrorRecord;
+
+#define T_MAXRECORDS 2000
+
+// The value of the numeric field key in the record at rec.
+static
+int64_t t_record_field(const char *rec, const char *key) {
+    const char *s = strstr(rec, key);
+    return s ? strtoll(s + strlen(key), NULL, 10) : -1;
+}
+
+// Parse the error records in the output [str, str+len) into recs
+// (with room for T_MAXRECORDS), returns their number.
+static
+size_t t_parse_records(const char *str, size_t len, TErrorRecord *recs) {
+    size_t n = 0;
+    const char *end = str + len;
+    while ((str < end) && (n < T_MAXRECORDS)) {
+        const char *nl = memchr(str, '\n', end - str);
+        if (! nl) break;
+        if (strncmp(str, "{ \"type\": \"utf-8-error\"", 23) == 0) {
+            recs[n++] = (TErrorRecord) {
+                .offset = t_record_field(str, "\"byte_offset\": "),
+                .length = t_record_field(str, "\"byte_length\": "),
+                .position = t_record_field(str, "\"character_position\": "),
+                .line = t_record_field(str, "\"line\": "),
+                .column = t_record_field(str, "\"column\": ")
+            };
+        }
+        str = nl + 1;
+    }
+    return n;
+}
+
+// Whether the len bytes at p are a proper prefix of a valid
+// character, by padding it with continuation bytes.
+static
+bool t_is_char_prefix(const u8 *p, size_t len) {
+    size_t seqlen = utf8_sequence_length(p[0]);
+    if (len >= seqlen) return false;
+    u8 buf[4];
+    memcpy(buf, p, len);
+    memset(buf + len, 0x80, seqlen - len);
+    return utf8_valid_prefix_bytewise(buf, seqlen) == seqlen;
+}
+
+// The errors, and the count, the obvious way. Returns the number of
+// errors.
+static
+size_t t_allerrors_reference(const u8 *p, size_t len, TErrorRecord *recs,
+                             LineCount *lc) {
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t seqlen = utf8_sequence_length(p[i]);
+        if ((seqlen <= len - i)
+            && (utf8_valid_prefix_bytewise(p + i, seqlen) == seqlen)) {
+            LineCount_char(lc, (p[i] < 0x80) ? p[i] : 'x');
+            i += seqlen;
+            continue;
+        }
+        size_t k = 1;
+        for (size_t j = 2; (j <= 3) && (j <= len - i); j++) {
+            if (t_is_char_prefix(p + i, j)) k = j;
+        }
+        if (n < T_MAXRECORDS) {
+            recs[n] = (TErrorRecord) {
+                .offset = i, .length = k,
+                .position = lc->charcount + 1,
+                .line = LineCount_lines(lc) + lc->last_was_CR + 1,
+                .column = lc->column + 1
+            };
+        }
+        n++;
+        LineCount_char(lc, 0xFFFD);
+        i += k;
+    }
+    LineCount_finish(lc);
+    return n;
+}
+
+// Scan in with `Report_scan_all`, the records going to the buffer
+// out (of size outsiz).
+static
+Report t_scan_all(BufferedStream *in, u8 *out, size_t outsiz,
+                  u64 max_records, ErrorLog *log, size_t *outlen) {
+    BufferedStream outs = Buffer_to_BufferedStream(
+        Buffer_from_buf(false, out, outsiz), STREAM_DIRECTION_OUT,
+        literal_String("out"));
+    *log = ErrorLog_new(&outs, max_records);
+    ScanOptions opts = default_ScanOptions;
+    Report r = Report_scan_all(in, &opts, log);
+    ErrorLog_summary(log, &r);
+    *outlen = outs.buffer.lslice.startpos;
+    BufferedStream_close(&outs);
+    BufferedStream_release(&outs);
+    return r;
+}
+
+static
+bool t_records_equal(const TErrorRecord *a, const TErrorRecord *b,
+                     size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if ((a[i].offset != b[i].offset) || (a[i].length != b[i].length)
+            || (a[i].position != b[i].position) || (a[i].line != b[i].line)
+            || (a[i].column != b[i].column)) {
+            WARN_("error record %zu differs: offset %lu vs. %lu, length "
+                  "%lu vs. %lu, position %li vs. %li, line %li vs. %li, "
+                  "column %li vs. %li", i, a[i].offset, b[i].offset,
+                  a[i].length, b[i].length, a[i].position, b[i].position,
+                  a[i].line, b[i].line, a[i].column, b[i].column);
+            return false;
+        }
+    }
+    return true;
+}
+
+static
+void test_allerrors(TestStatistics *stats) {
+    // The example from table 3-8 of the Unicode standard: a U+FFFD
+    // for each maximal subpart
+    {
+        const u8 s[] = "\x61\xF1\x80\x80\xE1\x80\xC2\x62\x80\x63\x80\xBF\x64";
+        // the character, or the negated error length
+        const int expected[] = { 0x61, -3, -2, -1, 0x62, -1, 0x63, -1, -1,
+                                 0x64 };
+        BufferedStream in = Buffer_to_BufferedStream(
+            Buffer_from_array(false, (unsigned char*)s, sizeof(s) - 1),
+            STREAM_DIRECTION_IN,
+            literal_String("buf"));
+        bool ok = true;
+        for (size_t i = 0; i <= sizeof(expected) / sizeof(expected[0]); i++) {
+            size_t errlen;
+            Result(Option(u32)) c = get_unicodechar_resync(&in, &errlen);
+            if (i == sizeof(expected) / sizeof(expected[0])) {
+                ok = ok && Result_is_Ok(c) && c.ok.is_none;
+            } else if (expected[i] < 0) {
+                ok = ok && Result_is_Err(c)
+                    && (errlen == (size_t)-expected[i]);
+            } else {
+                ok = ok && Result_is_Ok(c) && (! c.ok.is_none)
+                    && (c.ok.value == (u32)expected[i]);
+            }
+            Result_release(c);
+        }
+        TEST_ASSERT(ok);
+        BufferedStream_close(&in);
+        BufferedStream_release(&in);
+    }
+
+    // An unpaired surrogate in UTF-16
+    {
+        const char s[] = "\xFF\xFE" "a\0" "\x00\xDC" "\n\0" "b\0";
+        BufferedStream in = Buffer_to_BufferedStream(
+            Buffer_from_array(false, (unsigned char*)s, sizeof(s) - 1),
+            STREAM_DIRECTION_IN,
+            literal_String("buf"));
+        u8 out[1000];
+        size_t outlen;
+        ErrorLog log;
+        Report r = t_scan_all(&in, out, sizeof(out) - 1, 10, &log, &outlen);
+        out[outlen] = 0;
+        TEST_ASSERT(strstr((char *)out, "{ \"type\": \"utf-16-error\", \"failure\": \"unpaired surrogate decoding UTF-16 (0xDC00)\", \"byte_offset\": 4, \"byte_length\": 2, \"character_position\": 2, \"line\": 1, \"column\": 2 }\n{ \"type\": \"summary\", \"encoding\": \"UTF-16LE\", \"errorcount\": 1,")
+                    && (r.lc.charcount == 4) && (r.lc.LFcount == 1));
+        Report_release(&r);
+        ErrorLog_release(&log);
+        BufferedStream_close(&in);
+        BufferedStream_release(&in);
+    }
+
+#define AEBUFSIZ 50000
+    // Random input, crossing the read buffer boundaries of a file
+    // stream, against the reference
+    {
+        const char *pieces[] = {
+            "a", "\r", "\n", "\r\n", "\xC3\xA4", "\xE2\x82\xAC",
+            "\xF0\x9F\x98\x80", "\xF4\x8F\xBF\xBF",
+            // overlong CR and LF, see linecount.h
+            "\xC0\x8D", "\xE0\x80\x8A",
+            // invalid
+            "\x80", "\xBF", "\xC3", "\xE2\x82", "\xF0\x9F\x98", "\xF4\x90",
+            "\xF5", "\xFF"
+        };
+        u8 *buf = (u8 *)xmalloc(AEBUFSIZ);
+        TErrorRecord *expected = (TErrorRecord *)xmalloc(
+            T_MAXRECORDS * sizeof(TErrorRecord));
+        TErrorRecord *got = (TErrorRecord *)xmalloc(
+            T_MAXRECORDS * sizeof(TErrorRecord));
+        size_t outsiz = (T_MAXRECORDS + 1) * ERRORLOG_RECORDSIZ;
+        u8 *out = (u8 *)xmalloc(outsiz);
+        const char *path = ".test-allerrors.in";
+        u64 rnd = 0x3C6EF372FE94F82B;
+        int failures = 0;
+        for (int round = 0; round < 40; round++) {
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (AEBUFSIZ - 4);
+            // errors get rare in later rounds
+            u64 text_rate = 1 + round * round;
+            while (len < targetlen) {
+                u64 r = t_random(&rnd);
+                const char *s = (r % text_rate) ? "x"
+                    : pieces[(r >> 8) % (sizeof(pieces) / sizeof(pieces[0]))];
+                size_t slen = strlen(s);
+                memcpy(buf + len, s, slen);
+                len += slen;
+            }
+            LineCount expected_lc = default_LineCount;
+            size_t nexpected = t_allerrors_reference(buf, len, expected,
+                                                     &expected_lc);
+            FILE *f = fopen(path, "w");
+            if (! f) {
+                TEST_ERROR("can't create file");
+                break;
+            }
+            fwrite(buf, 1, len, f);
+            fclose(f);
+            for (int is_file = 0; is_file < 2; is_file++) {
+                BufferedStream in = is_file
+                    ? fd_BufferedStream(open(path, O_RDONLY),
+                                        STREAM_DIRECTION_IN,
+                                        borrowing_String(path), true)
+                    : Buffer_to_BufferedStream(
+                        Buffer_from_array(false, buf, len),
+                        STREAM_DIRECTION_IN, literal_String("buf"));
+                ErrorLog log;
+                size_t outlen;
+                Report r = t_scan_all(&in, out, outsiz, T_MAXRECORDS, &log,
+                                      &outlen);
+                size_t ngot = t_parse_records((const char *)out, outlen,
+                                              got);
+                size_t nrecs = (nexpected < T_MAXRECORDS) ? nexpected
+                    : T_MAXRECORDS;
+                if (Report_is_failure(&r) || ErrorLog_is_failure(&log)
+                    || (log.errorcount != nexpected) || (ngot != nrecs)
+                    || (r.bytecount != len)
+                    || ! (LineCount_equal(&expected_lc, &r.lc)
+                          && t_records_equal(expected, got, nrecs))) {
+                    WARN_("Report_scan_all on %zu bytes (%s) differs: "
+                          "%zu errors, expected %zu", len,
+                          is_file ? "file" : "buffer",
+                          (size_t)log.errorcount, nexpected);
+                    failures++;
+                }
+                Report_release(&r);
+                ErrorLog_release(&log);
+                BufferedStream_close(&in);
+                BufferedStream_release(&in);
+            }
+
+            // Only the first records are written
+            if (nexpected > 3) {
+                BufferedStream in = Buffer_to_BufferedStream(
+                    Buffer_from_array(false, buf, len),
+                    STREAM_DIRECTION_IN, literal_String("buf"));
+                ErrorLog log;
+                size_t outlen;
+                Report r = t_scan_all(&in, out, outsiz, 3, &log, &outlen);
+                size_t ngot = t_parse_records((const char *)out, outlen,
+                                              got);
+                char summary[100];
+                snprintf(summary, sizeof(summary),
+                         "\"errorcount\": %zu, \"omitted_errorcount\": %zu,",
+                         nexpected, nexpected - 3);
+                out[outlen - 1] = 0;
+                if ((ngot != 3) || ! t_records_equal(expected, got, 3)
+                    || ! strstr((const char *)out, summary)) {
+                    failures++;
+                }
+                Report_release(&r);
+                ErrorLog_release(&log);
+                BufferedStream_close(&in);
+                BufferedStream_release(&in);
+            }
+        }
+        TEST_ASSERT(failures == 0);
+        unlink(path);
+        free(out);
+        free(got);
+        free(expected);
+        free(buf);
+    }
+#undef AEBUFSIZ
+
+    // An overlong CR crossing the end of the read buffer of a file
+    // stream counts the same as in memory (as some other character)
+    {
+        const size_t len = BufferedStream_buffersize + 3;
+        const size_t pos = BufferedStream_buffersize - 1;
+        u8 *buf = (u8 *)xmalloc(len);
+        memset(buf, 'a', len);
+        memcpy(buf + pos, "\xC0\x8D", 2);
+        buf[len - 1] = '\n';
+        const char *path = ".test-allerrors.in";
+        FILE *f = fopen(path, "w");
+        if (f) {
+            fwrite(buf, 1, len, f);
+            fclose(f);
+            for (int is_file = 0; is_file < 2; is_file++) {
+                BufferedStream in = is_file
+                    ? fd_BufferedStream(open(path, O_RDONLY),
+                                        STREAM_DIRECTION_IN,
+                                        borrowing_String(path), true)
+                    : Buffer_to_BufferedStream(
+                        Buffer_from_array(false, buf, len),
+                        STREAM_DIRECTION_IN, literal_String("buf"));
+                u8 out[1000];
+                ErrorLog log;
+                size_t outlen;
+                Report r = t_scan_all(&in, out, sizeof(out), 10, &log,
+                                      &outlen);
+                TEST_ASSERT((! Report_is_failure(&r))
+                            && (log.errorcount == 0)
+                            && (r.lc.CRcount == 0) && (r.lc.LFcount == 1)
+                            && (r.lc.charcount == len - 1));
+                Report_release(&r);
+                ErrorLog_release(&log);
+                BufferedStream_close(&in);
+                BufferedStream_release(&in);
+            }
+            unlink(path);
+        } else {
+            TEST_ERROR("can't create file");
+        }
+        free(buf);
+    }
+}
+
+#undef T_MAXRECORDS
+
+#endif /* TEST_ALLERRORS_H_ */
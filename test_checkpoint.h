@@ -0,0 +1,213 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_CHECKPOINT_H_
+#define TEST_CHECKPOINT_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "checkpoint.h"
+#include "report.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+// Scan the file at path, from ck if it is not NULL; *ck_out is set to
+// the checkpoint after the scan (if there is one, otherwise
+// *has_ck_out is false).
+static
+Report t_checkpoint_scan(const char *path, const Checkpoint *ck,
+                         Checkpoint *ck_out, bool *has_ck_out) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    ScanOptions opts = default_ScanOptions;
+    opts.lazy_column = false;
+    if (ck) {
+        opts.resume = &ck->state;
+        lseek(fd, ck->state.offset, SEEK_SET);
+    }
+    BufferedStream in = fd_BufferedStream(fd, STREAM_DIRECTION_IN,
+                                          borrowing_String(path), true);
+    Report r = Report_scan(&in, &opts);
+    *has_ck_out = Checkpoint_of_report(ck_out, &r, fd, &st);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return r;
+}
+
+static
+void t_append(const char *path, const char *mode, const u8 *p, size_t len) {
+    FILE *f = fopen(path, mode);
+    if (f) {
+        fwrite(p, 1, len, f);
+        fclose(f);
+    }
+}
+
+static
+bool t_reports_equal(const Report *a, const Report *b) {
+    return (Report_is_failure(a) == Report_is_failure(b))
+        && ((! Report_is_failure(a)) || (a->failure.kind == b->failure.kind))
+        && (a->bytecount == b->bytecount) && (a->has_bom == b->has_bom)
+        && LineCount_equal(&a->lc, &b->lc)
+        && (a->lc.column == b->lc.column);
+}
+
+static
+bool t_checkpoints_equal(const Checkpoint *a, const Checkpoint *b) {
+    return (a->dev == b->dev) && (a->ino == b->ino) && (a->size == b->size)
+        && (a->state.offset == b->state.offset)
+        && LineCount_equal(&a->state.lc, &b->state.lc)
+        && (a->state.lc.column == b->state.lc.column)
+        && (a->state.has_bom == b->state.has_bom)
+        && (a->pendinglen == b->pendinglen)
+        && (memcmp(a->pending, b->pending, a->pendinglen) == 0)
+        && (a->head_hash == b->head_hash) && (a->tail_hash == b->tail_hash);
+}
+
+static
+void test_checkpoint(TestStatistics *stats) {
+    const char *path = ".test-checkpoint.in";
+    const char *ckpath = ".test-checkpoint.checkpoint";
+
+    // Saving and loading
+    {
+        t_append(path, "w", (const u8 *)"ab\r", 3);
+        Checkpoint ck;
+        bool has_ck;
+        Report r = t_checkpoint_scan(path, NULL, &ck, &has_ck);
+        // the CR at the end is pending in the checkpoint
+        TEST_ASSERT(has_ck && (r.lc.CRcount == 1)
+                    && (ck.state.lc.CRcount == 0) && ck.state.lc.last_was_CR
+                    && (ck.size == 3));
+        Report_release(&r);
+        Result(Unit) rs = Checkpoint_save(&ck, ckpath);
+        TEST_ASSERT(Result_is_Ok(rs));
+        Result_release(rs);
+        Result(Checkpoint) rl = Checkpoint_load(ckpath);
+        TEST_ASSERT(Result_is_Ok(rl)
+                    && t_checkpoints_equal(&rl.ok, &ck));
+        Result_release(rl);
+        rl = Checkpoint_load(path);
+        TEST_ASSERT(Result_is_Err(rl));
+        Result_release(rl);
+        unlink(ckpath);
+        rl = Checkpoint_load(ckpath);
+        TEST_ASSERT(Result_is_Err(rl) && (rl.err.kind == ERROR_ERRNO)
+                    && (rl.err.context == ENOENT));
+        Result_release(rl);
+    }
+
+#define CKBUFSIZ 200000
+    // Appending random pieces (also splitting characters and CRLF),
+    // continuing from the checkpoint each time, against scanning in
+    // full
+    {
+        const char *pieces[] = {
+            "a", "\r", "\n", "\r\n", "\xC3\xA4", "\xE2\x82\xAC",
+            "\xF0\x9F\x98\x80"
+        };
+        u8 *buf = (u8 *)xmalloc(CKBUFSIZ);
+        u64 rnd = 0xA54FF53A5F1D36F1;
+        int failures = 0;
+        int resumed = 0;
+        for (int round = 0; round < 20; round++) {
+            size_t len = 0;
+            if (round % 4 == 0) {
+                memcpy(buf, "\xEF\xBB\xBF", 3);
+                len = 3;
+            }
+            t_append(path, "w", buf, len);
+            Checkpoint ck;
+            bool has_ck = false;
+            for (int step = 0; step < 6; step++) {
+                size_t n = t_random(&rnd) % ((step % 3 == 2) ? 100000 : 50);
+                size_t start = len;
+                while ((len - start < n) && (len < CKBUFSIZ - 4)) {
+                    u64 r = t_random(&rnd);
+                    const char *s = (r % 4) ? "x"
+                        : pieces[(r >> 8)
+                                 % (sizeof(pieces) / sizeof(pieces[0]))];
+                    memcpy(buf + len, s, strlen(s));
+                    len += strlen(s);
+                }
+                // an invalid byte now and then
+                if (t_random(&rnd) % 40 == 0) {
+                    buf[len++] = 0xFF;
+                }
+                // stop in the middle of the last piece, sometimes
+                size_t cut = len - (t_random(&rnd) % 2) * (t_random(&rnd) % 3);
+                if (cut < start) cut = start;
+                t_append(path, "a", buf + start, cut - start);
+                struct stat st;
+                stat(path, &st);
+                int fd = open(path, O_RDONLY);
+                bool matches = has_ck && Checkpoint_matches(&ck, fd, &st);
+                close(fd);
+                Checkpoint ck2, ck3;
+                bool has_ck2, has_ck3;
+                Report r = t_checkpoint_scan(path, matches ? &ck : NULL,
+                                             &ck2, &has_ck2);
+                Report full = t_checkpoint_scan(path, NULL, &ck3, &has_ck3);
+                if (has_ck && ! matches) {
+                    failures++;
+                }
+                resumed += matches;
+                if (! (t_reports_equal(&r, &full)
+                       && (has_ck2 == has_ck3)
+                       && ((! has_ck2)
+                           || t_checkpoints_equal(&ck2, &ck3)))) {
+                    WARN_("scanning %zu bytes from a checkpoint differs "
+                          "from scanning in full", cut);
+                    failures++;
+                }
+                Report_release(&r);
+                Report_release(&full);
+                if (has_ck2) {
+                    ck = ck2;
+                }
+                has_ck = has_ck2;
+                t_append(path, "a", buf + cut, len - cut);
+                if (buf[len - 1] == 0xFF) {
+                    break;
+                }
+            }
+        }
+        TEST_ASSERT((failures == 0) && (resumed > 20));
+        free(buf);
+    }
+#undef CKBUFSIZ
+
+    // Rewritten or truncated files don't match
+    {
+        t_append(path, "w", (const u8 *)"line 1\nline 2\n", 14);
+        Checkpoint ck;
+        bool has_ck;
+        Report r = t_checkpoint_scan(path, NULL, &ck, &has_ck);
+        Report_release(&r);
+        struct stat st;
+        int fd;
+#define T_MATCHES()                                             \
+        (stat(path, &st),                                       \
+         fd = open(path, O_RDONLY),                             \
+         has_ck = Checkpoint_matches(&ck, fd, &st),             \
+         close(fd),                                             \
+         has_ck)
+        TEST_ASSERT(T_MATCHES());
+        t_append(path, "a", (const u8 *)"line 3\n", 7);
+        TEST_ASSERT(T_MATCHES());
+        t_append(path, "w", (const u8 *)"line 1\nline 2", 13);
+        TEST_ASSERT(! T_MATCHES());
+        t_append(path, "w", (const u8 *)"line 1\nline X\nline 3\n", 21);
+        TEST_ASSERT(! T_MATCHES());
+#undef T_MATCHES
+    }
+    unlink(path);
+}
+
+#endif /* TEST_CHECKPOINT_H_ */
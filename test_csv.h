@@ -0,0 +1,146 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_CSV_H_
+#define TEST_CSV_H_
+
+#include <string.h>
+#include "testinfra.h"
+#include "scankernels.h"
+#include "report.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+static
+bool CsvCount_equal(const CsvCount *a, const CsvCount *b) {
+    return (a->cells.LFcount == b->cells.LFcount)
+        && (a->cells.CRcount == b->cells.CRcount)
+        && (a->cells.CRLFcount == b->cells.CRLFcount)
+        && (a->cells.last_was_CR == b->cells.last_was_CR)
+        && (a->in_quote == b->in_quote)
+        && (a->row_pending == b->row_pending)
+        && ((! a->in_quote) || LineCount_equal(&a->quote_lc, &b->quote_lc));
+}
+
+// Returns true if all variants count the same as the character-wise
+// `CsvCount_char`, counting in two pieces split at `split` (which must
+// be at a character boundary).
+static
+bool t_csv_kernels(const u8 *p, size_t len, size_t split) {
+    LineCount expected_lc = default_LineCount;
+    CsvCount expected_csv = default_CsvCount;
+    for (size_t i = 0; i < len; i++) {
+        if ((p[i] & 0b11000000) != 0b10000000) {
+            CsvCount_char(&expected_csv, &expected_lc, p[i]);
+            LineCount_char(&expected_lc, p[i]);
+        }
+    }
+    bool ok = true;
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if (! CpuLevel_is_supported((CpuLevel)level)) {
+            continue;
+        }
+        LineCount_csv_valid_bytes_fn count =
+            scankernels_by_level[level].LineCount_csv_valid_bytes;
+        LineCount lc = default_LineCount;
+        CsvCount csv = default_CsvCount;
+        count(&lc, &csv, p, split);
+        count(&lc, &csv, p + split, len - split);
+        if (! (LineCount_equal(&expected_lc, &lc)
+               && CsvCount_equal(&expected_csv, &csv))) {
+            WARN_("LineCount_csv_valid_bytes (%s) on %zu bytes, split at "
+                  "%zu, differs", CpuLevel_name((CpuLevel)level), len,
+                  split);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Scan str as CSV.
+static
+Report t_csv_report(const char *str) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)str, strlen(str)),
+        STREAM_DIRECTION_IN,
+        literal_String("buf"));
+    ScanOptions opts = default_ScanOptions;
+    opts.csv = true;
+    Report r = Report_scan(&in, &opts);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return r;
+}
+
+static
+void test_csv(TestStatistics *stats) {
+    TEST_ASSERT(u64_prefix_xor(0) == 0);
+    TEST_ASSERT(u64_prefix_xor(0b1001000) == 0b0111000);
+    TEST_ASSERT(u64_prefix_xor((u64)1 << 63) == (u64)1 << 63);
+
+    // Rows and line breaks in cells
+    {
+        Report r = t_csv_report("a,b\r\n\"x\ny\",\"\"\"q\"\"\r\"\r\nlast");
+        TEST_ASSERT((! Report_is_failure(&r))
+                    && (CsvCount_rows(&r.csv, &r.lc) == 3)
+                    && (r.lc.CRLFcount == 2)
+                    && (r.csv.cells.LFcount == 1)
+                    && (r.csv.cells.CRcount == 1)
+                    && (r.csv.cells.CRLFcount == 0));
+        Report_release(&r);
+        r = t_csv_report("a\n\nb\n");
+        TEST_ASSERT((! Report_is_failure(&r))
+                    && (CsvCount_rows(&r.csv, &r.lc) == 3));
+        Report_release(&r);
+    }
+
+    // An unclosed quote, reported at its position
+    {
+        Report r = t_csv_report("a,b\n1,\"x\"\"\n2,3\n");
+        TEST_ASSERT(Report_is_failure(&r)
+                    && (r.failure.kind == ERROR_CSV_UNBALANCED_QUOTE)
+                    && (r.lc.charcount == 6)
+                    && (LineCount_lines(&r.lc) == 1)
+                    && (r.lc.column == 2));
+        Report_release(&r);
+    }
+
+#define CSVBUFSIZ 700
+    // Random text against the character-wise counting
+    {
+        const char *pieces[] = {
+            "a", ",", "\"", "\"\"", "\r", "\n", "\r\n", "\xC3\xA4",
+            "\xF0\x9F\x98\x80"
+        };
+        u8 buf[CSVBUFSIZ];
+        u64 rnd = 0x1F83D9ABFB41BD6B;
+        int failures = 0;
+        for (int round = 0; round < 3000; round++) {
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (CSVBUFSIZ - 4);
+            u64 text_rate = 1 + round % 20;
+            size_t split = 0;
+            size_t splitlen = t_random(&rnd) % (targetlen + 1);
+            while (len < targetlen) {
+                u64 r = t_random(&rnd);
+                const char *s = (r % text_rate) ? "x"
+                    : pieces[(r >> 8) % (sizeof(pieces) / sizeof(pieces[0]))];
+                size_t slen = strlen(s);
+                memcpy(buf + len, s, slen);
+                if ((len <= splitlen) && (splitlen < len + slen)) {
+                    split = len;
+                }
+                len += slen;
+            }
+            if (! t_csv_kernels(buf, len, split)) {
+                failures++;
+            }
+        }
+        TEST_ASSERT(failures == 0);
+    }
+#undef CSVBUFSIZ
+}
+
+#endif /* TEST_CSV_H_ */
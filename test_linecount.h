@@ -0,0 +1,97 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_LINECOUNT_H_
+#define TEST_LINECOUNT_H_
+
+#include "testinfra.h"
+#include "linecount.h"
+#include "scankernels.h"
+
+
+static
+bool LineCount_equal(const LineCount *a, const LineCount *b) {
+    return (a->charcount == b->charcount)
+        && (a->LFcount == b->LFcount)
+        && (a->CRcount == b->CRcount)
+        && (a->CRLFcount == b->CRLFcount)
+        && (a->column == b->column)
+        && (a->last_was_CR == b->last_was_CR);
+}
+
+static
+void test_linecount(TestStatistics *stats) {
+#define LBUFSIZ 1000
+    u8 buf[LBUFSIZ];
+    // Character start positions, to split the input only there
+    size_t starts[LBUFSIZ];
+
+    // Lots of separators (runs of CRs in particular), some non-ASCII
+    // text, fed in random pieces so that CRLF pairs and runs of CRs
+    // cross the piece (and block) boundaries.
+    const char *pieces[] = {
+        "\r", "\n", "\r\n", "\r\r", "a", "abc", "\xc3\xa4", "\xe2\x82\xac",
+        "\xf0\x90\x8d\x88", "0123456789012345678901234567890123456789"
+    };
+    u64 rnd = 0x2545F4914F6CDD1D;
+    int failures = 0;
+    for (int round = 0; round < 2000; round++) {
+        size_t len = 0;
+        size_t nstarts = 0;
+        size_t targetlen = t_random(&rnd) % (LBUFSIZ - 50);
+        while (len < targetlen) {
+            const char *s = pieces[t_random(&rnd) % 10];
+            for (; *s; s++) {
+                if ((*s & 0b11000000) != 0b10000000) {
+                    starts[nstarts++] = len;
+                }
+                buf[len++] = *s;
+            }
+        }
+
+        LineCount expected = default_LineCount;
+        for (size_t i = 0; i < len; i++) {
+            if ((buf[i] & 0b11000000) != 0b10000000) {
+                LineCount_char(&expected, buf[i]);
+            }
+        }
+
+        // Every kernel variant the CPU can run, fed the same pieces
+        u64 rnd_pieces = rnd;
+        for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+            if (! CpuLevel_is_supported((CpuLevel)level)) {
+                continue;
+            }
+            const ScanKernels *k = &scankernels_by_level[level];
+            rnd = rnd_pieces;
+            LineCount got = default_LineCount;
+            size_t pos = 0;
+            while (pos < len) {
+                size_t end = (round & 1)
+                    ? starts[t_random(&rnd) % nstarts]
+                    : len;
+                if (end <= pos) end = len;
+                k->LineCount_valid_bytes(&got, buf + pos, end - pos);
+                pos = end;
+            }
+
+            if (! LineCount_equal(&expected, &got)) {
+                WARN_("LineCount_valid_bytes (%s) on %zu bytes (round %i): "
+                      "expected %li/%li/%li/%li column %li, "
+                      "got %li/%li/%li/%li column %li",
+                      CpuLevel_name((CpuLevel)level), len, round,
+                      expected.charcount, expected.LFcount,
+                      expected.CRcount, expected.CRLFcount, expected.column,
+                      got.charcount, got.LFcount,
+                      got.CRcount, got.CRLFcount, got.column);
+                failures++;
+            }
+        }
+    }
+    TEST_ASSERT(failures == 0);
+#undef LBUFSIZ
+}
+
+#endif /* TEST_LINECOUNT_H_ */
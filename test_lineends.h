@@ -0,0 +1,254 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_LINEENDS_H_
+#define TEST_LINEENDS_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "scankernels.h"
+#include "normalize.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+// The rewritten text, the obvious way. Returns its length.
+static
+size_t t_normalize_reference(const u8 *p, size_t len, u8 *out,
+                             LineSeparator target) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == '\r') {
+            if ((i + 1 < len) && (p[i + 1] == '\n')) {
+                i++;
+            }
+            o += LineSeparator_put(target, out + o);
+        } else if (p[i] == '\n') {
+            o += LineSeparator_put(target, out + o);
+        } else {
+            out[o++] = p[i];
+        }
+    }
+    return o;
+}
+
+// Returns true if the byte-wise variant gives the reference output,
+// and all variants give the same output and counts as it, rewriting
+// in two pieces split at `split` (which must be at a character
+// boundary).
+static
+bool t_normalize(const u8 *p, size_t len, LineSeparator target, size_t split,
+                 u8 *expected_out, u8 *out) {
+    size_t expected_len = t_normalize_reference(p, len, expected_out, target);
+    LineCount expected_lc = default_LineCount;
+    size_t n = normalize_separators_bytewise(&expected_lc, p, len, out,
+                                             target);
+    n += normalize_separators_finish(&expected_lc, out + n, target);
+    bool ok = true;
+    if ((n != expected_len) || memcmp(out, expected_out, n)) {
+        WARN_("normalize_separators_bytewise to %s on %zu bytes: "
+              "wrong output", LineSeparator_name(target), len);
+        ok = false;
+    }
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if (! CpuLevel_is_supported((CpuLevel)level)) {
+            continue;
+        }
+        normalize_separators_fn normalize =
+            scankernels_by_level[level].normalize_separators;
+        LineCount lc = default_LineCount;
+        n = normalize(&lc, p, split, out, target);
+        n += normalize(&lc, p + split, len - split, out + n, target);
+        n += normalize_separators_finish(&lc, out + n, target);
+        if ((n != expected_len) || memcmp(out, expected_out, n)
+            || ! LineCount_equal(&expected_lc, &lc)) {
+            WARN_("normalize_separators (%s) to %s on %zu bytes, split "
+                  "at %zu, differs", CpuLevel_name((CpuLevel)level),
+                  LineSeparator_name(target), len, split);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Checks `Report_normalize` between files on [p, p+len), to LF and,
+// with an invalid byte appended (p must have room for it), to CRLF;
+// reading the input via `read` (in pieces of the buffer size) and
+// mapped (in pieces of NORMALIZE_CHUNKSIZE).
+static
+void t_report_normalize(TestStatistics *stats, u8 *p, size_t len) {
+    p[len] = 0xFF;
+    const char *inpath = ".test-lineends.in";
+    const char *outpath = ".test-lineends.out";
+    u8 *expected = (u8 *)xmalloc(NORMALIZE_MAXLEN(len));
+    u8 *got = (u8 *)xmalloc(NORMALIZE_MAXLEN(len) + 1);
+    for (int round = 0; round < 4; round++) {
+        bool with_error = round % 2;
+        bool is_mapped = round / 2;
+        LineSeparator target = with_error ? LINESEPARATOR_CRLF
+            : LINESEPARATOR_LF;
+        size_t expected_len = t_normalize_reference(p, len, expected,
+                                                    target);
+        LineCount expected_lc = default_LineCount;
+        LineCount_valid_bytes(&expected_lc, p, len);
+        if (! with_error) {
+            LineCount_finish(&expected_lc);
+        }
+        FILE *f = fopen(inpath, "w");
+        if (f) {
+            fwrite(p, 1, len + with_error, f);
+            fclose(f);
+        }
+        int infd = open(inpath, O_RDONLY);
+        int outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if ((! f) || (infd < 0) || (outfd < 0)) {
+            TEST_ERROR("can't create files");
+            break;
+        }
+        BufferedStream in = is_mapped
+            ? fd_r_BufferedStream(infd, borrowing_String(inpath), true,
+                                  &default_ReadOptions)
+            : fd_BufferedStream(infd, STREAM_DIRECTION_IN,
+                                borrowing_String(inpath), true);
+        BufferedStream outs = fd_BufferedStream(
+            outfd, STREAM_DIRECTION_OUT, borrowing_String(outpath), true);
+        ScanOptions opts = default_ScanOptions;
+        Report r = Report_normalize(&in, &outs, target, &opts);
+        TEST_ASSERT((Report_is_failure(&r) == with_error)
+                    && (r.bytecount == len)
+                    && LineCount_equal(&expected_lc, &r.lc));
+        Report_release(&r);
+        Result(Unit) rc = BufferedStream_close(&in);
+        Result_release(rc);
+        rc = BufferedStream_close(&outs);
+        TEST_ASSERT(Result_is_Ok(rc));
+        Result_release(rc);
+        BufferedStream_release(&in);
+        BufferedStream_release(&outs);
+
+        f = fopen(outpath, "r");
+        size_t n = f ? fread(got, 1, NORMALIZE_MAXLEN(len) + 1, f) : 0;
+        if (f) fclose(f);
+        TEST_ASSERT((n == expected_len)
+                    && (memcmp(got, expected, n) == 0));
+    }
+    unlink(inpath);
+    unlink(outpath);
+    free(got);
+    free(expected);
+}
+
+static
+void test_lineends(TestStatistics *stats) {
+    // Option values
+    {
+        LineSeparator s;
+        TEST_ASSERT(LineSeparator_parse("crlf", &s)
+                    && (s == LINESEPARATOR_CRLF));
+        TEST_ASSERT(LineSeparator_parse("LF", &s) && (s == LINESEPARATOR_LF));
+        TEST_ASSERT(! LineSeparator_parse("CRCR", &s));
+    }
+
+#define NLBUFSIZ 700
+    // Random text, with runs of separators, against the reference
+    {
+        const char *pieces[] = {
+            "a", "bc", " ", "\r", "\n", "\r\n", "\n\r", "\xC3\xA4",
+            "\xED\x95\x9C", "\xF0\x9F\x98\x80"
+        };
+        u8 buf[NLBUFSIZ];
+        u8 *expected_out = (u8 *)xmalloc(NORMALIZE_MAXLEN(NLBUFSIZ));
+        u8 *out = (u8 *)xmalloc(NORMALIZE_MAXLEN(NLBUFSIZ));
+        u64 rnd = 0x510E527FADE682D1;
+        int failures = 0;
+        for (int round = 0; round < 3000; round++) {
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (NLBUFSIZ - 4);
+            // mostly separators in some rounds, rare ones in others
+            u64 text_rate = 1 + round % 30;
+            size_t split = 0;
+            size_t splitlen = t_random(&rnd) % (targetlen + 1);
+            while (len < targetlen) {
+                u64 r = t_random(&rnd);
+                const char *s = (r % text_rate) ? "x"
+                    : pieces[(r >> 8) % (sizeof(pieces) / sizeof(pieces[0]))];
+                size_t slen = strlen(s);
+                memcpy(buf + len, s, slen);
+                if ((len <= splitlen) && (splitlen < len + slen)) {
+                    split = (r & (1 << 20)) ? len + slen : len;
+                }
+                len += slen;
+            }
+            if (split > len) split = len;
+            if (! t_normalize(buf, len, (LineSeparator)(round % 3), split,
+                              expected_out, out)) {
+                failures++;
+            }
+        }
+        TEST_ASSERT(failures == 0);
+        free(out);
+        free(expected_out);
+    }
+#undef NLBUFSIZ
+
+    // Report_normalize between files, in several pieces, up to an
+    // invalid byte
+    {
+        size_t len = 3 * NORMALIZE_CHUNKSIZE + 1234;
+        u8 *p = (u8 *)xmalloc(len + 1);
+        u64 rnd = 0x9B05688C2B3E6C1F;
+        size_t i = 0;
+        while (i < len) {
+            u64 r = t_random(&rnd);
+            if ((r % 5 == 0) && (i + 2 <= len)) {
+                memcpy(p + i, "\xC3\xA4", 2); // crossing the pieces, too
+                i += 2;
+            } else {
+                p[i++] = (r % 3) ? 'a' + r % 26 : (r % 2) ? '\r' : '\n';
+            }
+        }
+        t_report_normalize(stats, p, len);
+        free(p);
+    }
+    // A piece that doubles in size, after a CR from the previous
+    // piece, and ends with a CR and a character crossing into the
+    // next one
+    {
+        size_t len = 2 * NORMALIZE_CHUNKSIZE + 3;
+        u8 *p = (u8 *)xmalloc(len + 1);
+        size_t i = NORMALIZE_CHUNKSIZE - 1;
+        memset(p, 'x', i);
+        p[i++] = '\r';
+        p[i++] = 'a';
+        memset(p + i, '\n', NORMALIZE_CHUNKSIZE - 3);
+        i += NORMALIZE_CHUNKSIZE - 3;
+        p[i++] = '\r';
+        memcpy(p + i, "\xF0\x9F\x98\x80", 4);
+        t_report_normalize(stats, p, len);
+        free(p);
+    }
+    // An overlong sequence crossing into the next piece is copied as
+    // it is (and isn't a line separator, see linecount.h)
+    {
+        const char *seqs[] = { "\xE0\x80\x8D", "\xC0\x8A", "\xC0\x80" };
+        for (size_t j = 0; j < sizeof(seqs) / sizeof(seqs[0]); j++) {
+            size_t seqlen = strlen(seqs[j]);
+            for (size_t split = 1; split < seqlen; split++) {
+                size_t i = NORMALIZE_CHUNKSIZE - split;
+                size_t len = i + seqlen + 2;
+                u8 *p = (u8 *)xmalloc(len + 1);
+                memset(p, 'a', i);
+                memcpy(p + i, seqs[j], seqlen);
+                memcpy(p + i + seqlen, "b\n", 2);
+                t_report_normalize(stats, p, len);
+                free(p);
+            }
+        }
+    }
+}
+
+#endif /* TEST_LINEENDS_H_ */
@@ -0,0 +1,253 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_LINEINDEX_H_
+#define TEST_LINEINDEX_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "scankernels.h"
+#include "lineindex.h"
+#include "report.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+static
+bool LineStarts_equal(const LineStarts *a, const LineStarts *b) {
+    return (a->count == b->count)
+        && (a->deltas_len == b->deltas_len)
+        && (a->table_len == b->table_len)
+        && ((a->deltas_len == 0)
+            || (memcmp(a->deltas, b->deltas, a->deltas_len) == 0))
+        && ((a->table_len == 0)
+            || (memcmp(a->table, b->table, a->table_len * sizeof(u64)) == 0));
+}
+
+// The line starts for the kind k, the obvious way. Returns their
+// number.
+static
+size_t t_line_starts(const u8 *p, size_t len, LineSeparator k, u64 *starts) {
+    size_t n = 0;
+    starts[n++] = 0;
+    for (size_t i = 0; i < len; i++) {
+        bool is_crlf = (p[i] == '\r') && (i + 1 < len) && (p[i + 1] == '\n');
+        if ((k == LINESEPARATOR_CRLF) ? is_crlf
+            : (k == LINESEPARATOR_CR) ? ((p[i] == '\r') && ! is_crlf)
+            : ((p[i] == '\n') && ! ((i > 0) && (p[i - 1] == '\r')))) {
+            starts[n++] = i + (is_crlf ? 2 : 1);
+        }
+    }
+    return n;
+}
+
+// Returns true if all variants collect the same line starts as the
+// character-wise `LineIndexing_char`, in two pieces split at `split`
+// (which must be at a character boundary).
+static
+bool t_index_kernels(const u8 *p, size_t len, size_t split) {
+    LineIndexing expected;
+    LineIndexing_init(&expected);
+    LineIndexing_begin(&expected, 0);
+    LineCount expected_lc = default_LineCount;
+    for (size_t i = 0; i < len; i++) {
+        if ((p[i] & 0b11000000) != 0b10000000) {
+            LineIndexing_char(&expected, &expected_lc, p[i], i);
+            LineCount_char(&expected_lc, p[i]);
+        }
+    }
+    LineIndexing_finish(&expected, &expected_lc, len);
+    bool ok = true;
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if (! CpuLevel_is_supported((CpuLevel)level)) {
+            continue;
+        }
+        LineCount_index_valid_bytes_fn count =
+            scankernels_by_level[level].LineCount_index_valid_bytes;
+        LineIndexing ix;
+        LineIndexing_init(&ix);
+        LineIndexing_begin(&ix, 0);
+        LineCount lc = default_LineCount;
+        count(&lc, &ix, p, split, 0);
+        count(&lc, &ix, p + split, len - split, split);
+        LineIndexing_finish(&ix, &lc, len);
+        bool same = LineCount_equal(&expected_lc, &lc);
+        for (int k = 0; k < 3; k++) {
+            same = same && LineStarts_equal(&expected.kinds[k], &ix.kinds[k]);
+        }
+        if (! same) {
+            WARN_("LineCount_index_valid_bytes (%s) on %zu bytes, split "
+                  "at %zu, differs", CpuLevel_name((CpuLevel)level), len,
+                  split);
+            ok = false;
+        }
+        LineIndexing_release(&ix);
+    }
+    LineIndexing_release(&expected);
+    return ok;
+}
+
+static
+void test_lineindex(TestStatistics *stats) {
+#define LIBUFSIZ 700
+    // Random text against the character-wise collecting
+    {
+        const char *pieces[] = {
+            "a", "\r", "\n", "\r\n", "\n\r", "\xC3\xA4", "\xF0\x9F\x98\x80"
+        };
+        u8 buf[LIBUFSIZ];
+        u64 rnd = 0xBB67AE8584CAA73B;
+        int failures = 0;
+        for (int round = 0; round < 3000; round++) {
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (LIBUFSIZ - 4);
+            u64 text_rate = 1 + round % 20;
+            size_t split = 0;
+            size_t splitlen = t_random(&rnd) % (targetlen + 1);
+            while (len < targetlen) {
+                u64 r = t_random(&rnd);
+                const char *s = (r % text_rate) ? "x"
+                    : pieces[(r >> 8) % (sizeof(pieces) / sizeof(pieces[0]))];
+                size_t slen = strlen(s);
+                memcpy(buf + len, s, slen);
+                if ((len <= splitlen) && (splitlen < len + slen)) {
+                    split = len;
+                }
+                len += slen;
+            }
+            if (! t_index_kernels(buf, len, split)) {
+                failures++;
+            }
+        }
+        TEST_ASSERT(failures == 0);
+    }
+#undef LIBUFSIZ
+
+    // Scanning a file (in several buffers), writing the index, and
+    // looking lines up in it
+#define LIBUFSIZ 100000
+    {
+        u8 *buf = (u8 *)xmalloc(LIBUFSIZ);
+        u64 *starts = (u64 *)xmalloc((LIBUFSIZ + 1) * sizeof(u64));
+        const char *path = ".test-lineindex.in";
+        const char *ixpath = ".test-lineindex.idx";
+        u64 rnd = 0x3C6EF372FE94F82B;
+        int failures = 0;
+        for (int round = 0; round < 12; round++) {
+            LineSeparator k = (LineSeparator)(round % 3);
+            const char *sep = (k == LINESEPARATOR_LF) ? "\n"
+                : (k == LINESEPARATOR_CRLF) ? "\r\n" : "\r";
+            // long lines in some rounds (deltas of several bytes),
+            // a separator at the end in others, and a few separators
+            // of the other kinds
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (LIBUFSIZ - 10);
+            u64 linelen = (round < 6) ? 40 : 1000;
+            while (len < targetlen) {
+                u64 r = t_random(&rnd);
+                const char *s = (r % linelen == 0) ? sep
+                    : (r % 20011 == 0) ? "\n\r"
+                    : (r % 3 == 0) ? "\xC3\xA4" : "y";
+                size_t slen = strlen(s);
+                memcpy(buf + len, s, slen);
+                len += slen;
+            }
+            if (round % 2) {
+                memcpy(buf + len, sep, strlen(sep));
+                len += strlen(sep);
+            }
+            size_t nstarts = t_line_starts(buf, len, k, starts);
+
+            FILE *f = fopen(path, "w");
+            if (! f) {
+                TEST_ERROR("can't create file");
+                break;
+            }
+            fwrite(buf, 1, len, f);
+            fclose(f);
+            BufferedStream in = fd_BufferedStream(open(path, O_RDONLY),
+                                                  STREAM_DIRECTION_IN,
+                                                  borrowing_String(path),
+                                                  true);
+            LineIndexing ix;
+            LineIndexing_init(&ix);
+            ScanOptions opts = default_ScanOptions;
+            opts.index = &ix;
+            Report r = Report_scan(&in, &opts);
+            BufferedStream_close(&in);
+            BufferedStream_release(&in);
+            int outfd = open(ixpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            BufferedStream out = fd_BufferedStream(outfd, STREAM_DIRECTION_OUT,
+                                                   borrowing_String(ixpath),
+                                                   true);
+            Result(Unit) rw = LineIndexing_write(
+                &ix, LineIndexing_kind(&r.lc), r.bytecount, &out);
+            TEST_ASSERT((! Report_is_failure(&r))
+                        && (LineIndexing_kind(&r.lc) == k)
+                        && Result_is_Ok(rw));
+            Result_release(rw);
+            BufferedStream_close(&out);
+            BufferedStream_release(&out);
+            LineIndexing_release(&ix);
+            Report_release(&r);
+
+            Result(LineIndex) rix = LineIndex_read(ixpath);
+            if (Result_is_Err(rix)) {
+                TEST_ERROR("can't read the index");
+                Result_release(rix);
+                break;
+            }
+            LineIndex *li = &rix.ok;
+            bool ok = (li->kind == k) && (li->linecount == nstarts)
+                && (li->datasize == len);
+            for (size_t l = 0; ok && (l < nstarts); l++) {
+                u64 s, e;
+                u64 expected_end = (l + 1 < nstarts) ? starts[l + 1] : len;
+                ok = LineIndex_line_range(li, l, &s, &e)
+                    && (s == starts[l]) && (e == expected_end);
+                for (u64 o = s; ok && (o < e); o += 1 + o % 97) {
+                    u64 line;
+                    ok = LineIndex_line_at(li, o, &line) && (line == l);
+                }
+            }
+            u64 s, e, line;
+            ok = ok && ! LineIndex_line_range(li, nstarts, &s, &e)
+                && ! LineIndex_line_at(li, len, &line);
+            if (! ok) {
+                WARN_("line index on %zu bytes (%s) is wrong", len,
+                      LineSeparator_name(k));
+                failures++;
+            }
+            LineIndex_release(li);
+        }
+        TEST_ASSERT(failures == 0);
+
+        // A broken index
+        {
+            FILE *f = fopen(ixpath, "r+");
+            if (f) {
+                // the highest byte of the number of lines
+                fseek(f, LINEINDEX_MAGICLEN + 15, SEEK_SET);
+                fputc(0x55, f);
+                fclose(f);
+            }
+            Result(LineIndex) rix = LineIndex_read(ixpath);
+            TEST_ASSERT(Result_is_Err(rix));
+            Result_release(rix);
+            rix = LineIndex_read(path);
+            TEST_ASSERT(Result_is_Err(rix));
+            Result_release(rix);
+        }
+        unlink(path);
+        unlink(ixpath);
+        free(starts);
+        free(buf);
+    }
+#undef LIBUFSIZ
+}
+
+#endif /* TEST_LINEINDEX_H_ */
@@ -0,0 +1,57 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_PARALLELSCAN_H_
+#define TEST_PARALLELSCAN_H_
+
+#include "testinfra.h"
+#include "parallelscan.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+static
+void test_parallelscan(TestStatistics *stats) {
+#define PBUFSIZ 3000
+    u8 buf[PBUFSIZ];
+    const char *pieces[] = {
+        "\r", "\n", "\r\n", "a", "xyz", "\xc3\xa4", "\xe2\x82\xac",
+        "\xf0\x90\x8d\x88"
+    };
+    u64 rnd = 0x853C49E6748FEA9B;
+    int failures = 0;
+    for (int round = 0; round < 500; round++) {
+        size_t len = 0;
+        size_t targetlen = t_random(&rnd) % (PBUFSIZ - 10);
+        while (len < targetlen) {
+            const char *s = pieces[t_random(&rnd) % 8];
+            for (; *s; s++) {
+                buf[len++] = *s;
+            }
+        }
+        if (len && (round % 4 == 0)) {
+            buf[t_random(&rnd) % len] = 0x80 + t_random(&rnd) % 0x80;
+        }
+
+        LineCount expected = default_LineCount;
+        size_t expected_n = utf8_valid_prefix(buf, len);
+        LineCount_valid_bytes(&expected, buf, expected_n);
+
+        int threads = 1 + round % 9;
+        LineCount got = default_LineCount;
+        size_t got_n = parallel_scan(buf, len, threads, &got,
+                                     utf8_valid_prefix);
+
+        if ((got_n != expected_n) || (! LineCount_equal(&expected, &got))) {
+            WARN_("parallel_scan on %zu bytes with %i threads: "
+                  "expected n = %zu, got %zu", len, threads,
+                  expected_n, got_n);
+            failures++;
+        }
+    }
+    TEST_ASSERT(failures == 0);
+#undef PBUFSIZ
+}
+
+#endif /* TEST_PARALLELSCAN_H_ */
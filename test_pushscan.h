@@ -0,0 +1,160 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_PUSHSCAN_H_
+#define TEST_PUSHSCAN_H_
+
+#include <string.h>
+#include "testinfra.h"
+#include "pushscan.h"
+#include "report.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+static
+bool t_pushscan_reports_equal(const Report *a, const Report *b) {
+    return (Report_is_failure(a) == Report_is_failure(b))
+        && (a->failure.kind == b->failure.kind)
+        && (a->failure.context == b->failure.context)
+        && (a->bytecount == b->bytecount)
+        && (a->encoding == b->encoding) && (a->has_bom == b->has_bom)
+        && LineCount_equal(&a->lc, &b->lc)
+        && (a->is_csv == b->is_csv)
+        && ((! a->is_csv)
+            || (LineCount_equal(&a->csv.cells, &b->csv.cells)
+                && (a->csv.row_pending == b->csv.row_pending)));
+}
+
+// Returns true if feeding [p, p+len) in random fragments (some of
+// them empty) gives the same report as `Report_scan`.
+static
+bool t_pushscan(u8 *p, size_t len, const ScanOptions *opts, u64 *rnd) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, p, len), STREAM_DIRECTION_IN,
+        literal_String("buffer"));
+    Report expected = Report_scan(&in, opts);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+
+    PushScan s;
+    PushScan_init(&s, opts);
+    size_t maxfragment = 1 + t_random(rnd) % ((t_random(rnd) % 2) ? 5
+                                               : 300);
+    size_t i = 0;
+    bool is_valid = true;
+    bool ok = true;
+    while (i < len) {
+        size_t n = t_random(rnd) % (maxfragment + 1);
+        if (n > len - i) n = len - i;
+        bool v = PushScan_feed(&s, p + i, n);
+        // once invalid, it stays so
+        ok = ok && (is_valid || ! v);
+        is_valid = v;
+        i += n;
+    }
+    Report r = PushScan_finish(&s);
+    ok = ok && t_pushscan_reports_equal(&expected, &r)
+        && (is_valid || Report_is_failure(&r));
+    Report r2 = PushScan_finish(&s);
+    ok = ok && t_pushscan_reports_equal(&r, &r2);
+    if (! ok) {
+        WARN_("push scanning %zu bytes in fragments of up to %zu bytes "
+              "(decoder %i, csv %i) differs from Report_scan", len,
+              maxfragment, opts->decoder, opts->csv);
+    }
+    Report_release(&r);
+    Report_release(&expected);
+    return ok;
+}
+
+static
+void test_pushscan(TestStatistics *stats) {
+#define PSBUFSIZ 2000
+    const char *boms[] = { "", "", "\xEF\xBB\xBF", "\xFF\xFE", "\xFE\xFF",
+                           "\xEF\xBB" };
+    // (with their lengths, for the UTF-16 ones)
+    const struct { const char *s; size_t len; } pieces[] = {
+        { "a", 1 }, { "\r", 1 }, { "\n", 1 }, { "\r\n", 2 }, { "\"", 1 },
+        { ",", 1 }, { "\xC3\xA4", 2 }, { "\xE2\x82\xAC", 3 },
+        { "\xF0\x9F\x98\x80", 4 }, { "\0\n", 2 }, { "\n\0", 2 },
+        { "\x3D\xD8\x00\xDE", 4 },
+        // overlong CR, LF and quote, see linecount.h
+        { "\xC0\x8D", 2 }, { "\xE0\x80\x8A", 3 }, { "\xC0\xA2", 2 }
+    }, invalid[] = {
+        { "\xFF", 1 }, { "\xC3", 1 }, { "\xE2\x82", 2 }, { "\xC3\x41", 2 },
+        { "\xF4\x90\x80\x80", 4 }, { "\xF7\xBF\xBF\xBF", 4 },
+        { "\x00\xDC", 2 }, { "\x00\xD8", 2 }
+    };
+    u8 buf[PSBUFSIZ];
+    u64 rnd = 0x510E527FADE682D1;
+    int failures = 0;
+    for (int round = 0; round < 4000; round++) {
+        size_t len = 0;
+        const char *bom = boms[round % (sizeof(boms) / sizeof(boms[0]))];
+        memcpy(buf, bom, strlen(bom));
+        len = strlen(bom);
+        size_t targetlen = t_random(&rnd)
+            % ((round % 3) ? 40 : PSBUFSIZ - 8);
+        while (len < targetlen) {
+            u64 r = t_random(&rnd);
+            size_t k = r % (sizeof(pieces) / sizeof(pieces[0]));
+            memcpy(buf + len, pieces[k].s, pieces[k].len);
+            len += pieces[k].len;
+        }
+        // an invalid sequence, in the middle or at the end, in some
+        // rounds
+        if (round % 4 == 1) {
+            u64 r = t_random(&rnd);
+            size_t k = r % (sizeof(invalid) / sizeof(invalid[0]));
+            size_t at = (r >> 8) % (len + 1);
+            size_t slen = invalid[k].len;
+            memmove(buf + at + slen, buf + at, len - at);
+            memcpy(buf + at, invalid[k].s, slen);
+            len += slen;
+        }
+        ScanOptions opts = default_ScanOptions;
+        opts.lazy_column = false;
+        opts.decoder = (round % 2) ? UTF8_DECODER_DFA : UTF8_DECODER_SIMD;
+        opts.csv = (round % 5 == 0);
+        if (! t_pushscan(buf, len, &opts, &rnd)) {
+            failures++;
+        }
+    }
+    TEST_ASSERT(failures == 0);
+#undef PSBUFSIZ
+
+    // Empty input, and input shorter than a BOM
+    {
+        ScanOptions opts = default_ScanOptions;
+        opts.lazy_column = false;
+        TEST_ASSERT(t_pushscan((u8 *)"", 0, &opts, &rnd));
+        TEST_ASSERT(t_pushscan((u8 *)"\xEF", 1, &opts, &rnd));
+        TEST_ASSERT(t_pushscan((u8 *)"\xFF\xFE", 2, &opts, &rnd));
+        TEST_ASSERT(t_pushscan((u8 *)"\xFF\xFE" "a", 3, &opts, &rnd));
+        TEST_ASSERT(t_pushscan((u8 *)"\r", 1, &opts, &rnd));
+    }
+
+    // An overlong CR split between fragments counts as in one piece
+    // (as some other character)
+    {
+        ScanOptions opts = default_ScanOptions;
+        opts.lazy_column = false;
+        PushScan s;
+        PushScan_init(&s, &opts);
+        PushScan_feed(&s, (const u8 *)"a\xC0", 2);
+        PushScan_feed(&s, (const u8 *)"\x8D" "b\n", 3);
+        Report split = PushScan_finish(&s);
+        PushScan_init(&s, &opts);
+        PushScan_feed(&s, (const u8 *)"a\xC0\x8D" "b\n", 5);
+        Report whole = PushScan_finish(&s);
+        TEST_ASSERT(t_pushscan_reports_equal(&whole, &split)
+                    && (split.lc.CRcount == 0) && (split.lc.LFcount == 1)
+                    && (split.lc.charcount == 4));
+        Report_release(&split);
+        Report_release(&whole);
+    }
+}
+
+#endif /* TEST_PUSHSCAN_H_ */
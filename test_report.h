@@ -0,0 +1,186 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_REPORT_H_
+#define TEST_REPORT_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "report.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+static
+Report t_report_buf(const u8 *p, size_t len, bool lazy_column) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)p, len),
+        STREAM_DIRECTION_IN,
+        literal_String("buf"));
+    ScanOptions opts = default_ScanOptions;
+    opts.lazy_column = lazy_column;
+    Report r = Report_scan(&in, &opts);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return r;
+}
+
+static
+bool t_report_equal(const Report *expected, const Report *got) {
+    // (the column is only meaningful in case of a failure)
+    LineCount lc = got->lc;
+    if (! Report_is_failure(got)) {
+        lc.column = expected->lc.column;
+    }
+    bool ok = LineCount_equal(&expected->lc, &lc)
+        && (Report_is_failure(expected) == Report_is_failure(got))
+        && ((! Report_is_failure(expected))
+            || (0 == strcmp(expected->failure.str, got->failure.str)));
+    if (! ok) {
+        WARN_("Report_scan: expected column %li (%s), got %li (%s)",
+              expected->lc.column,
+              expected->failure.str ? expected->failure.str : "ok",
+              got->lc.column,
+              got->failure.str ? got->failure.str : "ok");
+    }
+    return ok;
+}
+
+// Overlong encodings of CR and LF are not line separators, wherever
+// the read buffer ends (see linecount.h): scan 'a's, a CR, the
+// overlong sequence, "b\n", with the end of the first buffer at each
+// position in the sequence, from a file and from memory.
+static
+void t_report_overlong(TestStatistics *stats) {
+    const char *seqs[] = {
+        "\xc0\x8d", "\xc0\x8a", "\xe0\x80\x8d", "\xf0\x80\x80\x8a"
+    };
+    const char *path = ".test-report.out";
+    size_t bufsiz = BufferedStream_buffersize;
+    u8 *buf = (u8 *)xmalloc(bufsiz + 8);
+    for (size_t k = 0; k < sizeof(seqs) / sizeof(seqs[0]); k++) {
+        size_t seqlen = strlen(seqs[k]);
+        for (size_t split = 0; split <= seqlen; split++) {
+            size_t len = bufsiz - split;
+            memset(buf, 'a', len - 1);
+            buf[len - 1] = '\r';
+            memcpy(buf + len, seqs[k], seqlen);
+            len += seqlen;
+            memcpy(buf + len, "b\n", 2);
+            len += 2;
+            LineCount expected = default_LineCount;
+            expected.charcount = len - seqlen + 1;
+            expected.CRcount = 1;
+            expected.LFcount = 1;
+            FILE *out = fopen(path, "w");
+            if (! out) {
+                TEST_ERROR("can't create file");
+                break;
+            }
+            fwrite(buf, 1, len, out);
+            fclose(out);
+            for (int decoder = 0; decoder < 2; decoder++) {
+                ScanOptions opts = default_ScanOptions;
+                opts.decoder = decoder ? UTF8_DECODER_DFA : UTF8_DECODER_SIMD;
+                int fd = open(path, O_RDONLY);
+                if (fd < 0) {
+                    TEST_ERROR("can't open file");
+                    break;
+                }
+                BufferedStream in = fd_BufferedStream(
+                    fd, STREAM_DIRECTION_IN, borrowing_String(path), true);
+                Report r = Report_scan(&in, &opts);
+                BufferedStream_close(&in);
+                BufferedStream_release(&in);
+                Report r2 = t_report_buf(buf, len, opts.lazy_column);
+                r.lc.column = r2.lc.column = 0;
+                if (! (LineCount_equal(&expected, &r.lc)
+                       && LineCount_equal(&expected, &r2.lc))) {
+                    WARN_("overlong sequence %zu split at %zu (decoder "
+                          "%i): CRcount %li/%li, LFcount %li/%li", k,
+                          split, decoder, r.lc.CRcount, r2.lc.CRcount,
+                          r.lc.LFcount, r2.lc.LFcount);
+                }
+                TEST_ASSERT(LineCount_equal(&expected, &r.lc)
+                            && LineCount_equal(&expected, &r2.lc));
+                Report_release(&r);
+                Report_release(&r2);
+            }
+        }
+    }
+    unlink(path);
+    free(buf);
+}
+
+// The lazily reconstructed column must be the one tracked eagerly,
+// for memory and for (non-mapped) file streams.
+static
+void test_report(TestStatistics *stats) {
+#define RBUFSIZ 100000
+    u8 *buf = (u8 *)xmalloc(RBUFSIZ);
+    u64 rnd = 0x6A09E667F3BCC909;
+    const char *pieces[] = {
+        "\r", "\n", "\r\n", "a", "xyz", "\xc3\xa4", "\xe2\x82\xac"
+    };
+    int failures = 0;
+    for (int round = 0; round < 300; round++) {
+        // Separators get rare in later rounds, so that lines cross
+        // the read buffer boundaries
+        size_t len = 0;
+        size_t targetlen = t_random(&rnd) % (RBUFSIZ - 10);
+        u64 sep_rate = 2 + round * round;
+        while (len < targetlen) {
+            u64 r = t_random(&rnd);
+            const char *s = pieces[(r % sep_rate < 3) ? r % 3 : 3 + r % 4];
+            for (; *s; s++) {
+                buf[len++] = *s;
+            }
+        }
+        if (len && (round % 4 != 0)) {
+            buf[len - 1 - t_random(&rnd) % (len < 1000 ? len : 1000)] = 0xff;
+        }
+        Report expected = t_report_buf(buf, len, false);
+        Report got = t_report_buf(buf, len, true);
+        if (! t_report_equal(&expected, &got)) failures++;
+        Report_release(&got);
+
+        if (round % 10 == 0) {
+            const char *path = ".test-report.out";
+            FILE *out = fopen(path, "w");
+            if (! out) {
+                TEST_ERROR("can't create file");
+                break;
+            }
+            fwrite(buf, 1, len, out);
+            fclose(out);
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                TEST_ERROR("can't open file");
+                break;
+            }
+            BufferedStream in = fd_BufferedStream(fd, STREAM_DIRECTION_IN,
+                                                  borrowing_String(path),
+                                                  true);
+            TEST_ASSERT(BufferedStream_can_reread(&in));
+            ScanOptions opts = default_ScanOptions;
+            Report got2 = Report_scan(&in, &opts);
+            if (! t_report_equal(&expected, &got2)) failures++;
+            Report_release(&got2);
+            BufferedStream_close(&in);
+            BufferedStream_release(&in);
+            unlink(path);
+        }
+        Report_release(&expected);
+    }
+    TEST_ASSERT(failures == 0);
+    free(buf);
+#undef RBUFSIZ
+
+    t_report_overlong(stats);
+}
+
+#endif /* TEST_REPORT_H_ */
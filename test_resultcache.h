@@ -0,0 +1,172 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_RESULTCACHE_H_
+#define TEST_RESULTCACHE_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "testinfra.h"
+#include "resultcache.h"
+#include "report.h"
+
+
+// Write len bytes from p to the file at path, with the modification
+// time set to mtime (seconds since the epoch).
+static
+void t_resultcache_write(const char *path, const char *p, size_t len,
+                         time_t mtime) {
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fwrite(p, 1, len, f);
+        fclose(f);
+    }
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+// Scan the file at path, store the result in c, and look it up again
+// (as what is_csv_lookup). Returns whether it was found and equal.
+static
+bool t_resultcache_roundtrip(const ResultCache *c, const char *path,
+                             bool is_csv, bool is_csv_lookup) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    ScanOptions opts = default_ScanOptions;
+    opts.csv = is_csv;
+    BufferedStream in = fd_BufferedStream(fd, STREAM_DIRECTION_IN,
+                                          borrowing_String(path), false);
+    Report r = Report_scan(&in, &opts);
+    int err = ResultCache_store(c, fd, &st, &r);
+    Report cached;
+    bool found = (err == 0)
+        && ResultCache_lookup(c, fd, &st, is_csv_lookup, &cached);
+    bool ok = found && ResultCache_reports_equal(&cached, &r);
+    if (found) {
+        Report_release(&cached);
+    }
+    Report_release(&r);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return ok;
+}
+
+// Whether there is an entry in c for the file at path, as it is now.
+static
+bool t_resultcache_has(const ResultCache *c, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    Report r;
+    bool found = ResultCache_lookup(c, fd, &st, false, &r);
+    if (found) {
+        Report_release(&r);
+    }
+    close(fd);
+    return found;
+}
+
+static
+void test_resultcache(TestStatistics *stats) {
+    const char *path = ".test-resultcache.in";
+    const char *dir = ".test-resultcache.d";
+    const time_t old = 1600000000;
+    ResultCache c = {
+        .dir = dir,
+        .use_fingerprint = false,
+        .verify = false,
+        .max_entries = RESULTCACHE_DEFAULT_MAX_ENTRIES
+    };
+    ResultCache cf = c;
+    cf.use_fingerprint = true;
+
+    // Storing and looking up valid and invalid input, plain and CSV
+    {
+        t_resultcache_write(path, "a\r\nb,\"c\nd\"\r\n", 13, old);
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, false, false));
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, true, true));
+        TEST_ASSERT(! t_resultcache_roundtrip(&c, path, true, false));
+        TEST_ASSERT(t_resultcache_roundtrip(&cf, path, false, false));
+        t_resultcache_write(path, "\xEF\xBB\xBF" "a\rb\xC3", 7, old);
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, false, false));
+        t_resultcache_write(path, "a,\"b\n", 5, old);
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, true, true));
+        t_resultcache_write(path, "\xFF\xFE" "a\0\n\0", 6, old);
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, false, false));
+    }
+
+    // Changes to the file
+    {
+        t_resultcache_write(path, "line 1\nline 2\n", 14, old);
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, false, false));
+        TEST_ASSERT(t_resultcache_roundtrip(&cf, path, false, false));
+        // the same size and modification time: only the fingerprint
+        // notices
+        t_resultcache_write(path, "line 1\rline 2\n", 14, old);
+        TEST_ASSERT(t_resultcache_has(&c, path));
+        TEST_ASSERT(! t_resultcache_has(&cf, path));
+        t_resultcache_write(path, "line 1\rline 2\n", 14, old + 1);
+        TEST_ASSERT(! t_resultcache_has(&c, path));
+        t_resultcache_write(path, "line 1\nline 2\n\n", 15, old);
+        TEST_ASSERT(! t_resultcache_has(&c, path));
+        // too new to be stored
+        t_resultcache_write(path, "line 1\n", 7, time(NULL));
+        TEST_ASSERT(! t_resultcache_roundtrip(&c, path, false, false));
+    }
+
+    // A broken entry is not used
+    {
+        t_resultcache_write(path, "line 1\n", 7, old);
+        TEST_ASSERT(t_resultcache_roundtrip(&c, path, false, false));
+        struct stat st;
+        stat(path, &st);
+        char entry[PATH_MAX];
+        _ResultCache_path(&c, &st, false, entry);
+        FILE *f = fopen(entry, "r+");
+        if (f) {
+            // the encoding
+            fseek(f, RESULTCACHE_MAGICLEN + 8 * 9, SEEK_SET);
+            fputc(0x55, f);
+            fclose(f);
+        }
+        TEST_ASSERT(! t_resultcache_has(&c, path));
+        unlink(entry);
+        _ResultCache_path(&c, &st, true, entry);
+        rmdir(entry);
+        TEST_ASSERT(rmdir(dir) == 0);
+    }
+
+    // Eviction keeps the most recently used entries
+    {
+        const char *shard = ".test-resultcache.shard";
+        mkdir(shard, 0777);
+        char p[PATH_MAX];
+        for (int i = 0; i < 6; i++) {
+            snprintf(p, PATH_MAX, "%s/%x-%x", shard, i, i);
+            t_resultcache_write(p, "", 0, old + ((i * 7) % 6));
+        }
+        snprintf(p, PATH_MAX, "%s/0-0.1-1.tmp", shard);
+        t_resultcache_write(p, "", 0, old - 10);
+        _ResultCache_evict(shard, 2);
+        int n = 0;
+        for (int i = 0; i < 6; i++) {
+            snprintf(p, PATH_MAX, "%s/%x-%x", shard, i, i);
+            bool exists = (access(p, F_OK) == 0);
+            n += exists;
+            TEST_ASSERT(exists == ((i * 7) % 6 >= 4));
+            unlink(p);
+        }
+        snprintf(p, PATH_MAX, "%s/0-0.1-1.tmp", shard);
+        TEST_ASSERT((n == 2) && (unlink(p) == 0));
+        rmdir(shard);
+    }
+    unlink(path);
+}
+
+#endif /* TEST_RESULTCACHE_H_ */
@@ -0,0 +1,195 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_TRANSCODE_H_
+#define TEST_TRANSCODE_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "scankernels.h"
+#include "unicode.h"
+#include "transcode.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+// Whether the UTF-8 [out, out+outlen) decodes to exactly the
+// characters of the input [p, p+len).
+static
+bool t_transcode_decodes_to(const u8 *out, size_t outlen, const u8 *p,
+                            size_t len, bool is_windows1252) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)out, outlen),
+        STREAM_DIRECTION_IN,
+        literal_String("buf"));
+    bool ok = true;
+    size_t i = 0;
+    while (ok) {
+        Result(Option(u32)) c = get_unicodechar(&in);
+        if (Result_is_Err(c)) {
+            Result_release(c);
+            ok = false;
+            break;
+        }
+        if (c.ok.is_none) {
+            break;
+        }
+        u8 b = (i < len) ? p[i] : 0;
+        u32 expected = (is_windows1252 && (b >= 0x80) && (b < 0xA0))
+            ? windows1252_c1[b - 0x80] : b;
+        ok = (i < len) && (c.ok.value == expected);
+        i++;
+    }
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return ok && (i == len);
+}
+
+// Returns true if all variants give the same output and counts as
+// the byte-wise one, converting in two pieces split at `split`, and
+// that output is right.
+static
+bool t_transcode(const u8 *p, size_t len, bool is_windows1252, size_t split,
+                 u8 *expected_out, u8 *out) {
+    LineCount expected_lc = default_LineCount;
+    size_t expected_len = latin1_to_utf8_bytewise(&expected_lc, p, len,
+                                                  expected_out,
+                                                  is_windows1252);
+    bool ok = t_transcode_decodes_to(expected_out, expected_len, p, len,
+                                     is_windows1252);
+    if (! ok) {
+        WARN_("latin1_to_utf8_bytewise on %zu bytes: wrong output", len);
+    }
+    if (split > len) {
+        split = len;
+    }
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if (! CpuLevel_is_supported((CpuLevel)level)) {
+            continue;
+        }
+        const ScanKernels *k = &scankernels_by_level[level];
+        transcode_to_utf8_fn convert = is_windows1252
+            ? k->windows1252_to_utf8 : k->latin1_to_utf8;
+        LineCount lc = default_LineCount;
+        size_t n = convert(&lc, p, split, out);
+        n += convert(&lc, p + split, len - split, out + n);
+        if ((n != expected_len) || memcmp(out, expected_out, n)
+            || ! LineCount_equal(&expected_lc, &lc)) {
+            WARN_("%s_to_utf8 (%s) on %zu bytes differs",
+                  is_windows1252 ? "windows1252" : "latin1",
+                  CpuLevel_name((CpuLevel)level), len);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static
+void test_transcode(TestStatistics *stats) {
+#define TCBUFSIZ 700
+    u8 buf[TCBUFSIZ];
+    u8 *expected_out = (u8 *)xmalloc(TRANSCODE_UTF8_MAXLEN(TCBUFSIZ));
+    u8 *out = (u8 *)xmalloc(TRANSCODE_UTF8_MAXLEN(TCBUFSIZ));
+
+    // All bytes, in both encodings
+    {
+        for (int i = 0; i < 256; i++) {
+            buf[i] = i;
+        }
+        TEST_ASSERT(t_transcode(buf, 256, false, 100, expected_out, out));
+        TEST_ASSERT(t_transcode(buf, 256, true, 100, expected_out, out));
+    }
+
+    // Random text with varying density of high bytes and separators
+    {
+        const u8 bytes[] = {
+            'a', 'b', ' ', '\r', '\n', 0xe4, 0xff, 0x80, 0x9d, 0xc0, 0xbf
+        };
+        u64 rnd = 0xBB67AE8584CAA73B;
+        int failures = 0;
+        for (int round = 0; round < 2000; round++) {
+            size_t len = t_random(&rnd) % TCBUFSIZ;
+            u64 ascii_rate = 1 + round % 20;
+            for (size_t i = 0; i < len; i++) {
+                u64 r = t_random(&rnd);
+                buf[i] = (r % ascii_rate)
+                    ? 'a' + r % 26 : bytes[(r >> 8) % sizeof(bytes)];
+            }
+            if (! t_transcode(buf, len, round & 1,
+                              t_random(&rnd) % (len + 1),
+                              expected_out, out)) {
+                failures++;
+            }
+        }
+        TEST_ASSERT(failures == 0);
+    }
+
+    free(out);
+    free(expected_out);
+#undef TCBUFSIZ
+
+    // Transcoding_run between files, in several chunks
+    {
+        size_t len = 3 * TRANSCODE_CHUNKSIZE + 1234;
+        u8 *p = (u8 *)xmalloc(len);
+        u64 rnd = 0x3C6EF372FE94F82B;
+        for (size_t i = 0; i < len; i++) {
+            u64 r = t_random(&rnd);
+            p[i] = (r % 7) ? 'a' + r % 26 : (r % 3) ? '\r' : r >> 8;
+        }
+        LineCount expected_lc = default_LineCount;
+        u8 *expected = (u8 *)xmalloc(TRANSCODE_UTF8_MAXLEN(len));
+        size_t expected_len = latin1_to_utf8_bytewise(&expected_lc, p, len,
+                                                      expected, true);
+        LineCount_finish(&expected_lc);
+        const char *inpath = ".test-transcode.in";
+        const char *outpath = ".test-transcode.out";
+        FILE *f = fopen(inpath, "w");
+        if (f) {
+            fwrite(p, 1, len, f);
+            fclose(f);
+        }
+        int infd = open(inpath, O_RDONLY);
+        int outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if ((! f) || (infd < 0) || (outfd < 0)) {
+            TEST_ERROR("can't create files");
+        } else {
+            BufferedStream in = fd_BufferedStream(
+                infd, STREAM_DIRECTION_IN, borrowing_String(inpath), true);
+            BufferedStream outs = fd_BufferedStream(
+                outfd, STREAM_DIRECTION_OUT, borrowing_String(outpath), true);
+            Transcoding t = Transcoding_run(&in, &outs,
+                                            ENCODING_WINDOWS1252);
+            TEST_ASSERT(! Transcoding_is_failure(&t)
+                        && (t.bytes_in == len)
+                        && (t.bytes_out == expected_len)
+                        && LineCount_equal(&expected_lc, &t.lc));
+            Transcoding_release(&t);
+            Result(Unit) rc = BufferedStream_close(&in);
+            Result_release(rc);
+            rc = BufferedStream_close(&outs);
+            TEST_ASSERT(Result_is_Ok(rc));
+            Result_release(rc);
+            BufferedStream_release(&in);
+            BufferedStream_release(&outs);
+
+            u8 *got = (u8 *)xmalloc(expected_len + 1);
+            f = fopen(outpath, "r");
+            size_t n = f ? fread(got, 1, expected_len + 1, f) : 0;
+            if (f) fclose(f);
+            TEST_ASSERT((n == expected_len)
+                        && (memcmp(got, expected, n) == 0));
+            free(got);
+        }
+        unlink(inpath);
+        unlink(outpath);
+        free(expected);
+        free(p);
+    }
+}
+
+#endif /* TEST_TRANSCODE_H_ */
@@ -88,6 +88,39 @@ void t_utf8_equal_codepoint(u32 codepoint,
                                __FILE__, __LINE__, stats);              \
     }
 
+// Decode buf, which must fail with the message expected, without
+// allocating the error.
+static
+void t_utf8_error(const char *expected, const unsigned char *buf,
+                  size_t buflen, const char *sourcefile, int sourceline,
+                  TestStatistics *stats) {
+    Result(u32) rc = buf_to_utf8_codepoint(buf, buflen);
+    if (Result_is_Ok(rc)) {
+        WARN_("*** Test failed: expected an error, got %u at %s:%i",
+              rc.ok, sourcefile, sourceline);
+        stats->failures++;
+        return;
+    }
+    char msg[ERROR_MSGSIZ];
+    const char *str = Error_format(&rc.err, msg, ERROR_MSGSIZ);
+    if ((0 == strcmp(str, expected)) && ! rc.err.needs_freeing
+        && (ErrorKind_subsystem(rc.err.kind) == ERROR_SUBSYSTEM_UTF8)) {
+        stats->successes++;
+    } else {
+        WARN_("*** Test failed: expected error '%s', got '%s' at %s:%i",
+              expected, str, sourcefile, sourceline);
+        stats->failures++;
+    }
+    Result_release(rc);
+}
+
+#define T_UTF8_ERROR(expected, ...)                                     \
+    {                                                                   \
+        const unsigned char buf[] = { __VA_ARGS__ };                    \
+        t_utf8_error(expected, buf, sizeof(buf),                        \
+                     __FILE__, __LINE__, stats);                        \
+    }
+
 void test_unicode(TestStatistics *stats) {
 
     /* failing tests to verify test program
@@ -102,6 +135,13 @@ void test_unicode(TestStatistics *stats) {
     T_UTF8_EQUAL_CODEPOINT(0x20AC, 0xE2, 0x82, 0xAC);
     T_UTF8_EQUAL_CODEPOINT(0xD55C, 0xED, 0x95, 0x9C);
     T_UTF8_EQUAL_CODEPOINT(0x10348, 0xF0, 0x90, 0x8D, 0x88);
+
+    T_UTF8_ERROR("invalid start byte decoding UTF-8", 0xFF);
+    T_UTF8_ERROR("premature EOF decoding UTF-8 (byte #3)", 0xE2, 0x82);
+    T_UTF8_ERROR("invalid continuation byte decoding UTF-8 (byte #2)",
+                 0xE2, 0x41, 0xAC);
+    T_UTF8_ERROR("invalid unicode codepoint (1114112, 0x110000)",
+                 0xF4, 0x90, 0x80, 0x80);
     if (! env("EXHAUSTIVE")) {
         T_UTF8_EQUAL_CODEPOINT(0x10FFF0, 0xf4, 0x8f, 0xbf, 0xb0);
     } else {
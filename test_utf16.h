@@ -0,0 +1,306 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_UTF16_H_
+#define TEST_UTF16_H_
+
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "testinfra.h"
+#include "scankernels.h"
+#include "unicode.h"
+#include "report.h"
+#include "test_linecount.h" /* LineCount_equal */
+
+
+static
+void t_utf16_put(u8 *p, u16 u, bool is_be) {
+    p[is_be ? 0 : 1] = u >> 8;
+    p[is_be ? 1 : 0] = u & 0xFF;
+}
+
+// Returns the number of bytes written to p (2 or 4).
+static
+size_t t_utf16_encode(u8 *p, u32 c, bool is_be) {
+    if (c < 0x10000) {
+        t_utf16_put(p, c, is_be);
+        return 2;
+    }
+    c -= 0x10000;
+    t_utf16_put(p, 0xD800 | (c >> 10), is_be);
+    t_utf16_put(p + 2, 0xDC00 | (c & 0x3FF), is_be);
+    return 4;
+}
+
+static
+size_t t_utf8_encode(u8 *p, u32 c) {
+    if (c < 0x80) {
+        p[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        p[0] = 0xC0 | (c >> 6);
+        p[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        p[0] = 0xE0 | (c >> 12);
+        p[1] = 0x80 | ((c >> 6) & 0x3F);
+        p[2] = 0x80 | (c & 0x3F);
+        return 3;
+    } else {
+        p[0] = 0xF0 | (c >> 18);
+        p[1] = 0x80 | ((c >> 12) & 0x3F);
+        p[2] = 0x80 | ((c >> 6) & 0x3F);
+        p[3] = 0x80 | (c & 0x3F);
+        return 4;
+    }
+}
+
+// What the valid prefix is, and the counts for it, derived from
+// get_utf16char and LineCount_char.
+static
+size_t utf16_valid_prefix_reference(const u8 *p, size_t len, bool is_be,
+                                    LineCount *lc) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)p, len),
+        STREAM_DIRECTION_IN,
+        literal_String("buf"));
+    size_t valid = 0;
+    while (1) {
+        Result(Option(u32)) c = get_utf16char(&in, is_be);
+        if (Result_is_Err(c)) {
+            Result_release(c);
+            break;
+        }
+        if (c.ok.is_none) {
+            break;
+        }
+        LineCount_char(lc, c.ok.value);
+        valid = in.buffer.lslice.startpos;
+    }
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return valid;
+}
+
+// Returns true if all variants agree with the reference, for the
+// validation and for counting the valid prefix in two pieces split
+// at `split` (to check the carrying of a CR).
+static
+bool t_utf16_kernels(const u8 *p, size_t len, bool is_be, size_t split) {
+    LineCount expected_lc = default_LineCount;
+    size_t expected = utf16_valid_prefix_reference(p, len, is_be,
+                                                   &expected_lc);
+    bool ok = true;
+    size_t got_unitwise = utf16_valid_prefix_unitwise(p, len, is_be);
+    if (got_unitwise != expected) {
+        WARN_("utf16_valid_prefix_unitwise on %zu bytes: expected %zu, "
+              "got %zu", len, expected, got_unitwise);
+        ok = false;
+    }
+    split = (split > expected) ? expected : split & ~(size_t)1;
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if (! CpuLevel_is_supported((CpuLevel)level)) {
+            continue;
+        }
+        const ScanKernels *k = &scankernels_by_level[level];
+        size_t got = is_be ? k->utf16be_valid_prefix(p, len)
+            : k->utf16le_valid_prefix(p, len);
+        if (got != expected) {
+            WARN_("utf16%s_valid_prefix (%s) on %zu bytes: expected %zu, "
+                  "got %zu", is_be ? "be" : "le",
+                  CpuLevel_name((CpuLevel)level), len, expected, got);
+            ok = false;
+        }
+        LineCount_valid_bytes_fn count = is_be
+            ? k->LineCount_utf16be_valid_bytes
+            : k->LineCount_utf16le_valid_bytes;
+        LineCount lc = default_LineCount;
+        // (the split never falls between the units of a pair here,
+        // as the kernels are only used on complete characters)
+        if ((split < expected)
+            && utf16_is_low_surrogate(utf16_unit(p + split, is_be))) {
+            split -= 2;
+        }
+        count(&lc, p, split);
+        count(&lc, p + split, expected - split);
+        if (! LineCount_equal(&expected_lc, &lc)) {
+            WARN_("LineCount_utf16%s_valid_bytes (%s) on %zu bytes "
+                  "differs", is_be ? "be" : "le",
+                  CpuLevel_name((CpuLevel)level), expected);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Report_scan on UTF-16 input with a BOM, read from a (non-mapped)
+// file so that characters cross the buffer boundaries, must give the
+// same report as on the same text in UTF-8.
+static
+bool t_utf16_report(const u8 *p16, size_t len16, const u8 *p8,
+                    size_t len8) {
+    BufferedStream in8 = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)p8, len8),
+        STREAM_DIRECTION_IN,
+        literal_String("buf"));
+    ScanOptions opts = default_ScanOptions;
+    opts.lazy_column = false;
+    Report expected = Report_scan(&in8, &opts);
+    BufferedStream_close(&in8);
+    BufferedStream_release(&in8);
+
+    const char *path = ".test-utf16.out";
+    FILE *out = fopen(path, "w");
+    if (! out) {
+        Report_release(&expected);
+        return false;
+    }
+    fwrite(p16, 1, len16, out);
+    fclose(out);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        Report_release(&expected);
+        return false;
+    }
+    BufferedStream in = fd_BufferedStream(fd, STREAM_DIRECTION_IN,
+                                          borrowing_String(path), true);
+    Report got = Report_scan(&in, &opts);
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    unlink(path);
+
+    bool ok = got.has_bom && (got.encoding != ENCODING_UTF8)
+        && (! Report_is_failure(&got))
+        && LineCount_equal(&expected.lc, &got.lc)
+        && (got.bytecount == len16);
+    if (! ok) {
+        WARN_("Report_scan on %zu bytes of UTF-16: %s, charcount "
+              "expected %li, got %li", len16,
+              got.failure.str ? got.failure.str : "ok",
+              expected.lc.charcount, got.lc.charcount);
+    }
+    Report_release(&expected);
+    Report_release(&got);
+    return ok;
+}
+
+static
+void test_utf16(TestStatistics *stats) {
+    // BOM detection
+    {
+        Encoding e;
+        TEST_ASSERT(Encoding_from_bom((const u8*)"\xFF\xFE" "a", 3, &e) == 2
+                    && e == ENCODING_UTF16LE);
+        TEST_ASSERT(Encoding_from_bom((const u8*)"\xFE\xFF", 2, &e) == 2
+                    && e == ENCODING_UTF16BE);
+        TEST_ASSERT(Encoding_from_bom((const u8*)"\xEF\xBB\xBF", 3, &e) == 3
+                    && e == ENCODING_UTF8);
+        TEST_ASSERT(Encoding_from_bom((const u8*)"\xEF\xBB", 2, &e) == 0
+                    && e == ENCODING_UTF8);
+        TEST_ASSERT(Encoding_from_bom((const u8*)"ab", 2, &e) == 0
+                    && e == ENCODING_UTF8);
+    }
+
+    // Errors
+    {
+        const struct {
+            const char *bytes; // little endian
+            size_t len;
+            ErrorKind kind;
+            u32 context;
+        } cases[] = {
+            { "a", 1, ERROR_UTF16_PREMATURE_EOF, 2 },
+            { "\x00\xD8", 2, ERROR_UTF16_PREMATURE_EOF, 3 },
+            { "\x00\xD8" "a", 3, ERROR_UTF16_PREMATURE_EOF, 4 },
+            { "\x00\xDC", 2, ERROR_UTF16_UNPAIRED_SURROGATE, 0xDC00 },
+            { "\x3D\xD8" "a\x00", 4, ERROR_UTF16_UNPAIRED_SURROGATE,
+              0xD83D },
+        };
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            BufferedStream in = Buffer_to_BufferedStream(
+                Buffer_from_array(false, (unsigned char*)cases[i].bytes,
+                                  cases[i].len),
+                STREAM_DIRECTION_IN,
+                literal_String("buf"));
+            Result(Option(u32)) c = get_utf16char(&in, false);
+            TEST_ASSERT(Result_is_Err(c)
+                        && (c.err.kind == cases[i].kind)
+                        && (c.err.context == cases[i].context));
+            Result_release(c);
+            BufferedStream_close(&in);
+            BufferedStream_release(&in);
+        }
+    }
+
+#define U16BUFSIZ 600
+    // Random text, mostly valid, in both byte orders, against the
+    // reference.
+    {
+        const u32 codepoints[] = {
+            'a', '\n', '\r', 0xe4, 0x0d0a, 0x0a0d, 0xd55c, 0x1F600,
+            0x10FFFF, 0xFFFF
+        };
+        u8 buf[U16BUFSIZ];
+        u64 rnd = 0x3C6EF372FE94F82B;
+        int failures = 0;
+        for (int round = 0; round < 3000; round++) {
+            bool is_be = round & 1;
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (U16BUFSIZ - 4);
+            while (len < targetlen) {
+                u32 c = codepoints[t_random(&rnd) % 10];
+                len += t_utf16_encode(buf + len, c, is_be);
+            }
+            if (len && (round % 3 == 0)) {
+                // a lone surrogate half, or a random byte
+                size_t pos = (t_random(&rnd) % len) & ~(size_t)1;
+                if (round % 2) {
+                    buf[pos] = t_random(&rnd);
+                } else if (pos + 2 <= len) {
+                    t_utf16_put(buf + pos, 0xD800 + t_random(&rnd) % 0x800,
+                                is_be);
+                }
+            }
+            size_t cut = (round % 5 == 0) ? 1 : 0; // odd length
+            if (len < cut) cut = 0;
+            if (! t_utf16_kernels(buf, len - cut, is_be,
+                                  t_random(&rnd) % (len + 1))) {
+                failures++;
+            }
+        }
+        TEST_ASSERT(failures == 0);
+    }
+#undef U16BUFSIZ
+
+    // Report_scan across buffer boundaries
+    {
+        size_t n = 150000;
+        u8 *p16 = (u8 *)xmalloc(2 + 4 * n);
+        u8 *p8 = (u8 *)xmalloc(4 * n);
+        const u32 codepoints[] = { 'a', '\n', '\r', 0xe4, 0x1F600 };
+        u64 rnd = 0xA54FF53A5F1D36F1;
+        int failures = 0;
+        for (int round = 0; round < 4; round++) {
+            bool is_be = round & 1;
+            size_t len16 = 0, len8 = 0;
+            t_utf16_put(p16, 0xFEFF, is_be);
+            len16 = 2;
+            for (size_t i = 0; i < n; i++) {
+                u64 r = t_random(&rnd) % (round < 2 ? 5 : 500);
+                u32 c = codepoints[r < 5 ? r : 0];
+                len16 += t_utf16_encode(p16 + len16, c, is_be);
+                len8 += t_utf8_encode(p8 + len8, c);
+            }
+            if (! t_utf16_report(p16, len16, p8, len8)) failures++;
+        }
+        TEST_ASSERT(failures == 0);
+        free(p8);
+        free(p16);
+    }
+}
+
+#endif /* TEST_UTF16_H_ */
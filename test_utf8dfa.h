@@ -0,0 +1,119 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_UTF8DFA_H_
+#define TEST_UTF8DFA_H_
+
+#include <string.h>
+#include "testinfra.h"
+#include "unicode.h"
+#include "utf8dfa.h"
+#include "BufferedStream.h"
+
+
+// Decode [p, p+len) with both decoders to the end (continuing after
+// errors), returns true if they agree on every result and on how much
+// they consumed.
+static
+bool t_utf8dfa_agrees(const u8 *p, size_t len) {
+    BufferedStream a = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)p, len),
+        STREAM_DIRECTION_IN,
+        literal_String("a"));
+    BufferedStream b = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)p, len),
+        STREAM_DIRECTION_IN,
+        literal_String("b"));
+    bool ok = true;
+    while (ok) {
+        Result(Option(u32)) ca = get_unicodechar(&a);
+        Result(Option(u32)) cb = get_unicodechar_dfa(&b);
+        if (Result_is_Err(ca) || Result_is_Err(cb)) {
+            ok = Result_is_Err(ca) && Result_is_Err(cb)
+                && (ca.err.kind == cb.err.kind)
+                && (ca.err.context == cb.err.context);
+            if (! ok) {
+                char msga[ERROR_MSGSIZ], msgb[ERROR_MSGSIZ];
+                WARN_("get_unicodechar_dfa: expected '%s', got '%s'",
+                      Result_is_Err(ca)
+                      ? Error_format(&ca.err, msga, ERROR_MSGSIZ) : "(ok)",
+                      Result_is_Err(cb)
+                      ? Error_format(&cb.err, msgb, ERROR_MSGSIZ) : "(ok)");
+            }
+        } else {
+            ok = (ca.ok.is_none == cb.ok.is_none)
+                && (ca.ok.is_none || (ca.ok.value == cb.ok.value));
+            if (! ok) {
+                WARN_("get_unicodechar_dfa: expected %u, got %u",
+                      ca.ok.value, cb.ok.value);
+            }
+        }
+        if (a.buffer.lslice.startpos != b.buffer.lslice.startpos) {
+            WARN_("get_unicodechar_dfa: consumed up to %zu instead of %zu",
+                  b.buffer.lslice.startpos, a.buffer.lslice.startpos);
+            ok = false;
+        }
+        bool is_end = Result_is_Ok(ca) && ca.ok.is_none;
+        Result_release(ca);
+        Result_release(cb);
+        if (is_end) {
+            break;
+        }
+    }
+    BufferedStream_close(&a);
+    BufferedStream_release(&a);
+    BufferedStream_close(&b);
+    BufferedStream_release(&b);
+    return ok;
+}
+
+static
+void test_utf8dfa(TestStatistics *stats) {
+    // All sequences of up to 4 bytes from the bytes around the class
+    // boundaries
+    {
+        const u8 bytes[] = {
+            0x00, 0x0a, 0x0d, 0x41, 0x7f, 0x80, 0x8f, 0x90, 0xbf, 0xc0,
+            0xc3, 0xdf, 0xe0, 0xe2, 0xed, 0xef, 0xf0, 0xf3, 0xf4, 0xf5,
+            0xf7, 0xf8, 0xff
+        };
+        const size_t nbytes = sizeof(bytes);
+        int failures = 0;
+        u8 buf[4];
+        for (size_t len = 1; len <= 4; len++) {
+            size_t n = 1;
+            for (size_t k = 0; k < len; k++) n *= nbytes;
+            for (size_t i = 0; i < n; i++) {
+                size_t x = i;
+                for (size_t k = 0; k < len; k++) {
+                    buf[k] = bytes[x % nbytes];
+                    x /= nbytes;
+                }
+                if (! t_utf8dfa_agrees(buf, len)) failures++;
+            }
+        }
+        TEST_ASSERT(failures == 0);
+    }
+
+    // Random bytes, biased towards non-ASCII
+    {
+#define DBUFSIZ 100
+        u8 buf[DBUFSIZ];
+        u64 rnd = 0xD1B54A32D192ED03;
+        int failures = 0;
+        for (int round = 0; round < 2000; round++) {
+            size_t len = t_random(&rnd) % DBUFSIZ;
+            for (size_t i = 0; i < len; i++) {
+                u64 r = t_random(&rnd);
+                buf[i] = (r & 0x300) ? (0x80 | r) : r;
+            }
+            if (! t_utf8dfa_agrees(buf, len)) failures++;
+        }
+        TEST_ASSERT(failures == 0);
+#undef DBUFSIZ
+    }
+}
+
+#endif /* TEST_UTF8DFA_H_ */
@@ -0,0 +1,148 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TEST_UTF8VALIDATE_H_
+#define TEST_UTF8VALIDATE_H_
+
+#include "testinfra.h"
+#include "scankernels.h"
+#include "utf8dfa.h"
+#include "unicode.h"
+#include "BufferedStream.h"
+
+
+// What utf8_valid_prefix should return, derived from get_unicodechar.
+static
+size_t utf8_valid_prefix_reference(const u8 *p, size_t len) {
+    BufferedStream in = Buffer_to_BufferedStream(
+        Buffer_from_array(false, (unsigned char*)p, len),
+        STREAM_DIRECTION_IN,
+        literal_String("buf"));
+    size_t valid = 0;
+    while (1) {
+        Result(Option(u32)) c = get_unicodechar(&in);
+        if (Result_is_Err(c)) {
+            Result_release(c);
+            break;
+        }
+        if (c.ok.is_none) {
+            break;
+        }
+        valid = in.buffer.lslice.startpos;
+    }
+    BufferedStream_close(&in);
+    BufferedStream_release(&in);
+    return valid;
+}
+
+// Returns true if all variants agree with the reference.
+static
+bool t_utf8_valid_prefix(const u8 *p, size_t len) {
+    size_t expected = utf8_valid_prefix_reference(p, len);
+    bool ok = true;
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++) {
+        if (! CpuLevel_is_supported((CpuLevel)level)) {
+            continue;
+        }
+        size_t got = scankernels_by_level[level].utf8_valid_prefix(p, len);
+        if (got != expected) {
+            WARN_("utf8_valid_prefix (%s) on %zu bytes: expected %zu, got %zu",
+                  CpuLevel_name((CpuLevel)level), len, expected, got);
+            ok = false;
+        }
+    }
+    size_t got_bytewise = utf8_valid_prefix_bytewise(p, len);
+    size_t got_dfa = utf8dfa_valid_prefix(p, len);
+    if ((got_bytewise != expected) || (got_dfa != expected)) {
+        WARN_("utf8_valid_prefix on %zu bytes: expected %zu, got "
+              "bytewise: %zu, dfa: %zu", len, expected, got_bytewise,
+              got_dfa);
+        ok = false;
+    }
+    return ok;
+}
+
+static
+void test_utf8validate(TestStatistics *stats) {
+#define VBUFSIZ 400
+    u8 buf[VBUFSIZ];
+
+    // Each interesting sequence at every position around the block
+    // boundaries, embedded in ASCII.
+    {
+        const u8 seqs[][5] = {
+            // length, bytes
+            { 2, 0xc3, 0xa4 },
+            { 2, 0xc0, 0x80 }, // overlong, accepted by get_unicodechar
+            { 3, 0xe2, 0x82, 0xac },
+            { 3, 0xed, 0xa0, 0x80 }, // surrogate, accepted as well
+            { 4, 0xf0, 0x90, 0x8d, 0x88 },
+            { 4, 0xf4, 0x8f, 0xbf, 0xbf },
+            { 4, 0xf4, 0x90, 0x80, 0x80 }, // > 0x10FFFF
+            { 4, 0xf5, 0x80, 0x80, 0x80 },
+            { 1, 0xf8 },
+            { 1, 0x80 },
+            { 2, 0xc3, 0x41 },
+            { 2, 0xe2, 0x82 },
+            { 3, 0xf0, 0x90, 0x8d },
+            { 4, 0xe2, 0x82, 0xac, 0xac },
+        };
+        int failures = 0;
+        for (size_t s = 0; s < sizeof(seqs) / sizeof(seqs[0]); s++) {
+            size_t seqlen = seqs[s][0];
+            for (size_t pos = 0; pos < 140; pos++) {
+                for (size_t tail = 0; tail < 3; tail++) {
+                    size_t len = pos + seqlen + tail;
+                    memset(buf, 'a', len);
+                    memcpy(buf + pos, &seqs[s][1], seqlen);
+                    if (! t_utf8_valid_prefix(buf, len)) failures++;
+                    if (! t_utf8_valid_prefix(buf, pos + seqlen - 1)) {
+                        failures++;
+                    }
+                }
+            }
+        }
+        TEST_ASSERT(failures == 0);
+    }
+
+    // Random mostly-valid text with occasional corruption.
+    {
+        const u32 codepoints[] = {
+            'a', '\n', '\r', 0xe4, 0x20ac, 0xd55c, 0x10348, 0x10FFFF
+        };
+        u64 rnd = 0x9E3779B97F4A7C15;
+        int failures = 0;
+        for (int round = 0; round < 3000; round++) {
+            size_t len = 0;
+            size_t targetlen = t_random(&rnd) % (VBUFSIZ - 4);
+            while (len < targetlen) {
+                u32 c = codepoints[t_random(&rnd) % 8];
+                if (c < 0x80) {
+                    buf[len++] = c;
+                } else if (c < 0x800) {
+                    buf[len++] = 0xC0 | (c >> 6);
+                    buf[len++] = 0x80 | (c & 0x3F);
+                } else if (c < 0x10000) {
+                    buf[len++] = 0xE0 | (c >> 12);
+                    buf[len++] = 0x80 | ((c >> 6) & 0x3F);
+                    buf[len++] = 0x80 | (c & 0x3F);
+                } else {
+                    buf[len++] = 0xF0 | (c >> 18);
+                    buf[len++] = 0x80 | ((c >> 12) & 0x3F);
+                    buf[len++] = 0x80 | ((c >> 6) & 0x3F);
+                    buf[len++] = 0x80 | (c & 0x3F);
+                }
+            }
+            if (len && (round % 3 == 0)) {
+                buf[t_random(&rnd) % len] = t_random(&rnd);
+            }
+            if (! t_utf8_valid_prefix(buf, len)) failures++;
+        }
+        TEST_ASSERT(failures == 0);
+    }
+#undef VBUFSIZ
+}
+
+#endif /* TEST_UTF8VALIDATE_H_ */
@@ -7,6 +7,7 @@
 #define TESTINFRA_H_
 
 #include "util.h" /* XSTR */
+#include "shorttypenames.h"
 
 
 typedef struct {
@@ -28,6 +29,18 @@ int TestStatistics_issues(TestStatistics *stats) {
 }
 
 
+// A small xorshift PRNG, so that tests using random data are
+// reproducible.
+static UNUSED
+u64 t_random(u64 *state) {
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+
 // Helper macros: these expect `TestStatistics *stats` to be in scope.
 
 #define TEST_SUCCESS                            \
@@ -0,0 +1,143 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef TRANSCODE_H_
+#define TRANSCODE_H_
+
+/*
+
+  Converting Latin-1 or Windows-1252 input to UTF-8 output in a single
+  pass, counting the line separators along the way
+  (`Transcoding_run`), and printing what was done as a JSON record
+  (`Transcoding_print`).
+
+  The input is converted a piece of at most TRANSCODE_CHUNKSIZE bytes
+  at a time into a scratch buffer, by the vectorized kernels (see
+  `latin1_to_utf8` in scankernels.h), which goes to the output stream
+  via `BufferedStream_write` (thus, being larger than the stream's
+  buffer, usually without being copied again).
+
+  These encodings can't be invalid; the only failures are reading
+  the input or writing the output.
+
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "shorttypenames.h"
+#include "String.h"
+#include "Error.h"
+#include "BufferedStream.h"
+#include "linecount.h"
+#include "encoding.h"
+#include "scankernels.h"
+
+
+#define TRANSCODE_CHUNKSIZE (64 * 1024)
+
+typedef struct {
+    Encoding from;
+    LineCount lc;
+    u64 bytes_in; // up to the failure, if any
+    u64 bytes_out;
+    Error failure; // noError if all of the input was converted
+} Transcoding;
+
+static
+void Transcoding_release(Transcoding *t) {
+    Error_release(t->failure);
+}
+
+static inline
+bool Transcoding_is_failure(const Transcoding *t) {
+    return t->failure.str != NULL;
+}
+
+// Drop what couldn't be written, so that closing out doesn't try
+// again
+static
+void _Transcoding_drop_output(BufferedStream *out) {
+    out->buffer.lslice.startpos = 0;
+    out->buffer.lslice.endpos = 0;
+}
+
+/*
+  Convert `in` from the encoding `from` (ENCODING_LATIN1 or
+  ENCODING_WINDOWS1252) to UTF-8, written to `out` (which is flushed
+  at the end). On a failure writing, the data that is still buffered
+  in `out` is dropped.
+*/
+static
+Transcoding Transcoding_run(BufferedStream *in /* borrowed */,
+                            BufferedStream *out /* borrowed */,
+                            Encoding from) {
+    Transcoding t = { .from = from, .lc = default_LineCount,
+                      .bytes_in = 0, .bytes_out = 0,
+                      .failure = noError };
+    transcode_to_utf8_fn convert =
+        (from == ENCODING_WINDOWS1252) ? windows1252_to_utf8
+        : latin1_to_utf8;
+    u8 *scratch = (u8 *)xmalloc(TRANSCODE_UTF8_MAXLEN(TRANSCODE_CHUNKSIZE));
+    while (1) {
+        Result(LSlice_u8) rs = BufferedStream_peek(in);
+        if (Result_is_Err(rs)) {
+            t.failure = rs.err; // moved
+            break;
+        }
+        size_t len = LSlice_length(rs.ok);
+        if (len == 0) {
+            LineCount_finish(&t.lc);
+            break;
+        }
+        if (len > TRANSCODE_CHUNKSIZE) {
+            len = TRANSCODE_CHUNKSIZE;
+        }
+        size_t n = convert(&t.lc, LSlice_start(rs.ok), len, scratch);
+        BufferedStream_consume(in, len);
+        Result(Unit) rw = BufferedStream_write(out, scratch, n);
+        if (Result_is_Err(rw)) {
+            t.failure = rw.err; // moved
+            _Transcoding_drop_output(out);
+            break;
+        }
+        t.bytes_in += len;
+        t.bytes_out += n;
+    }
+    free(scratch);
+    if (! Transcoding_is_failure(&t)) {
+        Result(Unit) rf = BufferedStream_flush(out);
+        if (Result_is_Err(rf)) {
+            t.failure = rf.err; // moved
+            _Transcoding_drop_output(out);
+        }
+    }
+    return t;
+}
+
+// Print the record for t as one line to out.
+static UNUSED
+void Transcoding_print(const Transcoding *t, FILE *out) {
+    const LineCount *lc = &t->lc;
+    fprintf(out, "{ \"type\": \"transcoding\", \"from\": \"%s\", "
+            "\"to\": \"UTF-8\", \"bytes_in\": %" PRIu64
+            ", \"bytes_out\": %" PRIu64 ", \"charcount\": %li, "
+            "\"LFcount\": %li, \"CRcount\": %li, \"CRLFcount\": %li, "
+            "\"failure\": ",
+            Encoding_name(t->from), t->bytes_in, t->bytes_out,
+            lc->charcount, lc->LFcount, lc->CRcount, lc->CRLFcount);
+    if (Transcoding_is_failure(t)) {
+        char buf[ERROR_MSGSIZ];
+        String msg = String_quote_js(
+            Error_format(&t->failure, buf, ERROR_MSGSIZ));
+        fprintf(out, "%s }\n", msg.str);
+        String_release(msg);
+    } else {
+        fprintf(out, "null }\n");
+    }
+}
+
+
+#endif /* TRANSCODE_H_ */
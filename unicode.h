@@ -11,6 +11,7 @@
 #include "BufferedStream.h"
 #include "Result.h"
 #include "Option.h"
+#include "utf16validate.h"
 
 
 DEFTYPE_Option(u32);
@@ -18,66 +19,253 @@ DEFTYPE_Option(u32);
 DEFTYPE_Result(Option(u32));
 
 
+// The errors for decoding failures, shared with the alternative
+// decoder in utf8dfa.h. byteno counts from 1. (The messages are only
+// formatted when printing, see Error.h.)
+
+#define UTF8_ERROR_INVALID_START_BYTE                           \
+    Error_of_kind(ERROR_UTF8_INVALID_START_BYTE, 0)
+
+static inline
+Error utf8_error_premature_eof(int byteno) {
+    return Error_of_kind(ERROR_UTF8_PREMATURE_EOF, byteno);
+}
+
+static inline
+Error utf8_error_invalid_continuation(int byteno) {
+    return Error_of_kind(ERROR_UTF8_INVALID_CONTINUATION, byteno);
+}
+
+static inline
+Error utf8_error_invalid_codepoint(u32 codepoint) {
+    return Error_of_kind(ERROR_UTF8_INVALID_CODEPOINT, codepoint);
+}
+
+
+// The number of bytes of the character starting with b1, if it is
+// valid.
+static inline UNUSED
+size_t utf8_sequence_length(u8 b1) {
+    return (b1 < 0xC0) ? 1 : (b1 < 0xE0) ? 2 : (b1 < 0xF0) ? 3 : 4;
+}
+
+// What the codepoint c, decoded from the UTF-8 sequence starting
+// with b1, counts as (for line separators, CSV quotes etc.): the
+// byte-wise counters only see the bytes, thus an overlong encoding of
+// an ASCII character is U+FFFD instead (see linecount.h).
+static inline UNUSED
+u32 utf8_counted_char(u8 b1, u32 c) {
+    return ((b1 >= 0x80) && (c < 0x80)) ? 0xFFFD : c;
+}
+
+// Write the UTF-8 encoding of the (valid) codepoint c to out,
+// returns the number of bytes written (1 to 4).
+static inline UNUSED
+size_t utf8_encode(u32 c, u8 *out) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    } else {
+        out[0] = 0xF0 | (c >> 18);
+        out[1] = 0x80 | ((c >> 12) & 0x3F);
+        out[2] = 0x80 | ((c >> 6) & 0x3F);
+        out[3] = 0x80 | (c & 0x3F);
+        return 4;
+    }
+}
+
 static
 Result(Option(u32)) get_unicodechar(BufferedStream *in) {
     // https://en.wikipedia.org/wiki/Utf-8#Encoding
-#define EBUFSIZ 256
     u32 codepoint;
-    Result(Option(u8)) b1 = BufferedStream_getc(in);
-    PROPAGATE_return(Option(u32), b1);
-    if (b1.ok.is_none) {
+    Result(LSlice_u8) rs = BufferedStream_peek(in);
+    PROPAGATE_return(Option(u32), rs);
+    size_t avail = LSlice_length(rs.ok);
+    if (avail == 0) {
         return Ok(Option(u32), None(u32));
     }
-    if ((b1.ok.value & 128) == 0) {
+    const u8 *p = LSlice_start(rs.ok);
+    u8 b1 = p[0];
+    if ((b1 & 128) == 0) {
         // 1 byte
-        codepoint = b1.ok.value;
+        BufferedStream_consume(in, 1);
+        return Ok(Option(u32), Some(u32, b1));
+    }
+    int numbytes;
+    if        ((b1 & 0b11100000) == 0b11000000) {
+        numbytes = 2;
+        codepoint = b1 & 0b11111;
+    } else if ((b1 & 0b11110000) == 0b11100000) {
+        numbytes = 3;
+        codepoint = b1 & 0b1111;
+    } else if ((b1 & 0b11111000) == 0b11110000) {
+        numbytes = 4;
+        codepoint = b1 & 0b111;
     } else {
-        int numbytes;
-        if        ((b1.ok.value & 0b11100000) == 0b11000000) {
-            numbytes = 2;
-            codepoint = b1.ok.value & 0b11111;
-        } else if ((b1.ok.value & 0b11110000) == 0b11100000) {
-            numbytes = 3;
-            codepoint = b1.ok.value & 0b1111;
-        } else if ((b1.ok.value & 0b11111000) == 0b11110000) {
-            numbytes = 4;
-            codepoint = b1.ok.value & 0b111;
-        } else {
-            return Err(Option(u32), literal_String(
-                             "invalid start byte decoding UTF-8"));
-        }
-        for (int i = 1; i < numbytes; i++) {
-            Result(Option(u8)) b = BufferedStream_getc(in);
-            PROPAGATE_return(Option(u32), b);
-            if (b.ok.is_none) {
-                char msg[EBUFSIZ];
-                snprintf(msg, EBUFSIZ,
-                         "premature EOF decoding UTF-8 (byte #%i)",
-                         i+1);
-                return Err(Option(u32), copy_String(msg));
-            }
-            if ((b.ok.value & 0b11000000) != 0b10000000) {
-                char msg[EBUFSIZ];
-                snprintf(msg, EBUFSIZ,
-                         "invalid continuation byte decoding UTF-8 (byte #%i)",
-                         i+1);
-                return Err(Option(u32), copy_String(msg));
+        BufferedStream_consume(in, 1);
+        return Err_from(Option(u32), UTF8_ERROR_INVALID_START_BYTE);
+    }
+    for (int i = 1; i < numbytes; i++) {
+        if ((size_t)i >= avail) {
+            // The character continues beyond the buffered data; ask
+            // for just one more byte at a time so that errors are
+            // reported in the same order as when reading byte-wise.
+            rs = BufferedStream_peek_atleast(in, i + 1);
+            PROPAGATE_return(Option(u32), rs);
+            avail = LSlice_length(rs.ok);
+            p = LSlice_start(rs.ok);
+            if ((size_t)i >= avail) {
+                BufferedStream_consume(in, avail);
+                return Err_from(Option(u32), utf8_error_premature_eof(i+1));
             }
-            codepoint <<= 6;
-            codepoint |= (b.ok.value & 0b00111111);
         }
+        u8 b = p[i];
+        if ((b & 0b11000000) != 0b10000000) {
+            BufferedStream_consume(in, i + 1);
+            return Err_from(Option(u32),
+                            utf8_error_invalid_continuation(i+1));
+        }
+        codepoint <<= 6;
+        codepoint |= (b & 0b00111111);
     }
+    BufferedStream_consume(in, numbytes);
     if (codepoint <= 0x10FFFF) {
         return Ok(Option(u32), Some(u32, codepoint));
     } else {
-        char msg[EBUFSIZ];
-        snprintf(msg, EBUFSIZ,
-                 "invalid unicode codepoint (%u, 0x%x)",
-                 codepoint, codepoint);
-        return Err(Option(u32), copy_String(msg));
+        return Err_from(Option(u32),
+                        utf8_error_invalid_codepoint(codepoint));
+    }
+}
+
+/*
+  Like `get_unicodechar`, but on an invalid sequence only the maximal
+  subpart of it is consumed: the longest prefix that could still
+  have been the start of a valid character, or the first byte if
+  there is none (as recommended in section 3.9 of the Unicode
+  standard, "U+FFFD Substitution of Maximal Subparts"). Decoding can
+  thus resume with the next byte that may start a character; its
+  number of bytes is stored in *errlen.
+
+  Valid is what `get_unicodechar` accepts, thus an overlong encoding
+  or a surrogate is a character, not an error. The errors differ
+  where the codepoint would be out of range: F5..F7 are invalid start
+  bytes, and after F4, a byte from 90 is an invalid continuation
+  byte. I/O errors are returned as they are, with *errlen 0.
+*/
+static UNUSED
+Result(Option(u32)) get_unicodechar_resync(BufferedStream *in,
+                                           size_t *errlen) {
+    *errlen = 0;
+    Result(LSlice_u8) rs = BufferedStream_peek_atleast(in, 4);
+    PROPAGATE_return(Option(u32), rs);
+    size_t avail = LSlice_length(rs.ok);
+    if (avail == 0) {
+        return Ok(Option(u32), None(u32));
+    }
+    const u8 *p = LSlice_start(rs.ok);
+    u8 b1 = p[0];
+    if (b1 < 0x80) {
+        BufferedStream_consume(in, 1);
+        return Ok(Option(u32), Some(u32, b1));
+    }
+    int numbytes;
+    u32 codepoint;
+    if ((b1 < 0xC0) || (b1 > 0xF4)) {
+        BufferedStream_consume(in, 1);
+        *errlen = 1;
+        return Err_from(Option(u32), UTF8_ERROR_INVALID_START_BYTE);
+    } else if (b1 < 0xE0) {
+        numbytes = 2;
+        codepoint = b1 & 0b11111;
+    } else if (b1 < 0xF0) {
+        numbytes = 3;
+        codepoint = b1 & 0b1111;
+    } else {
+        numbytes = 4;
+        codepoint = b1 & 0b111;
+    }
+    for (int i = 1; i < numbytes; i++) {
+        if ((size_t)i >= avail) {
+            BufferedStream_consume(in, avail);
+            *errlen = avail;
+            return Err_from(Option(u32), utf8_error_premature_eof(i+1));
+        }
+        u8 b = p[i];
+        if (((b & 0b11000000) != 0b10000000)
+            || ((i == 1) && (b1 == 0xF4) && (b >= 0x90))) {
+            BufferedStream_consume(in, i);
+            *errlen = i;
+            return Err_from(Option(u32),
+                            utf8_error_invalid_continuation(i+1));
+        }
+        codepoint <<= 6;
+        codepoint |= (b & 0b00111111);
     }
-#undef EBUFSIZ
+    BufferedStream_consume(in, numbytes);
+    return Ok(Option(u32), Some(u32, codepoint));
 }
 
 
+static inline
+Error utf16_error_premature_eof(int byteno) {
+    return Error_of_kind(ERROR_UTF16_PREMATURE_EOF, byteno);
+}
+
+static inline
+Error utf16_error_unpaired_surrogate(u16 unit) {
+    return Error_of_kind(ERROR_UTF16_UNPAIRED_SURROGATE, unit);
+}
+
+// The UTF-16 counterpart of `get_unicodechar`, reading code units
+// in big (is_be) or little endian byte order.
+static
+Result(Option(u32)) get_utf16char(BufferedStream *in, bool is_be) {
+    Result(LSlice_u8) rs = BufferedStream_peek_atleast(in, 2);
+    PROPAGATE_return(Option(u32), rs);
+    size_t avail = LSlice_length(rs.ok);
+    if (avail == 0) {
+        return Ok(Option(u32), None(u32));
+    }
+    if (avail < 2) {
+        BufferedStream_consume(in, avail);
+        return Err_from(Option(u32), utf16_error_premature_eof(2));
+    }
+    u16 u1 = utf16_unit(LSlice_start(rs.ok), is_be);
+    if (utf16_is_low_surrogate(u1)) {
+        BufferedStream_consume(in, 2);
+        return Err_from(Option(u32), utf16_error_unpaired_surrogate(u1));
+    }
+    if (! utf16_is_high_surrogate(u1)) {
+        BufferedStream_consume(in, 2);
+        return Ok(Option(u32), Some(u32, u1));
+    }
+    rs = BufferedStream_peek_atleast(in, 4);
+    PROPAGATE_return(Option(u32), rs);
+    avail = LSlice_length(rs.ok);
+    if (avail < 4) {
+        BufferedStream_consume(in, avail);
+        return Err_from(Option(u32),
+                        utf16_error_premature_eof((avail < 3) ? 3 : 4));
+    }
+    u16 u2 = utf16_unit(LSlice_start(rs.ok) + 2, is_be);
+    if (! utf16_is_low_surrogate(u2)) {
+        // leave u2 to be decoded next
+        BufferedStream_consume(in, 2);
+        return Err_from(Option(u32), utf16_error_unpaired_surrogate(u1));
+    }
+    BufferedStream_consume(in, 4);
+    return Ok(Option(u32),
+              Some(u32, 0x10000 + (((u32)(u1 - 0xD800) << 10)
+                                   | (u32)(u2 - 0xDC00))));
+}
+
 #endif /* UNICODE_H_ */
@@ -0,0 +1,363 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef URINGREADER_H_
+#define URINGREADER_H_
+
+/*
+
+  Reading a regular file ahead via io_uring: `depth` buffers of
+  URINGREADER_SLOTSIZE bytes each are being filled by the kernel, at
+  consecutive file offsets, while the data of the oldest one is
+  handed out by `UringReader_read`, which behaves like `read` (so
+  that the callers' EINTR/EOF/error handling stays the same). Once a
+  buffer has been handed out completely, it is resubmitted (and
+  submitted to the kernel right away, not only once the reader runs
+  out of data) for the next range of the file.
+
+  Short reads are continued where they stopped; a read returning 0
+  marks the end of the file (later buffers are ignored), as does an
+  error, which is returned once the data before it has been handed
+  out.
+
+  `UringReader_new` returns NULL if io_uring is not available (old
+  kernel, disabled via sysctl or seccomp, not Linux), in which case
+  the caller should fall back to `read`. Uses the raw system calls,
+  as liburing is not a dependency of this project.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "shorttypenames.h"
+#include "util.h" /* DIE_ */
+#include "mem.h"
+#include "Error.h"
+
+#ifdef __linux__
+#  define URINGREADER_AVAILABLE 1
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#else
+#  define URINGREADER_AVAILABLE 0
+#endif
+
+
+#define URINGREADER_SLOTSIZE (64 * 1024)
+#define URINGREADER_DEFAULT_DEPTH 8
+#define URINGREADER_MAX_DEPTH 256
+
+typedef struct {
+    u8 *buf;
+    u64 offset; // file position of buf[0]
+    size_t len; // number of bytes read into buf
+    size_t pos; // number of bytes handed out
+    bool is_in_flight;
+    bool is_final; // the file ends after buf[len] (EOF or error)
+    int error; // errno of the failure ending the file, 0 if none
+} UringSlot;
+
+#if URINGREADER_AVAILABLE
+
+typedef struct {
+    int ring_fd;
+    int fd; // the file being read (borrowed)
+    void *ring; // submission and completion queue rings
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned nsubmit; // queued in the SQ ring but not yet submitted
+
+    UringSlot *slots;
+    unsigned depth;
+    unsigned head; // the slot being handed out
+    unsigned nin_flight;
+    u64 next_offset; // for the next slot to be (re)submitted
+} UringReader;
+
+
+static
+void _UringReader_submit(UringReader *r, unsigned i) {
+    UringSlot *slot = &r->slots[i];
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->addr = (u64)(uintptr_t)(slot->buf + slot->len);
+    sqe->len = URINGREADER_SLOTSIZE - slot->len;
+    sqe->off = slot->offset + slot->len;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    slot->is_in_flight = true;
+    r->nin_flight++;
+    r->nsubmit++;
+}
+
+// Submit the queued requests and, if wait is true, wait for at least
+// one completion. Returns 0 or an errno value.
+static
+int _UringReader_enter(UringReader *r, bool wait) {
+    while (1) {
+        long n = syscall(__NR_io_uring_enter, r->ring_fd, r->nsubmit,
+                         wait ? 1 : 0,
+                         wait ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            return err;
+        }
+        r->nsubmit -= n;
+        return 0;
+    }
+}
+
+// Process the completions that are available; with continue_reads
+// false, short or interrupted reads are not continued, otherwise
+// they are submitted right away. Returns 0 or an errno value.
+static
+int _UringReader_reap(UringReader *r, bool continue_reads) {
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        UringSlot *slot = &r->slots[cqe->user_data];
+        int res = cqe->res;
+        slot->is_in_flight = false;
+        r->nin_flight--;
+        if (res > 0) {
+            slot->len += res;
+            if ((slot->len < URINGREADER_SLOTSIZE) && continue_reads) {
+                // short read, continue it
+                _UringReader_submit(r, cqe->user_data);
+            }
+        } else if (res == 0) {
+            slot->is_final = true;
+        } else if ((res == -EINTR) || (res == -EAGAIN)) {
+            if (continue_reads) {
+                _UringReader_submit(r, cqe->user_data);
+            }
+        } else {
+            slot->is_final = true;
+            slot->error = -res;
+        }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return r->nsubmit ? _UringReader_enter(r, false) : 0;
+}
+
+static
+void _UringReader_unmap(UringReader *r) {
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring, r->ring_size);
+    close(r->ring_fd);
+}
+
+/*
+  Start reading fd (which should be a regular file) from offset on,
+  with depth buffers. Returns NULL if io_uring can't be used. fd is
+  not owned, but must stay open until `UringReader_free`.
+*/
+static
+UringReader *UringReader_new(int fd, u64 offset, unsigned depth) {
+    if (depth < 1) {
+        depth = 1;
+    }
+    if (depth > URINGREADER_MAX_DEPTH) {
+        depth = URINGREADER_MAX_DEPTH;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    long ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring_fd < 0) {
+        return NULL;
+    }
+    if (! (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        // kernels before 5.4; not worth supporting
+        close(ring_fd);
+        return NULL;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    void *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(ring_fd);
+        return NULL;
+    }
+    size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ring, ring_size);
+        close(ring_fd);
+        return NULL;
+    }
+
+    UringReader *r = (UringReader *)xmalloc(sizeof(UringReader));
+    u8 *base = (u8 *)ring;
+    *r = (UringReader) {
+        .ring_fd = (int)ring_fd,
+        .fd = fd,
+        .ring = ring,
+        .ring_size = ring_size,
+        .sqes = (struct io_uring_sqe *)sqes,
+        .sqes_size = sqes_size,
+        .sq_head = (unsigned *)(base + p.sq_off.head),
+        .sq_tail = (unsigned *)(base + p.sq_off.tail),
+        .sq_mask = (unsigned *)(base + p.sq_off.ring_mask),
+        .sq_array = (unsigned *)(base + p.sq_off.array),
+        .cq_head = (unsigned *)(base + p.cq_off.head),
+        .cq_tail = (unsigned *)(base + p.cq_off.tail),
+        .cq_mask = (unsigned *)(base + p.cq_off.ring_mask),
+        .cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes),
+        .nsubmit = 0,
+        .slots = (UringSlot *)xmalloc(depth * sizeof(UringSlot)),
+        .depth = depth,
+        .head = 0,
+        .nin_flight = 0,
+        .next_offset = offset
+    };
+    for (unsigned i = 0; i < depth; i++) {
+        r->slots[i] = (UringSlot) {
+            .buf = (u8 *)xmalloc(URINGREADER_SLOTSIZE),
+            .offset = r->next_offset
+        };
+        r->next_offset += URINGREADER_SLOTSIZE;
+        _UringReader_submit(r, i);
+    }
+    int err = _UringReader_enter(r, false);
+    if (err) {
+        // io_uring_enter only fails if nothing was submitted, thus
+        // nothing is in flight
+        for (unsigned i = 0; i < depth; i++) {
+            free(r->slots[i].buf);
+        }
+        free(r->slots);
+        _UringReader_unmap(r);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/*
+  Copy up to len bytes of the file into buf. Returns the number of
+  bytes copied, 0 at the end of the file, or -1 with errno set on
+  failure, like `read`.
+*/
+static
+ssize_t UringReader_read(UringReader *r, u8 *buf, size_t len) {
+    while (1) {
+        UringSlot *slot = &r->slots[r->head];
+        if (slot->pos < slot->len) {
+            size_t n = slot->len - slot->pos;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(buf, slot->buf + slot->pos, n);
+            slot->pos += n;
+            if (slot->pos == URINGREADER_SLOTSIZE) {
+                // Done with this one, read the next range into it
+                slot->offset = r->next_offset;
+                slot->len = 0;
+                slot->pos = 0;
+                r->next_offset += URINGREADER_SLOTSIZE;
+                _UringReader_submit(r, r->head);
+                r->head = (r->head + 1) % r->depth;
+                // so that the kernel fills it while the others are
+                // handed out
+                int err = _UringReader_enter(r, false);
+                if (err) {
+                    errno = err;
+                    return -1;
+                }
+            }
+            return n;
+        }
+        if (slot->is_final && ! slot->is_in_flight) {
+            if (slot->error) {
+                errno = slot->error;
+                return -1;
+            }
+            return 0;
+        }
+        int err = _UringReader_enter(r, true);
+        if (! err) {
+            err = _UringReader_reap(r, true);
+        }
+        if (err) {
+            errno = err;
+            return -1;
+        }
+    }
+}
+
+// Wait for the reads in flight (the kernel is writing to the
+// buffers) and free everything.
+static
+void UringReader_free(UringReader *r) {
+    while (r->nin_flight) {
+        int err = _UringReader_enter(r, true);
+        if (err) {
+            Error e = Error_errno(err);
+            DIE_("io_uring_enter: can't wait for the reads in flight: %s",
+                 Error_message(e));
+        }
+        _UringReader_reap(r, false);
+    }
+    for (unsigned i = 0; i < r->depth; i++) {
+        free(r->slots[i].buf);
+    }
+    free(r->slots);
+    _UringReader_unmap(r);
+    free(r);
+}
+
+#else /* ! URINGREADER_AVAILABLE */
+
+typedef struct {
+    int unused;
+} UringReader;
+
+static
+UringReader *UringReader_new(int fd, u64 offset, unsigned depth) {
+    (void)fd; (void)offset; (void)depth;
+    return NULL;
+}
+
+static
+ssize_t UringReader_read(UringReader *r, u8 *buf, size_t len) {
+    (void)r; (void)buf; (void)len;
+    errno = ENOSYS;
+    return -1;
+}
+
+static
+void UringReader_free(UringReader *r) {
+    (void)r;
+}
+
+#endif /* URINGREADER_AVAILABLE */
+
+#endif /* URINGREADER_H_ */
@@ -5,11 +5,15 @@
 
 #undef _GNU_SOURCE
 #define _POSIX_C_SOURCE 202112L
+#define _DEFAULT_SOURCE /* syscall, MAP_POPULATE */
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h> /* sysconf */
+#include <limits.h> /* INT_MAX */
 
 #include "leakcheck.h"
 
@@ -17,68 +21,298 @@
 #include "util.h"
 #include "env.h"
 #include "BufferedStream.h"
-#include "unicode.h"
-
-
-
-static
-int report(BufferedStream* in /* borrowed */) {
-    int64_t charcount = 0;
-    int64_t LFcount = 0;
-    int64_t CRcount = 0;
-    int64_t CRLFcount = 0;
-    int64_t column = 0;
-    bool last_was_CR = false;
-    while (1) {
-        Result(Option(u32)) c = get_unicodechar(in);
-        if (Result_is_Err(c)) {
-            int64_t linecount = LFcount + CRcount + CRLFcount;
-            const char *questionable =
-                (linecount == MAX3(LFcount, CRcount, CRLFcount)) ? "false" : "true";
-            printf("{ \"type\": \"utf-8-failure\", \"failure\": \"%s\", \"character_position\": %li, \"line\": %li, \"column\": %li, \"line_questionable\": %s }\n",
-                   c.err.str, // XXX Needs to be converted to json string
-                   charcount + 1,
-                   linecount + 1,
-                   column + 1,
-                   questionable);
-            Result_release(c);
-            return 0;
-        }
-        if (c.ok.is_none) {
-            break;
+#include "report.h"
+#include "batch.h"
+#include "passthrough.h"
+#include "transcode.h"
+#include "normalize.h"
+#include "allerrors.h"
+#include "checkpoint.h"
+#include "resultcache.h"
+#include "perfcounters.h"
+#include "monotime.h"
+
+
+typedef struct {
+    ReadOptions read;
+    ScanOptions scan;
+    bool batch;
+    int jobs; // number of worker threads in batch mode
+    bool unordered; // print batch records in completion order
+    bool version;
+    bool tee; // filter mode
+    bool transcode; // transcoding mode
+    Encoding transcode_from; // transcoding mode: the input encoding
+    bool normalize; // normalizing mode
+    LineSeparator normalize_to; // normalizing mode: the separator
+    int report_fd; // filter, transcoding and normalizing mode: where
+                   // the report goes
+    bool abort_on_error; // filter mode: stop passing on at an error
+    bool perf; // print performance counters and timings
+    const char *index_path; // write a line index file there
+    const char *checkpoint_dir; // continue from and save checkpoints
+                                // there
+    ResultCache cache; // used if cache.dir is set
+    bool no_cache; // don't use one even if the environment says so
+    bool all_errors; // report all errors, not just the first one
+    long max_errors; // all-errors mode: the number of error records
+} Options;
+
+#define default_Options (Options) { .read = default_ReadOptions,   \
+                                    .scan = default_ScanOptions,   \
+                                    .batch = false, .jobs = 0,         \
+                                    .unordered = false,                \
+                                    .version = false,                  \
+                                    .tee = false,                      \
+                                    .transcode = false,                \
+                                    .transcode_from = ENCODING_LATIN1, \
+                                    .normalize = false,                \
+                                    .normalize_to = LINESEPARATOR_LF,  \
+                                    .report_fd = 2,                    \
+                                    .abort_on_error = false,           \
+                                    .perf = false,                     \
+                                    .index_path = NULL,                \
+                                    .checkpoint_dir = NULL,            \
+                                    .cache = {                         \
+                                        .dir = NULL,                   \
+                                        .use_fingerprint = false,      \
+                                        .verify = false,               \
+                                        .max_entries =                 \
+                                        RESULTCACHE_DEFAULT_MAX_ENTRIES \
+                                    },                                 \
+                                    .no_cache = false,                 \
+                                    .all_errors = false,               \
+                                    .max_errors =                      \
+                                        ERRORLOG_DEFAULT_MAX_RECORDS }
+
+
+// Print the "perf" record for the scan that led to r: the hardware
+// counters, and the time spent in total and in reading (the rest is
+// spent decoding).
+static
+void print_perf(const Report *r, const PerfCounters *pc,
+                const ReadStats *stats, u64 wall_ns, FILE *out) {
+    u64 decode_ns = (wall_ns > stats->read_ns) ? wall_ns - stats->read_ns : 0;
+    fprintf(out, "{ \"type\": \"perf\", \"bytes\": %" PRIu64
+            ", \"codepoints\": %" PRIi64 ", \"wall_seconds\": %.6f"
+            ", \"read_seconds\": %.6f, \"decode_seconds\": %.6f"
+            ", \"refills\": %" PRIu64 ", \"average_refill_bytes\": ",
+            r->bytecount, r->lc.charcount, wall_ns * 1e-9,
+            stats->read_ns * 1e-9, decode_ns * 1e-9, stats->refills);
+    if (stats->refills) {
+        fprintf(out, "%.1f, ", (double)stats->bytes / stats->refills);
+    } else {
+        fprintf(out, "null, ");
+    }
+    PerfCounters_print_fields(pc, r->bytecount, r->lc.charcount, out);
+    fprintf(out, " }\n");
+}
+
+// Write the line index collected in ix to path, for the input whose
+// report r has been printed. Returns the exit code: 1 if the
+// input is not valid UTF-8 (no index is written then) or writing
+// failed.
+static
+int write_index(const Report *r, const LineIndexing *ix, const char *path) {
+    if (Report_is_failure(r) || (r->encoding != ENCODING_UTF8)) {
+        WARN_("--index: not writing '%s', the input is not valid UTF-8",
+              path);
+        return 1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        WARN_("--index: '%s': %s", path, strerror(errno));
+        return 1;
+    }
+    BufferedStream out = fd_BufferedStream(fd, STREAM_DIRECTION_OUT,
+                                           borrowing_String(path), true);
+    int res = 0;
+    Result(Unit) rw = LineIndexing_write(ix, LineIndexing_kind(&r->lc),
+                                         r->bytecount, &out);
+    if (Result_is_Err(rw)) {
+        WARN_("--index: '%s': %s", path, Error_message(rw.err));
+        res = 1;
+        // drop what couldn't be written
+        out.buffer.lslice.startpos = 0;
+        out.buffer.lslice.endpos = 0;
+    }
+    Result_release(rw);
+    Result(Unit) rc = BufferedStream_close(&out);
+    if (Result_is_Err(rc)) {
+        WARN_("--index: '%s': %s", path, Error_message(rc.err));
+        res = 1;
+    }
+    Result_release(rc);
+    BufferedStream_release(&out);
+    return res;
+}
+
+// Scan in with scan and print the record(s) for it.
+static
+Report scan_print(BufferedStream* in /* borrowed */, const ScanOptions *scan,
+                  const Options *opts) {
+    Report r;
+    if (opts->perf) {
+        PerfCounters pc;
+        PerfCounters_open(&pc);
+        ReadStats stats = {};
+        BufferedStream_set_read_stats(in, &stats);
+        u64 t0 = monotime_ns();
+        PerfCounters_start(&pc);
+        r = Report_scan(in, scan);
+        PerfCounters_stop(&pc);
+        u64 wall_ns = monotime_ns() - t0;
+        BufferedStream_set_read_stats(in, NULL);
+        Report_print(&r, NULL, stdout);
+        print_perf(&r, &pc, &stats, wall_ns, stdout);
+        PerfCounters_close(&pc);
+    } else {
+        r = Report_scan(in, scan);
+        Report_print(&r, NULL, stdout);
+    }
+    return r;
+}
+
+static
+int report(BufferedStream* in /* borrowed */, const Options *opts) {
+    ScanOptions scan = opts->scan;
+    LineIndexing ix;
+    if (opts->index_path) {
+        LineIndexing_init(&ix);
+        scan.index = &ix;
+    }
+    Report r = scan_print(in, &scan, opts);
+    int res = 0;
+    if (opts->index_path) {
+        fflush(stdout);
+        res = write_index(&r, &ix, opts->index_path);
+        LineIndexing_release(&ix);
+    }
+    Report_release(&r);
+    return res;
+}
+
+/*
+  `report` for the file at path, continuing from its checkpoint in
+  opts->checkpoint_dir if it still matches (the file only grew since),
+  and saving the new checkpoint afterwards. Not being able to use or
+  save a checkpoint is not an error, a warning is printed for the
+  latter.
+*/
+static
+int checkpointed(const char *path, const Options *opts) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+        WARN_("open: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    char ckpath[PATH_MAX];
+    if (! (S_ISREG(st.st_mode)
+           && Checkpoint_path(ckpath, PATH_MAX, opts->checkpoint_dir, &st))) {
+        WARN_("--checkpoint: '%s' is not a regular file, or the path of "
+              "its checkpoint is too long", path);
+        close(fd);
+        return 1;
+    }
+    ScanOptions scan = opts->scan;
+    scan.lazy_column = false;
+    Result(Checkpoint) rck = Checkpoint_load(ckpath);
+    bool is_resume = Result_is_Ok(rck) && Checkpoint_matches(&rck.ok, fd, &st);
+    if (Result_is_Err(rck)
+        && ! ((rck.err.kind == ERROR_ERRNO) && (rck.err.context == ENOENT))) {
+        WARN_("--checkpoint: '%s': %s, scanning in full", ckpath,
+              Error_message(rck.err));
+    }
+    if (is_resume) {
+        scan.resume = &rck.ok.state;
+        if (lseek(fd, rck.ok.state.offset, SEEK_SET) < 0) {
+            is_resume = false;
+            scan.resume = NULL;
+            lseek(fd, 0, SEEK_SET);
         }
-        charcount++;
-        if (c.ok.value == '\r') {
-            if (last_was_CR) {
-                CRcount++;
-            }
-            // the new one will be counted in the next iteration
-            last_was_CR = true;
-            column = 0;
-        } else if (c.ok.value == '\n') {
-            if (last_was_CR) {
-                CRLFcount++;
-            } else {
-                LFcount++;
-            }
-            last_was_CR = false;
-            column = 0;
-        } else {
-            if (last_was_CR) {
-                CRcount++;
-            }
-            last_was_CR = false;
-            column++;
+    }
+    BufferedStream in = fd_r_BufferedStream(fd, borrowing_String(path), true,
+                                            &opts->read);
+    if (is_resume && (in.stream_type == STREAM_TYPE_MMAPSTREAM)) {
+        // The whole file is mapped, from its start
+        BufferedStream_consume(&in, rck.ok.state.offset);
+    }
+    Report r = scan_print(&in, &scan, opts);
+    Checkpoint ck;
+    if (Checkpoint_of_report(&ck, &r, fd, &st)) {
+        Result(Unit) rs = Checkpoint_save(&ck, ckpath);
+        if (Result_is_Err(rs)) {
+            WARN_("--checkpoint: can't save '%s': %s", ckpath,
+                  Error_message(rs.err));
         }
+        Result_release(rs);
     }
-    if (last_was_CR) {
-        CRcount++;
+    int res = 0;
+    Result(Unit) rc = BufferedStream_close(&in);
+    if (Result_is_Err(rc)) {
+        WARN_("close: %s", Error_message(rc.err));
+        res = 1;
     }
-    printf("{ \"type\": \"linecount\", \"charcount\": %li, \"LFcount\": %li, \"CRcount\": %li, \"CRLFcount\": %li }\n",
-           charcount, LFcount, CRcount, CRLFcount);
-    return 0;
+    Result_release(rc);
+    BufferedStream_release(&in);
+    Report_release(&r);
+    Result_release(rck);
+    return res;
 }
 
+/*
+  `report` for the file at path, taking the result from opts->cache
+  if the file hasn't changed since it was stored there (unless in
+  verify mode), otherwise storing it there after scanning. Not being
+  able to store it is not an error, a warning is printed.
+*/
+static
+int cached(const char *path, const Options *opts) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+        WARN_("open: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    Report r;
+    if ((! opts->cache.verify)
+        && ResultCache_lookup(&opts->cache, fd, &st, opts->scan.csv, &r)) {
+        Report_print(&r, NULL, stdout);
+        Report_release(&r);
+        close(fd);
+        return 0;
+    }
+    BufferedStream in = fd_r_BufferedStream(fd, borrowing_String(path), true,
+                                            &opts->read);
+    r = scan_print(&in, &opts->scan, opts);
+    ResultCache_update(&opts->cache, fd, &st, &r, path);
+    int res = 0;
+    Result(Unit) rc = BufferedStream_close(&in);
+    if (Result_is_Err(rc)) {
+        WARN_("close: %s", Error_message(rc.err));
+        res = 1;
+    }
+    Result_release(rc);
+    BufferedStream_release(&in);
+    Report_release(&r);
+    return res;
+}
+
+// Print the build and runtime configuration: the byte scanning
+// kernels selected (and the best ones the CPU supports), and the
+// default decoder.
+static
+int version(const Options *opts) {
+    printf("{ \"type\": \"version\", \"program\": \"utf-8-lineseparator\", "
+           "\"kernel\": \"%s\", \"cpu\": \"%s\", \"decoder\": \"%s\" }\n",
+           CpuLevel_name(scankernels()->level),
+           CpuLevel_name(CpuLevel_detect()),
+           (opts->scan.decoder == UTF8_DECODER_DFA) ? "dfa" : "simd");
+    return 0;
+}
 
 #if AFL
 // See
@@ -91,6 +325,700 @@ __AFL_FUZZ_INIT();
 // XX configurable?
 #define MONKEY_INIT_LEN 0
 
+static
+void usage(const char *progname) {
+    WARN_("Usage: %s [--io M [--io-depth N]] [--readahead N] [--threads N]\n"
+          "           [--decoder D] [--csv] [--perf] [--no-cache]\n"
+          "           [--index P | --tee [--report-fd N] [--abort-on-error]]\n"
+          "           [file]\n"
+          "       %s --cache D [--verify-cache] [--cache-fingerprint]\n"
+          "           [--cache-max-entries N] [--batch [--jobs N]\n"
+          "           [--unordered]] [--io M [--io-depth N]] [--readahead N]\n"
+          "           [--threads N] [--decoder D] [--csv] [file...]\n"
+          "       %s --checkpoint D [--io M [--io-depth N]] [--readahead N]\n"
+          "           [--threads N] [--decoder D] [--perf] file\n"
+          "       %s --transcode E [--report-fd N] [--io M [--io-depth N]]\n"
+          "           [--readahead N] [file]\n"
+          "       %s --normalize S [--report-fd N] [--io M [--io-depth N]]\n"
+          "           [--readahead N] [--decoder D] [file]\n"
+          "       %s --all-errors [--max-errors N] [--io M [--io-depth N]]\n"
+          "           [--readahead N] [--decoder D] [file]\n"
+          "       %s --batch [--jobs N] [--unordered] [--io M [--io-depth N]]\n"
+          "           [--readahead N] [--threads N] [--decoder D] [--csv]\n"
+          "           [--no-cache] [file...]\n"
+          "  Verify proper UTF-8 encoding and report usage of CR and LF\n"
+          "  characters in <file> if given, otherwise of STDIN.\n"
+          "\n"
+          "  --io M       how to read regular files: 'mmap' (map them\n"
+          "               into memory, the default), 'read', or 'uring'\n"
+          "               (read ahead via io_uring; falls back to 'read'\n"
+          "               if not available)\n"
+          "  --io-depth N number of buffers being read ahead with\n"
+          "               '--io uring' (default: %i)\n"
+          "  --readahead N\n"
+          "               read pipes and sockets (and files with\n"
+          "               '--io read') on a background thread, into a\n"
+          "               ring of N buffers of %i KiB (default: 0, off)\n"
+          "  --threads N  scan a regular file using N threads (0: one\n"
+          "               per CPU; only with '--io mmap')\n"
+          "  --decoder D  the UTF-8 decoder to use: 'simd' or 'dfa'\n"
+          "               (table-driven)\n"
+          "  --csv        also count the input as CSV: the rows, and\n"
+          "               which line separators end rows and which are\n"
+          "               in quoted cells; a quoted cell that is not\n"
+          "               closed is an error (always scans on one\n"
+          "               thread)\n"
+          "  --index P    write an index of the byte offsets where the\n"
+          "               lines start to file P, for the kind of line\n"
+          "               separator used most (see lineindex.h); only\n"
+          "               if the input is valid UTF-8, otherwise exits\n"
+          "               with code 1 (always scans on one thread)\n"
+          "  --checkpoint D\n"
+          "               continue checking file from where the last\n"
+          "               run with the same directory D stopped, if it\n"
+          "               has only been appended to since (otherwise\n"
+          "               check it in full), and save a checkpoint for\n"
+          "               the next run to D (unless the file has an\n"
+          "               invalid character)\n"
+          "  --cache D    keep the results for regular files in\n"
+          "               directory D, and print the stored result\n"
+          "               without reading the file if its device,\n"
+          "               inode, size and modification time are still\n"
+          "               the same\n"
+          "               (see resultcache.h); only in report and batch\n"
+          "               mode, without --perf; the default is taken\n"
+          "               from %s if set\n"
+          "  --no-cache   don't use a cache even if %s\n"
+          "               is set\n"
+          "  --verify-cache\n"
+          "               scan the files anyway, warn if the stored\n"
+          "               result differs, and replace it\n"
+          "  --cache-fingerprint\n"
+          "               also require the first and last %i KiB of\n"
+          "               the file to be unchanged (reads them)\n"
+          "  --cache-max-entries N\n"
+          "               keep about N results, evicting the least\n"
+          "               recently used ones (default: %i)\n"
+          "  --tee        filter mode: copy the input to STDOUT\n"
+          "               unchanged (via tee/splice/copy_file_range\n"
+          "               where possible) and print the record to\n"
+          "               STDERR; exits with code 1 if the input is\n"
+          "               not valid\n"
+          "  --transcode E\n"
+          "               transcoding mode: convert the input from\n"
+          "               encoding E ('latin1' or 'windows-1252') to\n"
+          "               UTF-8 on STDOUT, and print a record about the\n"
+          "               conversion to STDERR\n"
+          "  --normalize S\n"
+          "               normalizing mode: copy the input to STDOUT\n"
+          "               with all line separators rewritten to S\n"
+          "               ('LF', 'CRLF' or 'CR'), up to the first\n"
+          "               invalid character, and print the record to\n"
+          "               STDERR; exits with code 1 if the input is\n"
+          "               not valid\n"
+          "  --report-fd N\n"
+          "               print the record in filter, transcoding or\n"
+          "               normalizing mode to file descriptor N instead\n"
+          "  --abort-on-error\n"
+          "               stop copying in filter mode as soon as an\n"
+          "               error is found (data before it may have been\n"
+          "               passed on already; a regular input file is\n"
+          "               not copied at all then)\n"
+          "  --all-errors go on after invalid sequences (resuming after\n"
+          "               the longest prefix of each that could have\n"
+          "               been valid, which counts as one character):\n"
+          "               print a record for each of them, then a\n"
+          "               summary record with the number of errors\n"
+          "               and the counts (always scans on one thread)\n"
+          "  --max-errors N\n"
+          "               print at most N error records with\n"
+          "               --all-errors, the rest are only counted\n"
+          "               (default: %i)\n"
+          "  --perf       print a second record with the time spent\n"
+          "               reading and decoding, the number of reads,\n"
+          "               and hardware performance counters (per byte\n"
+          "               and per codepoint; null where perf events\n"
+          "               are not available)\n"
+          "  --batch      check all given files, or if none are given,\n"
+          "               the files whose paths are read from STDIN\n"
+          "               separated by NUL bytes (as from `find -print0`);\n"
+          "               prints one record per file, with its path\n"
+          "  --jobs N     check N files at the same time in batch mode\n"
+          "               (default, or 0: one per CPU)\n"
+          "  --unordered  print the records in batch mode as the files\n"
+          "               are done, instead of in the order given\n"
+          "  --version    print the configuration, including the byte\n"
+          "               scanning kernels chosen for this CPU (can be\n"
+          "               overridden by setting %s\n"
+          "               to scalar, sse4.2, avx2 or avx512)\n",
+          progname, progname, progname, progname, progname, progname,
+          progname,
+          URINGREADER_DEFAULT_DEPTH,
+          READAHEAD_BUFSIZE / 1024,
+          RESULTCACHE_ENVVAR, RESULTCACHE_ENVVAR,
+          FINGERPRINT_BLOCKSIZ / 1024, RESULTCACHE_DEFAULT_MAX_ENTRIES,
+          ERRORLOG_DEFAULT_MAX_RECORDS,
+          SCANKERNELS_ENVVAR);
+}
+
+static
+int number_of_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (int)n;
+}
+
+// Parse the argument of the option argv[i] into *out, a number from
+// min to max. Returns false (after printing a message) if it is
+// missing or invalid.
+static
+bool Options_parse_number(long *out, int argc, const char**argv, int i,
+                          long min, long max) {
+    if (i + 1 >= argc) {
+        WARN_("%s: missing argument", argv[i]);
+        return false;
+    }
+    char *end;
+    long n = strtol(argv[i + 1], &end, 10);
+    if ((*argv[i + 1] == 0) || (*end != 0) || (n < min) || (n > max)) {
+        WARN_("%s: invalid number: '%s'", argv[i], argv[i + 1]);
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+// Parse the argument of the option argv[i] into *out: a number from
+// 0 to max, 0 meaning one per CPU (capped at max). Returns false
+// (after printing a message) if it is missing or invalid.
+static
+bool Options_parse_count(int *out, int argc, const char**argv, int i,
+                         long max) {
+    long n;
+    if (! Options_parse_number(&n, argc, argv, i, 0, max)) {
+        return false;
+    }
+    if (n == 0) {
+        n = number_of_cpus();
+        if (n > max) n = max;
+    }
+    *out = n;
+    return true;
+}
+
+// Parse the options in argv into *opts. Returns the index of the
+// first non-option argument, or -1 if the options are invalid (after
+// printing a message).
+static
+int Options_parse(Options *opts, int argc, const char**argv) {
+    int i = 1;
+    while (i < argc) {
+        const char *arg = argv[i];
+        if (0 == strcmp(arg, "--")) {
+            return i + 1;
+        } else if (0 == strcmp(arg, "--threads")) {
+            if (! Options_parse_count(&opts->scan.threads, argc, argv, i,
+                                      PARALLELSCAN_MAX_THREADS)) {
+                return -1;
+            }
+            i += 2;
+        } else if (0 == strcmp(arg, "--jobs")) {
+            if (! Options_parse_count(&opts->jobs, argc, argv, i,
+                                      BATCH_MAX_JOBS)) {
+                return -1;
+            }
+            i += 2;
+        } else if (0 == strcmp(arg, "--decoder")) {
+            if (i + 1 >= argc) {
+                WARN("--decoder: missing argument");
+                return -1;
+            }
+            const char *name = argv[i + 1];
+            if (0 == strcmp(name, "simd")) {
+                opts->scan.decoder = UTF8_DECODER_SIMD;
+            } else if (0 == strcmp(name, "dfa")) {
+                opts->scan.decoder = UTF8_DECODER_DFA;
+            } else {
+                WARN_("--decoder: unknown decoder: '%s'", name);
+                return -1;
+            }
+            i += 2;
+        } else if (0 == strcmp(arg, "--io")) {
+            if (i + 1 >= argc) {
+                WARN("--io: missing argument");
+                return -1;
+            }
+            const char *name = argv[i + 1];
+            if (0 == strcmp(name, "mmap")) {
+                opts->read.method = READ_METHOD_MMAP;
+            } else if (0 == strcmp(name, "read")) {
+                opts->read.method = READ_METHOD_READ;
+            } else if (0 == strcmp(name, "uring")) {
+                opts->read.method = READ_METHOD_URING;
+            } else {
+                WARN_("--io: unknown method: '%s'", name);
+                return -1;
+            }
+            i += 2;
+        } else if (0 == strcmp(arg, "--io-depth")) {
+            long n;
+            if (! Options_parse_number(&n, argc, argv, i,
+                                       1, URINGREADER_MAX_DEPTH)) {
+                return -1;
+            }
+            opts->read.uring_depth = n;
+            i += 2;
+        } else if (0 == strcmp(arg, "--readahead")) {
+            long n;
+            if (! Options_parse_number(&n, argc, argv, i,
+                                       0, READAHEAD_MAX_BUFFERS)) {
+                return -1;
+            }
+            opts->read.readahead_buffers = n;
+            i += 2;
+        } else if (0 == strcmp(arg, "--csv")) {
+            opts->scan.csv = true;
+            i++;
+        } else if (0 == strcmp(arg, "--batch")) {
+            opts->batch = true;
+            i++;
+        } else if (0 == strcmp(arg, "--unordered")) {
+            opts->unordered = true;
+            i++;
+        } else if (0 == strcmp(arg, "--tee")) {
+            opts->tee = true;
+            i++;
+        } else if (0 == strcmp(arg, "--transcode")) {
+            if (i + 1 >= argc) {
+                WARN("--transcode: missing argument");
+                return -1;
+            }
+            const char *name = argv[i + 1];
+            if (! (Encoding_parse(name, &opts->transcode_from)
+                   && ((opts->transcode_from == ENCODING_LATIN1)
+                       || (opts->transcode_from == ENCODING_WINDOWS1252)))) {
+                WARN_("--transcode: unsupported encoding: '%s'", name);
+                return -1;
+            }
+            opts->transcode = true;
+            i += 2;
+        } else if (0 == strcmp(arg, "--normalize")) {
+            if (i + 1 >= argc) {
+                WARN("--normalize: missing argument");
+                return -1;
+            }
+            const char *name = argv[i + 1];
+            if (! LineSeparator_parse(name, &opts->normalize_to)) {
+                WARN_("--normalize: unknown line separator: '%s'", name);
+                return -1;
+            }
+            opts->normalize = true;
+            i += 2;
+        } else if (0 == strcmp(arg, "--report-fd")) {
+            long n;
+            if (! Options_parse_number(&n, argc, argv, i, 0, INT_MAX)) {
+                return -1;
+            }
+            opts->report_fd = n;
+            i += 2;
+        } else if (0 == strcmp(arg, "--abort-on-error")) {
+            opts->abort_on_error = true;
+            i++;
+        } else if (0 == strcmp(arg, "--index")) {
+            if (i + 1 >= argc) {
+                WARN("--index: missing argument");
+                return -1;
+            }
+            opts->index_path = argv[i + 1];
+            i += 2;
+        } else if (0 == strcmp(arg, "--checkpoint")) {
+            if (i + 1 >= argc) {
+                WARN("--checkpoint: missing argument");
+                return -1;
+            }
+            opts->checkpoint_dir = argv[i + 1];
+            i += 2;
+        } else if (0 == strcmp(arg, "--cache")) {
+            if (i + 1 >= argc) {
+                WARN("--cache: missing argument");
+                return -1;
+            }
+            opts->cache.dir = argv[i + 1];
+            i += 2;
+        } else if (0 == strcmp(arg, "--no-cache")) {
+            opts->no_cache = true;
+            i++;
+        } else if (0 == strcmp(arg, "--verify-cache")) {
+            opts->cache.verify = true;
+            i++;
+        } else if (0 == strcmp(arg, "--cache-fingerprint")) {
+            opts->cache.use_fingerprint = true;
+            i++;
+        } else if (0 == strcmp(arg, "--cache-max-entries")) {
+            long n;
+            if (! Options_parse_number(&n, argc, argv, i, 1, LONG_MAX)) {
+                return -1;
+            }
+            opts->cache.max_entries = n;
+            i += 2;
+        } else if (0 == strcmp(arg, "--all-errors")) {
+            opts->all_errors = true;
+            i++;
+        } else if (0 == strcmp(arg, "--max-errors")) {
+            if (! Options_parse_number(&opts->max_errors, argc, argv, i,
+                                       0, LONG_MAX)) {
+                return -1;
+            }
+            i += 2;
+        } else if (0 == strcmp(arg, "--perf")) {
+            opts->perf = true;
+            i++;
+        } else if (0 == strcmp(arg, "--version")) {
+            opts->version = true;
+            i++;
+        } else if ((arg[0] == '-') && (arg[1] != 0)) {
+            WARN_("unknown option: '%s'", arg);
+            return -1;
+        } else {
+            break;
+        }
+    }
+    if ((! opts->batch) && (opts->unordered || opts->jobs)) {
+        WARN("--jobs and --unordered are only valid with --batch");
+        return -1;
+    }
+    if (opts->perf
+        && (opts->batch || opts->tee || opts->transcode || opts->normalize)) {
+        WARN("--perf can't be combined with --batch, --tee, --transcode "
+             "or --normalize");
+        return -1;
+    }
+    if (opts->all_errors
+        && (opts->batch || opts->tee || opts->transcode || opts->normalize
+            || opts->scan.csv || opts->perf)) {
+        WARN("--all-errors can't be combined with --batch, --tee, "
+             "--transcode, --normalize, --csv or --perf");
+        return -1;
+    }
+    if ((! opts->all_errors)
+        && (opts->max_errors != ERRORLOG_DEFAULT_MAX_RECORDS)) {
+        WARN("--max-errors is only valid with --all-errors");
+        return -1;
+    }
+    if (opts->index_path
+        && (opts->batch || opts->tee || opts->transcode || opts->normalize
+            || opts->all_errors || opts->scan.csv)) {
+        WARN("--index can't be combined with --batch, --tee, --transcode, "
+             "--normalize, --all-errors or --csv");
+        return -1;
+    }
+    if (opts->checkpoint_dir
+        && (opts->batch || opts->tee || opts->transcode || opts->normalize
+            || opts->all_errors || opts->scan.csv || opts->index_path)) {
+        WARN("--checkpoint can't be combined with --batch, --tee, "
+             "--transcode, --normalize, --all-errors, --csv or --index");
+        return -1;
+    }
+    bool is_cacheable_mode = ! (opts->tee || opts->transcode
+                                || opts->normalize || opts->all_errors
+                                || opts->index_path || opts->checkpoint_dir
+                                || opts->perf);
+    if (opts->cache.dir && ! is_cacheable_mode) {
+        WARN("--cache can't be combined with --tee, --transcode, "
+             "--normalize, --all-errors, --index, --checkpoint or --perf");
+        return -1;
+    }
+    if ((opts->cache.verify || opts->cache.use_fingerprint
+         || (opts->cache.max_entries != RESULTCACHE_DEFAULT_MAX_ENTRIES))
+        && ! (opts->cache.dir || opts->no_cache
+              || env_string(RESULTCACHE_ENVVAR))) {
+        WARN("--verify-cache, --cache-fingerprint and --cache-max-entries "
+             "are only valid with --cache");
+        return -1;
+    }
+    if (opts->no_cache) {
+        opts->cache.dir = NULL;
+    } else if ((! opts->cache.dir) && is_cacheable_mode) {
+        opts->cache.dir = env_string(RESULTCACHE_ENVVAR);
+    }
+    if (opts->scan.csv && (opts->transcode || opts->normalize)) {
+        WARN("--csv can't be combined with --transcode or --normalize");
+        return -1;
+    }
+    if (opts->transcode && (opts->batch || opts->tee)) {
+        WARN("--transcode can't be combined with --batch or --tee");
+        return -1;
+    }
+    if (opts->normalize && (opts->batch || opts->tee || opts->transcode)) {
+        WARN("--normalize can't be combined with --batch, --tee or "
+             "--transcode");
+        return -1;
+    }
+    if (opts->tee) {
+        if (opts->batch) {
+            WARN("--tee and --batch can't be combined");
+            return -1;
+        }
+        if ((opts->read.method == READ_METHOD_URING)
+            || opts->read.readahead_buffers) {
+            WARN("--tee can't be combined with '--io uring' or --readahead");
+            return -1;
+        }
+    } else if (opts->abort_on_error) {
+        WARN("--abort-on-error is only valid with --tee");
+        return -1;
+    } else if ((opts->report_fd != 2)
+               && ! (opts->transcode || opts->normalize)) {
+        WARN("--report-fd is only valid with --tee, --transcode or "
+             "--normalize");
+        return -1;
+    }
+    return i;
+}
+
+// Check the files given in paths, or if npaths is 0, those read from
+// STDIN. Returns the exit code.
+static
+int batch(const char **paths, int npaths, const Options *opts) {
+    int res = 0;
+    Batch b;
+    Batch_init(&b, opts->jobs ? opts->jobs : number_of_cpus(),
+               &opts->read, &opts->scan,
+               opts->cache.dir ? &opts->cache : NULL, opts->unordered,
+               stdout);
+    if (npaths) {
+        for (int i = 0; i < npaths; i++) {
+            Batch_submit(&b, borrowing_String(paths[i]));
+        }
+    } else {
+        BufferedStream in = fd_r_BufferedStream(0,
+                                                literal_String("STDIN"),
+                                                false, &opts->read);
+        Result(Unit) r = Batch_submit_nul_separated(&b, &in);
+        if (Result_is_Err(r)) {
+            WARN_("reading paths from STDIN: %s", Error_message(r.err));
+            res = 1;
+        }
+        Result_release(r);
+        Result(Unit) rc = BufferedStream_close(&in);
+        if (Result_is_Err(rc)) {
+            WARN_("close: %s", Error_message(rc.err));
+            res = 1;
+        }
+        Result_release(rc);
+        BufferedStream_release(&in);
+    }
+    if (Batch_finish(&b)) {
+        res = 1;
+    }
+    return res;
+}
+
+// Where the record goes in filter, transcoding and normalizing mode:
+// STDERR or
+// (a dup of) opts->report_fd. Returns NULL (after printing a
+// message) on failure.
+static
+FILE *report_out_open(const Options *opts) {
+    if (opts->report_fd == 2) {
+        return stderr;
+    }
+    int fd = dup(opts->report_fd);
+    FILE *report_out = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (! report_out) {
+        WARN_("--report-fd %i: %s", opts->report_fd, strerror(errno));
+        if (fd >= 0) close(fd);
+    }
+    return report_out;
+}
+
+static
+void report_out_close(FILE *report_out) {
+    if (report_out != stderr) {
+        fclose(report_out);
+    }
+}
+
+// Filter mode: copy `in` to STDOUT while checking it, the report
+// goes to opts->report_fd. Returns the exit code: 1 if the input is
+// not valid or it couldn't be passed on completely.
+static
+int filter(BufferedStream *in /* borrowed */, const Options *opts) {
+    FILE *report_out = report_out_open(opts);
+    if (! report_out) {
+        return 1;
+    }
+    int res = 0;
+    bool is_mapped = (in->stream_type == STREAM_TYPE_MMAPSTREAM);
+    int in_fd = is_mapped ? in->mmapstream.optional_fd
+        : in->filestream.optional_fd;
+    Result(Passthrough) rp = Passthrough_new(in_fd, 1);
+    if (Result_is_Err(rp)) {
+        WARN_("output: %s", Error_message(rp.err));
+        Result_release(rp);
+        res = 1;
+        goto report_out;
+    }
+    Passthrough *pt = &rp.ok;
+    if (! is_mapped) {
+        BufferedStream_set_read_fn(in, Passthrough_read, pt);
+    }
+
+    Report r = Report_scan(in, &opts->scan);
+    if (Report_is_failure(&r)) {
+        res = 1;
+    }
+    if (Report_is_failure(&r) && opts->abort_on_error) {
+        Passthrough_stop(pt);
+    } else if (is_mapped) {
+        Passthrough_copy_rest(pt, in_fd);
+    } else {
+        // Pass on the rest, after the point where the scan stopped
+        while (1) {
+            Result(LSlice_u8) rs = BufferedStream_peek(in);
+            if (Result_is_Err(rs)) {
+                WARN_("read: %s", Error_message(rs.err));
+                Result_release(rs);
+                res = 1;
+                break;
+            }
+            size_t n = LSlice_length(rs.ok);
+            if (n == 0) {
+                break;
+            }
+            BufferedStream_consume(in, n);
+        }
+    }
+    Result(Unit) rf = Passthrough_finish(pt);
+    if (Result_is_Err(rf)) {
+        WARN_("output: %s", Error_message(rf.err));
+        res = 1;
+    }
+    Result_release(rf);
+    Report_print(&r, NULL, report_out);
+    Report_release(&r);
+report_out:
+    report_out_close(report_out);
+    return res;
+}
+
+// The file descriptor for the output stream in transcoding and
+// normalizing mode, a dup of STDOUT. Returns -1 (after printing a
+// message) on failure.
+static
+int stdout_dup() {
+    int fd = dup(1);
+    if (fd < 0) {
+        WARN_("output: %s", strerror(errno));
+    }
+    return fd;
+}
+
+// Returns false (after printing a message) if the output couldn't be
+// completed.
+static
+bool stdout_close(BufferedStream *out) {
+    bool ok = true;
+    Result(Unit) rc = BufferedStream_close(out);
+    if (Result_is_Err(rc)) {
+        WARN_("output: %s", Error_message(rc.err));
+        ok = false;
+    }
+    Result_release(rc);
+    BufferedStream_release(out);
+    return ok;
+}
+
+// Transcoding mode: convert `in` to UTF-8 on STDOUT, the record goes
+// to opts->report_fd. Returns the exit code: 1 if the input couldn't
+// be converted completely.
+static
+int transcode(BufferedStream *in /* borrowed */, const Options *opts) {
+    FILE *report_out = report_out_open(opts);
+    if (! report_out) {
+        return 1;
+    }
+    int fd = stdout_dup();
+    if (fd < 0) {
+        report_out_close(report_out);
+        return 1;
+    }
+    BufferedStream out = fd_BufferedStream(fd, STREAM_DIRECTION_OUT,
+                                           literal_String("STDOUT"), false);
+    Transcoding t = Transcoding_run(in, &out, opts->transcode_from);
+    int res = Transcoding_is_failure(&t) ? 1 : 0;
+    if (! stdout_close(&out)) {
+        res = 1;
+    }
+    Transcoding_print(&t, report_out);
+    Transcoding_release(&t);
+    report_out_close(report_out);
+    return res;
+}
+
+// Normalizing mode: copy `in` to STDOUT with the line separators
+// rewritten, the record goes to opts->report_fd. Returns the exit
+// code: 1 if the input is not valid or it couldn't be passed on
+// completely.
+static
+int normalize(BufferedStream *in /* borrowed */, const Options *opts) {
+    FILE *report_out = report_out_open(opts);
+    if (! report_out) {
+        return 1;
+    }
+    int fd = stdout_dup();
+    if (fd < 0) {
+        report_out_close(report_out);
+        return 1;
+    }
+    BufferedStream out = fd_BufferedStream(fd, STREAM_DIRECTION_OUT,
+                                           literal_String("STDOUT"), false);
+    Report r = Report_normalize(in, &out, opts->normalize_to, &opts->scan);
+    int res = Report_is_failure(&r) ? 1 : 0;
+    if (! stdout_close(&out)) {
+        res = 1;
+    }
+    Report_print(&r, NULL, report_out);
+    Report_release(&r);
+    report_out_close(report_out);
+    return res;
+}
+
+// All-errors mode: print a record for each invalid sequence in `in`
+// (up to opts->max_errors of them) and a summary record to STDOUT.
+// Returns the exit code: 1 if the records couldn't be written.
+static
+int all_errors(BufferedStream *in /* borrowed */, const Options *opts) {
+    int fd = stdout_dup();
+    if (fd < 0) {
+        return 1;
+    }
+    BufferedStream out = fd_BufferedStream(fd, STREAM_DIRECTION_OUT,
+                                           literal_String("STDOUT"), false);
+    ErrorLog log = ErrorLog_new(&out, opts->max_errors);
+    Report r = Report_scan_all(in, &opts->scan, &log);
+    int res = 0;
+    if (! ErrorLog_summary(&log, &r)) {
+        WARN_("output: %s", Error_message(log.failure));
+        res = 1;
+    }
+    if (! stdout_close(&out)) {
+        res = 1;
+    }
+    Report_release(&r);
+    ErrorLog_release(&log);
+    return res;
+}
+
+// The mode for a single input
+static
+int run(BufferedStream *in /* borrowed */, const Options *opts) {
+    return opts->tee ? filter(in, opts)
+        : opts->transcode ? transcode(in, opts)
+        : opts->normalize ? normalize(in, opts)
+        : opts->all_errors ? all_errors(in, opts)
+        : report(in, opts);
+}
+
 int main(int argc, const char**argv) {
 #if AFL
     if (env("AFL")) {
@@ -110,7 +1038,8 @@ int main(int argc, const char**argv) {
                 STREAM_DIRECTION_IN,
                 literal_String("AFL buffer"));
 
-            int res = report(&in);
+            Options opts = default_Options;
+            int res = report(&in, &opts);
             WARN_("report returned with exit code %i", res);
             BufferedStream_close(&in);
             BufferedStream_release(&in);
@@ -123,19 +1052,37 @@ int main(int argc, const char**argv) {
     } else {
 #endif
         // Normal execution
-        if (argc == 1) {
+        Options opts = default_Options;
+        int argi = Options_parse(&opts, argc, argv);
+        if (argi < 0) {
+            usage(argv[0]);
+            leakcheck_verify(false);
+            return 1;
+        }
+        // Select the kernels now, before any threads are started, and
+        // so that a bad setting is reported even with empty input
+        scankernels();
+        int nargs = argc - argi;
+        if (opts.version) {
+            int res = version(&opts);
+            leakcheck_verify(false);
+            return res;
+        } else if (opts.batch) {
+            int res = batch(argv + argi, nargs, &opts);
+            leakcheck_verify(false);
+            return res;
+        } else if (nargs == 0) {
             BufferedStream in =
-                fd_BufferedStream(0,
-                                  STREAM_DIRECTION_IN,
-                                  literal_String("STDIN"),
-                                  false);
-            int res = report(&in);
+                fd_r_BufferedStream(0,
+                                    literal_String("STDIN"),
+                                    false, &opts.read);
+            int res = run(&in, &opts);
             Result(Unit) r = BufferedStream_close(&in);
             if (Result_is_Err(r)) {
                 // XX should this have the path in the message,
                 // already? Should there be a
                 // BufferedStream_error_message method?
-                WARN_("close: %s", r.err.str);
+                WARN_("close: %s", Error_message(r.err));
                 res = 1; // OK?
             }
             Result_release(r);
@@ -143,24 +1090,36 @@ int main(int argc, const char**argv) {
 
             leakcheck_verify(false);
             return res;
-        } else if (argc == 2) {
-            const char *path = argv[1];
+        } else if (opts.checkpoint_dir && (nargs == 1)) {
+            int res = checkpointed(argv[argi], &opts);
+            leakcheck_verify(false);
+            return res;
+        } else if (opts.checkpoint_dir) {
+            WARN("--checkpoint needs a file argument");
+            leakcheck_verify(false);
+            return 1;
+        } else if (opts.cache.dir && (nargs == 1)) {
+            int res = cached(argv[argi], &opts);
+            leakcheck_verify(false);
+            return res;
+        } else if (nargs == 1) {
+            const char *path = argv[argi];
             Result(BufferedStream) r_in =
-                open_r_BufferedStream(borrowing_String(path));
+                open_r_BufferedStream(borrowing_String(path), &opts.read);
             if (Result_is_Err(r_in)) {
                 // XX should this have the path in the message,
                 // already? Should there be a
                 // BufferedStream_error_message method?
-                WARN_("open: %s", r_in.err.str);
+                WARN_("open: %s", Error_message(r_in.err));
                 Result_release(r_in);
                 leakcheck_verify(false);
                 return 1;
             }
 
-            int res = report(&r_in.ok);
+            int res = run(&r_in.ok, &opts);
             Result(Unit) r = BufferedStream_close(&r_in.ok);
             if (Result_is_Err(r)) {
-                WARN_("close: %s", r.err.str);
+                WARN_("close: %s", Error_message(r.err));
                 res = 1; // OK?
             }
             Result_release(r);
@@ -170,10 +1129,7 @@ int main(int argc, const char**argv) {
             leakcheck_verify(false);
             return res;
         } else {
-            WARN_("Usage: %s [file]\n"
-                  "  Verify proper UTF-8 encoding and report usage of CR and LF\n"
-                  "  characters in <file> if given, otherwise of STDIN.\n",
-                  argv[0]);
+            usage(argv[0]);
             leakcheck_verify(false);
             return 1;
         }
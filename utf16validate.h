@@ -0,0 +1,90 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef UTF16VALIDATE_H_
+#define UTF16VALIDATE_H_
+
+/*
+
+  Bulk UTF-16 validation and counting of in-memory data, in either
+  byte order.
+
+  Validation only concerns the surrogates: a high (leading) surrogate
+  has to be followed by a low (trailing) one, and a low surrogate
+  must not appear on its own; all other code units are characters by
+  themselves. Like utf8validate.h, the validation only reports how
+  far the data is valid; the caller uses `get_utf16char` from
+  `unicode.h` on the rest to get the exact error (or to decode a
+  character that continues in the next buffer).
+
+  Line separators are the code units 0x000D and 0x000A.
+
+  This file has the code unit-wise variants; the vectorized ones,
+  `utf16le_valid_prefix` etc., are in scankernels.h.
+
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "shorttypenames.h"
+#include "linecount.h"
+
+
+static inline
+u16 utf16_unit(const u8 *p, bool is_be) {
+    return is_be ? (u16)((p[0] << 8) | p[1]) : (u16)((p[1] << 8) | p[0]);
+}
+
+static inline
+bool utf16_is_high_surrogate(u16 u) {
+    return (u & 0xFC00) == 0xD800;
+}
+
+static inline
+bool utf16_is_low_surrogate(u16 u) {
+    return (u & 0xFC00) == 0xDC00;
+}
+
+// Returns the length in bytes of the longest prefix of [p, p+len)
+// that consists only of complete, correctly paired UTF-16 characters.
+static inline
+size_t utf16_valid_prefix_unitwise(const u8 *p, size_t len, bool is_be) {
+    size_t i = 0;
+    while (len - i >= 2) {
+        u16 u = utf16_unit(p + i, is_be);
+        if ((u & 0xF800) != 0xD800) {
+            i += 2;
+            continue;
+        }
+        if (utf16_is_low_surrogate(u)) {
+            return i;
+        }
+        if (len - i < 4) {
+            return i; // incomplete
+        }
+        if (! utf16_is_low_surrogate(utf16_unit(p + i + 2, is_be))) {
+            return i;
+        }
+        i += 4;
+    }
+    return i;
+}
+
+// Count the characters in [p, p+len), which must have been validated
+// via `utf16_valid_prefix_unitwise` or equivalent.
+static inline
+void LineCount_utf16_valid_unitwise(LineCount *lc, const u8 *p, size_t len,
+                                    bool is_be) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        u16 u = utf16_unit(p + i, is_be);
+        if (! utf16_is_low_surrogate(u)) {
+            // Only the first unit of a pair matters for the counting
+            LineCount_char(lc, u);
+        }
+    }
+}
+
+
+#endif /* UTF16VALIDATE_H_ */
@@ -0,0 +1,194 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef UTF8DFA_H_
+#define UTF8DFA_H_
+
+/*
+
+  A table-driven UTF-8 decoder (a deterministic finite automaton, in
+  the style of Bjoern Hoehrmann's decoder), as an alternative to the
+  if/else chain in `get_unicodechar` and the SIMD kernel in
+  `utf8validate.h`: it is portable and branch-light, and serves as the
+  reference when benchmarking the SIMD kernels.
+
+  It accepts exactly the same (lenient) grammar as `get_unicodechar`,
+  and `get_unicodechar_dfa` reports the same errors, consuming the
+  same bytes.
+
+  Each byte is mapped to one of 9 classes; the state table maps a
+  state and class to the next state. States are stored premultiplied
+  by 16 (the row length), so that a step is one load from each table
+  and an addition. The error states are sticky, which lets
+  `utf8dfa_valid_prefix` run through whole blocks without a branch per
+  byte.
+
+ */
+
+#include <stdlib.h>
+#include "shorttypenames.h"
+#include "BufferedStream.h"
+#include "Result.h"
+#include "Option.h"
+#include "unicode.h"
+
+
+// Byte classes
+#define UTF8DFA_C_ASCII 0
+#define UTF8DFA_C_CONT_LO 1 // 80..8F
+#define UTF8DFA_C_CONT_HI 2 // 90..BF
+#define UTF8DFA_C_LEAD2 3 // C0..DF
+#define UTF8DFA_C_LEAD3 4 // E0..EF
+#define UTF8DFA_C_LEAD4 5 // F0..F3
+#define UTF8DFA_C_F4 6 // F4: range depends on the next byte
+#define UTF8DFA_C_LEAD4_OOR 7 // F5..F7: always out of range
+#define UTF8DFA_C_INVALID 8 // F8..FF
+
+// States
+#define UTF8DFA_ACCEPT 0
+#define UTF8DFA_NEED1 16 // continuation bytes still needed
+#define UTF8DFA_NEED2 32
+#define UTF8DFA_NEED3 48
+#define UTF8DFA_F4 64 // after F4
+#define UTF8DFA_OOR1 80 // ditto, the codepoint will be out of range
+#define UTF8DFA_OOR2 96
+#define UTF8DFA_OOR3 112
+// Error states, all >= UTF8DFA_FIRST_ERROR:
+#define UTF8DFA_FIRST_ERROR 128
+#define UTF8DFA_ERR_CODEPOINT 128 // complete, but out of range
+#define UTF8DFA_ERR_START 144
+#define UTF8DFA_ERR_CONTINUATION 160
+
+// Should be in a utf8dfa.c but we're currently using a single binary
+// object for everything.
+const u8 utf8dfa_classes[256] = {
+#define C16(c) c,c,c,c,c,c,c,c,c,c,c,c,c,c,c,c
+    C16(0), C16(0), C16(0), C16(0), C16(0), C16(0), C16(0), C16(0),
+    C16(1), C16(2), C16(2), C16(2),
+    C16(3), C16(3),
+    C16(4),
+    5,5,5,5, 6, 7,7,7, 8,8,8,8,8,8,8,8
+#undef C16
+};
+
+// Mask for the codepoint bits in a lead byte, by class
+const u8 utf8dfa_lead_mask[9] = {
+    0x7F, 0, 0, 0x1F, 0x0F, 0x07, 0x07, 0x07, 0
+};
+
+const u8 utf8dfa_states[176] = {
+#define A UTF8DFA_ACCEPT
+#define ES UTF8DFA_ERR_START
+#define EC UTF8DFA_ERR_CONTINUATION
+#define EO UTF8DFA_ERR_CODEPOINT
+#define ROW(c0, c1, c2, c3, c4, c5, c6, c7, c8)                 \
+    c0, c1, c2, c3, c4, c5, c6, c7, c8, 0, 0, 0, 0, 0, 0, 0
+#define ROW_CONT(next) ROW(EC, next, next, EC, EC, EC, EC, EC, EC)
+#define ROW_STICKY(s) ROW(s, s, s, s, s, s, s, s, s)
+    // ACCEPT
+    ROW(A, ES, ES, UTF8DFA_NEED1, UTF8DFA_NEED2, UTF8DFA_NEED3,
+        UTF8DFA_F4, UTF8DFA_OOR3, ES),
+    ROW_CONT(A), // NEED1
+    ROW_CONT(UTF8DFA_NEED1), // NEED2
+    ROW_CONT(UTF8DFA_NEED2), // NEED3
+    // F4
+    ROW(EC, UTF8DFA_NEED2, UTF8DFA_OOR2, EC, EC, EC, EC, EC, EC),
+    ROW_CONT(EO), // OOR1
+    ROW_CONT(UTF8DFA_OOR1), // OOR2
+    ROW_CONT(UTF8DFA_OOR2), // OOR3
+    ROW_STICKY(EO),
+    ROW_STICKY(ES),
+    ROW_STICKY(EC)
+#undef ROW_STICKY
+#undef ROW_CONT
+#undef ROW
+#undef EO
+#undef EC
+#undef ES
+#undef A
+};
+
+
+// Feed byte b; *codepoint is complete when the new state is
+// UTF8DFA_ACCEPT.
+static inline
+u32 utf8dfa_step(u32 state, u32 *codepoint, u8 b) {
+    u8 cls = utf8dfa_classes[b];
+    *codepoint = (state == UTF8DFA_ACCEPT)
+        ? (b & utf8dfa_lead_mask[cls])
+        : ((*codepoint << 6) | (b & 0b00111111));
+    return utf8dfa_states[state + cls];
+}
+
+// Same as `utf8_valid_prefix` from utf8validate.h.
+static UNUSED
+size_t utf8dfa_valid_prefix(const u8 *p, size_t len) {
+    u32 state = UTF8DFA_ACCEPT;
+    size_t ok = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t end = (len - i > 64) ? i + 64 : len;
+        for (; i < end; i++) {
+            state = utf8dfa_states[state + utf8dfa_classes[p[i]]];
+            ok = (state == UTF8DFA_ACCEPT) ? i + 1 : ok;
+        }
+        if (state >= UTF8DFA_FIRST_ERROR) {
+            break;
+        }
+    }
+    return ok;
+}
+
+// A drop-in replacement for `get_unicodechar`.
+static UNUSED
+Result(Option(u32)) get_unicodechar_dfa(BufferedStream *in) {
+    Result(LSlice_u8) rs = BufferedStream_peek(in);
+    PROPAGATE_return(Option(u32), rs);
+    size_t avail = LSlice_length(rs.ok);
+    if (avail == 0) {
+        return Ok(Option(u32), None(u32));
+    }
+    const u8 *p = LSlice_start(rs.ok);
+    u32 state = UTF8DFA_ACCEPT;
+    u32 codepoint = 0;
+    size_t i = 0;
+    while (1) {
+        if (i >= avail) {
+            // As in get_unicodechar, one more byte at a time
+            rs = BufferedStream_peek_atleast(in, i + 1);
+            PROPAGATE_return(Option(u32), rs);
+            avail = LSlice_length(rs.ok);
+            p = LSlice_start(rs.ok);
+            if (i >= avail) {
+                BufferedStream_consume(in, avail);
+                return Err_from(Option(u32),
+                                utf8_error_premature_eof(i + 1));
+            }
+        }
+        state = utf8dfa_step(state, &codepoint, p[i]);
+        i++;
+        if (state == UTF8DFA_ACCEPT) {
+            BufferedStream_consume(in, i);
+            return Ok(Option(u32), Some(u32, codepoint));
+        }
+        if (state >= UTF8DFA_FIRST_ERROR) {
+            break;
+        }
+    }
+    BufferedStream_consume(in, i);
+    switch (state) {
+    case UTF8DFA_ERR_START:
+        return Err_from(Option(u32), UTF8_ERROR_INVALID_START_BYTE);
+    case UTF8DFA_ERR_CONTINUATION:
+        return Err_from(Option(u32),
+                        utf8_error_invalid_continuation(i));
+    default:
+        return Err_from(Option(u32),
+                        utf8_error_invalid_codepoint(codepoint));
+    }
+}
+
+
+#endif /* UTF8DFA_H_ */
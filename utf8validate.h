@@ -0,0 +1,75 @@
+/*
+  Copyright (C) 2021 Christian Jaeger, <ch@christianjaeger.ch>
+  Published under the terms of the MIT License, see the LICENSE file.
+*/
+
+#ifndef UTF8VALIDATE_H_
+#define UTF8VALIDATE_H_
+
+/*
+
+  Bulk UTF-8 validation of in-memory data.
+
+  This accepts exactly what `get_unicodechar` from `unicode.h`
+  accepts (which is more lenient than the Unicode standard: overlong
+  encodings and surrogates are let through, only the codepoint range
+  is checked). It does not produce error messages; instead it reports
+  how far the data is valid, and the caller uses `get_unicodechar` on
+  the rest to get the exact error (or to decode a character that
+  continues in the next buffer).
+
+  This file has the byte-wise variant; the vectorized one,
+  `utf8_valid_prefix`, is in scankernels.h.
+
+ */
+
+#include <stdlib.h>
+#include "shorttypenames.h"
+
+
+// The signature of the functions returning the valid prefix (also
+// see utf8dfa.h)
+typedef size_t (*utf8_valid_prefix_fn)(const u8 *p, size_t len);
+
+// Returns the length of the longest prefix of [p, p+len) that
+// consists only of complete characters that `get_unicodechar` would
+// accept.
+static inline
+size_t utf8_valid_prefix_bytewise(const u8 *p, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        u8 b = p[i];
+        if (b < 0x80) {
+            i++;
+            continue;
+        }
+        size_t numbytes;
+        if (b < 0xC0) {
+            return i; // invalid start byte
+        } else if (b < 0xE0) {
+            numbytes = 2;
+        } else if (b < 0xF0) {
+            numbytes = 3;
+        } else if (b < 0xF5) {
+            numbytes = 4;
+        } else {
+            return i; // codepoint out of range or invalid start byte
+        }
+        if (numbytes > len - i) {
+            return i; // incomplete
+        }
+        for (size_t k = 1; k < numbytes; k++) {
+            if ((p[i + k] & 0b11000000) != 0b10000000) {
+                return i;
+            }
+        }
+        if ((b == 0xF4) && (p[i + 1] >= 0x90)) {
+            return i; // > 0x10FFFF
+        }
+        i += numbytes;
+    }
+    return i;
+}
+
+
+#endif /* UTF8VALIDATE_H_ */